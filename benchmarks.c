@@ -0,0 +1,1032 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mqtt.h>
+#include <mqtt_reactor.h>
+#include <mqtt_dispatcher.h>
+#include <mqtt_topic.h>
+#include <mqtt_store.h>
+#include <mqtt_worker_pool.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#if defined(MQTT_REACTOR_AVAILABLE)
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#endif
+
+/* BENCHMARK HELPERS */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static uint32_t xorshift(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/* BENCHMARKS */
+
+/**
+ * Time the PUBACK lookup (mqtt_mq_find by packet id) with \p inflight QoS 1 PUBLISH
+ * messages in the queue, acknowledged in random order. \p qos0 QoS 0 PUBLISH messages are
+ * queued after each of them.
+ */
+static double BENCH__mq_find(int inflight, int use_index, int qos0) {
+    const size_t packet_size = 32;
+    size_t bufsz = (size_t) inflight * (size_t) (qos0 + 1) * (sizeof(struct mqtt_queued_message) + packet_size) * 2;
+    uint8_t *buf = (uint8_t*) malloc(bufsz);
+    uint16_t *order = (uint16_t*) malloc(sizeof(uint16_t) * (size_t) inflight);
+    struct mqtt_message_queue mq;
+    uint32_t rng = 2463534242u;
+    const int lookups = 200000;
+    double start, stop;
+    int i, j;
+
+    mqtt_mq_init(&mq, buf, bufsz);
+    if (!use_index) {
+        mq.index = NULL;
+    }
+    for(i = 0; i < inflight; ++i) {
+        struct mqtt_queued_message *msg;
+        memset(mq.curr, 0, packet_size);
+        mq.curr[0] = (uint8_t) ((MQTT_CONTROL_PUBLISH << 4) | MQTT_PUBLISH_QOS_1);
+        msg = mqtt_mq_register(&mq, packet_size);
+        msg->control_type = MQTT_CONTROL_PUBLISH;
+        msg->packet_id = (uint16_t) (i + 1);
+        msg->state = MQTT_QUEUED_AWAITING_ACK;
+        order[i] = msg->packet_id;
+        for(j = 0; j < qos0; ++j) {
+            memset(mq.curr, 0, packet_size);
+            mq.curr[0] = (uint8_t) (MQTT_CONTROL_PUBLISH << 4);
+            msg = mqtt_mq_register(&mq, packet_size);
+            msg->control_type = MQTT_CONTROL_PUBLISH;
+            msg->state = MQTT_QUEUED_AWAITING_ACK;
+        }
+    }
+
+    start = now_ns();
+    for(i = 0; i < lookups; ++i) {
+        uint16_t packet_id = order[xorshift(&rng) % (uint32_t) inflight];
+        if (mqtt_mq_find(&mq, MQTT_CONTROL_PUBLISH, &packet_id) == NULL) {
+            printf("error: packet id %u not found\n", packet_id);
+            exit(1);
+        }
+    }
+    stop = now_ns();
+
+    free(order);
+    free(buf);
+    return (stop - start) / lookups;
+}
+
+/**
+ * Time removing the message at the front of the queue (mqtt_mq_clean) and queuing a new one
+ * at the back with \p inflight messages in between.
+ */
+static double BENCH__mq_clean(int inflight) {
+    const size_t packet_size = 128;
+    size_t bufsz = (size_t) (inflight + 1) * (sizeof(struct mqtt_queued_message) + packet_size) * 3;
+    uint8_t *buf = (uint8_t*) malloc(bufsz);
+    struct mqtt_message_queue mq;
+    const int cycles = 200000;
+    double start, stop;
+    int i;
+
+    mqtt_mq_init(&mq, buf, bufsz);
+    for(i = 0; i < inflight; ++i) {
+        memset(mq.curr, 0, packet_size);
+        mqtt_mq_register(&mq, packet_size)->state = MQTT_QUEUED_AWAITING_ACK;
+    }
+
+    start = now_ns();
+    for(i = 0; i < cycles; ++i) {
+        mqtt_mq_get(&mq, 0)->state = MQTT_QUEUED_COMPLETE;
+        mqtt_mq_clean(&mq);
+        if (mq.curr_sz < packet_size) {
+            printf("error: queue is full\n");
+            exit(1);
+        }
+        memset(mq.curr, 0, packet_size);
+        mqtt_mq_register(&mq, packet_size)->state = MQTT_QUEUED_AWAITING_ACK;
+    }
+    stop = now_ns();
+
+    free(buf);
+    return (stop - start) / cycles;
+}
+
+/**
+ * Time mqtt_publish (QoS 1) with \p inflight unacknowledged messages in the queue.
+ */
+static double BENCH__publish(int inflight, int use_bitmap) {
+    static uint32_t pid_bitmap[MQTT_PID_BITMAP_WORDS];
+    const int publishes = 1000;
+    size_t bufsz = (size_t) (inflight + publishes + 1) * (sizeof(struct mqtt_queued_message) + 64);
+    uint8_t *sendbuf = (uint8_t*) malloc(bufsz);
+    uint8_t recvbuf[64];
+    struct mqtt_client client;
+    double start, stop;
+    int i;
+
+    mqtt_init(&client, (mqtt_pal_socket_handle) -1, sendbuf, bufsz, recvbuf, sizeof(recvbuf), NULL);
+    if (use_bitmap) {
+        mqtt_init_pid_bitmap(&client, pid_bitmap);
+    }
+    mqtt_connect(&client, "benchmark", NULL, NULL, 0, NULL, NULL, 0, 400);
+    for(i = 0; i < inflight; ++i) {
+        mqtt_publish(&client, "benchmark/topic", "payload", 7, MQTT_PUBLISH_QOS_1);
+    }
+
+    start = now_ns();
+    for(i = 0; i < publishes; ++i) {
+        if (mqtt_publish(&client, "benchmark/topic", "payload", 7, MQTT_PUBLISH_QOS_1) != MQTT_OK) {
+            printf("error: %s\n", mqtt_error_str(client.error));
+            exit(1);
+        }
+    }
+    stop = now_ns();
+
+    free(sendbuf);
+    return (stop - start) / publishes;
+}
+
+/**
+ * Time QoS 0 publishes queued in bursts of \p batch, with mqtt_publish_many or (with
+ * \p batch 0) one mqtt_publish per message.
+ */
+static double BENCH__publish_many(int batch) {
+    const int publishes = 4096;
+    size_t bufsz = (size_t) (publishes + 1) * (sizeof(struct mqtt_queued_message) + 64);
+    uint8_t *sendbuf = (uint8_t*) malloc(bufsz);
+    uint8_t recvbuf[64];
+    struct mqtt_publish_desc msgs[64];
+    struct mqtt_client client;
+    double start, stop;
+    int i;
+
+    for(i = 0; i < 64; ++i) {
+        msgs[i].topic_name = "benchmark/topic";
+        msgs[i].application_message = "payload";
+        msgs[i].application_message_size = 7;
+        msgs[i].publish_flags = MQTT_PUBLISH_QOS_0;
+    }
+    mqtt_init(&client, (mqtt_pal_socket_handle) -1, sendbuf, bufsz, recvbuf, sizeof(recvbuf), NULL);
+    mqtt_connect(&client, "benchmark", NULL, NULL, 0, NULL, NULL, 0, 400);
+
+    start = now_ns();
+    for(i = 0; i < publishes; i += batch > 0 ? batch : 1) {
+        enum MQTTErrors rv;
+        if (batch > 0) {
+            rv = mqtt_publish_many(&client, msgs, (size_t) batch, NULL);
+        } else {
+            rv = mqtt_publish(&client, "benchmark/topic", "payload", 7, MQTT_PUBLISH_QOS_0);
+        }
+        if (rv != MQTT_OK) {
+            printf("error: %s\n", mqtt_error_str(rv));
+            exit(1);
+        }
+    }
+    stop = now_ns();
+
+    free(sendbuf);
+    return (stop - start) / publishes;
+}
+
+/* Returns non-zero if \p filter matches \p topic, the way applications match without a dispatcher. */
+static int topic_matches(const char *filter, const char *topic, size_t topic_size) {
+    const char *end = topic + topic_size;
+    while (*filter != '\0') {
+        if (filter[0] == '#') {
+            return 1;
+        } else if (filter[0] == '+') {
+            while (topic < end && *topic != '/') {
+                ++topic;
+            }
+            ++filter;
+        } else {
+            while (*filter != '\0' && *filter != '/') {
+                if (topic == end || *topic++ != *filter++) {
+                    return 0;
+                }
+            }
+        }
+        if (*filter == '\0') {
+            return topic == end;
+        }
+        /* both are at a '/' */
+        if (topic == end) {
+            return filter[1] == '#';
+        }
+        if (*topic != '/') {
+            return 0;
+        }
+        ++filter;
+        ++topic;
+    }
+    return 0;
+}
+
+static void count_dispatch(void **state, struct mqtt_response_publish *publish) {
+    ++*(size_t*) *state;
+}
+
+/**
+ * Time routing a publish to the matching one of \p num_filters filters, with a dispatcher or
+ * (without \p use_trie) by comparing the topic against every filter.
+ */
+static double BENCH__dispatch(int num_filters, int use_trie) {
+    const int dispatches = 10000;
+    struct mqtt_dispatcher dispatcher;
+    struct mqtt_response_publish publish;
+    char (*filters)[48] = (char (*)[48]) malloc((size_t) num_filters * 48);
+    char (*topics)[48] = (char (*)[48]) malloc(1024 * 48);
+    size_t arena_size = (size_t) num_filters * 512;
+    uint8_t *arena = (uint8_t*) malloc(arena_size);
+    uint32_t rng = 12345;
+    size_t matched = 0;
+    double start, stop;
+    int i, j;
+
+    /* mostly exact device filters, a tenth of them with a wildcard */
+    mqtt_dispatcher_init(&dispatcher, arena, arena_size, NULL, NULL);
+    for(i = 0; i < num_filters; ++i) {
+        if (i % 10 == 0) {
+            snprintf(filters[i], 48, "site/%d/+/%d/#", i % 100, i);
+        } else {
+            snprintf(filters[i], 48, "site/%d/device/%d/temperature", i % 100, i);
+        }
+        if (mqtt_dispatcher_add(&dispatcher, filters[i], count_dispatch, &matched) != MQTT_OK) {
+            printf("error: couldn't add %s\n", filters[i]);
+            exit(1);
+        }
+    }
+    for(i = 0; i < 1024; ++i) {
+        int n = (int) (xorshift(&rng) % (uint32_t) num_filters);
+        snprintf(topics[i], 48, "site/%d/device/%d/temperature", n % 100, n);
+    }
+    memset(&publish, 0, sizeof(publish));
+
+    start = now_ns();
+    for(i = 0; i < dispatches; ++i) {
+        publish.topic_name = topics[i & 1023];
+        publish.topic_name_size = (uint16_t) strlen(topics[i & 1023]);
+        if (use_trie) {
+            mqtt_dispatcher_dispatch(&dispatcher, &publish);
+        } else {
+            for(j = 0; j < num_filters; ++j) {
+                if (topic_matches(filters[j], (const char*) publish.topic_name, publish.topic_name_size)) {
+                    ++matched;
+                }
+            }
+        }
+    }
+    stop = now_ns();
+
+    if (matched != (size_t) dispatches) {
+        printf("error: %zu of %d publishes matched\n", matched, dispatches);
+        exit(1);
+    }
+    free(filters);
+    free(topics);
+    free(arena);
+    return (stop - start) / dispatches;
+}
+
+/**
+ * Time matching a publish against all of \p num_filters filters: split once and matched against
+ * the compiled filters (\p mode 0), with mqtt_topic_matches per filter (1) or with the
+ * byte-by-byte topic_matches per filter (2).
+ */
+static double BENCH__topic(int num_filters, int mode) {
+    const int publishes = 2000;
+    char (*filters)[64] = (char (*)[64]) malloc((size_t) num_filters * 64);
+    char (*topics)[64] = (char (*)[64]) malloc(1024 * 64);
+    struct mqtt_topic_filter *compiled = (struct mqtt_topic_filter*) malloc((size_t) num_filters * sizeof(struct mqtt_topic_filter));
+    struct mqtt_topic_levels levels;
+    uint32_t rng = 12345;
+    size_t matched = 0;
+    double start, stop;
+    int i, j;
+
+    /* the filters of BENCH__dispatch, under a longer prefix */
+    for(i = 0; i < num_filters; ++i) {
+        if (i % 10 == 0) {
+            snprintf(filters[i], 64, "building-north-campus/site/%d/+/%d/#", i % 100, i);
+        } else {
+            snprintf(filters[i], 64, "building-north-campus/site/%d/device/%d/temperature", i % 100, i);
+        }
+        mqtt_topic_filter_compile(&compiled[i], filters[i]);
+    }
+    for(i = 0; i < 1024; ++i) {
+        int n = (int) (xorshift(&rng) % (uint32_t) num_filters);
+        snprintf(topics[i], 64, "building-north-campus/site/%d/device/%d/temperature", n % 100, n);
+    }
+
+    start = now_ns();
+    for(i = 0; i < publishes; ++i) {
+        const char *topic = topics[i & 1023];
+        size_t size = strlen(topic);
+        if (mode == 0) {
+            mqtt_topic_split(&levels, topic, size);
+            matched += mqtt_topic_match_batch(compiled, (size_t) num_filters, &levels, NULL);
+        } else {
+            for(j = 0; j < num_filters; ++j) {
+                matched += (size_t) (mode == 1 ? mqtt_topic_matches(filters[j], topic, size) : topic_matches(filters[j], topic, size));
+            }
+        }
+    }
+    stop = now_ns();
+
+    if (matched < (size_t) publishes) {
+        printf("error: %zu of %d publishes matched\n", matched, publishes);
+        exit(1);
+    }
+    free(filters);
+    free(topics);
+    free(compiled);
+    return (stop - start) / publishes;
+}
+
+#if defined(MQTT_STORE_AVAILABLE)
+/**
+ * Time recording QoS 1 publishes (with 64 byte payloads) and their PUBACKs in a session
+ * store with \p durability, when \p per_send publishes are queued per __mqtt_send.
+ */
+static double BENCH__store(enum MQTTStoreDurability durability, int per_send) {
+    char path[] = "/var/tmp/mqtt-c-store-XXXXXX";
+    struct mqtt_store store;
+    struct mqtt_queued_message msg;
+    uint8_t packet[128], payload[64];
+    const int messages = durability == MQTT_STORE_SYNC_EACH ? 2000 : 20000;
+    double start, stop;
+    ssize_t packet_size;
+    int i, k, fd;
+
+    fd = mkstemp(path);
+    if (fd < 0 || mqtt_store_open(&store, path, 1u << 20, durability) != MQTT_OK) {
+        printf("error: can't open %s\n", path);
+        exit(1);
+    }
+    close(fd);
+    memset(payload, 'p', sizeof(payload));
+    packet_size = mqtt_pack_publish_request(packet, sizeof(packet), "bench/store", 1, payload, sizeof(payload), MQTT_PUBLISH_QOS_1);
+    memset(&msg, 0, sizeof(msg));
+    msg.start = packet;
+    msg.size = (size_t) packet_size;
+    msg.control_type = MQTT_CONTROL_PUBLISH;
+
+    start = now_ns();
+    for(i = 0; i < messages; i += per_send) {
+        for(k = 0; k < per_send; ++k) {
+            msg.packet_id = (uint16_t) ((i + k) % 65535 + 1);
+            if (store.journal.append(store.journal.state, &msg) != MQTT_OK) {
+                printf("error: can't append\n");
+                exit(1);
+            }
+        }
+        store.journal.flush(store.journal.state);
+        for(k = 0; k < per_send; ++k) {
+            store.journal.complete(store.journal.state, MQTT_CONTROL_PUBLISH, (uint16_t) ((i + k) % 65535 + 1));
+        }
+    }
+    stop = now_ns();
+
+    mqtt_store_close(&store);
+    unlink(path);
+    return messages / ((stop - start) / 1e9);
+}
+#endif
+
+#if defined(MQTT_WORKER_POOL_AVAILABLE)
+/* A callback that spends a few hundred ns hashing the payload, like a parser would. */
+static void busy_callback(void **state, struct mqtt_response_publish *publish) {
+    const uint8_t *payload = (const uint8_t*) publish->application_message;
+    uint32_t hash = 2166136261u;
+    int round;
+    size_t i;
+    for(round = 0; round < 16; ++round) {
+        for(i = 0; i < publish->application_message_size; ++i) {
+            hash = (hash ^ payload[i]) * 16777619u;
+        }
+    }
+    __atomic_fetch_add((uint32_t*) *state, hash & 1u, __ATOMIC_RELAXED);
+}
+
+struct worker_pool_thread {
+    struct mqtt_worker_pool *pool;
+    size_t index;
+};
+
+static void* worker_pool_thread(void *arg) {
+    struct worker_pool_thread *thread = (struct worker_pool_thread*) arg;
+    mqtt_worker_pool_run(thread->pool, thread->index);
+    return NULL;
+}
+
+/**
+ * Time 64 byte publishes on 64 topics passed to a CPU-bound callback, by the receiving thread
+ * itself (0 workers) or through a worker pool with \p num_workers workers.
+ */
+static double BENCH__worker_pool(int num_workers) {
+    static uint8_t mem[1 << 20];
+    struct mqtt_worker_pool pool;
+    struct mqtt_worker workers[8];
+    struct worker_pool_thread threads[8];
+    pthread_t tids[8];
+    struct mqtt_response_publish publish;
+    char topics[64][16];
+    uint8_t payload[64];
+    uint32_t odd = 0;
+    void *state = &odd;
+    const int publishes = 200000;
+    double start, stop;
+    int i;
+
+    for(i = 0; i < 64; ++i) {
+        snprintf(topics[i], sizeof(topics[i]), "sensors/%d", i);
+    }
+    memset(payload, 0x5a, sizeof(payload));
+    memset(&publish, 0, sizeof(publish));
+    publish.application_message = payload;
+    publish.application_message_size = sizeof(payload);
+
+    if (num_workers > 0) {
+        mqtt_worker_pool_init(&pool, workers, (size_t) num_workers, mem, sizeof(mem), busy_callback, &odd);
+        state = &pool;
+        for(i = 0; i < num_workers; ++i) {
+            threads[i].pool = &pool;
+            threads[i].index = (size_t) i;
+            pthread_create(&tids[i], NULL, worker_pool_thread, &threads[i]);
+        }
+    }
+
+    start = now_ns();
+    for(i = 0; i < publishes; ++i) {
+        publish.topic_name = topics[i & 63];
+        publish.topic_name_size = (uint16_t) strlen(topics[i & 63]);
+        if (num_workers > 0) {
+            mqtt_worker_pool_dispatch(&state, &publish);
+        } else {
+            busy_callback(&state, &publish);
+        }
+    }
+    if (num_workers > 0) {
+        mqtt_worker_pool_drain(&pool);
+    }
+    stop = now_ns();
+
+    if (num_workers > 0) {
+        mqtt_worker_pool_stop(&pool);
+        for(i = 0; i < num_workers; ++i) {
+            pthread_join(tids[i], NULL);
+        }
+        mqtt_worker_pool_destroy(&pool);
+    }
+    return publishes / ((stop - start) / 1e9);
+}
+#endif
+
+/**
+ * Time an uncontended lock and unlock the way each \c MQTT_PAL_LOCK_POLICY implements it:
+ * a pthread mutex (\p policy MQTT_PAL_LOCK_MUTEX), the spinlock's atomic exchange and store
+ * (MQTT_PAL_LOCK_SPIN), or nothing (MQTT_PAL_LOCK_NONE).
+ */
+static double BENCH__lock_pair(int policy) {
+    const int pairs = 10000000;
+    pthread_mutex_t mutex;
+    uint32_t spin = 0;
+    double start, stop;
+    int i;
+
+    pthread_mutex_init(&mutex, NULL);
+    start = now_ns();
+    for(i = 0; i < pairs; ++i) {
+        if (policy == MQTT_PAL_LOCK_MUTEX) {
+            pthread_mutex_lock(&mutex);
+            pthread_mutex_unlock(&mutex);
+        } else if (policy == MQTT_PAL_LOCK_SPIN) {
+            while (__atomic_exchange_n(&spin, 1u, __ATOMIC_ACQUIRE) != 0u);
+            __atomic_store_n(&spin, 0u, __ATOMIC_RELEASE);
+        }
+        __asm__ __volatile__("" ::: "memory");
+    }
+    stop = now_ns();
+    pthread_mutex_destroy(&mutex);
+    return (stop - start) / pairs;
+}
+
+#if MQTT_PAL_LOCK_POLICY != MQTT_PAL_LOCK_NONE
+/* A thread that accepts the client's CONNECT and reads (and discards) everything it sends. */
+static void* sink_thread(void *arg) {
+    static const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    uint8_t buf[65536];
+    if (write(*(int*) arg, connack, sizeof(connack)) != sizeof(connack)) {
+        return NULL;
+    }
+    while (read(*(int*) arg, buf, sizeof(buf)) > 0);
+    return NULL;
+}
+
+struct contention_state {
+    struct mqtt_client client;
+    int staged;
+    int publishes;
+    volatile int stop;
+};
+
+static void* refresher_thread(void *arg) {
+    struct contention_state *state = (struct contention_state*) arg;
+    while (!state->stop) {
+        mqtt_sync(&state->client);
+    }
+    return NULL;
+}
+
+static void* publisher_thread(void *arg) {
+    struct contention_state *state = (struct contention_state*) arg;
+    int i;
+    for(i = 0; i < state->publishes; ++i) {
+        enum MQTTErrors rv;
+        do {
+            if (state->staged) {
+                rv = mqtt_publish_staged(&state->client, "benchmark/topic", "payload", 7, MQTT_PUBLISH_QOS_0);
+            } else {
+                rv = mqtt_publish(&state->client, "benchmark/topic", "payload", 7, MQTT_PUBLISH_QOS_0);
+            }
+            if (rv == MQTT_ERROR_SEND_BUFFER_IS_FULL) {
+                sched_yield();
+            }
+        } while (rv == MQTT_ERROR_SEND_BUFFER_IS_FULL);
+        if (rv != MQTT_OK) {
+            printf("error: %s\n", mqtt_error_str(rv));
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Time QoS 0 publishes from \p num_threads threads while a refresher thread keeps calling
+ * mqtt_sync, with mqtt_publish or (with \p staged) mqtt_publish_staged. The send buffer and
+ * the staging ring hold every message, so neither path waits for the refresher (and
+ * mqtt_publish never sees the sticky MQTT_ERROR_SEND_BUFFER_IS_FULL).
+ */
+static double BENCH__publish_contention(int num_threads, int staged) {
+    static uint8_t sendbuf[1 << 25], stagebuf[1 << 23];
+    static struct contention_state state;
+    uint8_t recvbuf[64];
+    pthread_t sink, refresher, publishers[16];
+    double start, stop;
+    int sv[2], i;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    mqtt_init(&state.client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    if (staged) {
+        mqtt_init_publish_stage(&state.client, stagebuf, sizeof(stagebuf));
+    }
+    mqtt_connect(&state.client, "benchmark", NULL, NULL, 0, NULL, NULL, 0, 400);
+    state.staged = staged;
+    state.publishes = 120000 / num_threads;
+    state.stop = 0;
+    pthread_create(&sink, NULL, sink_thread, &sv[1]);
+    pthread_create(&refresher, NULL, refresher_thread, &state);
+
+    start = now_ns();
+    for(i = 0; i < num_threads; ++i) {
+        pthread_create(&publishers[i], NULL, publisher_thread, &state);
+    }
+    for(i = 0; i < num_threads; ++i) {
+        pthread_join(publishers[i], NULL);
+    }
+    stop = now_ns();
+
+    state.stop = 1;
+    pthread_join(refresher, NULL);
+    close(sv[0]);
+    pthread_join(sink, NULL);
+    close(sv[1]);
+    return (stop - start) / ((double) num_threads * state.publishes);
+}
+
+struct duplex_state {
+    struct mqtt_client client;
+    int fd;
+    uint32_t odd;
+    volatile int stop;
+};
+
+/* A publish callback that spends about a microsecond on every message. */
+static void slow_callback(void **state, struct mqtt_response_publish *publish) {
+    const uint8_t *payload = (const uint8_t*) publish->application_message;
+    uint32_t hash = 2166136261u;
+    int round;
+    size_t i;
+    for(round = 0; round < 32; ++round) {
+        for(i = 0; i < publish->application_message_size; ++i) {
+            hash = (hash ^ payload[i]) * 16777619u;
+        }
+    }
+    __atomic_fetch_add((uint32_t*) *state, hash & 1u, __ATOMIC_RELAXED);
+}
+
+/* A thread that floods the client with QoS 0 publishes until the client's socket is closed. */
+static void* injector_thread(void *arg) {
+    struct duplex_state *state = (struct duplex_state*) arg;
+    uint8_t packets[4096], payload[32];
+    size_t size = 0;
+    memset(payload, 0x5a, sizeof(payload));
+    while (size + 64 <= sizeof(packets)) {
+        size += (size_t) mqtt_pack_publish_request(packets + size, sizeof(packets) - size,
+                                                   "benchmark/in", 0, payload, sizeof(payload), MQTT_PUBLISH_QOS_0);
+    }
+    while (!state->stop) {
+        if (send(state->fd, packets, size, MSG_NOSIGNAL) < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void* duplex_refresher_thread(void *arg) {
+    struct duplex_state *state = (struct duplex_state*) arg;
+    while (!state->stop) {
+        mqtt_sync(&state->client);
+    }
+    return NULL;
+}
+
+/**
+ * Time QoS 0 publishes while a refresher thread keeps calling mqtt_sync, with nothing to
+ * receive or (with \p receiving) while the client is flooded with publishes that its callback
+ * spends about a microsecond on.
+ */
+static double BENCH__duplex(int receiving) {
+    static uint8_t sendbuf[1 << 25], recvbuf[1 << 16];
+    static struct duplex_state state;
+    pthread_t sink, injector, refresher;
+    const int publishes = 120000;
+    double start, stop;
+    int sv[2], i;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    mqtt_init(&state.client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), slow_callback);
+    state.client.publish_response_callback_state = &state.odd;
+    mqtt_connect(&state.client, "benchmark", NULL, NULL, 0, NULL, NULL, 0, 400);
+    state.fd = sv[1];
+    state.odd = 0;
+    state.stop = 0;
+    pthread_create(&sink, NULL, sink_thread, &sv[1]);
+    pthread_create(&refresher, NULL, duplex_refresher_thread, &state);
+    if (receiving) {
+        pthread_create(&injector, NULL, injector_thread, &state);
+    }
+
+    start = now_ns();
+    for(i = 0; i < publishes; ++i) {
+        enum MQTTErrors rv = mqtt_publish(&state.client, "benchmark/out", "payload", 7, MQTT_PUBLISH_QOS_0);
+        if (rv != MQTT_OK) {
+            printf("error: %s\n", mqtt_error_str(rv));
+            exit(1);
+        }
+    }
+    stop = now_ns();
+
+    state.stop = 1;
+    pthread_join(refresher, NULL);
+    close(sv[0]);
+    if (receiving) {
+        pthread_join(injector, NULL);
+    }
+    pthread_join(sink, NULL);
+    close(sv[1]);
+    return (stop - start) / publishes;
+}
+#endif
+
+/* the reactor benchmark publishes from the main thread while the reactors run */
+#if defined(MQTT_REACTOR_AVAILABLE) && MQTT_PAL_LOCK_POLICY != MQTT_PAL_LOCK_NONE
+/* A broker stub that acknowledges CONNECT, QoS 1 PUBLISH and PINGREQ packets. */
+struct stub_connection {
+    int fd;
+    size_t fill;
+    uint8_t buf[512];
+};
+
+struct stub_broker {
+    int epoll_fd;
+    volatile int stop;
+    volatile long publishes;
+};
+
+static void stub_broker_handle(struct stub_broker *broker, struct stub_connection *conn) {
+    for(;;) {
+        ssize_t n = read(conn->fd, conn->buf + conn->fill, sizeof(conn->buf) - conn->fill);
+        size_t pos = 0;
+        if (n <= 0) {
+            return;
+        }
+        conn->fill += (size_t) n;
+
+        /* respond to every complete packet */
+        for(;;) {
+            struct mqtt_response response;
+            uint8_t reply[4];
+            ssize_t len = mqtt_unpack_fixed_header(&response, conn->buf + pos, conn->fill - pos);
+            if (len <= 0 || conn->fill - pos < (size_t) len + response.fixed_header.remaining_length) {
+                break;
+            }
+            if (response.fixed_header.control_type == MQTT_CONTROL_CONNECT) {
+                reply[0] = 0x20; reply[1] = 0x02; reply[2] = 0x00; reply[3] = 0x00;
+                write(conn->fd, reply, 4);
+            } else if (response.fixed_header.control_type == MQTT_CONTROL_PUBLISH) {
+                const uint8_t *vh = conn->buf + pos + len;
+                size_t topic_len = ((size_t) vh[0] << 8) | vh[1];
+                reply[0] = 0x40; reply[1] = 0x02; reply[2] = vh[2 + topic_len]; reply[3] = vh[3 + topic_len];
+                write(conn->fd, reply, 4);
+                __atomic_add_fetch(&broker->publishes, 1, __ATOMIC_RELAXED);
+            } else if (response.fixed_header.control_type == MQTT_CONTROL_PINGREQ) {
+                reply[0] = 0xD0; reply[1] = 0x00;
+                write(conn->fd, reply, 2);
+            }
+            pos += (size_t) len + response.fixed_header.remaining_length;
+        }
+        memmove(conn->buf, conn->buf + pos, conn->fill - pos);
+        conn->fill -= pos;
+    }
+}
+
+static void* stub_broker_thread(void *arg) {
+    struct stub_broker *broker = (struct stub_broker*) arg;
+    struct epoll_event events[256];
+    while(!broker->stop) {
+        int n = epoll_wait(broker->epoll_fd, events, 256, 10);
+        int i;
+        for(i = 0; i < n; ++i) {
+            stub_broker_handle(broker, (struct stub_connection*) events[i].data.ptr);
+        }
+    }
+    return NULL;
+}
+
+struct reactor_thread {
+    struct mqtt_reactor reactor;
+    volatile int *stop;
+};
+
+static void* reactor_thread(void *arg) {
+    struct reactor_thread *thread = (struct reactor_thread*) arg;
+    while(!*thread->stop) {
+        mqtt_reactor_run_once(&thread->reactor, 10);
+    }
+    return NULL;
+}
+
+static double cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Drive \p num_clients clients connected to a broker stub with \p num_threads reactors, and
+ * measure the QoS 1 publish throughput and the CPU time used by idle clients.
+ */
+static void BENCH__reactor(int num_clients, int num_threads, double *publishes_per_s, double *idle_cpu) {
+    const size_t bufsz = 4096;
+    const int rounds = 20000 / num_clients + 2;
+    struct stub_broker broker;
+    struct stub_connection *conns = (struct stub_connection*) calloc((size_t) num_clients, sizeof(*conns));
+    struct mqtt_client *clients = (struct mqtt_client*) calloc((size_t) num_clients, sizeof(*clients));
+    struct mqtt_reactor_entry *entries = (struct mqtt_reactor_entry*) calloc((size_t) num_clients, sizeof(*entries));
+    const size_t heap_capacity = (size_t) (num_clients + num_threads - 1) / (size_t) num_threads;
+    struct mqtt_reactor_entry **heap = (struct mqtt_reactor_entry**) calloc(heap_capacity * (size_t) num_threads, sizeof(*heap));
+    struct reactor_thread threads[4];
+    uint8_t *bufs = (uint8_t*) malloc((size_t) num_clients * bufsz * 2);
+    pthread_t broker_tid, tids[4];
+    volatile int stop = 0;
+    double start, stop_ns, cpu;
+    int i, r;
+
+    broker.epoll_fd = epoll_create1(0);
+    broker.stop = 0;
+    broker.publishes = 0;
+    for(i = 0; i < num_threads; ++i) {
+        mqtt_reactor_init(&threads[i].reactor, heap + (size_t) i * heap_capacity, heap_capacity);
+        threads[i].stop = &stop;
+    }
+    for(i = 0; i < num_clients; ++i) {
+        struct epoll_event ev;
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+            printf("error: socketpair failed (raise the file descriptor limit)\n");
+            exit(1);
+        }
+        fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+        fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+        conns[i].fd = sv[1];
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &conns[i];
+        epoll_ctl(broker.epoll_fd, EPOLL_CTL_ADD, sv[1], &ev);
+
+        mqtt_init(&clients[i], sv[0], bufs + (size_t) i * bufsz * 2, bufsz, bufs + (size_t) i * bufsz * 2 + bufsz, bufsz, NULL);
+        mqtt_connect(&clients[i], "benchmark", NULL, NULL, 0, NULL, NULL, 0, 60);
+    }
+    pthread_create(&broker_tid, NULL, stub_broker_thread, &broker);
+
+    /* shard the clients over the reactors before starting them */
+    for(i = 0; i < num_clients; ++i) {
+        mqtt_reactor_add(&threads[i % num_threads].reactor, &entries[i], &clients[i]);
+    }
+    for(i = 0; i < num_threads; ++i) {
+        pthread_create(&tids[i], NULL, reactor_thread, &threads[i]);
+    }
+
+    /* every client publishes one message per round */
+    start = now_ns();
+    for(r = 0; r < rounds; ++r) {
+        for(i = 0; i < num_clients; ++i) {
+            if (mqtt_publish(&clients[i], "benchmark/topic", "payload", 7, MQTT_PUBLISH_QOS_1) != MQTT_OK) {
+                printf("error: %s\n", mqtt_error_str(clients[i].error));
+                exit(1);
+            }
+            mqtt_reactor_wakeup(&threads[i % num_threads].reactor, &entries[i]);
+        }
+        while (__atomic_load_n(&broker.publishes, __ATOMIC_RELAXED) < (long) (r + 1) * num_clients) {
+            sched_yield();
+        }
+    }
+    stop_ns = now_ns();
+    *publishes_per_s = (double) rounds * num_clients / ((stop_ns - start) * 1e-9);
+
+    /* nothing to do but keep-alives */
+    cpu = cpu_seconds();
+    start = now_ns();
+    usleep(500000);
+    *idle_cpu = (cpu_seconds() - cpu) / ((now_ns() - start) * 1e-9);
+
+    stop = 1;
+    broker.stop = 1;
+    for(i = 0; i < num_threads; ++i) {
+        pthread_join(tids[i], NULL);
+        mqtt_reactor_destroy(&threads[i].reactor);
+    }
+    pthread_join(broker_tid, NULL);
+    for(i = 0; i < num_clients; ++i) {
+        close(clients[i].socketfd);
+        close(conns[i].fd);
+    }
+    close(broker.epoll_fd);
+    free(bufs);
+    free(heap);
+    free(entries);
+    free(clients);
+    free(conns);
+}
+#endif
+
+int main(void) {
+    const int inflight[] = {10, 100, 1000, 10000};
+    size_t i;
+
+    printf("[mqtt_mq_find: ns per PUBACK lookup]\n");
+    printf("%10s %12s %12s %12s\n", "inflight", "indexed", "linear", "+15 QoS 0");
+    for(i = 0; i < sizeof(inflight) / sizeof(inflight[0]); ++i) {
+        printf("%10d %12.1f %12.1f %12.1f\n", inflight[i], BENCH__mq_find(inflight[i], 1, 0), BENCH__mq_find(inflight[i], 0, 0),
+               BENCH__mq_find(inflight[i], 1, 15));
+    }
+
+    printf("\n[mqtt_mq_clean: ns per dequeue/enqueue]\n");
+    printf("%10s %12s\n", "inflight", "lazy");
+    for(i = 0; i < sizeof(inflight) / sizeof(inflight[0]); ++i) {
+        printf("%10d %12.1f\n", inflight[i], BENCH__mq_clean(inflight[i]));
+    }
+
+    printf("\n[mqtt_publish: ns per QoS 1 publish]\n");
+    printf("%10s %12s %12s\n", "inflight", "pid bitmap", "pid lfsr");
+    for(i = 0; i < sizeof(inflight) / sizeof(inflight[0]); ++i) {
+        printf("%10d %12.1f %12.1f\n", inflight[i], BENCH__publish(inflight[i], 1), BENCH__publish(inflight[i], 0));
+    }
+
+    {
+        const int batches[] = {1, 8, 64};
+        printf("\n[mqtt_publish_many: ns per QoS 0 message]\n");
+        printf("%10s %12s %12s\n", "batch", "publish", "many");
+        for(i = 0; i < sizeof(batches) / sizeof(batches[0]); ++i) {
+            printf("%10d %12.1f %12.1f\n", batches[i], BENCH__publish_many(0), BENCH__publish_many(batches[i]));
+        }
+    }
+
+    {
+        const int filters[] = {100, 1000, 10000};
+        printf("\n[topic filter matching: ns per publish]\n");
+        printf("%10s %12s %12s\n", "filters", "trie", "linear");
+        for(i = 0; i < sizeof(filters) / sizeof(filters[0]); ++i) {
+            printf("%10d %12.1f %12.1f\n", filters[i], BENCH__dispatch(filters[i], 1), BENCH__dispatch(filters[i], 0));
+        }
+    }
+
+    {
+        const int filters[] = {100, 1000, 10000};
+        printf("\n[matching a publish against every filter: ns per publish]\n");
+        printf("%10s %12s %12s %12s\n", "filters", "batch", "matches", "bytewise");
+        for(i = 0; i < sizeof(filters) / sizeof(filters[0]); ++i) {
+            printf("%10d %12.1f %12.1f %12.1f\n", filters[i], BENCH__topic(filters[i], 0), BENCH__topic(filters[i], 1), BENCH__topic(filters[i], 2));
+        }
+    }
+
+    {
+        const int policies[] = {MQTT_PAL_LOCK_MUTEX, MQTT_PAL_LOCK_SPIN, MQTT_PAL_LOCK_NONE};
+        const char *names[] = {"none", "spin", "mutex"};
+        printf("\n[lock policies: ns per uncontended lock and unlock]\n");
+        printf("%10s %12s\n", "policy", "lock pair");
+        for(i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i) {
+            printf("%10s %12.1f\n", names[policies[i]], BENCH__lock_pair(policies[i]));
+        }
+        printf("\n[mqtt_publish with the %s lock policy: ns per QoS 0 publish]\n", names[MQTT_PAL_LOCK_POLICY]);
+        printf("%12.1f\n", BENCH__publish_many(0));
+    }
+
+#if MQTT_PAL_LOCK_POLICY != MQTT_PAL_LOCK_NONE
+    {
+        const int threads[] = {1, 4, 16};
+        printf("\n[QoS 0 publishes with a refresher thread: ns per publish]\n");
+        printf("%10s %12s %12s\n", "threads", "locked", "staged");
+        for(i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i) {
+            printf("%10d %12.1f %12.1f\n", threads[i], BENCH__publish_contention(threads[i], 0), BENCH__publish_contention(threads[i], 1));
+        }
+    }
+
+    printf("\n[QoS 0 publishes with a refresher thread while receiving: ns per publish]\n");
+    printf("%12s %12s\n", "idle", "receiving");
+    printf("%12.1f %12.1f\n", BENCH__duplex(0), BENCH__duplex(1));
+#endif
+
+#if defined(MQTT_STORE_AVAILABLE)
+    {
+        const enum MQTTStoreDurability durability[] = {MQTT_STORE_NO_SYNC, MQTT_STORE_SYNC_BATCH, MQTT_STORE_SYNC_EACH};
+        const char *names[] = {"no sync", "sync batch", "sync each"};
+        printf("\n[mqtt_store: QoS 1 publishes/s recorded and completed]\n");
+        printf("%12s %14s %14s\n", "durability", "1 per send", "16 per send");
+        for(i = 0; i < sizeof(durability) / sizeof(durability[0]); ++i) {
+            printf("%12s %14.0f %14.0f\n", names[i], BENCH__store(durability[i], 1), BENCH__store(durability[i], 16));
+        }
+    }
+#endif
+
+#if defined(MQTT_WORKER_POOL_AVAILABLE)
+    {
+        const int workers[] = {1, 2, 4};
+        printf("\n[mqtt_worker_pool: publishes/s on 64 topics with a CPU-bound callback]\n");
+        printf("%10s %12s %12s\n", "workers", "inline", "pool");
+        for(i = 0; i < sizeof(workers) / sizeof(workers[0]); ++i) {
+            printf("%10d %12.0f %12.0f\n", workers[i], BENCH__worker_pool(0), BENCH__worker_pool(workers[i]));
+        }
+    }
+#endif
+
+#if defined(MQTT_REACTOR_AVAILABLE) && MQTT_PAL_LOCK_POLICY != MQTT_PAL_LOCK_NONE
+    {
+        const int clients[] = {10, 100, 1000, 5000};
+        const char *backend = "epoll";
+        struct rlimit limit;
+#if defined(MQTT_USE_IO_URING)
+        struct mqtt_reactor_entry *probe_heap[1];
+        struct mqtt_reactor probe;
+#endif
+        getrlimit(RLIMIT_NOFILE, &limit);
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+
+#if defined(MQTT_USE_IO_URING)
+        /* the reactors fall back to epoll if the kernel can't do io_uring */
+        if (mqtt_reactor_init(&probe, probe_heap, 1) == MQTT_OK) {
+            if (probe.ring_fd >= 0) {
+                backend = "io_uring";
+            }
+            mqtt_reactor_destroy(&probe);
+        }
+#endif
+        printf("\n[mqtt_reactor (%s): QoS 1 publishes/s (idle CPU %%) against a broker stub]\n", backend);
+        printf("%10s %20s %20s\n", "clients", "1 reactor", "4 reactors");
+        for(i = 0; i < sizeof(clients) / sizeof(clients[0]); ++i) {
+            double rate[2], idle[2];
+            BENCH__reactor(clients[i], 1, &rate[0], &idle[0]);
+            BENCH__reactor(clients[i], 4, &rate[1], &idle[1]);
+            printf("%10d %12.0f (%4.1f%%) %12.0f (%4.1f%%)\n", clients[i], rate[0], idle[0] * 100, rate[1], idle[1] * 100);
+        }
+    }
+#endif
+    return 0;
+}
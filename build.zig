@@ -65,6 +65,12 @@ fn includeCommon(lib: *std.build.LibExeObjStep) !void {
 
     lib.addCSourceFile("src/mqtt.c", &[_][]const u8 {});
     lib.addCSourceFile("src/mqtt_pal.c", &[_][]const u8 {});
+    lib.addCSourceFile("src/mqtt_reactor.c", &[_][]const u8 {});
+    lib.addCSourceFile("src/mqtt_dispatcher.c", &[_][]const u8 {});
+    lib.addCSourceFile("src/mqtt_topic.c", &[_][]const u8 {});
+    lib.addCSourceFile("src/mqtt_store.c", &[_][]const u8 {});
+    lib.addCSourceFile("src/mqtt_worker_pool.c", &[_][]const u8 {});
+    lib.addCSourceFile("src/mqtt_io_thread.c", &[_][]const u8 {});
 
     lib.setBuildMode(.Debug); // Can be .Debug, .ReleaseSafe, .ReleaseFast, and .ReleaseSmall
     lib.linkLibC();
@@ -6,9 +6,9 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <pthread.h>
 
 #include <mqtt.h>
+#include <mqtt_io_thread.h>
 #include "templates/posix_sockets.h"
 
 
@@ -20,19 +20,9 @@
 void publish_callback(void** unused, struct mqtt_response_publish *published);
 
 /**
- * @brief The client's refresher. This function triggers back-end routines to
- *        handle ingress/egress traffic to the broker.
- *
- * @note All this function needs to do is call \ref __mqtt_recv and
- *       \ref __mqtt_send every so often. I've picked 100 ms meaning that
- *       client ingress/egress traffic will be handled every 100 ms.
+ * @brief Safelty stops the \p io_thread and closes the \p sockfd before \c exit.
  */
-void* client_refresher(void* client);
-
-/**
- * @brief Safelty closes the \p sockfd and cancels the \p client_daemon before \c exit.
- */
-void exit_example(int status, int sockfd, pthread_t *client_daemon);
+void exit_example(int status, int sockfd, struct mqtt_io_thread *io_thread);
 
 /**
  * A simple program to that publishes the current time whenever ENTER is pressed.
@@ -90,12 +80,11 @@ int main(int argc, const char *argv[])
         exit_example(EXIT_FAILURE, sockfd, NULL);
     }
 
-    /* start a thread to refresh the client (handle egress and ingree client traffic) */
-    pthread_t client_daemon;
-    if(pthread_create(&client_daemon, NULL, client_refresher, &client)) {
-        fprintf(stderr, "Failed to start client daemon.\n");
+    /* start the client's I/O thread (it handles the egress and ingress client traffic) */
+    struct mqtt_io_thread io_thread;
+    if(mqtt_io_thread_start(&io_thread, &client, -1, -1, 0) != MQTT_OK) {
+        fprintf(stderr, "Failed to start the client's I/O thread.\n");
         exit_example(EXIT_FAILURE, sockfd, NULL);
-
     }
 
     /* start publishing the time */
@@ -121,22 +110,22 @@ int main(int argc, const char *argv[])
         /* check for errors */
         if (client.error != MQTT_OK) {
             fprintf(stderr, "error: %s\n", mqtt_error_str(client.error));
-            exit_example(EXIT_FAILURE, sockfd, &client_daemon);
+            exit_example(EXIT_FAILURE, sockfd, &io_thread);
         }
     }
 
     /* disconnect */
     printf("\n%s disconnecting from %s\n", argv[0], addr);
-    sleep(1);
+    mqtt_disconnect(&client);
 
     /* exit */
-    exit_example(EXIT_SUCCESS, sockfd, &client_daemon);
+    exit_example(EXIT_SUCCESS, sockfd, &io_thread);
 }
 
-void exit_example(int status, int sockfd, pthread_t *client_daemon)
+void exit_example(int status, int sockfd, struct mqtt_io_thread *io_thread)
 {
+    if (io_thread != NULL) mqtt_io_thread_stop(io_thread);
     if (sockfd != -1) close(sockfd);
-    if (client_daemon != NULL) pthread_cancel(*client_daemon);
     exit(status);
 }
 
@@ -146,13 +135,3 @@ void publish_callback(void** unused, struct mqtt_response_publish *published)
 {
     /* not used in this example */
 }
-
-void* client_refresher(void* client)
-{
-    while(1)
-    {
-        mqtt_sync((struct mqtt_client*) client);
-        usleep(100000U);
-    }
-    return NULL;
-}
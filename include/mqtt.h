@@ -207,7 +207,14 @@ struct mqtt_fixed_header {
     MQTT_ERROR(MQTT_ERROR_INVALID_REMAINING_LENGTH)      \
     MQTT_ERROR(MQTT_ERROR_CLEAN_SESSION_IS_REQUIRED)     \
     MQTT_ERROR(MQTT_ERROR_RECONNECT_FAILED)              \
-    MQTT_ERROR(MQTT_ERROR_RECONNECTING)
+    MQTT_ERROR(MQTT_ERROR_RECONNECTING)                  \
+    MQTT_ERROR(MQTT_ERROR_PACKET_ID_EXHAUSTED)           \
+    MQTT_ERROR(MQTT_ERROR_REACTOR_FULL)                  \
+    MQTT_ERROR(MQTT_ERROR_DISPATCHER_FULL)               \
+    MQTT_ERROR(MQTT_ERROR_INVALID_TOPIC_FILTER)          \
+    MQTT_ERROR(MQTT_ERROR_STORE_FULL)                    \
+    MQTT_ERROR(MQTT_ERROR_STORE_IO)                      \
+    MQTT_ERROR(MQTT_ERROR_IO_THREAD)
 
 /* todo: add more connection refused errors */
 
@@ -779,6 +786,36 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
                                   size_t application_message_size,
                                   uint8_t publish_flags);
 
+/**
+ * @brief Serialize the header of a PUBLISH request and put it in \p buf.
+ * @ingroup packers
+ * 
+ * This packs everything but the application message itself (i.e. the fixed header, 
+ * the topic name and the packet ID). The remaining length that is written accounts for 
+ * \p application_message_size bytes of payload that must be sent directly after the 
+ * header.
+ * 
+ * @param[out] buf the buffer to put the PUBLISH header in.
+ * @param[in] bufsz the maximum number of bytes that can be put into \p buf.
+ * @param[in] topic_name the topic to publish the application message under.
+ * @param[in] packet_id this packets packet ID.
+ * @param[in] application_message_size the size of the application message in bytes.
+ * @param[in] publish_flags The flags to publish the application message with. See 
+ *                          \ref mqtt_pack_publish_request.
+ * 
+ * @see <a href="http://docs.oasis-open.org/mqtt/mqtt/v3.1.1/os/mqtt-v3.1.1-os.html#_Toc398718037">
+ * MQTT v3.1.1: PUBLISH - Publish Message.
+ * </a>
+ * 
+ * @returns The number of bytes put into \p buf, 0 if \p buf is too small to fit the PUBLISH 
+ *          header, a negative value if there was a protocol violation.
+ */
+ssize_t mqtt_pack_publish_header(uint8_t *buf, size_t bufsz,
+                                 const char* topic_name,
+                                 uint16_t packet_id,
+                                 size_t application_message_size,
+                                 uint8_t publish_flags);
+
 /**
  * @brief Serialize a PUBACK, PUBREC, PUBREL, or PUBCOMP packet and put it in \p buf.
  * @ingroup packers
@@ -934,17 +971,44 @@ struct mqtt_queued_message {
     /** @brief The number of bytes in the message. */
     size_t size;
 
+    /** 
+     * @brief A caller-owned application message that is sent directly after the 
+     *        \c size bytes at \c start, or NULL.
+     * 
+     * @see mqtt_publish_ref
+     */
+    const void *application_message;
+
+    /** @brief The number of bytes in \c application_message. */
+    size_t application_message_size;
+
+    /**
+     * @brief The callback that produces the application message piece by piece while it is
+     *        sent, or NULL (then \c application_message is sent).
+     *
+     * @see mqtt_publish_stream
+     */
+    ssize_t (*producer)(void *state, size_t offset, const void **data);
+
+    /** 
+     * @brief The callback that hands \c application_message back to its owner once the 
+     *        message no longer needs it.
+     */
+    void (*release_callback)(void *release_state, const void *application_message);
+
+    /** @brief The state passed to \c release_callback and \c producer. */
+    void *release_state;
 
     /** @brief The state of the message. */
     enum MQTTQueuedMessageState state;
 
     /** 
-     * @brief The time at which the message was sent..
+     * @brief The time (\ref MQTT_PAL_TIME_MS) at which the message was sent.
      * 
      * @note A timeout will only occur if the message is in
      *       the MQTT_QUEUED_AWAITING_ACK \c state.
      */
-    mqtt_pal_time_t time_sent;
+    mqtt_pal_time_ms_t time_sent;
 
     /**
      * @brief The control type of the message.
@@ -971,6 +1035,9 @@ struct mqtt_message_queue {
     /** 
      * @brief The start of the message queue's memory block. 
      * 
+     * Packets are packed upward from \c mem_start and their mqtt_queued_message's are
+     * allocated downward from \c mem_end.
+     * 
      * @warning This member should \em not be manually changed.
      */
     void *mem_start;
@@ -1002,8 +1069,57 @@ struct mqtt_message_queue {
      * @note This member should not be used manually.
      */
     struct mqtt_queued_message *queue_tail;
+
+    /**
+     * @brief The number of mqtt_queued_message's at the top of the array (next to 
+     *        \c mem_end) that were removed by mqtt_mq_clean but not reclaimed yet.
+     * 
+     * @note This member should not be used manually.
+     */
+    size_t queue_head;
+
+    /**
+     * @brief The packet ID index of the queue, or \c NULL if the queue's memory is too small 
+     *        to hold one.
+     * 
+     * An open addressing (linear probing) hash table that maps a message's 
+     * (control_type, packet_id) to its sequence number plus one (0 marks an empty slot). 
+     * It's carved from the front of the queue's memory by \ref mqtt_mq_init and lets 
+     * \ref mqtt_mq_find look up acknowledged messages in constant time. Only messages that 
+     * can be acknowledged are added: PUBLISH's with a QoS above 0, PUBREC's, PUBREL's, 
+     * SUBSCRIBE's and UNSUBSCRIBE's with a packet ID other than 0.
+     * 
+     * @note This member should not be used manually.
+     */
+    uint32_t *index;
+
+    /** @brief The number of slots in \c index minus one. */
+    uint32_t index_mask;
+
+    /** @brief The sequence number of the message at the front of the queue. */
+    uint32_t index_head_seq;
+
+    /**
+     * @brief The number of messages, counted from the front of the queue, that were added to
+     *        \c index (or skipped because they can't be acknowledged).
+     */
+    uint32_t index_count;
+
+    /** @brief The number of occupied slots in \c index. */
+    uint32_t index_used;
 };
 
+/**
+ * @brief The smallest number of slots that a message queue's packet ID index is built with.
+ * @ingroup details
+ * 
+ * The index gets one slot per \c sizeof(struct mqtt_queued_message) bytes of the queue's 
+ * memory (rounded up to a power of two). Smaller queues are searched linearly.
+ */
+#if !defined(MQTT_MQ_INDEX_MIN_SLOTS)
+#define MQTT_MQ_INDEX_MIN_SLOTS 64
+#endif
+
 /**
  * @brief Initialize a message queue.
  * @ingroup details
@@ -1020,6 +1136,11 @@ void mqtt_mq_init(struct mqtt_message_queue *mq, void *buf, size_t bufsz);
  * @brief Clear as many messages from the front of the queue as possible.
  * @ingroup details
  * 
+ * Removing messages only advances the front of the queue. The remaining messages are moved
+ * to the ends of the queue's memory once the space taken by the removed ones is at least as
+ * large as the space they take, so that each byte is moved a constant number of times on
+ * average. Pointers to queued messages are invalidated.
+ * 
  * @note Calls to this function are the \em only way to remove messages from the queue.
  * 
  * @param mq The message queue.
@@ -1050,6 +1171,13 @@ struct mqtt_queued_message* mqtt_mq_register(struct mqtt_message_queue *mq, size
  * @brief Find a message in the message queue.
  * @ingroup details
  * 
+ * If more than one message matches a \p packet_id, the most recently queued one is returned
+ * (a packet ID can be reused while an older, completed message with the same ID is still 
+ * queued). Otherwise the first match from the front of the queue is returned.
+ * Lookups with a \p packet_id use the queue's packet ID index (if it has one), which is
+ * brought up to date with the messages registered since the last lookup. Messages that can't
+ * be acknowledged (see \ref mqtt_message_queue::index) are searched linearly.
+ * 
  * @param mq The message queue.
  * @param[in] control_type The control type of the message you want to find.
  * @param[in] packet_id The packet ID of the message you want to find. Set to \c NULL if you 
@@ -1058,32 +1186,228 @@ struct mqtt_queued_message* mqtt_mq_register(struct mqtt_message_queue *mq, size
  * @relates mqtt_message_queue
  * @returns The found message. \c NULL if the message was not found.
  */
-struct mqtt_queued_message* mqtt_mq_find(const struct mqtt_message_queue *mq, enum MQTTControlPacketType control_type, const uint16_t *packet_id);
+struct mqtt_queued_message* mqtt_mq_find(struct mqtt_message_queue *mq, enum MQTTControlPacketType control_type, const uint16_t *packet_id);
 
 /**
  * @brief Returns the mqtt_queued_message at \p index.
  * @ingroup details
  * 
  * @param mq_ptr A pointer to the message queue.
- * @param index The index of the message. 
+ * @param index The index of the message (0 is the front of the queue). 
  *
  * @returns The mqtt_queued_message at \p index.
  */
-#define mqtt_mq_get(mq_ptr, index) (((struct mqtt_queued_message*) ((mq_ptr)->mem_end)) - 1 - index)
+#define mqtt_mq_get(mq_ptr, index) (((struct mqtt_queued_message*) ((mq_ptr)->mem_end)) - 1 - (mq_ptr)->queue_head - (index))
 
 /**
  * @brief Returns the number of messages in the message queue, \p mq_ptr.
  * @ingroup details
  */
-#define mqtt_mq_length(mq_ptr) (((struct mqtt_queued_message*) ((mq_ptr)->mem_end)) - (mq_ptr)->queue_tail)
+#define mqtt_mq_length(mq_ptr) (((struct mqtt_queued_message*) ((mq_ptr)->mem_end)) - (ssize_t) (mq_ptr)->queue_head - (mq_ptr)->queue_tail)
+
+/* CLIENT */
+
+/**
+ * @brief A lock-free ring in which publisher threads stage PUBLISH packets.
+ * @ingroup details
+ *
+ * Publishers reserve a record by advancing \c reserved with a compare-and-swap, pack their
+ * PUBLISH packet into it without a packet ID and then mark it ready. Whoever holds the
+ * client's mutex in \ref __mqtt_send moves the ready records into the message queue, in the
+ * order in which they were reserved, and gives them their packet ID's.
+ *
+ * @see mqtt_init_publish_stage
+ */
+struct mqtt_publish_stage {
+    /** @brief The memory of the ring (\c NULL if the client doesn't stage publishes). */
+    uint8_t *mem;
+
+    /** @brief The size of \c mem minus one (the size is a power of two). */
+    size_t mask;
+
+    /** @brief The number of bytes reserved by publishers so far. */
+    size_t reserved;
+
+    /** @brief The number of bytes moved into the message queue so far. */
+    size_t drained;
+};
 
 /**
- * @brief Used internally to recalculate the \c curr_sz.
+ * @brief The callbacks that receive the PUBLISH packets which are too large for the receive
+ *        buffer, and the progress of the one that is being received.
  * @ingroup details
+ *
+ * @see mqtt_init_recv_stream
  */
-#define mqtt_mq_currsz(mq_ptr) (((mq_ptr)->curr >= (uint8_t*) ((mq_ptr)->queue_tail - 1)) ? 0 : ((uint8_t*) ((mq_ptr)->queue_tail - 1)) - (mq_ptr)->curr)
+struct mqtt_recv_stream {
+    /**
+     * @brief Called once the fixed and variable header of a streamed PUBLISH are received.
+     *
+     * \c application_message is NULL and \c application_message_size is the size of the whole
+     * payload. \c topic_name is only valid until the callback returns.
+     */
+    void (*begin)(void** state, struct mqtt_response_publish *publish);
 
-/* CLIENT */
+    /** @brief Called for every piece of the payload, in order, as it is received. */
+    void (*chunk)(void** state, const void *data, size_t size);
+
+    /**
+     * @brief Called after the last piece of the payload with \c MQTT_OK, or with the client's
+     *        error if the connection was lost before (by \ref mqtt_reinit).
+     */
+    void (*end)(void** state, enum MQTTErrors result);
+
+    /** @brief A pointer to any state information the callbacks need. */
+    void *state;
+
+    /** @brief The number of payload bytes of the streamed PUBLISH that are still to come. */
+    size_t remaining;
+
+    /** @brief The packet ID of the streamed PUBLISH. */
+    uint16_t packet_id;
+
+    /** @brief The QoS level of the streamed PUBLISH. */
+    uint8_t qos_level;
+
+    /** @brief Non-zero if the streamed PUBLISH is a duplicate that is skipped. */
+    uint8_t discard;
+};
+
+/**
+ * @brief The received PUBLISH packets that wait to be passed to the publish callback until 
+ *        the client's receive lock is released.
+ * @ingroup details
+ *
+ * @see mqtt_init_deferred_delivery
+ */
+struct mqtt_delivery_queue {
+    /** @brief The staged publishes (\c NULL if the callback is called with the receive lock held). */
+    struct mqtt_response_publish *publishes;
+
+    /** @brief The number of publishes that fit in \c publishes. */
+    size_t capacity;
+
+    /** @brief The number of staged publishes. */
+    size_t length;
+
+    /** @brief Non-zero while the staged publishes are passed to the callback. */
+    int delivering;
+
+    /** @brief A counter counting the times the receive lock was released to deliver publishes. */
+    int number_of_deliveries;
+};
+
+/**
+ * @brief The allocator hooks with which a client grows its send and receive buffers.
+ * @ingroup api
+ *
+ * @see mqtt_init_allocator
+ */
+struct mqtt_allocator {
+    /** @brief Returns \p size bytes of memory (aligned like malloc's), or NULL. */
+    void* (*allocate)(void *context, size_t size);
+
+    /** @brief Returns \p ptr (which is \p size bytes long) to the allocator. */
+    void (*deallocate)(void *context, void *ptr, size_t size);
+
+    /** @brief The context that is passed to the hooks. */
+    void *context;
+};
+
+/**
+ * @brief The buffers of a client that grow (up to a limit) under load and shrink back to the
+ *        buffers of \ref mqtt_init or \ref mqtt_reinit when they are idle.
+ * @ingroup details
+ *
+ * @see mqtt_init_allocator
+ */
+struct mqtt_elastic_buffers {
+    /** @brief The allocator of the grown buffers, or NULL if the buffers don't grow. */
+    const struct mqtt_allocator *allocator;
+
+    /** @brief The send buffer passed to \ref mqtt_init or \ref mqtt_reinit. */
+    uint8_t *sendbuf;
+
+    /** @brief The size of \c sendbuf in bytes. */
+    size_t sendbuf_size;
+
+    /** @brief The allocated send buffer the message queue lives in, or NULL. */
+    uint8_t *grown_sendbuf;
+
+    /** @brief The size of \c grown_sendbuf in bytes. */
+    size_t grown_sendbuf_size;
+
+    /** @brief The size in bytes that the send buffer must not grow beyond. */
+    size_t max_sendbuf_size;
+
+    /** @brief The receive buffer passed to \ref mqtt_init or \ref mqtt_reinit. */
+    uint8_t *recvbuf;
+
+    /** @brief The size of \c recvbuf in bytes. */
+    size_t recvbuf_size;
+
+    /** @brief The allocated receive buffer that is in use, or NULL. */
+    uint8_t *grown_recvbuf;
+
+    /** @brief The size in bytes that the receive buffer must not grow beyond. */
+    size_t max_recvbuf_size;
+
+    /** @brief A counter counting the times a buffer was grown. */
+    int number_of_grows;
+};
+
+/**
+ * @brief What \ref mqtt_reinit does with the messages that are still queued.
+ * @ingroup api
+ *
+ * @see mqtt_init_reinit_policy
+ */
+enum MQTTReinitPolicy {
+    /** @brief The queued messages are discarded (the default). */
+    MQTT_REINIT_DISCARD_QUEUE,
+
+    /**
+     * @brief The unacknowledged QoS 1 and 2 messages (and the pending SUBSCRIBE, UNSUBSCRIBE 
+     *        and acknowledgements) are resent after the next CONNECT, unsent QoS 0 messages are
+     *        discarded.
+     */
+    MQTT_REINIT_KEEP_SESSION,
+
+    /** @brief Like \c MQTT_REINIT_KEEP_SESSION, but unsent QoS 0 messages are kept too. */
+    MQTT_REINIT_KEEP_ALL
+};
+
+/**
+ * @brief The hooks with which a client records the QoS 1 and 2 messages of its session, so
+ *        they can be resent after the process restarts.
+ * @ingroup api
+ *
+ * @see mqtt_init_session_journal
+ */
+struct mqtt_session_journal {
+    /**
+     * @brief Records a QoS 1 or 2 PUBLISH, a PUBREC or a PUBREL that was queued.
+     *
+     * A PUBREL replaces the PUBLISH with the same packet ID. If a PUBLISH can't be recorded
+     * it is dropped again, and the error is returned by the publish function.
+     */
+    enum MQTTErrors (*append)(void *state, const struct mqtt_queued_message *msg);
+
+    /**
+     * @brief Forgets a recorded message because it was acknowledged (a PUBLISH by its PUBACK,
+     *        a PUBREL by its PUBCOMP and a PUBREC by the PUBREL of the broker).
+     */
+    void (*complete)(void *state, enum MQTTControlPacketType control_type, uint16_t packet_id);
+
+    /**
+     * @brief Called by \ref __mqtt_send before the queued messages are sent, so the records
+     *        can be made durable in one go. Can be NULL.
+     */
+    enum MQTTErrors (*flush)(void *state);
+
+    /** @brief The state that is passed to the hooks. */
+    void *state;
+};
 
 /**
  * @brief An MQTT client. 
@@ -1098,7 +1422,18 @@ struct mqtt_client {
     /** @brief The LFSR state used to generate packet ID's. */
     uint16_t pid_lfsr;
 
-    /** @brief The keep-alive time in seconds. */
+    /**
+     * @brief The packet ID in-use bitmap (bit \c pid of word \c pid/32), or \c NULL if
+     *        packet ID's are generated by the LFSR.
+     * 
+     * @see mqtt_init_pid_bitmap
+     */
+    uint32_t *pid_bitmap;
+
+    /** @brief The word of \c pid_bitmap at which the search for a free packet ID starts. */
+    uint16_t pid_cursor;
+
+    /** @brief The keep-alive time in seconds (0 disables the keep-alive pings). */
     uint16_t keep_alive;
 
     /** 
@@ -1114,14 +1449,29 @@ struct mqtt_client {
      */
     size_t send_offset;
 
+    /**
+     * @brief The message that \c send_offset bytes of were sent, or NULL.
+     *
+     * The rest of it has to go on the wire before any other message is sent.
+     */
+    struct mqtt_queued_message *send_partial;
+
+    /**
+     * @brief Set while the rest of \c send_partial waits for its producer (that returned 0).
+     *
+     * Nothing else can be sent before it, so \ref mqtt_sync_interest reports neither
+     * \c MQTT_SYNC_WANT_WRITE nor a deadline until \ref mqtt_publish_stream_resume is called.
+     */
+    int producer_starved;
+
     /** 
-     * @brief The timestamp of the last message sent to the buffer.
+     * @brief The time (\ref MQTT_PAL_TIME_MS) at which the last message was sent.
      * 
      * This is used to detect the need for keep-alive pings.
      * 
      * @see keep_alive
     */
-    mqtt_pal_time_t time_of_last_send;
+    mqtt_pal_time_ms_t time_of_last_send;
 
     /** 
      * @brief The error state of the client. 
@@ -1134,25 +1484,66 @@ struct mqtt_client {
     enum MQTTErrors error;
 
     /** 
-     * @brief The timeout period in seconds.
+     * @brief The timeout period in milliseconds.
      * 
-     * If the broker doesn't return an ACK within response_timeout seconds a timeout
+     * If the broker doesn't return an ACK within response_timeout_ms milliseconds a timeout
      * will occur and the message will be retransmitted. 
      * 
-     * @note The default value is 30 [seconds] but you can change it at any time.
+     * @note The default value is 30000 [milliseconds] but you can change it at any time.
      */
-    int response_timeout;
+    uint32_t response_timeout_ms;
 
     /** @brief A counter counting the number of timeouts that have occurred. */
     int number_of_timeouts;
 
     /**
-     * @brief Approximately much time it has typically taken to receive responses from the 
-     *        broker.
+     * @brief The maximum number of QoS 1 PUBLISH messages awaiting their PUBACK.
+     *
+     * Further QoS 1 PUBLISH messages stay queued until a PUBACK opens the window.
+     *
+     * @note The default value is 0 (no limit) but you can change it at any time.
+     */
+    uint16_t max_inflight_qos1;
+
+    /**
+     * @brief The maximum number of QoS 2 PUBLISH messages awaiting their PUBREC.
+     *
+     * Each QoS 2 exchange has its own packet ID, so any number of them can be in flight.
+     * Further QoS 2 PUBLISH messages stay queued until a PUBREC opens the window.
+     *
+     * @note The default value is 1 (QoS 2 messages are sent one round trip at a time) but
+     *       you can change it at any time. 0 means no limit.
+     */
+    uint16_t max_inflight_qos2;
+
+    /**
+     * @brief A counter counting the sends that held back QoS 1 PUBLISH messages because of
+     *        \c max_inflight_qos1.
+     */
+    int number_of_qos1_window_stalls;
+
+    /**
+     * @brief A counter counting the sends that held back QoS 2 PUBLISH messages because of
+     *        \c max_inflight_qos2.
+     */
+    int number_of_qos2_window_stalls;
+
+    /**
+     * @brief Approximately how much time, in milliseconds, it has typically taken to receive 
+     *        responses from the broker.
      * 
-     * @note This is tracked using a exponential-averaging.
+     * @note This is tracked using a exponential-averaging. It is -1 until the first response
+     *       (the CONNACK) has been received.
      */
-    float typical_response_time;
+    float typical_response_time_ms;
+
+    /**
+     * @brief The mean deviation, in milliseconds, of the response times from 
+     *        \c typical_response_time_ms.
+     * 
+     * @note This is tracked using a exponential-averaging (like the RTT variance of TCP).
+     */
+    float response_time_deviation_ms;
 
     /**
      * @brief The callback that is called whenever a publish is received from the broker.
@@ -1164,6 +1555,9 @@ struct mqtt_client {
      * @note A pointer to publish_response_callback_state is always passed to the callback.
      *       Use publish_response_callback_state to keep track of any state information you 
      *       need.
+     * @note The callback is called with the client's receive lock (\c recv_mutex) held but
+     *       not its \c mutex, so it may publish. With \ref mqtt_init_deferred_delivery the
+     *       receive lock is released too.
      */
     void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish);
 
@@ -1217,6 +1611,14 @@ struct mqtt_client {
         /** @brief The size of the receive buffer's memory. */
         size_t mem_size;
 
+        /** 
+         * @brief A pointer to the start of the first packet that hasn't been handled yet. 
+         * 
+         * Packets are parsed in place between \c parse_curr and \c curr. The unparsed bytes
+         * are only moved back to \c mem_start when the end of the buffer is reached.
+         */
+        uint8_t *parse_curr;
+
         /** @brief A pointer to the next writable location in the receive buffer. */
         uint8_t *curr;
 
@@ -1228,23 +1630,99 @@ struct mqtt_client {
      * @brief A variable passed to support thread-safety.
      * 
      * A pointer to this variable is passed to \c MQTT_PAL_MUTEX_LOCK, and
-     * \c MQTT_PAL_MUTEX_UNLOCK.
+     * \c MQTT_PAL_MUTEX_UNLOCK. It guards the sending side of the client: the message queue,
+     * the packet ID's, the send state and \c error.
+     *
+     * @note What the locks are (a mutex, a spinlock or nothing) is chosen when MQTT-C is
+     *       compiled, see \ref MQTT_PAL_LOCK_POLICY.
      */
     mqtt_pal_mutex_t mutex;
 
+    /**
+     * @brief The receive lock, it guards the receiving side of the client: \c recv_buffer,
+     *        \c recv_stream and \c delivery.
+     *
+     * \ref __mqtt_recv holds it while it reads and parses, and takes \c mutex only to hand
+     * a parsed packet over to the sending side (e.g. to complete the PUBLISH that a PUBACK
+     * acknowledges, or to queue the PUBACK of a received PUBLISH). So receiving doesn't hold 
+     * up \ref mqtt_publish and \ref __mqtt_send on other threads. When both are taken,
+     * \c recv_mutex is taken first.
+     */
+    mqtt_pal_mutex_t recv_mutex;
+
     /** @brief The sending message queue. */
     struct mqtt_message_queue mq;
+
+    /**
+     * @brief The ring in which \ref mqtt_publish_staged stages messages.
+     *
+     * @see mqtt_init_publish_stage
+     */
+    struct mqtt_publish_stage publish_stage;
+
+    /**
+     * @brief The callbacks that receive the PUBLISH packets that don't fit into the receive
+     *        buffer.
+     *
+     * @see mqtt_init_recv_stream
+     */
+    struct mqtt_recv_stream recv_stream;
+
+    /**
+     * @brief The send and receive buffers that are grown with an allocator.
+     *
+     * @see mqtt_init_allocator
+     */
+    struct mqtt_elastic_buffers buffers;
+
+    /**
+     * @brief The journal that records the QoS 1 and 2 messages of the session, or NULL.
+     *
+     * @see mqtt_init_session_journal
+     */
+    const struct mqtt_session_journal *journal;
+
+    /**
+     * @brief What \ref mqtt_reinit does with the queued messages.
+     *
+     * @see mqtt_init_reinit_policy
+     */
+    enum MQTTReinitPolicy reinit_policy;
+
+    /**
+     * @brief The publishes that are passed to \c publish_response_callback once the receive
+     *        lock is released.
+     *
+     * @see mqtt_init_deferred_delivery
+     */
+    struct mqtt_delivery_queue delivery;
+
+    /**
+     * @brief Called (with the mutex held) after a message was queued by an API call, so
+     *        the thread that calls \ref mqtt_sync can send it right away. Can be NULL.
+     *
+     * @note This and \c wakeup_state are only accessed under the mutex.
+     *
+     * @see mqtt_init_wakeup
+     */
+    void (*wakeup_callback)(void** state);
+
+    /** @brief A pointer to any wakeup_callback state information you need. */
+    void* wakeup_state;
 };
 
 /**
  * @brief Generate a new next packet ID.
  * @ingroup details
  * 
- * Packet ID's are generated using a max-length LFSR.
+ * Packet ID's are generated using a max-length LFSR (and checked against every queued
+ * message), or, if the client has one, by taking the first free ID out of the client's 
+ * packet ID bitmap. The bitmap is not modified, the ID is marked as in use once the 
+ * message using it has been queued.
  * 
  * @param client The MQTT client.
  * 
- * @returns The new packet ID that should be used.
+ * @returns The new packet ID that should be used, 0 if all packet ID's are in use.
  */
 uint16_t __mqtt_next_pid(struct mqtt_client *client);
 
@@ -1268,6 +1746,114 @@ ssize_t __mqtt_send(struct mqtt_client *client);
  */
 ssize_t __mqtt_recv(struct mqtt_client *client);
 
+/**
+ * @brief Handles ingress client traffic that was already read from the client's socket.
+ * @ingroup details
+ *
+ * Works like \ref __mqtt_recv, except that the bytes are taken from \p data instead of the
+ * socket. This lets a transport that receives on its own (e.g. the io_uring reactor) feed
+ * the client.
+ *
+ * @param client The MQTT client.
+ * @param[in] data The received bytes.
+ * @param[in] size The number of bytes in \p data.
+ *
+ * @returns MQTT_OK upon success (all of \p data was consumed), an \ref MQTTErrors otherwise.
+ *
+ * @note Must not be called while the client is delivering publishes (i.e. from its publish
+ *       callback), the bytes would be lost.
+ */
+ssize_t __mqtt_recv_data(struct mqtt_client *client, const void *data, size_t size);
+
+/**
+ * @brief The messages that \ref __mqtt_send hands to the socket in one go.
+ * @ingroup details
+ *
+ * The send is split up so that a transport can submit the gathered buffers on its own (e.g.
+ * the io_uring reactor, which submits the batches of many clients in one system call):
+ * \ref __mqtt_send_begin, then \ref __mqtt_send_gather and \ref __mqtt_send_sent for as
+ * long as \ref __mqtt_send_sent returns 1, then \ref __mqtt_send_end. The client's mutex is
+ * held from \ref __mqtt_send_begin until \ref __mqtt_send_end.
+ */
+struct mqtt_send_batch {
+    /** @brief The buffers to send. */
+    mqtt_pal_iovec iov[MQTT_PAL_IOV_MAX];
+
+    /** @brief The number of buffers in \c iov. */
+    int num_iov;
+
+    /** @brief The messages the buffers belong to. */
+    struct mqtt_queued_message *msgs[MQTT_PAL_IOV_MAX];
+
+    /** @brief The number of messages in \c msgs. */
+    int num_msgs;
+
+    /** @brief The number of bytes of the first message that were sent before. */
+    size_t first_offset;
+
+    /** @brief The number of bytes in \c iov. */
+    size_t size;
+
+    /** @brief What the producer of the last message returned (-1 if it wasn't called). */
+    ssize_t produced;
+
+    /** @brief The time of the send. */
+    mqtt_pal_time_ms_t now;
+
+    /** @brief The position in the message queue and the queue's length. */
+    ssize_t next, length;
+
+    /** @brief The QoS 1 and QoS 2 PUBLISH messages in flight. */
+    unsigned inflight[3];
+
+    /** @brief Whether QoS 1 or QoS 2 PUBLISH messages were held back by the in-flight window. */
+    int stalled[3];
+};
+
+/**
+ * @brief Locks the client's mutex and prepares a send.
+ * @ingroup details
+ *
+ * @returns MQTT_OK upon success, an \ref MQTTErrors otherwise. The mutex is locked either
+ *          way, call \ref __mqtt_send_end with the return value.
+ */
+ssize_t __mqtt_send_begin(struct mqtt_client *client, struct mqtt_send_batch *batch, mqtt_pal_time_ms_t now);
+
+/**
+ * @brief Gathers the next messages that need to be sent.
+ * @ingroup details
+ *
+ * @returns The number of gathered messages (0 if there is nothing to send), an
+ *          \ref MQTTErrors otherwise.
+ */
+ssize_t __mqtt_send_gather(struct mqtt_client *client, struct mqtt_send_batch *batch);
+
+/**
+ * @brief Updates the gathered messages after \p sent bytes of them were sent.
+ * @ingroup details
+ *
+ * @param client The MQTT client.
+ * @param batch The batch.
+ * @param[in] sent The number of bytes that were sent, or an \ref MQTTErrors if the send failed.
+ *
+ * @returns 1 if the next messages should be gathered, 0 if the send is done (e.g. the socket
+ *          is full), an \ref MQTTErrors otherwise.
+ */
+ssize_t __mqtt_send_sent(struct mqtt_client *client, struct mqtt_send_batch *batch, ssize_t sent);
+
+/**
+ * @brief Finishes a send (queues a keep-alive ping if one is due) and unlocks the client's
+ *        mutex.
+ * @ingroup details
+ *
+ * @param client The MQTT client.
+ * @param batch The batch.
+ * @param[in] rv The last return value of the other send functions.
+ *
+ * @returns MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+ssize_t __mqtt_send_end(struct mqtt_client *client, struct mqtt_send_batch *batch, ssize_t rv);
+
 /**
  * @brief Function that does the actual sending and receiving of 
  *        traffic from the network.
@@ -1289,13 +1875,58 @@ ssize_t __mqtt_recv(struct mqtt_client *client);
  *            thread-safe so it is perfectly reasonable to have a thread dedicated
  *            to calling this function every 200 ms or so. MQTT-C can be used in single
  *            threaded application though by simply calling this functino periodically 
- *            inside your main thread. See @ref simple_publisher.c and @ref simple_subscriber.c
- *            for examples (specifically the \c client_refresher functions).
+ *            inside your main thread. Event loops can call it only when needed by waiting 
+ *            for the socket events and deadline reported by \ref mqtt_sync_interest. On POSIX
+ *            systems \ref mqtt_io_thread_start starts a thread that does just that, see 
+ *            @ref simple_publisher.c and @ref simple_subscriber.c for examples.
  * 
  * @returns MQTT_OK upon success, an \ref MQTTErrors otherwise. 
  */
 enum MQTTErrors mqtt_sync(struct mqtt_client *client);
 
+/**
+ * @brief The socket events that \ref mqtt_sync is waiting for.
+ * @ingroup api
+ * 
+ * @see mqtt_sync_interest
+ */
+enum MQTTSyncInterest {
+    MQTT_SYNC_WANT_READ = 1u,
+    MQTT_SYNC_WANT_WRITE = 2u
+};
+
+/**
+ * @brief The deadline \ref mqtt_sync_interest reports when there is no retransmit or 
+ *        keep-alive pending.
+ * @ingroup api
+ */
+#define MQTT_SYNC_NO_DEADLINE ((mqtt_pal_time_ms_t) -1)
+
+/**
+ * @brief Reports what \ref mqtt_sync is waiting for so that it can be called from an event 
+ *        loop (poll, epoll, kqueue, ...) instead of periodically.
+ * @ingroup api
+ * 
+ * Wait until the client's socket is ready for one of the returned \ref MQTTSyncInterest 
+ * events or until \p deadline has been reached, whichever comes first, then call 
+ * \ref mqtt_sync and ask again.
+ * 
+ * @pre mqtt_connect (or mqtt_init_reconnect) must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[out] deadline The time (\ref MQTT_PAL_TIME_MS) of the next message retransmit or 
+ *             keep-alive ping, \ref MQTT_SYNC_NO_DEADLINE if there is none. If the client is
+ *             in an error state (e.g. it needs to reconnect) this is the current time.
+ * 
+ * @note Messages that are queued (by another thread) while the event loop is waiting are not
+ *       sent before the loop wakes up. Wake it up after queuing messages if they can't wait 
+ *       until \p deadline, e.g. from the client's wakeup callback (see \ref mqtt_init_wakeup).
+ * 
+ * @returns A combination of \ref MQTTSyncInterest flags. \c MQTT_SYNC_WANT_WRITE is only
+ *          set while there are messages that \ref mqtt_sync can send right away.
+ */
+int mqtt_sync_interest(struct mqtt_client *client, mqtt_pal_time_ms_t *deadline);
+
 /**
  * @brief Initializes an MQTT client.
  * @ingroup api
@@ -1319,7 +1950,8 @@ enum MQTTErrors mqtt_sync(struct mqtt_client *client);
  * @note \p sockfd is a non-blocking TCP connection.
  * @note If \p sendbuf fills up completely during runtime a \c MQTT_ERROR_SEND_BUFFER_IS_FULL
  *       error will be set. Similarly if \p recvbuf is ever to small to receive a message from
- *       the broker an MQTT_ERROR_RECV_BUFFER_TOO_SMALL error will be set.
+ *       the broker an MQTT_ERROR_RECV_BUFFER_TOO_SMALL error will be set (unless the message
+ *       is a PUBLISH and the client streams publishes, see \ref mqtt_init_recv_stream).
  * @note A pointer to \ref mqtt_client.publish_response_callback_state is always passed as the 
  *       \c state argument to \p publish_response_callback. Note that the second argument is 
  *       the mqtt_response_publish that was received from the broker.
@@ -1406,7 +2038,13 @@ void mqtt_init_reconnect(struct mqtt_client *client,
  * 
  * This function also clears the \p client error state. Upon exiting this function
  * \c client->error will be \c MQTT_ERROR_CONNECT_NOT_CALLED (which will be cleared)
- * as soon as \ref mqtt_connect is called.
+ * as soon as \ref mqtt_connect is called. Application messages that are still referenced
+ * by the old send buffer (see \ref mqtt_publish_ref) are released.
+ * 
+ * Unless the client keeps its queue (see \ref mqtt_init_reinit_policy) the queued messages 
+ * are discarded. Kept messages are moved into \p sendbuf (if it isn't the old send buffer, 
+ * messages that don't fit are discarded and their packet ID's are freed) and are resent 
+ * after the CONNECT packet that \ref mqtt_connect queues.
  * 
  * @pre This function must be called BEFORE \ref mqtt_connect. 
  * 
@@ -1421,11 +2059,241 @@ void mqtt_init_reconnect(struct mqtt_client *client,
  * 
  * @attention This function should be used in conjunction with clients that have been 
  *            initialzed with \ref mqtt_init_reconnect.  
+ * 
+ * @returns \c MQTT_OK, or \c MQTT_ERROR_SEND_BUFFER_IS_FULL if kept messages didn't fit 
+ *          into \p sendbuf and were discarded. The client is reinitialized either way.
+ */
+enum MQTTErrors mqtt_reinit(struct mqtt_client* client,
+                            mqtt_pal_socket_handle socketfd,
+                            uint8_t *sendbuf, size_t sendbufsz,
+                            uint8_t *recvbuf, size_t recvbufsz);
+
+/**
+ * @brief Sets what \ref mqtt_reinit does with the messages that are still queued.
+ * @ingroup api
+ *
+ * Keeping the queue resumes the session on the new connection: PUBLISH packets that were 
+ * already sent are resent with their DUP flag set, and so are PUBREL, SUBSCRIBE and 
+ * UNSUBSCRIBE packets that weren't acknowledged yet, all under their old packet ID's. CONNECT,
+ * PINGREQ and DISCONNECT packets are always discarded.
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] policy The policy, \c MQTT_REINIT_DISCARD_QUEUE by default.
+ *
+ * @note Keeping the queue is meant for clients that don't ask for a clean session in 
+ *       \ref mqtt_connect: a broker that starts a new session treats the resent PUBLISH 
+ *       packets as new ones.
+ */
+void mqtt_init_reinit_policy(struct mqtt_client *client, enum MQTTReinitPolicy policy);
+
+/**
+ * @brief The number of 32-bit words in a packet ID bitmap (one bit per packet ID).
+ * @ingroup api
+ */
+#define MQTT_PID_BITMAP_WORDS (65536 / 32)
+
+/**
+ * @brief Give the client an 8 KB bitmap to track the packet ID's that are in use.
+ * @ingroup api
+ * 
+ * Without a bitmap, packet ID's are generated by an LFSR and every candidate is checked
+ * against the whole message queue. With a bitmap, a free ID is found by scanning for the
+ * first word that isn't full, and ID's are returned as soon as their exchange with the 
+ * broker completes (PUBACK, PUBCOMP, SUBACK or UNSUBACK). The bitmap is cleared by 
+ * \ref mqtt_reinit.
+ * 
+ * @pre Call this function after \ref mqtt_init or \ref mqtt_init_reconnect and before 
+ *      \ref mqtt_connect. 
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] pid_bitmap An array of \ref MQTT_PID_BITMAP_WORDS words that must outlive 
+ *            \p client.
+ */
+void mqtt_init_pid_bitmap(struct mqtt_client *client, uint32_t *pid_bitmap);
+
+/**
+ * @brief Give the client a ring in which \ref mqtt_publish_staged stages messages without
+ *        taking the client's mutex.
+ * @ingroup api
+ *
+ * Staged messages are moved into the send buffer (and get their packet ID's) by the next
+ * \ref mqtt_sync, so publisher threads don't wait while the client's mutex is held for a
+ * socket write. A staged message takes the size of its PUBLISH packet plus 16 bytes, rounded
+ * up to a multiple of 16.
+ *
+ * @pre Call this function after \ref mqtt_init or \ref mqtt_init_reconnect and before
+ *      \ref mqtt_publish_staged is called.
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] buf The memory of the ring, it must outlive \p client. Only the largest power of
+ *            two number of bytes that fits in \p buf (after aligning it to 16 bytes) is used.
+ * @param[in] bufsz The size of \p buf in bytes.
+ */
+void mqtt_init_publish_stage(struct mqtt_client *client, uint8_t *buf, size_t bufsz);
+
+/**
+ * @brief Let the client grow its send and receive buffers when they are too small.
+ * @ingroup api
+ *
+ * By default the client only uses the buffers that are passed to \ref mqtt_init (or
+ * \ref mqtt_reinit), so they must be sized for the largest burst. With an allocator, when a
+ * message doesn't fit into the send buffer (where \c MQTT_ERROR_SEND_BUFFER_IS_FULL would be
+ * returned) the message queue is moved into a buffer of at least twice the size, and when a
+ * received packet doesn't fit into the receive buffer (where
+ * \c MQTT_ERROR_RECV_BUFFER_TOO_SMALL would be returned) the receive buffer is grown to fit
+ * it. The buffers never grow beyond \p max_sendbuf_size and \p max_recvbuf_size. Once a grown
+ * buffer is empty again the client moves back to the buffer that was passed to
+ * \ref mqtt_init and frees the grown one.
+ *
+ * @pre Call this function after \ref mqtt_init or \ref mqtt_init_reconnect and before
+ *      \ref mqtt_connect.
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] allocator The allocator hooks, they must outlive \p client. NULL to only use the
+ *            buffers that are passed to \ref mqtt_init.
+ * @param[in] max_sendbuf_size The size in bytes that the send buffer must not grow beyond.
+ * @param[in] max_recvbuf_size The size in bytes that the receive buffer must not grow beyond.
+ *
+ * @note The hooks are called with the client's mutex held.
+ * @note Call \ref mqtt_free_buffers to free the grown buffers when the client isn't used
+ *       anymore.
+ */
+void mqtt_init_allocator(struct mqtt_client *client,
+                         const struct mqtt_allocator *allocator,
+                         size_t max_sendbuf_size,
+                         size_t max_recvbuf_size);
+
+/**
+ * @brief Frees the buffers that the client grew with its allocator.
+ * @ingroup api
+ *
+ * The queued messages and the received bytes are discarded, the client has to be
+ * reinitialized (e.g. with \ref mqtt_reinit) before it can be used again.
+ *
+ * @param[in,out] client The MQTT client.
+ */
+void mqtt_free_buffers(struct mqtt_client *client);
+
+/**
+ * @brief Receive the PUBLISH packets that don't fit into the receive buffer piece by piece.
+ * @ingroup api
+ *
+ * Without these callbacks a PUBLISH packet that is larger than the receive buffer fails with
+ * \c MQTT_ERROR_RECV_BUFFER_TOO_SMALL. With them, the receive buffer only has to hold the
+ * fixed and variable header (i.e. the topic name) of such a packet: \p begin is called with
+ * the header, \p chunk with the payload as it arrives, and \p end once all of it was passed
+ * on. The callbacks are called from \ref __mqtt_recv, like \c publish_response_callback
+ * (which still receives all the packets that fit into the receive buffer).
+ *
+ * A streamed QoS 1 or 2 PUBLISH is only acknowledged after \p end was called, and the
+ * payload of a duplicate QoS 2 PUBLISH is skipped without calling the callbacks.
+ *
+ * @pre Call this function after \ref mqtt_init or \ref mqtt_init_reconnect and before
+ *      \ref mqtt_connect.
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] begin Called with the header of a streamed PUBLISH. NULL to not stream
+ *            publishes.
+ * @param[in] chunk Called with every piece of the payload.
+ * @param[in] end Called once the payload was received (or the connection was lost).
+ * @param[in] state The state that is passed to the callbacks.
+ */
+void mqtt_init_recv_stream(struct mqtt_client *client,
+                              void (*begin)(void** state, struct mqtt_response_publish *publish),
+                              void (*chunk)(void** state, const void *data, size_t size),
+                              void (*end)(void** state, enum MQTTErrors result),
+                              void *state);
+
+/**
+ * @brief Makes \ref __mqtt_recv call the publish callback with the client's receive lock 
+ *        released.
+ * @ingroup api
+ *
+ * Received PUBLISH packets are acknowledged as before (their PUBACK or PUBREC is queued right
+ * away), but they are staged in \p publishes and passed to \c publish_response_callback, in 
+ * the order they were received, after the receive lock (\c recv_mutex) is released: once 
+ * everything that was read from the socket is parsed, and whenever \p publishes is full. A
+ * slow callback then doesn't hold up \ref mqtt_sync on other threads, which keeps sending the
+ * acknowledgements and the keep-alives, and the callback may call \ref mqtt_sync itself.
+ *
+ * The staged publishes point into the receive buffer, which is left as it is until they are
+ * delivered: calls to \ref __mqtt_recv on other threads return \c MQTT_OK right away, and
+ * \ref mqtt_sync doesn't reconnect, while the callback runs.
+ *
+ * @pre Call this function after \ref mqtt_init or \ref mqtt_init_reconnect and before 
+ *      \ref mqtt_connect.
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] publishes The array in which the publishes are staged, it must outlive 
+ *            \p client. NULL to call the callback with the receive lock held (the default).
+ * @param[in] capacity The number of publishes that fit in \p publishes.
+ */
+void mqtt_init_deferred_delivery(struct mqtt_client *client, struct mqtt_response_publish *publishes, size_t capacity);
+
+/**
+ * @brief Sets the callback that wakes up the thread that calls \ref mqtt_sync.
+ * @ingroup api
+ *
+ * \p callback is called by \ref mqtt_publish (and the other publish functions),
+ * \ref mqtt_subscribe, \ref mqtt_unsubscribe, \ref mqtt_ping, \ref mqtt_disconnect and
+ * \ref mqtt_reconnect once they have queued their message, so an event loop that waits for
+ * the socket (see \ref mqtt_sync_interest) can send the message without waiting for its
+ * timeout. The I/O thread (see \ref mqtt_io_thread_start) installs one that signals its
+ * eventfd.
+ *
+ * The callback and its state are set, read and called with the client's mutex held, so once
+ * this function returns the old callback doesn't run anymore and its state can be freed.
+ * \p callback must therefore not call the client's API, and should only signal the other
+ * thread.
+ *
+ * @note Don't call this function while the mutex is held, e.g. from the reconnect callback.
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] callback The callback, NULL for none (the default).
+ * @param[in] state The state that is passed to \p callback.
+ */
+void mqtt_init_wakeup(struct mqtt_client *client, void (*callback)(void** state), void *state);
+
+/**
+ * @brief Record the QoS 1 and 2 messages of the session in a journal.
+ * @ingroup api
+ *
+ * The journal is told about every QoS 1 or 2 PUBLISH, PUBREC and PUBREL that is queued, and
+ * about every one of them that is acknowledged. What it still holds when the process restarts
+ * is queued again with \ref mqtt_restore_message. See @ref store for a journal that keeps
+ * the messages in a memory-mapped file.
+ *
+ * @pre Call this function after \ref mqtt_init or \ref mqtt_init_reconnect and before
+ *      messages are published.
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] journal The journal hooks, they must outlive \p client. NULL to not record the
+ *            session.
+ *
+ * @note The hooks are called with the client's mutex held.
+ */
+void mqtt_init_session_journal(struct mqtt_client *client, const struct mqtt_session_journal *journal);
+
+/**
+ * @brief Queues a PUBLISH, PUBREC or PUBREL packet that was recorded by a session journal.
+ * @ingroup api
+ *
+ * A PUBLISH is queued with its DUP flag set. The packet isn't recorded in the client's
+ * journal again, and it is skipped if a message of the same type with the same packet ID is
+ * already queued.
+ *
+ * @pre Call this function after \ref mqtt_connect (so the packet is sent after the CONNECT
+ *      packet, which should not ask for a clean session) and before other messages are
+ *      queued.
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] packet The whole packet, as it was passed to \c append of the journal.
+ * @param[in] packet_size The size of \p packet in bytes.
+ *
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_MALFORMED_REQUEST if \p packet isn't a
+ *          QoS 1 or 2 PUBLISH, a PUBREC or a PUBREL, an \ref MQTTErrors otherwise.
  */
-void mqtt_reinit(struct mqtt_client* client,
-                 mqtt_pal_socket_handle socketfd,
-                 uint8_t *sendbuf, size_t sendbufsz,
-                 uint8_t *recvbuf, size_t recvbufsz);
+enum MQTTErrors mqtt_restore_message(struct mqtt_client *client, const void *packet, size_t packet_size);
 
 /**
  * @brief Establishes a session with the MQTT broker.
@@ -1450,6 +2318,7 @@ void mqtt_reinit(struct mqtt_client* client,
  *            (provided \c will_message != \c NULL), MQTT_CONNECT_WILL_QOS_[0,1,2], and whether 
  *            or not the broker should retain the \c will_message, MQTT_CONNECT_WILL_RETAIN.
  * @param[in] keep_alive The keep-alive time in seconds. A reasonable value for this is 400 [seconds]. 
+ *            Set to 0 to turn off the keep-alive mechanism.
  * 
  * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
  */
@@ -1491,6 +2360,192 @@ enum MQTTErrors mqtt_publish(struct mqtt_client *client,
                              size_t application_message_size,
                              uint8_t publish_flags);
 
+/**
+ * @brief Publish an application message without copying it into the send buffer.
+ * @ingroup api
+ * 
+ * Only the PUBLISH header is queued in the client's send buffer. \p application_message 
+ * is sent directly from the caller's memory, so it must stay valid and unmodified until 
+ * \p release_callback is called. This happens once the message is complete (i.e. after 
+ * it has been sent for QoS 0, after the PUBACK for QoS 1 and after the PUBREC for QoS 2),
+ * or when the queued message is discarded by \ref mqtt_reinit.
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] topic_name The name of the topic.
+ * @param[in] application_message The data to be published.
+ * @param[in] application_message_size The size of \p application_message in bytes.
+ * @param[in] publish_flags \ref MQTTPublishFlags to be used, namely the QOS level to 
+ *            publish at (MQTT_PUBLISH_QOS_[0,1,2]) or whether or not the broker should 
+ *            retain the publish (MQTT_PUBLISH_RETAIN).
+ * @param[in] release_callback The callback that is called when \p application_message is no
+ *            longer referenced by the client. Set to \c NULL if no notification is required.
+ * @param[in] release_state A pointer that is passed to \p release_callback.
+ * 
+ * @note \p release_callback is called with the client's mutex held, so it must not call 
+ *       back into the client.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. If an error is returned 
+ *          \p application_message is not referenced and \p release_callback is never called.
+ */
+enum MQTTErrors mqtt_publish_ref(struct mqtt_client *client,
+                                 const char* topic_name,
+                                 const void* application_message,
+                                 size_t application_message_size,
+                                 uint8_t publish_flags,
+                                 void (*release_callback)(void *release_state, const void *application_message),
+                                 void *release_state);
+
+/**
+ * @brief Publish an application message that is produced piece by piece as it is sent.
+ * @ingroup api
+ *
+ * Only the PUBLISH header is queued in the client's send buffer, so the application message
+ * can be much larger than the send buffer (e.g. a firmware image that is read from a file).
+ * Whenever the socket can take more of it, \ref __mqtt_send calls
+ * <tt>producer(state, offset, &data)</tt>, which points \c data at the next bytes of the
+ * application message (starting at \c offset) and returns how many there are. The bytes must
+ * stay valid until \p producer is called again or \p release_callback is called, so a
+ * producer can reuse a single scratch buffer. It can return fewer bytes than are left (0 if
+ * none are available yet, then the rest is sent by the next \ref mqtt_sync), and a
+ * negative \ref MQTTErrors to fail the client. After it returned 0, \ref mqtt_sync_interest
+ * stops asking for the socket to become writable (which it already is), so call
+ * \ref mqtt_publish_stream_resume once more of the application message is ready.
+ *
+ * A QoS 1 or 2 message that is retransmitted is produced again from offset 0.
+ * \p release_callback (if any) is called with a NULL application message when the message
+ * is complete, like for \ref mqtt_publish_ref.
+ *
+ * @pre mqtt_connect must have been called.
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] topic_name The name of the topic.
+ * @param[in] application_message_size The size of the application message in bytes.
+ * @param[in] publish_flags \ref MQTTPublishFlags to be used, namely the QOS level to
+ *            publish at (MQTT_PUBLISH_QOS_[0,1,2]) or whether or not the broker should
+ *            retain the publish (MQTT_PUBLISH_RETAIN).
+ * @param[in] producer The callback that produces the application message.
+ * @param[in] release_callback The callback that is called when \p producer is no longer
+ *            called. Set to \c NULL if no notification is required.
+ * @param[in] state A pointer that is passed to \p producer and \p release_callback.
+ *
+ * @note \p producer and \p release_callback are called with the client's mutex held, so they
+ *       must not call back into the client.
+ *
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. If an error is returned
+ *          the callbacks are never called.
+ */
+enum MQTTErrors mqtt_publish_stream(struct mqtt_client *client,
+                                    const char* topic_name,
+                                    size_t application_message_size,
+                                    uint8_t publish_flags,
+                                    ssize_t (*producer)(void *state, size_t offset, const void **data),
+                                    void (*release_callback)(void *release_state, const void *application_message),
+                                    void *state);
+
+/**
+ * @brief Tells the client that the producer of a \ref mqtt_publish_stream message has more
+ *        of its application message ready.
+ * @ingroup api
+ *
+ * Call it after the producer returned 0. It calls the client's wakeup callback (see 
+ * \ref mqtt_init_wakeup) so that an event loop calls \ref mqtt_sync again.
+ *
+ * @param[in,out] client The MQTT client.
+ *
+ * @returns \c MQTT_OK.
+ */
+enum MQTTErrors mqtt_publish_stream_resume(struct mqtt_client *client);
+
+/**
+ * @brief A message to be published by \ref mqtt_publish_many.
+ * @ingroup api
+ */
+struct mqtt_publish_desc {
+    /** @brief The name of the topic. */
+    const char *topic_name;
+
+    /** @brief The data to be published. */
+    const void *application_message;
+
+    /** @brief The size of \c application_message in bytes. */
+    size_t application_message_size;
+
+    /** @brief The \ref MQTTPublishFlags of the message. */
+    uint8_t publish_flags;
+};
+
+/**
+ * @brief Publish a burst of application messages.
+ * @ingroup api
+ *
+ * Packs the messages back to back into the send buffer under a single acquisition of the
+ * client's mutex. The total size of the burst is computed up front, so the send buffer is
+ * cleaned at most once (when the whole burst doesn't fit).
+ *
+ * If the send buffer fills up, the messages that fit are queued and the rest are rejected.
+ * Unlike \ref mqtt_publish, this doesn't put the client in the
+ * \c MQTT_ERROR_SEND_BUFFER_IS_FULL error state, so the rejected messages can be published
+ * again after the next \ref mqtt_sync.
+ *
+ * The messages are checked before any of them is packed. Only the ones in front of the first
+ * invalid message (e.g. with a \c NULL topic) are published, and the error is returned
+ * without putting the client in an error state either.
+ *
+ * @pre mqtt_connect must have been called.
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] msgs The messages to publish.
+ * @param[in] n The number of messages in \p msgs.
+ * @param[out] accepted Set to the number of messages (from the front of \p msgs) that were
+ *             queued. May be \c NULL.
+ *
+ * @returns \c MQTT_OK if all \p n messages were queued, \c MQTT_ERROR_SEND_BUFFER_IS_FULL,
+ *          \c MQTT_ERROR_PACKET_ID_EXHAUSTED or the error of an invalid message if only the 
+ *          first \p accepted were, the client's error if it is in an error state.
+ */
+enum MQTTErrors mqtt_publish_many(struct mqtt_client *client,
+                                  const struct mqtt_publish_desc *msgs,
+                                  size_t n,
+                                  size_t *accepted);
+
+/**
+ * @brief Publish an application message without taking the client's mutex.
+ * @ingroup api
+ *
+ * The PUBLISH packet is packed into the client's staging ring (see
+ * \ref mqtt_init_publish_stage), which is lock-free for any number of publisher threads.
+ * It is moved into the send buffer, and gets its packet ID, by the next \ref mqtt_sync.
+ *
+ * Staged messages are sent in the order in which they were staged, so the messages of each
+ * publisher thread keep their order. There is no ordering between staged messages and
+ * messages queued with \ref mqtt_publish.
+ *
+ * @pre mqtt_connect must have been called.
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] topic_name The name of the topic.
+ * @param[in] application_message The data to be published.
+ * @param[in] application_message_size The size of \p application_message in bytes.
+ * @param[in] publish_flags \ref MQTTPublishFlags to be used, namely the QOS level to
+ *            publish at (MQTT_PUBLISH_QOS_[0,1,2]) or whether or not the broker should
+ *            retain the publish (MQTT_PUBLISH_RETAIN).
+ *
+ * @note Without a staging ring (or without \c MQTT_PAL_HAVE_ATOMICS) this is the same as
+ *       \ref mqtt_publish.
+ *
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_SEND_BUFFER_IS_FULL if the staging ring is
+ *          full (try again after the next \ref mqtt_sync) or if the message takes more than
+ *          half of the ring, an \ref MQTTErrors otherwise. Unlike \ref mqtt_publish, errors
+ *          don't change the client's error state.
+ */
+enum MQTTErrors mqtt_publish_staged(struct mqtt_client *client,
+                                    const char* topic_name,
+                                    const void* application_message,
+                                    size_t application_message_size,
+                                    uint8_t publish_flags);
+
 /**
  * @brief Acknowledge an ingree publish with QOS==1.
  * @ingroup details
@@ -0,0 +1,184 @@
+#if !defined(__MQTT_DISPATCHER_H__)
+#define __MQTT_DISPATCHER_H__
+
+/*
+MIT License
+
+Copyright(c) 2018 Liam Bindle
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <mqtt.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @file
+ * @brief Declares the dispatcher that routes received publishes to per-filter callbacks.
+ *
+ * @defgroup dispatcher Dispatcher
+ * @brief Routes received publishes to callbacks registered for topic filters.
+ *
+ * A client has a single \c publish_response_callback. A dispatcher takes its place and calls
+ * the callbacks of all the topic filters (with \c + and \c # wildcards) that match the topic
+ * of a received publish. The filters are kept in a trie with one node per topic level, so
+ * matching a topic costs a lookup per level instead of a comparison per filter.
+ *
+ * The publish is passed to the callbacks as it was received: the topic name is not copied
+ * and the callbacks are called from \ref __mqtt_recv, like \c publish_response_callback.
+ *
+ * Like the rest of MQTT-C the dispatcher doesn't allocate memory: the trie is built in an
+ * arena that is provided by the application.
+ *
+ * @note Filters must not be added or removed while the client that the dispatcher is attached
+ *       to can receive publishes (e.g. from the thread that calls \ref mqtt_sync), unless the
+ *       application serializes the two itself.
+ */
+
+/** @cond Doxygen_Suppress */
+struct mqtt_dispatcher_node;
+/** @endcond */
+
+/**
+ * @brief A callback that is called for a received publish.
+ * @ingroup dispatcher
+ *
+ * \p state points to the state that was registered with the callback.
+ */
+typedef void (*mqtt_dispatcher_callback)(void** state, struct mqtt_response_publish *publish);
+
+/**
+ * @brief A trie of topic filters and their callbacks.
+ * @ingroup dispatcher
+ *
+ * @note All the members can be manipulated via the related functions.
+ */
+struct mqtt_dispatcher {
+    /** @brief The arena that the trie is built in. */
+    uint8_t *arena;
+
+    /** @brief The size of \c arena in bytes. */
+    size_t arena_size;
+
+    /** @brief The number of bytes of \c arena that are used. */
+    size_t arena_used;
+
+    /** @brief The root of the trie (the level before the first topic level). */
+    struct mqtt_dispatcher_node *root;
+
+    /** @brief The number of registered filters. */
+    size_t number_of_filters;
+
+    /**
+     * @brief Called for the publishes that match none of the filters. Can be NULL.
+     */
+    mqtt_dispatcher_callback unmatched_callback;
+
+    /** @brief A pointer to any unmatched_callback state information you need. */
+    void *unmatched_state;
+};
+
+/**
+ * @brief Initializes a dispatcher.
+ * @ingroup dispatcher
+ *
+ * @param[out] dispatcher The dispatcher.
+ * @param[in] arena The memory that the trie is built in. Every filter takes a subscription
+ *            record, plus a node per topic level that isn't shared with another filter.
+ * @param[in] arena_size The size of \p arena in bytes.
+ * @param[in] unmatched_callback Called for the publishes that match none of the filters.
+ *            Can be NULL.
+ * @param[in] unmatched_state The state that is passed to \p unmatched_callback.
+ *
+ * @relates mqtt_dispatcher
+ */
+void mqtt_dispatcher_init(struct mqtt_dispatcher *dispatcher,
+                          void *arena, size_t arena_size,
+                          mqtt_dispatcher_callback unmatched_callback,
+                          void *unmatched_state);
+
+/**
+ * @brief Registers a callback for a topic filter.
+ * @ingroup dispatcher
+ *
+ * A filter can have any number of callbacks, and a callback can be registered for any number
+ * of filters. A publish that matches several filters is passed to all their callbacks.
+ *
+ * @param dispatcher The dispatcher.
+ * @param[in] topic_filter The topic filter, e.g. "sensors/+/temperature" or "sensors/#".
+ *            It is copied into the arena.
+ * @param[in] callback The callback.
+ * @param[in] state The state that is passed to \p callback.
+ *
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_INVALID_TOPIC_FILTER if \p topic_filter is
+ *          empty or misuses a wildcard, \c MQTT_ERROR_DISPATCHER_FULL if the arena is full.
+ *
+ * @relates mqtt_dispatcher
+ */
+enum MQTTErrors mqtt_dispatcher_add(struct mqtt_dispatcher *dispatcher,
+                                    const char *topic_filter,
+                                    mqtt_dispatcher_callback callback,
+                                    void *state);
+
+/**
+ * @brief Unregisters a callback that was registered with \ref mqtt_dispatcher_add.
+ * @ingroup dispatcher
+ *
+ * @note The memory in the arena isn't reused.
+ *
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_INVALID_TOPIC_FILTER if \p callback isn't
+ *          registered for \p topic_filter with \p state.
+ *
+ * @relates mqtt_dispatcher
+ */
+enum MQTTErrors mqtt_dispatcher_remove(struct mqtt_dispatcher *dispatcher,
+                                       const char *topic_filter,
+                                       mqtt_dispatcher_callback callback,
+                                       void *state);
+
+/**
+ * @brief Calls the callbacks of all the filters that match the topic of \p publish.
+ * @ingroup dispatcher
+ *
+ * @returns The number of callbacks that were called (not counting \c unmatched_callback).
+ *
+ * @relates mqtt_dispatcher
+ */
+size_t mqtt_dispatcher_dispatch(struct mqtt_dispatcher *dispatcher, struct mqtt_response_publish *publish);
+
+/**
+ * @brief Routes the publishes that \p client receives through \p dispatcher.
+ * @ingroup dispatcher
+ *
+ * Replaces the client's \c publish_response_callback (and its state). Like setting those
+ * members directly, this must be done before the client is synced (e.g. right after
+ * \ref mqtt_init or \ref mqtt_init_reconnect).
+ *
+ * @relates mqtt_dispatcher
+ */
+void mqtt_dispatcher_attach(struct mqtt_dispatcher *dispatcher, struct mqtt_client *client);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
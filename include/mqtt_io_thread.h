@@ -0,0 +1,155 @@
+#if !defined(__MQTT_IO_THREAD_H__)
+#define __MQTT_IO_THREAD_H__
+
+/*
+MIT License
+
+Copyright(c) 2018 Liam Bindle
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <mqtt.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @file
+ * @brief Declares the I/O thread that calls \ref mqtt_sync for a client.
+ *
+ * @defgroup io_thread I/O thread
+ * @brief Runs a client's \ref mqtt_sync on a thread that is managed by MQTT-C (POSIX only).
+ *
+ * Instead of a thread of its own that calls \ref mqtt_sync in a loop with a sleep in between
+ * (so a message waits half the sleep on average before it is sent), an application can start
+ * an I/O thread for its client. The thread blocks in \c poll on the client's socket and on an
+ * eventfd (a pipe where there are no eventfds) until the socket is ready, the next keep-alive
+ * or retransmit is due (see \ref mqtt_sync_interest), or a message is queued: the thread
+ * installs the client's wakeup callback (see \ref mqtt_init_wakeup), which signals the eventfd
+ * once per wakeup, so a published message is sent within microseconds.
+ *
+ * The thread can be pinned to a CPU and given a scheduling policy and priority.
+ *
+ * @note The I/O thread calls the client's \c publish_response_callback and
+ *       \c reconnect_callback.
+ */
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(WIN32) && defined(MQTT_PAL_HAVE_ATOMICS) \
+    && !defined(MQTT_USE_CUSTOM_SOCKET_HANDLE) && !defined(MQTT_USE_MBEDTLS) \
+    && !defined(MQTT_USE_WOLFSSL) && !defined(MQTT_USE_BIO) && !defined(MQTT_USE_BEARSSL) \
+    && MQTT_PAL_LOCK_POLICY != MQTT_PAL_LOCK_NONE
+/**
+ * @brief Defined when the I/O thread can be used with this build's \c mqtt_pal_socket_handle.
+ * @ingroup io_thread
+ */
+#define MQTT_IO_THREAD_AVAILABLE
+#endif
+
+#if defined(MQTT_IO_THREAD_AVAILABLE)
+
+/**
+ * @brief How long, in milliseconds, the I/O thread waits before it calls \ref mqtt_sync again
+ *        after it failed (e.g. a client without a \c reconnect_callback that lost its
+ *        connection).
+ * @ingroup io_thread
+ */
+#if !defined(MQTT_IO_THREAD_ERROR_BACKOFF_MS)
+#define MQTT_IO_THREAD_ERROR_BACKOFF_MS 100
+#endif
+
+/**
+ * @brief An I/O thread.
+ * @ingroup io_thread
+ *
+ * @note All the members can be manipulated via the related functions.
+ */
+struct mqtt_io_thread {
+    /** @brief The client. */
+    struct mqtt_client *client;
+
+    /** @brief The thread. */
+    pthread_t thread;
+
+    /** @brief The file descriptor the thread polls for wakeups (the eventfd or a pipe's read end). */
+    int wakeup_fd;
+
+    /** @brief The file descriptor that wakeups are written to (the eventfd or a pipe's write end). */
+    int wakeup_write_fd;
+
+    /** @brief Non-zero while a wakeup was written that the thread hasn't read yet. */
+    uint32_t signaled;
+
+    /** @brief Non-zero once \ref mqtt_io_thread_stop was called. */
+    uint32_t stopped;
+
+    /** @brief A counter counting the times the thread was woken up by a queued message. */
+    size_t number_of_wakeups;
+
+    /** @brief A counter counting the thread's calls to \ref mqtt_sync. */
+    size_t number_of_syncs;
+};
+
+/**
+ * @brief Starts an I/O thread for a client.
+ * @ingroup io_thread
+ *
+ * @pre Call this function after \ref mqtt_init (and \ref mqtt_connect) or
+ *      \ref mqtt_init_reconnect. The client's wakeup callback is replaced. Don't call
+ *      \ref mqtt_sync from other threads while the I/O thread runs.
+ *
+ * @param[out] io The I/O thread, it must stay valid until \ref mqtt_io_thread_stop returns.
+ * @param[in,out] client The client.
+ * @param[in] cpu The CPU the thread is pinned to, -1 to not pin it. Only supported on Linux.
+ * @param[in] policy The scheduling policy of the thread (e.g. \c SCHED_FIFO), -1 to inherit
+ *            it.
+ * @param[in] priority The scheduling priority of the thread (ignored if \p policy is -1).
+ *
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_SOCKET_ERROR if the eventfd (or pipe)
+ *          couldn't be created, \c MQTT_ERROR_NOT_IMPLEMENTED if \p cpu isn't -1 on a platform
+ *          without CPU affinity, \c MQTT_ERROR_IO_THREAD if the thread couldn't be created
+ *          (e.g. the policy needs privileges) or pinned.
+ *
+ * @relates mqtt_io_thread
+ */
+enum MQTTErrors mqtt_io_thread_start(struct mqtt_io_thread *io, struct mqtt_client *client,
+                                     int cpu, int policy, int priority);
+
+/**
+ * @brief Stops an I/O thread and waits for it to exit.
+ * @ingroup io_thread
+ *
+ * The client's wakeup callback is removed, and the thread calls \ref mqtt_sync a last time
+ * before it exits, so messages that were queued before (e.g. a DISCONNECT) are sent as far as
+ * the socket accepts them.
+ *
+ * @pre The other threads don't queue messages anymore.
+ *
+ * @relates mqtt_io_thread
+ */
+void mqtt_io_thread_stop(struct mqtt_io_thread *io);
+
+#endif
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -47,47 +47,110 @@ extern "C" {
  *      - \c uint8_t, \c uint16_t, \c uint32_t
  *      - \c va_list
  *      - \c mqtt_pal_time_t : return type of \c MQTT_PAL_TIME() 
+ *      - \c mqtt_pal_time_ms_t : return type of \c MQTT_PAL_TIME_MS() (an unsigned integer
+ *        type that doesn't wrap around during the lifetime of a connection)
  *      - \c mqtt_pal_mutex_t : type of the argument that is passed to \c MQTT_PAL_MUTEX_LOCK and 
  *        \c MQTT_PAL_MUTEX_RELEASE
+ *      - \c mqtt_pal_iovec : a buffer descriptor with \c iov_base and \c iov_len members (e.g. 
+ *        <code>struct iovec</code>) used by \ref mqtt_pal_sendv
  *  - Functions:
  *      - \c memcpy, \c strlen
  *      - \c va_start, \c va_arg, \c va_end
  *  - Constants:
  *      - \c INT_MIN
  * 
- * Additionally, three macro's are required:
+ * Additionally, the following macro's are required:
  *  - \c MQTT_PAL_HTONS(s) : host-to-network endian conversion for uint16_t.
  *  - \c MQTT_PAL_NTOHS(s) : network-to-host endian conversion for uint16_t.
  *  - \c MQTT_PAL_TIME()   : returns [type: \c mqtt_pal_time_t] current time in seconds. 
+ *  - \c MQTT_PAL_TIME_MS() : returns [type: \c mqtt_pal_time_ms_t] the time in milliseconds 
+ *    of a monotonic clock (one that doesn't jump when the wall-clock time is changed). It is
+ *    used for all timeouts, keep-alive and response time tracking. \ref mqtt_pal_time_ms 
+ *    implements it for the supported platforms.
  *  - \c MQTT_PAL_MUTEX_LOCK(mtx_pointer) : macro that locks the mutex pointed to by \c mtx_pointer.
  *  - \c MQTT_PAL_MUTEX_RELEASE(mtx_pointer) : macro that unlocks the mutex pointed to by 
  *    \c mtx_pointer.
+ *
+ * \c mqtt_pal_mutex_t and the mutex macro's only have to be defined for the
+ * \ref MQTT_PAL_LOCK_MUTEX lock policy (see \ref MQTT_PAL_LOCK_POLICY).
  * 
- * Lastly, \ref mqtt_pal_sendall and \ref mqtt_pal_recvall, must be implemented in mqtt_pal.c 
- * for sending and receiving data using the platforms socket calls.
+ * Lastly, \ref mqtt_pal_sendall, \ref mqtt_pal_sendv and \ref mqtt_pal_recvall, must be 
+ * implemented in mqtt_pal.c for sending and receiving data using the platforms socket calls.
+ * A generic \ref mqtt_pal_sendv built on top of \ref mqtt_pal_sendall is provided for platforms
+ * without vectored socket writes.
+ */
+
+/**
+ * @brief The client's locks are no-ops (see \ref MQTT_PAL_LOCK_POLICY).
+ * @ingroup pal
+ */
+#define MQTT_PAL_LOCK_NONE 0
+
+/**
+ * @brief The client's locks are spinlocks (see \ref MQTT_PAL_LOCK_POLICY).
+ * @ingroup pal
  */
+#define MQTT_PAL_LOCK_SPIN 1
 
+/**
+ * @brief The client's locks are the platform's mutexes (see \ref MQTT_PAL_LOCK_POLICY).
+ * @ingroup pal
+ */
+#define MQTT_PAL_LOCK_MUTEX 2
+
+/**
+ * @brief Selects what \c MQTT_PAL_MUTEX_LOCK and \c MQTT_PAL_MUTEX_UNLOCK do, for the whole
+ *        build.
+ * @ingroup pal
+ *
+ *  - \ref MQTT_PAL_LOCK_MUTEX (the default): the platform's mutex (\c pthread_mutex_t or
+ *    \c CRITICAL_SECTION).
+ *  - \ref MQTT_PAL_LOCK_SPIN: a test-and-test-and-set spinlock that spins for up to
+ *    \ref MQTT_PAL_SPIN_COUNT rounds and then yields the CPU between attempts. The client's
+ *    critical sections are short (copying a message into the send buffer, parsing a packet),
+ *    so a waiting thread usually gets the lock without a system call. Needs
+ *    \c MQTT_PAL_HAVE_ATOMICS.
+ *  - \ref MQTT_PAL_LOCK_NONE: the locks do nothing. Only for applications that use each
+ *    client from a single thread, e.g. a single-threaded event loop or a
+ *    \ref mqtt_reactor whose publishers run in the callbacks. The I/O thread
+ *    (\ref mqtt_io_thread) isn't available with this policy.
+ *
+ * Define it (e.g. <tt>-D MQTT_PAL_LOCK_POLICY=MQTT_PAL_LOCK_SPIN</tt>, or with CMake
+ * <tt>-D MQTT_C_LOCK_POLICY=spin</tt>) the same way for the library and the code that
+ * includes mqtt.h, since it changes the size of \ref mqtt_client.
+ */
+#if !defined(MQTT_PAL_LOCK_POLICY)
+    #define MQTT_PAL_LOCK_POLICY MQTT_PAL_LOCK_MUTEX
+#endif
 
 /* UNIX-like platform support */
 #if defined(__unix__) || defined(__APPLE__) || defined(__NuttX__)
     #include <limits.h>
+    #include <stdint.h>
     #include <string.h>
     #include <stdarg.h>
     #include <time.h>
     #include <arpa/inet.h>
     #include <pthread.h>
+    #include <sys/uio.h>
 
     #define MQTT_PAL_HTONS(s) htons(s)
     #define MQTT_PAL_NTOHS(s) ntohs(s)
 
     #define MQTT_PAL_TIME() time(NULL)
+    #define MQTT_PAL_TIME_MS() mqtt_pal_time_ms()
 
     typedef time_t mqtt_pal_time_t;
-    typedef pthread_mutex_t mqtt_pal_mutex_t;
+    typedef uint64_t mqtt_pal_time_ms_t;
+    typedef struct iovec mqtt_pal_iovec;
 
-    #define MQTT_PAL_MUTEX_INIT(mtx_ptr) pthread_mutex_init(mtx_ptr, NULL)
-    #define MQTT_PAL_MUTEX_LOCK(mtx_ptr) pthread_mutex_lock(mtx_ptr)
-    #define MQTT_PAL_MUTEX_UNLOCK(mtx_ptr) pthread_mutex_unlock(mtx_ptr)
+    #if MQTT_PAL_LOCK_POLICY == MQTT_PAL_LOCK_MUTEX
+        typedef pthread_mutex_t mqtt_pal_mutex_t;
+
+        #define MQTT_PAL_MUTEX_INIT(mtx_ptr) pthread_mutex_init(mtx_ptr, NULL)
+        #define MQTT_PAL_MUTEX_LOCK(mtx_ptr) pthread_mutex_lock(mtx_ptr)
+        #define MQTT_PAL_MUTEX_UNLOCK(mtx_ptr) pthread_mutex_unlock(mtx_ptr)
+    #endif
 
     #if !defined(MQTT_USE_CUSTOM_SOCKET_HANDLE)
         #if defined(MQTT_USE_MBEDTLS)
@@ -130,13 +193,22 @@ extern "C" {
     #define MQTT_PAL_NTOHS(s) ntohs(s)
 
     #define MQTT_PAL_TIME() time(NULL)
+    #define MQTT_PAL_TIME_MS() mqtt_pal_time_ms()
 
     typedef time_t mqtt_pal_time_t;
-    typedef CRITICAL_SECTION mqtt_pal_mutex_t;
+    typedef uint64_t mqtt_pal_time_ms_t;
+    typedef struct mqtt_pal_iovec {
+        void *iov_base;
+        size_t iov_len;
+    } mqtt_pal_iovec;
 
-    #define MQTT_PAL_MUTEX_INIT(mtx_ptr) InitializeCriticalSection(mtx_ptr)
-    #define MQTT_PAL_MUTEX_LOCK(mtx_ptr) EnterCriticalSection(mtx_ptr)
-    #define MQTT_PAL_MUTEX_UNLOCK(mtx_ptr) LeaveCriticalSection(mtx_ptr)
+    #if MQTT_PAL_LOCK_POLICY == MQTT_PAL_LOCK_MUTEX
+        typedef CRITICAL_SECTION mqtt_pal_mutex_t;
+
+        #define MQTT_PAL_MUTEX_INIT(mtx_ptr) InitializeCriticalSection(mtx_ptr)
+        #define MQTT_PAL_MUTEX_LOCK(mtx_ptr) EnterCriticalSection(mtx_ptr)
+        #define MQTT_PAL_MUTEX_UNLOCK(mtx_ptr) LeaveCriticalSection(mtx_ptr)
+    #endif
 
 
     #if !defined(MQTT_USE_CUSTOM_SOCKET_HANDLE)
@@ -150,6 +222,76 @@ extern "C" {
 
 #endif
 
+/**
+ * @brief The maximum number of buffers that are passed to a single \ref mqtt_pal_sendv call.
+ * @ingroup pal
+ *
+ * This also bounds the number of queued messages that \ref __mqtt_send flushes with one call
+ * to the socket (the gather arrays live on the stack of \ref __mqtt_send). It must be at 
+ * least 2 since a message queued by \ref mqtt_publish_ref takes two buffers.
+ */
+#if !defined(MQTT_PAL_IOV_MAX)
+    #define MQTT_PAL_IOV_MAX 32
+#endif
+
+/**
+ * @brief Defined when the atomic operations used by the lock-free publish staging ring (see
+ *        \ref mqtt_init_publish_stage) are available.
+ * @ingroup pal
+ *
+ * The operations work on naturally aligned \c uint32_t and \c size_t values:
+ *  - \c MQTT_PAL_ATOMIC_LOAD(ptr) : load with acquire semantics.
+ *  - \c MQTT_PAL_ATOMIC_STORE(ptr, value) : store with release semantics.
+ *  - \c MQTT_PAL_ATOMIC_CAS(ptr, expected_ptr, desired) : compare-and-swap with acquire-release
+ *    semantics. Returns non-zero on success, otherwise \c *expected_ptr is updated to the
+ *    current value.
+ *  - \c MQTT_PAL_ATOMIC_EXCHANGE(ptr, value) : exchange with acquire-release semantics.
+ *    Returns the previous value.
+ *
+ * They are provided for GCC and clang. Other platforms can define them (and
+ * \c MQTT_PAL_HAVE_ATOMICS) themselves, without them \ref mqtt_publish_staged behaves like
+ * \ref mqtt_publish.
+ */
+#if !defined(MQTT_PAL_HAVE_ATOMICS) && (defined(__GNUC__) || defined(__clang__))
+    #define MQTT_PAL_HAVE_ATOMICS
+    #define MQTT_PAL_ATOMIC_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+    #define MQTT_PAL_ATOMIC_STORE(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+    #define MQTT_PAL_ATOMIC_CAS(ptr, expected_ptr, desired) \
+        __atomic_compare_exchange_n(ptr, expected_ptr, desired, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+    #define MQTT_PAL_ATOMIC_EXCHANGE(ptr, value) __atomic_exchange_n(ptr, value, __ATOMIC_ACQ_REL)
+#endif
+
+#if MQTT_PAL_LOCK_POLICY == MQTT_PAL_LOCK_NONE
+    typedef int mqtt_pal_mutex_t;
+
+    #define MQTT_PAL_MUTEX_INIT(mtx_ptr) ((void) (*(mtx_ptr) = 0))
+    #define MQTT_PAL_MUTEX_LOCK(mtx_ptr) ((void) (mtx_ptr))
+    #define MQTT_PAL_MUTEX_UNLOCK(mtx_ptr) ((void) (mtx_ptr))
+#elif MQTT_PAL_LOCK_POLICY == MQTT_PAL_LOCK_SPIN
+    #if !defined(MQTT_PAL_HAVE_ATOMICS)
+        #error "MQTT_PAL_LOCK_SPIN needs MQTT_PAL_HAVE_ATOMICS"
+    #endif
+
+    /**
+     * @brief The number of rounds a thread spins on a taken \ref MQTT_PAL_LOCK_SPIN lock
+     *        before it starts yielding the CPU.
+     * @ingroup pal
+     */
+    #if !defined(MQTT_PAL_SPIN_COUNT)
+        #define MQTT_PAL_SPIN_COUNT 128
+    #endif
+
+    typedef uint32_t mqtt_pal_mutex_t;
+
+    /* an uncontended lock is a single atomic exchange, mqtt_pal_spin_lock waits for the others */
+    #define MQTT_PAL_MUTEX_INIT(mtx_ptr) MQTT_PAL_ATOMIC_STORE(mtx_ptr, 0u)
+    #define MQTT_PAL_MUTEX_LOCK(mtx_ptr) \
+        (MQTT_PAL_ATOMIC_EXCHANGE(mtx_ptr, 1u) == 0u ? (void) 0 : mqtt_pal_spin_lock(mtx_ptr))
+    #define MQTT_PAL_MUTEX_UNLOCK(mtx_ptr) MQTT_PAL_ATOMIC_STORE(mtx_ptr, 0u)
+#elif MQTT_PAL_LOCK_POLICY != MQTT_PAL_LOCK_MUTEX
+    #error "MQTT_PAL_LOCK_POLICY must be MQTT_PAL_LOCK_NONE, MQTT_PAL_LOCK_SPIN or MQTT_PAL_LOCK_MUTEX"
+#endif
+
 /**
  * @brief Sends all the bytes in a buffer.
  * @ingroup pal
@@ -170,6 +312,25 @@ extern "C" {
  */
 ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle fd, const void* buf, size_t len, int flags);
 
+/**
+ * @brief Sends all the bytes in an array of buffers (scatter-gather send).
+ * @ingroup pal
+ * 
+ * @param[in] fd The file-descriptor (or handle) of the socket.
+ * @param[in,out] iov The buffers to send, in order. The entries of \p iov may be modified.
+ * @param[in] iovcnt The number of buffers in \p iov (at most \ref MQTT_PAL_IOV_MAX).
+ * @param[in] flags Flags which are passed to the underlying socket.
+ * 
+ * @returns The number of bytes sent if successful, an \ref MQTTErrors otherwise.
+ *
+ * @note The error handling is the same as \ref mqtt_pal_sendall. The bytes are sent in order,
+ *       so a partial send of \c n bytes means that the first \c n bytes of the concatenated
+ *       buffers were sent.
+ * @note When \c MQTT_USE_CUSTOM_SOCKET_HANDLE is defined a generic implementation calling 
+ *       \ref mqtt_pal_sendall is provided, unless \c MQTT_USE_CUSTOM_SENDV is also defined.
+ */
+ssize_t mqtt_pal_sendv(mqtt_pal_socket_handle fd, mqtt_pal_iovec *iov, int iovcnt, int flags);
+
 /**
  * @brief Non-blocking receive all the byte available.
  * @ingroup pal
@@ -190,6 +351,30 @@ ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle fd, const void* buf, size_t len,
  */
 ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int flags);
 
+/**
+ * @brief Reads the platform's monotonic clock.
+ * @ingroup pal
+ * 
+ * Implemented with \c CLOCK_MONOTONIC on UNIX-like platforms and \c GetTickCount64 on 
+ * Windows.
+ * 
+ * @returns The time in milliseconds since an arbitrary (but fixed) point in the past.
+ */
+mqtt_pal_time_ms_t mqtt_pal_time_ms(void);
+
+#if MQTT_PAL_LOCK_POLICY == MQTT_PAL_LOCK_SPIN
+/**
+ * @brief Waits for a \ref MQTT_PAL_LOCK_SPIN lock that another thread holds and takes it.
+ * @ingroup pal
+ *
+ * Spins for up to \ref MQTT_PAL_SPIN_COUNT rounds and then yields the CPU (\c sched_yield or
+ * \c SwitchToThread) between attempts.
+ *
+ * @param[in] lock The lock.
+ */
+void mqtt_pal_spin_lock(mqtt_pal_mutex_t *lock);
+#endif
+
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,414 @@
+#if !defined(__MQTT_REACTOR_H__)
+#define __MQTT_REACTOR_H__
+
+/*
+MIT License
+
+Copyright(c) 2018 Liam Bindle
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <mqtt.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @file
+ * @brief Declares the epoll (and io_uring) based reactor that drives many MQTT clients from one thread.
+ *
+ * @defgroup reactor Reactor
+ * @brief Drives many mqtt_client's from one thread (Linux only).
+ *
+ * Instead of a refresher thread per client calling \ref mqtt_sync in a loop, a reactor
+ * waits (with epoll) for the sockets of all the clients registered to it and for the
+ * earliest retransmit or keep-alive deadline (with a timerfd). It then calls
+ * \ref __mqtt_recv and \ref __mqtt_send for the clients that are ready, and only for them.
+ *
+ * Reactors are independent of each other. To use N threads, create N reactors, spread the
+ * clients over them and call \ref mqtt_reactor_run_once for each reactor from its own thread.
+ *
+ * Like the rest of MQTT-C the reactor doesn't allocate memory: the application provides a
+ * struct mqtt_reactor_entry for every registered client and the storage of the reactor's
+ * timer heap.
+ *
+ * When MQTT-C is built with \c MQTT_USE_IO_URING (CMake option \c MQTT_C_IO_URING_SUPPORT)
+ * the reactor does the clients' I/O with io_uring instead:
+ *  - every client's socket is received from by a multishot receive into buffers that are
+ *    registered with the kernel (see \ref MQTT_REACTOR_RING_BUFFERS), and the received bytes
+ *    are passed to the client with \ref __mqtt_recv_data.
+ *  - the messages of all the clients that are ready are gathered (see \ref mqtt_send_batch)
+ *    and their sends are submitted together in one \c io_uring_enter call.
+ *
+ * So a busy reactor makes a couple of \c io_uring_enter calls per \ref mqtt_reactor_run_once,
+ * instead of a \c recv and a \c sendmsg per client. The clients' mutexes are held while their
+ * sends are submitted. A reactor falls back to epoll at runtime if the kernel doesn't support
+ * the io_uring features it uses (Linux < 6.0), or if the completion queue can't take as many
+ * clients as the reactor's capacity.
+ *
+ * @note The reactor is only available on Linux with plain (non-TLS) sockets, where
+ *       \c mqtt_pal_socket_handle is a file descriptor (see \c MQTT_REACTOR_AVAILABLE).
+ */
+
+#if defined(__linux__) && !defined(MQTT_USE_CUSTOM_SOCKET_HANDLE) && !defined(MQTT_USE_MBEDTLS) \
+    && !defined(MQTT_USE_WOLFSSL) && !defined(MQTT_USE_BIO) && !defined(MQTT_USE_BEARSSL)
+/**
+ * @brief Defined when the reactor can be used with this build's \c mqtt_pal_socket_handle.
+ * @ingroup reactor
+ */
+#define MQTT_REACTOR_AVAILABLE
+#endif
+
+#if defined(MQTT_REACTOR_AVAILABLE)
+
+#if defined(MQTT_USE_IO_URING)
+#include <linux/io_uring.h>
+#endif
+
+/**
+ * @brief The maximum number of socket events that \ref mqtt_reactor_run_once handles per call.
+ * @ingroup reactor
+ */
+#if !defined(MQTT_REACTOR_MAX_EVENTS)
+#define MQTT_REACTOR_MAX_EVENTS 256
+#endif
+
+/**
+ * @brief The fraction of the keep-alive time by which a client's pings are sent early.
+ * @ingroup reactor
+ *
+ * Every client gets a fixed, random jitter of up to <tt>keep_alive /
+ * MQTT_REACTOR_KEEP_ALIVE_JITTER</tt> so that clients that were connected at the same time
+ * don't all ping the broker at the same time.
+ */
+#if !defined(MQTT_REACTOR_KEEP_ALIVE_JITTER)
+#define MQTT_REACTOR_KEEP_ALIVE_JITTER 10
+#endif
+
+/**
+ * @brief The time in milliseconds after which a failed reconnect is retried.
+ * @ingroup reactor
+ */
+#if !defined(MQTT_REACTOR_RECONNECT_INTERVAL_MS)
+#define MQTT_REACTOR_RECONNECT_INTERVAL_MS 1000
+#endif
+
+#if defined(MQTT_USE_IO_URING)
+/**
+ * @brief The number of entries of the io_uring submission queue.
+ * @ingroup reactor
+ *
+ * The submission queue is flushed early when more changes than this are made between two waits.
+ */
+#if !defined(MQTT_REACTOR_RING_ENTRIES)
+#define MQTT_REACTOR_RING_ENTRIES 256
+#endif
+
+/**
+ * @brief The minimum number of buffers that the sockets are received into (a power of 2).
+ * @ingroup reactor
+ *
+ * The buffers are shared by all the clients of a reactor, which has a buffer per client (up
+ * to 32768). A receive that runs out of buffers is started again after the received bytes
+ * were passed to the clients.
+ */
+#if !defined(MQTT_REACTOR_RING_BUFFERS)
+#define MQTT_REACTOR_RING_BUFFERS 256
+#endif
+
+/**
+ * @brief The size of the buffers that the sockets are received into.
+ * @ingroup reactor
+ */
+#if !defined(MQTT_REACTOR_RING_BUFFER_SIZE)
+#define MQTT_REACTOR_RING_BUFFER_SIZE 2048
+#endif
+
+/**
+ * @brief The maximum number of clients whose sends are submitted in one \c io_uring_enter call.
+ * @ingroup reactor
+ */
+#if !defined(MQTT_REACTOR_RING_SENDS)
+#define MQTT_REACTOR_RING_SENDS 64
+#endif
+
+/**
+ * @brief The mappings of an io_uring instance's queues.
+ * @ingroup reactor
+ */
+struct mqtt_reactor_ring {
+    /** @brief The submission queue ring (and its size). */
+    void *sq_ptr;
+    size_t sq_size;
+
+    /** @brief The completion queue ring (and its size). */
+    void *cq_ptr;
+    size_t cq_size;
+
+    /** @brief The submission queue entries (and the size of the array). */
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /** @brief The indices of the submission queue (shared with the kernel). */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries;
+
+    /** @brief The indices of the completion queue (shared with the kernel). */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+
+    /** @brief The completion queue entries. */
+    struct io_uring_cqe *cqes;
+
+    /** @brief Non-zero while the wakeup eventfd is watched by a multishot poll. */
+    int wakeup_armed;
+
+    /** @brief The ring of the provided buffers (and its size). */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+
+    /** @brief The memory of the provided buffers (and its size). */
+    uint8_t *buffers;
+    size_t buffers_size;
+
+    /** @brief The number of provided buffers. */
+    unsigned num_buffers;
+
+    /** @brief The state of the sends that are submitted together (and its size). */
+    void *sends;
+    size_t sends_size;
+
+    /** @brief The first and the last entry whose client is ready to send. */
+    struct mqtt_reactor_entry *ready, *ready_tail;
+};
+#endif
+
+struct mqtt_reactor;
+
+/**
+ * @brief The reactor's bookkeeping of a registered client.
+ * @ingroup reactor
+ *
+ * @note The memory is owned by the application and must stay valid until the client is
+ *       removed from the reactor. None of the members should be changed manually.
+ */
+struct mqtt_reactor_entry {
+    /** @brief The registered client. */
+    struct mqtt_client *client;
+
+    /** @brief The socket that is watched by the reactor (or -1). */
+    int fd;
+
+    /**
+     * @brief The epoll events that \c fd is registered for (with io_uring: EPOLLIN while the
+     *        multishot receive is in flight, EPOLLOUT while the poll for EPOLLOUT is).
+     */
+    uint32_t events;
+
+    /** @brief The time (\ref MQTT_PAL_TIME_MS) at which the client has to be synced next. */
+    mqtt_pal_time_ms_t deadline;
+
+    /** @brief A random number that the client's keep-alive jitter is derived from. */
+    uint32_t jitter_seed;
+
+    /** @brief The position of this entry in the reactor's timer heap. */
+    size_t heap_index;
+
+    /**
+     * @brief Non-zero while this entry is in the reactor's list of entries to flush, and 
+     *        after it was removed from the reactor.
+     */
+    int pending;
+
+    /** @brief The next entry in the reactor's list of entries to flush. */
+    struct mqtt_reactor_entry *next_pending;
+
+#if defined(MQTT_USE_IO_URING)
+    /** @brief Non-zero while this entry's client is waiting for its messages to be sent. */
+    int ready;
+
+    /** @brief The next entry whose client is waiting for its messages to be sent. */
+    struct mqtt_reactor_entry *next_ready;
+#endif
+};
+
+/**
+ * @brief An epoll (or io_uring) based reactor.
+ * @ingroup reactor
+ *
+ * @note All the members can be manipulated via the related functions. A reactor must only be
+ *       used from one thread at a time, except for \ref mqtt_reactor_wakeup.
+ */
+struct mqtt_reactor {
+#if defined(MQTT_USE_IO_URING)
+    /** @brief The io_uring instance (-1 if the reactor fell back to epoll). */
+    int ring_fd;
+
+    /** @brief The mappings of \c ring_fd's queues. */
+    struct mqtt_reactor_ring ring;
+#endif
+
+    /**
+     * @brief The epoll instance (-1 if the reactor uses io_uring).
+     *
+     * It becomes readable when \ref mqtt_reactor_run_once has work to do, so a reactor can be
+     * embedded in another event loop.
+     */
+    int epoll_fd;
+
+    /** @brief The timerfd that is armed for the earliest deadline of the registered clients. */
+    int timer_fd;
+
+    /** @brief The deadline that \c timer_fd is armed for. */
+    mqtt_pal_time_ms_t timer_deadline;
+
+    /** @brief The eventfd that \ref mqtt_reactor_wakeup signals. */
+    int wakeup_fd;
+
+    /** @brief A min-heap of the registered clients, ordered by their deadline. */
+    struct mqtt_reactor_entry **heap;
+
+    /** @brief The number of registered clients. */
+    size_t heap_size;
+
+    /** @brief The number of clients that fit in \c heap. */
+    size_t heap_capacity;
+
+    /** @brief The entries that \ref mqtt_reactor_wakeup was called for (a lock-free stack). */
+    struct mqtt_reactor_entry *pending;
+
+    /** @brief The entries taken from \c pending that \ref mqtt_reactor_run_once is syncing. */
+    struct mqtt_reactor_entry *flushing;
+
+    /** @brief The state of the random numbers that are used for the keep-alive jitter. */
+    uint32_t jitter_state;
+
+    /**
+     * @brief Called when a client without a \c reconnect_callback runs into an error.
+     *
+     * The client has already been removed from the reactor when this is called. Can be NULL.
+     */
+    void (*error_callback)(struct mqtt_reactor *reactor, struct mqtt_client *client, enum MQTTErrors error);
+
+    /** @brief A pointer to any error_callback state information you need. */
+    void *error_callback_state;
+};
+
+/**
+ * @brief Initializes a reactor.
+ * @ingroup reactor
+ *
+ * @param[out] reactor The reactor.
+ * @param[in] heap The storage for the reactor's timer heap, one pointer per client.
+ * @param[in] capacity The number of elements in \p heap, i.e. the maximum number of clients.
+ *
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_SOCKET_ERROR if the epoll instance, the
+ *          timerfd or the eventfd couldn't be created (an io_uring instance that can't be
+ *          created isn't an error, the reactor uses epoll instead).
+ *
+ * @relates mqtt_reactor
+ */
+enum MQTTErrors mqtt_reactor_init(struct mqtt_reactor *reactor, struct mqtt_reactor_entry **heap, size_t capacity);
+
+/**
+ * @brief Closes the file descriptors of a reactor.
+ * @ingroup reactor
+ *
+ * The registered clients aren't touched (their sockets stay open).
+ *
+ * @relates mqtt_reactor
+ */
+void mqtt_reactor_destroy(struct mqtt_reactor *reactor);
+
+/**
+ * @brief Registers a client with a reactor.
+ * @ingroup reactor
+ *
+ * From now on the reactor syncs the client, the application must not call \ref mqtt_sync for
+ * it anymore. The client can be initialized with mqtt_init (and mqtt_connect) or
+ * mqtt_init_reconnect; the socket of the client is (re)registered by the reactor whenever
+ * the reconnect callback changes it.
+ *
+ * @note The reconnect callback is called by \ref mqtt_reactor_run_once (through 
+ *       \ref mqtt_sync), so none of the reactor's other clients are served while it runs.
+ *       It should only start connecting (e.g. a non-blocking connect whose socket is then
+ *       handed to mqtt_reinit) rather than wait for the broker.
+ *
+ * @param reactor The reactor.
+ * @param[out] entry The reactor's bookkeeping for \p client.
+ * @param client The client.
+ *
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_REACTOR_FULL if \p reactor already holds
+ *          as many clients as its heap has room for, \c MQTT_ERROR_SOCKET_ERROR if the socket
+ *          couldn't be watched.
+ *
+ * @relates mqtt_reactor
+ */
+enum MQTTErrors mqtt_reactor_add(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry, struct mqtt_client *client);
+
+/**
+ * @brief Removes a client from a reactor.
+ * @ingroup reactor
+ *
+ * Calls of \ref mqtt_reactor_wakeup for \p entry that race with this function are waited 
+ * for, later ones do nothing until \p entry is added again.
+ *
+ * @relates mqtt_reactor
+ */
+void mqtt_reactor_remove(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry);
+
+/**
+ * @brief Tells the reactor that messages were queued for a client.
+ * @ingroup reactor
+ *
+ * The reactor only learns about messages that are queued by other threads (e.g. with
+ * mqtt_publish) when the client's socket or timer fires. Call this after queuing them to
+ * have them sent right away. This function is thread-safe.
+ *
+ * @note \p entry must stay valid while other threads may call this function, even after it
+ *       was removed from the reactor (e.g. clear the client's wakeup callback with 
+ *       mqtt_init_wakeup before freeing it).
+ *
+ * @relates mqtt_reactor
+ */
+void mqtt_reactor_wakeup(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry);
+
+/**
+ * @brief Waits for socket events and deadlines, and syncs the clients that are ready.
+ * @ingroup reactor
+ *
+ * @param reactor The reactor.
+ * @param[in] timeout_ms The maximum time to wait in milliseconds (-1 waits until something
+ *            happens, 0 doesn't wait).
+ *
+ * @returns \c MQTT_OK upon success (including a timeout or an interrupted wait),
+ *          \c MQTT_ERROR_SOCKET_ERROR if epoll (or io_uring) failed. Errors of the clients are handled by
+ *          their \c reconnect_callback or reported to \c error_callback.
+ *
+ * @relates mqtt_reactor
+ */
+enum MQTTErrors mqtt_reactor_run_once(struct mqtt_reactor *reactor, int timeout_ms);
+
+#endif /* defined(MQTT_REACTOR_AVAILABLE) */
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
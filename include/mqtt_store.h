@@ -0,0 +1,207 @@
+#if !defined(__MQTT_STORE_H__)
+#define __MQTT_STORE_H__
+
+/*
+MIT License
+
+Copyright(c) 2018 Liam Bindle
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <mqtt.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @file
+ * @brief Declares the session store that keeps a client's QoS 1 and 2 messages in a file.
+ *
+ * @defgroup store Session store
+ * @brief Keeps the unacknowledged QoS 1 and 2 messages of a client in a memory-mapped file
+ *        (POSIX only).
+ *
+ * The store is a \ref mqtt_session_journal: every QoS 1 or 2 PUBLISH, PUBREC and PUBREL that
+ * the client queues is appended to the file, and so is a small record for every one of them
+ * that is acknowledged. When the file is full the live records are copied into a new file,
+ * which then replaces the old one.
+ *
+ * After a crash (or any restart) \ref mqtt_store_open finds the live records again and
+ * \ref mqtt_store_attach queues them behind the client's CONNECT packet, so a client that
+ * connects without asking for a clean session resends them (PUBLISH packets with their DUP
+ * flag set) under their old packet ID's. Records that were only partly written when the
+ * process or the machine went down are recognized by their checksum and dropped.
+ *
+ * How much survives depends on the store's \ref MQTTStoreDurability. The file is mapped
+ * shared, so everything that was appended survives a crash of the process; surviving a crash
+ * of the machine takes an \c msync, either once per \ref __mqtt_send (for all the messages
+ * that were queued since the last one) or once per message.
+ *
+ * Like the rest of MQTT-C the store doesn't allocate memory with malloc: the records live in
+ * the mapped file, and the packet ID index of the live records in an anonymous mapping.
+ *
+ * @note Streamed publishes (see \ref mqtt_publish_stream) aren't stored, their payload isn't
+ *       known when they are queued.
+ */
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(WIN32)
+/**
+ * @brief Defined when the session store is available on this platform.
+ * @ingroup store
+ */
+#define MQTT_STORE_AVAILABLE
+#endif
+
+#if defined(MQTT_STORE_AVAILABLE)
+
+/**
+ * @brief What survives a crash of the machine.
+ * @ingroup store
+ */
+enum MQTTStoreDurability {
+    /** @brief The file is never synced, the messages only survive a crash of the process. */
+    MQTT_STORE_NO_SYNC,
+
+    /**
+     * @brief The messages that were appended since the last send are synced (with a single
+     *        \c msync) before they are sent.
+     */
+    MQTT_STORE_SYNC_BATCH,
+
+    /** @brief Every message is synced as soon as it is appended. */
+    MQTT_STORE_SYNC_EACH
+};
+
+/**
+ * @brief A session store.
+ * @ingroup store
+ *
+ * @note All the members can be manipulated via the related functions.
+ */
+struct mqtt_store {
+    /** @brief The journal hooks that are installed by \ref mqtt_store_attach. */
+    struct mqtt_session_journal journal;
+
+    /** @brief The path of the file (not copied). */
+    const char *path;
+
+    /** @brief The file descriptor of the file. */
+    int fd;
+
+    /** @brief The mapping of the file. */
+    uint8_t *map;
+
+    /** @brief The size of the file in bytes. */
+    size_t capacity;
+
+    /** @brief The offset after the last record. */
+    size_t end;
+
+    /** @brief The offset up to which the file was synced. */
+    size_t synced;
+
+    /**
+     * @brief The offsets of the live records: outgoing PUBLISH and PUBREL records by their
+     *        packet ID, followed by the incoming PUBREC records by theirs (0 if there is none).
+     */
+    uint32_t *index;
+
+    /** @brief The epoch of the records that are appended (one more every time it is opened). */
+    uint32_t epoch;
+
+    /** @brief When the file is synced. */
+    enum MQTTStoreDurability durability;
+
+    /** @brief The number of live records. */
+    size_t number_of_messages;
+
+    /** @brief The number of bytes of the live records. */
+    size_t live_size;
+
+    /** @brief A counter counting the times the file was synced. */
+    int number_of_syncs;
+
+    /** @brief A counter counting the times the file was compacted. */
+    int number_of_compactions;
+};
+
+/**
+ * @brief Opens (or creates) a session store and finds its live records.
+ * @ingroup store
+ *
+ * @param[out] store The store.
+ * @param[in] path The path of the file, it must outlive \p store. The file is replaced by
+ *            \c path followed by ".tmp" when it is compacted.
+ * @param[in] capacity The size of the file in bytes (an existing file that is larger keeps
+ *            its size). It has to hold all the unacknowledged messages, plus 16 bytes and up
+ *            to 7 bytes of padding per message.
+ * @param[in] durability When the file is synced.
+ *
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_STORE_IO if the file can't be opened or
+ *          mapped or isn't a session store.
+ *
+ * @relates mqtt_store
+ */
+enum MQTTErrors mqtt_store_open(struct mqtt_store *store, const char *path, size_t capacity,
+                                enum MQTTStoreDurability durability);
+
+/**
+ * @brief Queues the live records of the store and records the client's session in it from
+ *        now on.
+ * @ingroup store
+ *
+ * @pre Call this function right after \ref mqtt_connect, before other messages are queued.
+ *      If the client reconnects with \ref mqtt_reinit and discards the queued messages (see 
+ *      \ref mqtt_init_reinit_policy), call it again after every \ref mqtt_connect.
+ *
+ * @returns \c MQTT_OK upon success, the error of \ref mqtt_restore_message otherwise.
+ *
+ * @relates mqtt_store
+ */
+enum MQTTErrors mqtt_store_attach(struct mqtt_store *store, struct mqtt_client *client);
+
+/**
+ * @brief Syncs the records that were appended since the file was last synced.
+ * @ingroup store
+ *
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_STORE_IO otherwise.
+ *
+ * @relates mqtt_store
+ */
+enum MQTTErrors mqtt_store_flush(struct mqtt_store *store);
+
+/**
+ * @brief Unmaps and closes the file (without syncing it).
+ * @ingroup store
+ *
+ * @note Detach the store from the client first with \ref mqtt_init_session_journal.
+ *
+ * @relates mqtt_store
+ */
+void mqtt_store_close(struct mqtt_store *store);
+
+#endif
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -0,0 +1,161 @@
+#if !defined(__MQTT_TOPIC_H__)
+#define __MQTT_TOPIC_H__
+
+/*
+MIT License
+
+Copyright(c) 2018 Liam Bindle
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <mqtt.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @file
+ * @brief Declares the helpers that match topic names against topic filters.
+ *
+ * @defgroup topic Topic matching
+ * @brief Matches topic names (e.g. of a \ref mqtt_response_publish) against topic filters.
+ *
+ * \ref mqtt_topic_matches matches a topic against a single filter. To match a topic against
+ * many filters, split the topic into its levels once with \ref mqtt_topic_split, compile the
+ * filters once with \ref mqtt_topic_filter_compile and match them all with
+ * \ref mqtt_topic_match_batch, which compares whole levels instead of scanning the topic for
+ * every filter.
+ *
+ * The topic is scanned for the level separators 16 (SSE2, NEON) or 32 (AVX2) bytes at a time
+ * when MQTT-C is compiled (with GCC or clang) for a target that has these instructions, and
+ * a byte at a time otherwise. Define \c MQTT_TOPIC_NO_SIMD to always use the scalar scan.
+ *
+ * Matching follows the MQTT 3.1.1 rules: \c + matches exactly one (possibly empty) level,
+ * \c # matches any number of levels including the parent level, and wildcards at the first
+ * level don't match topics that start with \c $.
+ */
+
+/**
+ * @brief The maximum number of levels of a split topic or compiled filter.
+ * @ingroup topic
+ *
+ * Longer topics and filters are still matched by \ref mqtt_topic_match_batch, but without the
+ * help of the split levels.
+ */
+#if !defined(MQTT_TOPIC_MAX_LEVELS)
+#define MQTT_TOPIC_MAX_LEVELS 32
+#endif
+
+/**
+ * @brief A topic name (or filter) split into its levels.
+ * @ingroup topic
+ *
+ * Level \c i starts at <tt>name + start[i]</tt> and is <tt>start[i + 1] - start[i] - 1</tt>
+ * bytes long.
+ */
+struct mqtt_topic_levels {
+    /** @brief The topic name (not copied). */
+    const char *name;
+
+    /** @brief The size of \c name in bytes. */
+    size_t size;
+
+    /**
+     * @brief The number of levels, <tt>MQTT_TOPIC_MAX_LEVELS + 1</tt> if there are more than
+     *        \ref MQTT_TOPIC_MAX_LEVELS (then \c start isn't valid).
+     */
+    size_t count;
+
+    /** @brief The offsets of the levels, followed by <tt>size + 1</tt>. */
+    uint32_t start[MQTT_TOPIC_MAX_LEVELS + 1];
+};
+
+/**
+ * @brief A topic filter that was prepared for \ref mqtt_topic_match_batch.
+ * @ingroup topic
+ */
+struct mqtt_topic_filter {
+    /** @brief The levels of the filter, without a trailing \c #. */
+    struct mqtt_topic_levels levels;
+
+    /** @brief Non-zero if the filter ends with \c #. */
+    int multi_level;
+
+    /** @brief Non-zero if the first level of the filter is a wildcard. */
+    int leading_wildcard;
+};
+
+/**
+ * @brief Splits a topic name into its levels.
+ * @ingroup topic
+ *
+ * @param[out] levels The levels of \p topic.
+ * @param[in] topic The topic name (it isn't copied and needn't be null-terminated).
+ * @param[in] size The size of \p topic in bytes.
+ *
+ * @returns The number of levels of \p topic, 0 if there are more than
+ *          \ref MQTT_TOPIC_MAX_LEVELS.
+ */
+size_t mqtt_topic_split(struct mqtt_topic_levels *levels, const char *topic, size_t size);
+
+/**
+ * @brief Prepares a topic filter for \ref mqtt_topic_match_batch.
+ * @ingroup topic
+ *
+ * @param[out] filter The compiled filter.
+ * @param[in] topic_filter The topic filter. It isn't copied, so it must stay valid as long as
+ *            \p filter is used.
+ *
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_INVALID_TOPIC_FILTER if \p topic_filter is
+ *          empty or misuses a wildcard.
+ */
+enum MQTTErrors mqtt_topic_filter_compile(struct mqtt_topic_filter *filter, const char *topic_filter);
+
+/**
+ * @brief Returns non-zero if \p topic_filter matches \p topic.
+ * @ingroup topic
+ *
+ * @param[in] topic_filter The (null-terminated) topic filter.
+ * @param[in] topic The topic name (it needn't be null-terminated).
+ * @param[in] size The size of \p topic in bytes.
+ */
+int mqtt_topic_matches(const char *topic_filter, const char *topic, size_t size);
+
+/**
+ * @brief Matches a topic against many compiled filters.
+ * @ingroup topic
+ *
+ * @param[in] filters The filters, compiled with \ref mqtt_topic_filter_compile.
+ * @param[in] n The number of filters.
+ * @param[in] topic The topic, split with \ref mqtt_topic_split.
+ * @param[out] matches Set to 1 for the filters that match \p topic and to 0 for the others.
+ *             Can be NULL.
+ *
+ * @returns The number of filters that match \p topic.
+ */
+size_t mqtt_topic_match_batch(const struct mqtt_topic_filter *filters, size_t n,
+                              const struct mqtt_topic_levels *topic, uint8_t *matches);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -0,0 +1,252 @@
+#if !defined(__MQTT_WORKER_POOL_H__)
+#define __MQTT_WORKER_POOL_H__
+
+/*
+MIT License
+
+Copyright(c) 2018 Liam Bindle
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <mqtt.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @file
+ * @brief Declares the worker pool that processes received publishes on several threads.
+ *
+ * @defgroup workers Worker pool
+ * @brief Spreads the received publishes of a client over worker threads, in order per topic.
+ *
+ * A client calls its \c publish_response_callback on one thread. A worker pool takes its
+ * place and hands every publish to one of N workers, chosen by a hash of its topic name, over
+ * a single-producer single-consumer ring per worker. Each worker passes its publishes to the
+ * pool's callback from its own thread, in the order they were received, so the publishes of a
+ * topic are processed in order while the processing of different topics scales across cores.
+ *
+ * The topic name and payload of a publish are copied into the ring of its worker. When the
+ * client delivers publishes with its receive lock released (see \ref mqtt_init_deferred_delivery)
+ * they are only referenced: the client leaves its receive buffer alone until the last publish
+ * of a delivered batch has been processed by the workers.
+ *
+ * Like the reactor the pool doesn't start threads: the application calls
+ * \ref mqtt_worker_pool_run for every worker from a thread of its own. And like the rest of
+ * MQTT-C the pool doesn't allocate memory, the rings are carved from memory that is provided
+ * by the application.
+ *
+ * @note A QoS 1 or 2 publish is acknowledged once it is handed to its worker, not once it
+ *       has been processed (just like the acknowledgement of a publish is queued before
+ *       \c publish_response_callback is called).
+ */
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(WIN32) && defined(MQTT_PAL_HAVE_ATOMICS) \
+    && (defined(__GNUC__) || defined(__clang__))
+/**
+ * @brief Defined when the worker pool is available on this platform.
+ * @ingroup workers
+ */
+#define MQTT_WORKER_POOL_AVAILABLE
+#endif
+
+#if defined(MQTT_WORKER_POOL_AVAILABLE)
+
+/**
+ * @brief The number of times an idle worker checks its ring before it goes to sleep.
+ * @ingroup workers
+ */
+#if !defined(MQTT_WORKER_POOL_SPIN)
+#define MQTT_WORKER_POOL_SPIN 256
+#endif
+
+/**
+ * @brief A worker of a worker pool and its ring.
+ * @ingroup workers
+ *
+ * @note None of the members should be changed manually.
+ */
+struct mqtt_worker {
+    /** @brief The memory of the ring. */
+    uint8_t *mem;
+
+    /** @brief The size of \c mem minus one (the size is a power of two). */
+    size_t mask;
+
+    /** @brief The number of bytes written to the ring (by the receiving thread). */
+    size_t head;
+
+    /** @brief The number of bytes processed by the worker. */
+    size_t tail;
+
+    /** @brief Guards the sleeps of the worker and of the receiving thread. */
+    pthread_mutex_t mutex;
+
+    /** @brief Signaled when records are written to an empty ring. */
+    pthread_cond_t records;
+
+    /** @brief Signaled when records were processed while the receiving thread waits. */
+    pthread_cond_t space;
+
+    /** @brief Non-zero while the worker sleeps. */
+    uint32_t sleeping;
+
+    /** @brief Non-zero while the receiving thread waits for the worker. */
+    uint32_t waiting;
+
+    /** @brief A counter counting the publishes the worker processed. */
+    size_t number_of_publishes;
+
+    /** @brief A counter counting the times the receiving thread waited for the worker. */
+    size_t number_of_waits;
+};
+
+/**
+ * @brief A pool of workers.
+ * @ingroup workers
+ *
+ * @note All the members can be manipulated via the related functions.
+ */
+struct mqtt_worker_pool {
+    /** @brief The workers. */
+    struct mqtt_worker *workers;
+
+    /** @brief The number of workers. */
+    size_t number_of_workers;
+
+    /** @brief The callback that the workers pass the publishes to. */
+    void (*callback)(void** state, struct mqtt_response_publish *publish);
+
+    /** @brief A pointer to any callback state information you need. */
+    void *state;
+
+    /**
+     * @brief The client whose receive buffer the publishes are referenced in, or NULL if they
+     *        are copied.
+     */
+    struct mqtt_client *client;
+
+    /** @brief Non-zero once \ref mqtt_worker_pool_stop was called. */
+    uint32_t stopped;
+
+    /**
+     * @brief A counter counting the publishes that were too large for their worker's ring and
+     *        were processed by the receiving thread (after the worker was done).
+     */
+    size_t number_of_inline_publishes;
+};
+
+/**
+ * @brief Initializes a worker pool.
+ * @ingroup workers
+ *
+ * @param[out] pool The pool.
+ * @param[out] workers The workers, \p number_of_workers of them. They must outlive \p pool.
+ * @param[in] number_of_workers The number of workers.
+ * @param[in] mem The memory of the rings, it must outlive \p pool. Every worker gets the
+ *            largest power of two number of bytes that fits in its share. A copied publish
+ *            takes its topic name and payload plus 40 bytes, a referenced one 40 bytes, both
+ *            rounded up to a multiple of 8.
+ * @param[in] memsz The size of \p mem in bytes.
+ * @param[in] callback The callback that the workers pass the publishes to.
+ * @param[in] state The state that is passed to \p callback.
+ *
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_NULLPTR if a pointer is NULL, there are no
+ *          workers or \p mem is too small for a ring of 64 bytes per worker.
+ *
+ * @relates mqtt_worker_pool
+ */
+enum MQTTErrors mqtt_worker_pool_init(struct mqtt_worker_pool *pool,
+                                      struct mqtt_worker *workers, size_t number_of_workers,
+                                      void *mem, size_t memsz,
+                                      void (*callback)(void** state, struct mqtt_response_publish *publish),
+                                      void *state);
+
+/**
+ * @brief Destroys the mutexes and condition variables of a worker pool.
+ * @ingroup workers
+ *
+ * @pre All the calls to \ref mqtt_worker_pool_run have returned.
+ *
+ * @relates mqtt_worker_pool
+ */
+void mqtt_worker_pool_destroy(struct mqtt_worker_pool *pool);
+
+/**
+ * @brief Routes the publishes that \p client receives through \p pool.
+ * @ingroup workers
+ *
+ * Replaces the client's \c publish_response_callback (and its state). The publishes are
+ * referenced instead of copied if the client delivers them with its receive lock released, so call
+ * \ref mqtt_init_deferred_delivery first if you want that.
+ *
+ * @relates mqtt_worker_pool
+ */
+void mqtt_worker_pool_attach(struct mqtt_worker_pool *pool, struct mqtt_client *client);
+
+/**
+ * @brief Hands a publish to the worker of its topic.
+ * @ingroup workers
+ *
+ * This is the \c publish_response_callback that \ref mqtt_worker_pool_attach installs (with
+ * the pool as its state). It waits while the worker's ring is full.
+ *
+ * @relates mqtt_worker_pool
+ */
+void mqtt_worker_pool_dispatch(void** state, struct mqtt_response_publish *publish);
+
+/**
+ * @brief Processes the publishes of a worker until the pool is stopped.
+ * @ingroup workers
+ *
+ * Call this function once for every worker, each from its own thread. It sleeps while the
+ * worker's ring is empty, and returns once the pool is stopped and the ring is empty.
+ *
+ * @param pool The pool.
+ * @param[in] index The index of the worker.
+ *
+ * @relates mqtt_worker_pool
+ */
+void mqtt_worker_pool_run(struct mqtt_worker_pool *pool, size_t index);
+
+/**
+ * @brief Waits until the workers have processed all the publishes that were handed to them.
+ * @ingroup workers
+ *
+ * @relates mqtt_worker_pool
+ */
+void mqtt_worker_pool_drain(struct mqtt_worker_pool *pool);
+
+/**
+ * @brief Makes the calls to \ref mqtt_worker_pool_run return once their rings are empty.
+ * @ingroup workers
+ *
+ * @relates mqtt_worker_pool
+ */
+void mqtt_worker_pool_stop(struct mqtt_worker_pool *pool);
+
+#endif
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -32,12 +32,26 @@ SOFTWARE.
  * @cond Doxygen_Suppress
  */
 
+static ssize_t __mqtt_send_at(struct mqtt_client *client, mqtt_pal_time_ms_t now);
+static ssize_t __mqtt_recv_at(struct mqtt_client *client, mqtt_pal_time_ms_t now, const uint8_t *data, size_t size);
+static int __mqtt_publish_stage_pending(struct mqtt_client *client);
+static void __mqtt_publish_stage_drain(struct mqtt_client *client);
+static ssize_t __mqtt_unpack_fixed_header(struct mqtt_response *response, const uint8_t *buf, size_t bufsz);
+static int __mqtt_mq_compact(struct mqtt_message_queue *mq);
+static ssize_t __mqtt_mq_close_gaps(struct mqtt_message_queue *mq);
+static void __mqtt_mq_straighten(struct mqtt_message_queue *mq);
+static void __mqtt_mq_move_back_to_front(struct mqtt_message_queue *mq);
+
 enum MQTTErrors mqtt_sync(struct mqtt_client *client) {
     /* Recover from any errors */
     enum MQTTErrors err;
+    mqtt_pal_time_ms_t now;
     int reconnecting = 0;
+    MQTT_PAL_MUTEX_LOCK(&client->recv_mutex);
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
-    if (client->error != MQTT_ERROR_RECONNECTING && client->error != MQTT_OK && client->reconnect_callback != NULL) {
+    if (client->error != MQTT_ERROR_RECONNECTING && client->error != MQTT_OK && client->reconnect_callback != NULL
+        && !client->delivery.delivering)
+    {
         client->reconnect_callback(client, &client->reconnect_state);
         if (client->error != MQTT_OK) {
             client->error = MQTT_ERROR_RECONNECT_FAILED;
@@ -46,6 +60,7 @@ enum MQTTErrors mqtt_sync(struct mqtt_client *client) {
             MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
         }
         err = client->error;
+        MQTT_PAL_MUTEX_UNLOCK(&client->recv_mutex);
 
         if (err != MQTT_OK) return err;
     } else {
@@ -55,6 +70,7 @@ enum MQTTErrors mqtt_sync(struct mqtt_client *client) {
             client->error = MQTT_OK;
         }
         MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        MQTT_PAL_MUTEX_UNLOCK(&client->recv_mutex);
     }
 
     /* Call inspector callback if necessary */
@@ -67,23 +83,164 @@ enum MQTTErrors mqtt_sync(struct mqtt_client *client) {
     }
 
     /* Call receive */
-    err = (enum MQTTErrors)__mqtt_recv(client);
+    now = MQTT_PAL_TIME_MS();
+    err = (enum MQTTErrors)__mqtt_recv_at(client, now, NULL, 0);
     if (err != MQTT_OK) return err;
 
     /* Call send */
-    err = (enum MQTTErrors)__mqtt_send(client);
+    err = (enum MQTTErrors)__mqtt_send_at(client, now);
 
     /* mqtt_reconnect will essentially be a disconnect if there is no callback */
     if (reconnecting && client->reconnect_callback != NULL) {
+        MQTT_PAL_MUTEX_LOCK(&client->recv_mutex);
         MQTT_PAL_MUTEX_LOCK(&client->mutex);
         client->reconnect_callback(client, &client->reconnect_state);
+        MQTT_PAL_MUTEX_UNLOCK(&client->recv_mutex);
     }
 
     return err;
 }
 
+/**
+ * Returns non-zero if \p msg is an unsent QoS 1 or QoS 2 PUBLISH that must wait for the
+ * in-flight window of its QoS level, given the \p inflight counts (indexed by QoS) of the
+ * messages before it in the queue. Otherwise \p msg is counted in \p inflight if it is in
+ * flight (or about to be sent).
+ */
+static int __mqtt_inflight_window_full(const struct mqtt_client *client, const struct mqtt_queued_message *msg, unsigned inflight[3])
+{
+    unsigned qos, window;
+    if (msg->control_type != MQTT_CONTROL_PUBLISH
+        || (msg->state != MQTT_QUEUED_UNSENT && msg->state != MQTT_QUEUED_AWAITING_ACK))
+    {
+        return 0;
+    }
+    qos = 0x03 & ((msg->start[0]) >> 1);
+    if (qos != 1 && qos != 2) {
+        return 0;
+    }
+
+    window = qos == 1 ? client->max_inflight_qos1 : client->max_inflight_qos2;
+    if (msg->state == MQTT_QUEUED_UNSENT && window != 0 && inflight[qos] >= window) {
+        return 1;
+    }
+    inflight[qos] += 1;
+    return 0;
+}
+
+int mqtt_sync_interest(struct mqtt_client *client, mqtt_pal_time_ms_t *deadline)
+{
+    int interest = MQTT_SYNC_WANT_READ;
+    unsigned inflight[3] = {0, 0, 0};
+    ssize_t i, len;
+
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    *deadline = MQTT_SYNC_NO_DEADLINE;
+    if (client->error != MQTT_OK && client->error != MQTT_ERROR_SEND_BUFFER_IS_FULL) {
+        /* mqtt_sync has to report (or recover from) the error right away */
+        *deadline = MQTT_PAL_TIME_MS();
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return interest;
+    }
+
+    /* staged messages are moved into the queue by __mqtt_send */
+    if (__mqtt_publish_stage_pending(client)) {
+        interest |= MQTT_SYNC_WANT_WRITE;
+    }
+
+    /* the rest of a partially sent message, unless its producer has nothing ready */
+    if (client->send_partial != NULL) {
+        if (client->producer_starved) {
+            /* nothing (not even a retransmit or ping) is sent before the producer resumes */
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return interest;
+        }
+        interest |= MQTT_SYNC_WANT_WRITE;
+    }
+
+    /* the same rules as __mqtt_send */
+    len = mqtt_mq_length(&client->mq);
+    for(i = 0; i < len; ++i) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
+        if (__mqtt_inflight_window_full(client, msg, inflight)) {
+            continue;
+        }
+
+        if (msg->state == MQTT_QUEUED_UNSENT) {
+            /* nothing is sent before the rest of a partially sent message */
+            if (client->send_partial == NULL) {
+                interest |= MQTT_SYNC_WANT_WRITE;
+            }
+        } else if (msg->state == MQTT_QUEUED_AWAITING_ACK) {
+            mqtt_pal_time_ms_t timeout = msg->time_sent + client->response_timeout_ms;
+            if (timeout < *deadline) {
+                *deadline = timeout;
+            }
+        }
+    }
+
+    if (client->keep_alive != 0) {
+        mqtt_pal_time_ms_t keep_alive_timeout = client->time_of_last_send + 1000u * (mqtt_pal_time_ms_t) client->keep_alive;
+        if (keep_alive_timeout < *deadline) {
+            *deadline = keep_alive_timeout;
+        }
+    }
+
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return interest;
+}
+
+/**
+ * Returns the index of the lowest set bit of \p x (which must not be 0).
+ */
+static unsigned __mqtt_ctz32(uint32_t x) {
+#if defined(__GNUC__)
+    return (unsigned) __builtin_ctz(x);
+#else
+    unsigned n = 0;
+    while((x & 1u) == 0) {
+        x >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+/**
+ * Marks \p packet_id as used in the client's packet ID bitmap (if it has one).
+ */
+static void __mqtt_pid_acquire(struct mqtt_client *client, uint16_t packet_id) {
+    if (client->pid_bitmap != NULL) {
+        client->pid_bitmap[packet_id >> 5] |= (uint32_t) 1u << (packet_id & 31u);
+    }
+}
+
+/**
+ * Marks \p packet_id as free in the client's packet ID bitmap (if it has one).
+ */
+static void __mqtt_pid_release(struct mqtt_client *client, uint16_t packet_id) {
+    if (client->pid_bitmap != NULL && packet_id != 0) {
+        client->pid_bitmap[packet_id >> 5] &= ~((uint32_t) 1u << (packet_id & 31u));
+    }
+}
+
 uint16_t __mqtt_next_pid(struct mqtt_client *client) {
     int pid_exists = 0;
+    if (client->pid_bitmap != NULL) {
+        /* find the first word with a free packet ID, starting where the last one was found */
+        unsigned n;
+        unsigned w = client->pid_cursor;
+        for(n = 0; n < MQTT_PID_BITMAP_WORDS; ++n) {
+            uint32_t word = client->pid_bitmap[w];
+            if (word != 0xFFFFFFFFu) {
+                client->pid_cursor = (uint16_t) w;
+                return (uint16_t) (w * 32u + __mqtt_ctz32(~word));
+            }
+            w = (w + 1u) % MQTT_PID_BITMAP_WORDS;
+        }
+        return 0;
+    }
+
     if (client->pid_lfsr == 0) {
         client->pid_lfsr = 163u;
     }
@@ -110,6 +267,42 @@ uint16_t __mqtt_next_pid(struct mqtt_client *client) {
     return client->pid_lfsr;
 }
 
+/**
+ * Hands a referenced application message (see mqtt_publish_ref) back to its owner.
+ */
+static void __mqtt_release_application_message(struct mqtt_queued_message *msg) {
+    if (msg->release_callback != NULL) {
+        msg->release_callback(msg->release_state, msg->application_message);
+        msg->release_callback = NULL;
+    }
+}
+
+/**
+ * Returns the grown receive buffer to the client's allocator.
+ */
+static void __mqtt_free_grown_recvbuf(struct mqtt_client *client)
+{
+    struct mqtt_elastic_buffers *buffers = &client->buffers;
+    if (buffers->grown_recvbuf != NULL) {
+        buffers->allocator->deallocate(buffers->allocator->context, buffers->grown_recvbuf, client->recv_buffer.mem_size);
+        buffers->grown_recvbuf = NULL;
+    }
+}
+
+/**
+ * Returns the grown send and receive buffers to the client's allocator.
+ */
+static void __mqtt_free_grown_buffers(struct mqtt_client *client)
+{
+    struct mqtt_elastic_buffers *buffers = &client->buffers;
+    if (buffers->grown_sendbuf != NULL) {
+        buffers->allocator->deallocate(buffers->allocator->context, buffers->grown_sendbuf, buffers->grown_sendbuf_size);
+        buffers->grown_sendbuf = NULL;
+        buffers->grown_sendbuf_size = 0;
+    }
+    __mqtt_free_grown_recvbuf(client);
+}
+
 enum MQTTErrors mqtt_init(struct mqtt_client *client,
                mqtt_pal_socket_handle sockfd,
                uint8_t *sendbuf, size_t sendbufsz,
@@ -122,6 +315,7 @@ enum MQTTErrors mqtt_init(struct mqtt_client *client,
 
     /* initialize mutex */
     MQTT_PAL_MUTEX_INIT(&client->mutex);
+    MQTT_PAL_MUTEX_INIT(&client->recv_mutex);
     MQTT_PAL_MUTEX_LOCK(&client->mutex); /* unlocked during CONNECT */
 
     client->socketfd = sockfd;
@@ -130,17 +324,47 @@ enum MQTTErrors mqtt_init(struct mqtt_client *client,
 
     client->recv_buffer.mem_start = recvbuf;
     client->recv_buffer.mem_size = recvbufsz;
+    client->recv_buffer.parse_curr = client->recv_buffer.mem_start;
     client->recv_buffer.curr = client->recv_buffer.mem_start;
     client->recv_buffer.curr_sz = client->recv_buffer.mem_size;
 
+    client->buffers.allocator = NULL;
+    client->buffers.sendbuf = sendbuf;
+    client->buffers.sendbuf_size = sendbufsz;
+    client->buffers.grown_sendbuf = NULL;
+    client->buffers.grown_sendbuf_size = 0;
+    client->buffers.max_sendbuf_size = sendbufsz;
+    client->buffers.recvbuf = recvbuf;
+    client->buffers.recvbuf_size = recvbufsz;
+    client->buffers.grown_recvbuf = NULL;
+    client->buffers.max_recvbuf_size = recvbufsz;
+    client->buffers.number_of_grows = 0;
+
     client->error = MQTT_ERROR_CONNECT_NOT_CALLED;
-    client->response_timeout = 30;
+    client->response_timeout_ms = 30000u;
     client->number_of_timeouts = 0;
+    client->max_inflight_qos1 = 0;
+    client->max_inflight_qos2 = 1;
+    client->number_of_qos1_window_stalls = 0;
+    client->number_of_qos2_window_stalls = 0;
     client->number_of_keep_alives = 0;
-    client->typical_response_time = -1.0f;
+    client->time_of_last_send = 0;
+    client->typical_response_time_ms = -1.0f;
+    client->response_time_deviation_ms = 0.0f;
     client->publish_response_callback = publish_response_callback;
     client->pid_lfsr = 0;
+    client->pid_bitmap = NULL;
+    client->pid_cursor = 0;
     client->send_offset = 0;
+    client->send_partial = NULL;
+    client->producer_starved = 0;
+    mqtt_init_publish_stage(client, NULL, 0);
+    mqtt_init_recv_stream(client, NULL, NULL, NULL, NULL);
+    mqtt_init_session_journal(client, NULL);
+    client->reinit_policy = MQTT_REINIT_DISCARD_QUEUE;
+    mqtt_init_deferred_delivery(client, NULL, 0);
+    client->wakeup_callback = NULL;
+    client->wakeup_state = NULL;
 
     client->inspector_callback = NULL;
     client->reconnect_callback = NULL;
@@ -156,6 +380,7 @@ void mqtt_init_reconnect(struct mqtt_client *client,
 {
     /* initialize mutex */
     MQTT_PAL_MUTEX_INIT(&client->mutex);
+    MQTT_PAL_MUTEX_INIT(&client->recv_mutex);
 
     client->socketfd = (mqtt_pal_socket_handle) -1;
 
@@ -163,37 +388,470 @@ void mqtt_init_reconnect(struct mqtt_client *client,
 
     client->recv_buffer.mem_start = NULL;
     client->recv_buffer.mem_size = 0;
+    client->recv_buffer.parse_curr = NULL;
     client->recv_buffer.curr = NULL;
     client->recv_buffer.curr_sz = 0;
 
+    client->buffers.allocator = NULL;
+    client->buffers.sendbuf = NULL;
+    client->buffers.sendbuf_size = 0;
+    client->buffers.grown_sendbuf = NULL;
+    client->buffers.grown_sendbuf_size = 0;
+    client->buffers.max_sendbuf_size = 0;
+    client->buffers.recvbuf = NULL;
+    client->buffers.recvbuf_size = 0;
+    client->buffers.grown_recvbuf = NULL;
+    client->buffers.max_recvbuf_size = 0;
+    client->buffers.number_of_grows = 0;
+
     client->error = MQTT_ERROR_INITIAL_RECONNECT;
-    client->response_timeout = 30;
+    client->response_timeout_ms = 30000u;
     client->number_of_timeouts = 0;
+    client->max_inflight_qos1 = 0;
+    client->max_inflight_qos2 = 1;
+    client->number_of_qos1_window_stalls = 0;
+    client->number_of_qos2_window_stalls = 0;
     client->number_of_keep_alives = 0;
-    client->typical_response_time = -1.0f;
+    client->time_of_last_send = 0;
+    client->typical_response_time_ms = -1.0f;
+    client->response_time_deviation_ms = 0.0f;
     client->publish_response_callback = publish_response_callback;
     client->pid_lfsr = 0;
+    client->pid_bitmap = NULL;
+    client->pid_cursor = 0;
     client->send_offset = 0;
+    client->send_partial = NULL;
+    client->producer_starved = 0;
+    mqtt_init_publish_stage(client, NULL, 0);
+    mqtt_init_recv_stream(client, NULL, NULL, NULL, NULL);
+    mqtt_init_session_journal(client, NULL);
+    client->reinit_policy = MQTT_REINIT_DISCARD_QUEUE;
+    mqtt_init_deferred_delivery(client, NULL, 0);
+    client->wakeup_callback = NULL;
+    client->wakeup_state = NULL;
 
     client->inspector_callback = NULL;
     client->reconnect_callback = reconnect;
     client->reconnect_state = reconnect_state;
 }
 
-void mqtt_reinit(struct mqtt_client* client,
-                 mqtt_pal_socket_handle socketfd,
-                 uint8_t *sendbuf, size_t sendbufsz,
-                 uint8_t *recvbuf, size_t recvbufsz)
+/**
+ * Discards a queued message that won't be sent on the new connection, and frees its packet ID.
+ */
+static void __mqtt_mq_discard(struct mqtt_client *client, struct mqtt_queued_message *msg)
+{
+    switch (msg->control_type) {
+    case MQTT_CONTROL_PUBLISH:
+    case MQTT_CONTROL_PUBREL:
+    case MQTT_CONTROL_SUBSCRIBE:
+    case MQTT_CONTROL_UNSUBSCRIBE:
+        __mqtt_pid_release(client, msg->packet_id);
+        break;
+    default:
+        break;
+    }
+    msg->state = MQTT_QUEUED_COMPLETE;
+    __mqtt_release_application_message(msg);
+}
+
+/**
+ * Prepares the queued messages to be resent on a new connection (see mqtt_init_reinit_policy).
+ * The kept messages stay where the queue lives if that is \p sendbuf or a grown buffer, and
+ * are moved into \p sendbuf (as far as they fit) otherwise.
+ *
+ * @returns MQTT_OK, or MQTT_ERROR_SEND_BUFFER_IS_FULL if kept messages didn't fit into
+ *          \p sendbuf and were discarded.
+ */
+static enum MQTTErrors __mqtt_mq_carry_over(struct mqtt_client *client, uint8_t *sendbuf, size_t sendbufsz)
+{
+    struct mqtt_elastic_buffers *buffers = &client->buffers;
+    enum MQTTErrors rv = MQTT_OK;
+    ssize_t i, len = mqtt_mq_length(&client->mq);
+
+    for(i = 0; i < len; ++i) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
+        if (msg->state == MQTT_QUEUED_COMPLETE) {
+            continue;
+        }
+        switch (msg->control_type) {
+        case MQTT_CONTROL_CONNECT:
+        case MQTT_CONTROL_PINGREQ:
+        case MQTT_CONTROL_DISCONNECT:
+            __mqtt_mq_discard(client, msg);
+            break;
+        case MQTT_CONTROL_PUBLISH:
+            if ((msg->start[0] & MQTT_PUBLISH_QOS_MASK) == 0) {
+                if (client->reinit_policy != MQTT_REINIT_KEEP_ALL) {
+                    __mqtt_mq_discard(client, msg);
+                }
+                break;
+            }
+            if (msg->state == MQTT_QUEUED_AWAITING_ACK) {
+                /* [Spec MQTT-3.3.1-1] */
+                msg->start[0] |= MQTT_PUBLISH_DUP;
+            }
+            msg->state = MQTT_QUEUED_UNSENT;
+            break;
+        default:
+            msg->state = MQTT_QUEUED_UNSENT;
+            break;
+        }
+    }
+
+    if (buffers->grown_sendbuf != NULL || (sendbuf == buffers->sendbuf && sendbufsz == buffers->sendbuf_size)) {
+        /* a grown queue moves into sendbuf once it's empty */
+        __mqtt_mq_straighten(&client->mq);
+        return MQTT_OK;
+    }
+
+    /* copy the kept messages in order, like __mqtt_mq_grow */
+    {
+        struct mqtt_message_queue mq;
+        mqtt_mq_init(&mq, sendbuf, sendbufsz);
+        for(i = 0; i < len; ++i) {
+            struct mqtt_queued_message *old = mqtt_mq_get(&client->mq, i);
+            struct mqtt_queued_message *msg;
+            uint8_t *start;
+            if (old->state == MQTT_QUEUED_COMPLETE) {
+                continue;
+            }
+            if (mq.curr_sz < old->size) {
+                __mqtt_mq_discard(client, old);
+                rv = MQTT_ERROR_SEND_BUFFER_IS_FULL;
+                continue;
+            }
+            memcpy(mq.curr, old->start, old->size);
+            msg = mqtt_mq_register(&mq, old->size);
+            start = msg->start;
+            *msg = *old;
+            msg->start = start;
+        }
+        client->mq = mq;
+    }
+    return rv;
+}
+
+enum MQTTErrors mqtt_reinit(struct mqtt_client* client,
+                            mqtt_pal_socket_handle socketfd,
+                            uint8_t *sendbuf, size_t sendbufsz,
+                            uint8_t *recvbuf, size_t recvbufsz)
 {
+    enum MQTTErrors rv = MQTT_OK;
+    ssize_t i;
+    ssize_t len;
+
+    /* the rest of a streamed publish won't arrive anymore */
+    if (client->recv_stream.remaining > 0) {
+        client->recv_stream.remaining = 0;
+        if (!client->recv_stream.discard) {
+            client->recv_stream.end(&client->recv_stream.state, client->error);
+        }
+    }
+
     client->error = MQTT_ERROR_CONNECT_NOT_CALLED;
     client->socketfd = socketfd;
+    client->send_offset = 0;
+    client->send_partial = NULL;
 
-    mqtt_mq_init(&client->mq, sendbuf, sendbufsz);
+    if (client->reinit_policy != MQTT_REINIT_DISCARD_QUEUE) {
+        /* the queue is resent on the new connection */
+        __mqtt_free_grown_recvbuf(client);
+        rv = __mqtt_mq_carry_over(client, sendbuf, sendbufsz);
+    } else {
+        /* release the application messages that the old queue still references */
+        len = mqtt_mq_length(&client->mq);
+        for(i = 0; i < len; ++i) {
+            __mqtt_release_application_message(mqtt_mq_get(&client->mq, i));
+        }
+
+        /* the old buffers are replaced */
+        __mqtt_free_grown_buffers(client);
+        mqtt_mq_init(&client->mq, sendbuf, sendbufsz);
+
+        /* the packet ID's of the discarded messages are free again */
+        if (client->pid_bitmap != NULL) {
+            mqtt_init_pid_bitmap(client, client->pid_bitmap);
+        }
+    }
+    client->buffers.sendbuf = sendbuf;
+    client->buffers.sendbuf_size = sendbufsz;
+    client->buffers.recvbuf = recvbuf;
+    client->buffers.recvbuf_size = recvbufsz;
 
     client->recv_buffer.mem_start = recvbuf;
     client->recv_buffer.mem_size = recvbufsz;
+    client->recv_buffer.parse_curr = client->recv_buffer.mem_start;
     client->recv_buffer.curr = client->recv_buffer.mem_start;
     client->recv_buffer.curr_sz = client->recv_buffer.mem_size;
+    return rv;
+}
+
+void mqtt_init_reinit_policy(struct mqtt_client *client, enum MQTTReinitPolicy policy)
+{
+    client->reinit_policy = policy;
+}
+
+void mqtt_init_pid_bitmap(struct mqtt_client *client, uint32_t *pid_bitmap)
+{
+    client->pid_bitmap = pid_bitmap;
+    client->pid_cursor = 0;
+    if (pid_bitmap != NULL) {
+        ssize_t i;
+        ssize_t len = mqtt_mq_length(&client->mq);
+        memset(pid_bitmap, 0, MQTT_PID_BITMAP_WORDS * sizeof(uint32_t));
+
+        /* packet ID 0 is not allowed */
+        pid_bitmap[0] = 1u;
+
+        /* keep the ID's of messages that are already waiting for an acknowledgement */
+        for(i = 0; i < len; ++i) {
+            struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
+            if (msg->state != MQTT_QUEUED_COMPLETE
+                && (msg->control_type == MQTT_CONTROL_PUBLISH
+                    || msg->control_type == MQTT_CONTROL_PUBREL
+                    || msg->control_type == MQTT_CONTROL_SUBSCRIBE
+                    || msg->control_type == MQTT_CONTROL_UNSUBSCRIBE)) 
+            {
+                __mqtt_pid_acquire(client, msg->packet_id);
+            }
+        }
+    }
+}
+
+void mqtt_init_allocator(struct mqtt_client *client,
+                         const struct mqtt_allocator *allocator,
+                         size_t max_sendbuf_size,
+                         size_t max_recvbuf_size)
+{
+    client->buffers.allocator = allocator;
+    client->buffers.max_sendbuf_size = max_sendbuf_size;
+    client->buffers.max_recvbuf_size = max_recvbuf_size;
+}
+
+void mqtt_free_buffers(struct mqtt_client *client)
+{
+    int recv_grown = client->buffers.grown_recvbuf != NULL;
+    if (client->buffers.grown_sendbuf != NULL) {
+        /* the queued messages are discarded */
+        ssize_t i;
+        ssize_t len = mqtt_mq_length(&client->mq);
+        for(i = 0; i < len; ++i) {
+            __mqtt_release_application_message(mqtt_mq_get(&client->mq, i));
+        }
+        mqtt_mq_init(&client->mq, client->buffers.sendbuf, client->buffers.sendbuf_size);
+        client->send_offset = 0;
+        client->send_partial = NULL;
+    }
+    __mqtt_free_grown_buffers(client);
+    if (recv_grown) {
+        client->recv_buffer.mem_start = client->buffers.recvbuf;
+        client->recv_buffer.mem_size = client->buffers.recvbuf_size;
+        client->recv_buffer.parse_curr = client->recv_buffer.mem_start;
+        client->recv_buffer.curr = client->recv_buffer.mem_start;
+        client->recv_buffer.curr_sz = client->recv_buffer.mem_size;
+    }
+}
+
+/**
+ * Moves the message queue into an allocated buffer of at least twice its size, with at least
+ * \p needed more bytes, but not beyond the client's limit. Returns 1 if the queue was moved.
+ */
+static int __mqtt_mq_grow(struct mqtt_client *client, size_t needed)
+{
+    struct mqtt_elastic_buffers *buffers = &client->buffers;
+    struct mqtt_message_queue mq;
+    size_t size = buffers->grown_sendbuf != NULL ? buffers->grown_sendbuf_size : buffers->sendbuf_size;
+    size_t new_size = 2 * size;
+    ssize_t i, len = mqtt_mq_length(&client->mq);
+    ssize_t partial = -1;
+    uint8_t *mem;
+
+    if (buffers->allocator == NULL || size == 0 || size >= buffers->max_sendbuf_size) {
+        return 0;
+    }
+    if (new_size < size + needed) {
+        new_size = size + needed;
+    }
+    if (new_size > buffers->max_sendbuf_size) {
+        new_size = buffers->max_sendbuf_size;
+    }
+    mem = (uint8_t*) buffers->allocator->allocate(buffers->allocator->context, new_size);
+    if (mem == NULL) {
+        return 0;
+    }
+
+    /* copy the queued messages in order, their packets end up in one piece */
+    mqtt_mq_init(&mq, mem, new_size);
+    for(i = 0; i < len; ++i) {
+        struct mqtt_queued_message *old = mqtt_mq_get(&client->mq, i);
+        struct mqtt_queued_message *msg;
+        uint8_t *start;
+        if (mq.curr_sz < old->size) {
+            buffers->allocator->deallocate(buffers->allocator->context, mem, new_size);
+            return 0;
+        }
+        if (old == client->send_partial) {
+            partial = i;
+        }
+        memcpy(mq.curr, old->start, old->size);
+        msg = mqtt_mq_register(&mq, old->size);
+        start = msg->start;
+        *msg = *old;
+        msg->start = start;
+    }
+    if (partial >= 0) {
+        client->send_partial = mqtt_mq_get(&mq, partial);
+    }
+
+    if (buffers->grown_sendbuf != NULL) {
+        buffers->allocator->deallocate(buffers->allocator->context, buffers->grown_sendbuf, buffers->grown_sendbuf_size);
+    }
+    client->mq = mq;
+    buffers->grown_sendbuf = mem;
+    buffers->grown_sendbuf_size = new_size;
+    buffers->number_of_grows += 1;
+    return 1;
+}
+
+/**
+ * Cleans the message queue and, if fewer than \p needed bytes can be packed at its \c curr,
+ * moves the remaining messages to the ends of its memory so that all of its free space is in
+ * one piece. If that isn't enough, the completed messages behind an incomplete front of the
+ * queue are reclaimed as well. Keeps \c send_partial pointing at its message. Returns 1 if
+ * the messages were moved.
+ */
+static int __mqtt_mq_make_room(struct mqtt_client *client, size_t needed)
+{
+    struct mqtt_message_queue *mq = &client->mq;
+    ssize_t len = mqtt_mq_length(mq);
+    ssize_t partial = client->send_partial != NULL ? mqtt_mq_get(mq, 0) - client->send_partial : -1;
+    int moved = 0;
+
+    mqtt_mq_clean(mq);
+
+    /* clean only removes messages from the front */
+    partial -= len - mqtt_mq_length(mq);
+    if (mq->curr_sz < needed) {
+        moved = __mqtt_mq_compact(mq);
+    }
+    if (mq->curr_sz < needed) {
+        /* the partially sent message isn't complete, it moves back by the ones before it */
+        ssize_t i, removed = 0;
+        for(i = 0; i < partial; ++i) {
+            removed += mqtt_mq_get(mq, i)->state == MQTT_QUEUED_COMPLETE;
+        }
+        if (__mqtt_mq_close_gaps(mq) > 0) {
+            partial -= removed;
+            moved = 1;
+        }
+    }
+
+    if (client->send_partial != NULL) {
+        if (partial >= 0) {
+            client->send_partial = mqtt_mq_get(mq, partial);
+        } else {
+            client->send_partial = NULL;
+            client->send_offset = 0;
+        }
+    }
+    return moved;
+}
+
+/**
+ * Moves the message queue back into the client's own send buffer once it is empty.
+ */
+static void __mqtt_mq_shrink(struct mqtt_client *client)
+{
+    struct mqtt_elastic_buffers *buffers = &client->buffers;
+    if (buffers->grown_sendbuf == NULL) {
+        return;
+    }
+    __mqtt_mq_make_room(client, 0);
+    if (mqtt_mq_length(&client->mq) != 0) {
+        return;
+    }
+    mqtt_mq_init(&client->mq, buffers->sendbuf, buffers->sendbuf_size);
+    buffers->allocator->deallocate(buffers->allocator->context, buffers->grown_sendbuf, buffers->grown_sendbuf_size);
+    buffers->grown_sendbuf = NULL;
+    buffers->grown_sendbuf_size = 0;
+    client->send_offset = 0;
+    client->send_partial = NULL;
+}
+
+void mqtt_init_deferred_delivery(struct mqtt_client *client, struct mqtt_response_publish *publishes, size_t capacity)
+{
+    client->delivery.publishes = capacity > 0 ? publishes : NULL;
+    client->delivery.capacity = capacity;
+    client->delivery.length = 0;
+    client->delivery.delivering = 0;
+    client->delivery.number_of_deliveries = 0;
+}
+
+void mqtt_init_wakeup(struct mqtt_client *client, void (*callback)(void** state), void *state)
+{
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    client->wakeup_callback = callback;
+    client->wakeup_state = state;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+}
+
+void mqtt_init_session_journal(struct mqtt_client *client, const struct mqtt_session_journal *journal)
+{
+    client->journal = journal;
+}
+
+/**
+ * Records a queued QoS 1/2 PUBLISH, PUBREC or PUBREL in the client's session journal. A
+ * PUBLISH that can't be recorded is dropped again (the caller keeps its application message).
+ */
+static enum MQTTErrors __mqtt_journal_append(struct mqtt_client *client, struct mqtt_queued_message *msg)
+{
+    enum MQTTErrors rv;
+    if (client->journal == NULL || (msg->control_type == MQTT_CONTROL_PUBLISH && msg->packet_id == 0)) {
+        return MQTT_OK;
+    }
+    rv = client->journal->append(client->journal->state, msg);
+    if (rv != MQTT_OK && msg->control_type == MQTT_CONTROL_PUBLISH) {
+        msg->state = MQTT_QUEUED_COMPLETE;
+        msg->release_callback = NULL;
+        __mqtt_pid_release(client, msg->packet_id);
+    }
+    return rv;
+}
+
+/**
+ * Tells the client's session journal that a recorded message was acknowledged.
+ */
+static void __mqtt_journal_complete(struct mqtt_client *client, const struct mqtt_queued_message *msg)
+{
+    if (client->journal != NULL) {
+        client->journal->complete(client->journal->state, msg->control_type, msg->packet_id);
+    }
+}
+
+void mqtt_init_publish_stage(struct mqtt_client *client, uint8_t *buf, size_t bufsz)
+{
+    struct mqtt_publish_stage *stage = &client->publish_stage;
+    size_t padding = buf != NULL ? (16u - ((uintptr_t) buf & 15u)) & 15u : 0;
+    size_t size = 64;
+
+    stage->mem = NULL;
+    stage->mask = 0;
+    stage->reserved = 0;
+    stage->drained = 0;
+    if (buf == NULL || bufsz < padding + size) {
+        return;
+    }
+
+    /* the largest power of two that fits */
+    while (size <= (bufsz - padding) / 2) {
+        size *= 2;
+    }
+    stage->mem = buf + padding;
+    stage->mask = size - 1;
+
+    /* records are only ready once their size is written */
+    memset(stage->mem, 0, size);
 }
 
 /** 
@@ -201,7 +859,8 @@ void mqtt_reinit(struct mqtt_client* client,
  *      1) Checks that the client isn't in an error state.
  *      2) Attempts to pack to client's message queue.
  *          a) handles errors
- *          b) if mq buffer is too small, cleans it and tries again
+ *          b) if mq buffer is too small, cleans it (and compacts or grows it 
+ *             if needed) and tries again
  *      3) Upon successful pack, registers the new message.
  */
 #define MQTT_CLIENT_TRY_PACK(tmp, msg, client, pack_call, release)  \
@@ -215,8 +874,14 @@ void mqtt_reinit(struct mqtt_client* client,
         if (release) MQTT_PAL_MUTEX_UNLOCK(&client->mutex);         \
         return (enum MQTTErrors)tmp;                                                 \
     } else if (tmp == 0) {                                          \
-        mqtt_mq_clean(&client->mq);                                 \
+        __mqtt_mq_make_room(client, 0);                             \
         tmp = pack_call;                                            \
+        if (tmp == 0 && __mqtt_mq_make_room(client, (size_t) -1)) { \
+            tmp = pack_call;                                        \
+        }                                                           \
+        while (tmp == 0 && __mqtt_mq_grow(client, 0)) {             \
+            tmp = pack_call;                                        \
+        }                                                           \
         if (tmp < 0) {                                              \
             client->error = (enum MQTTErrors)tmp;                                    \
             if (release) MQTT_PAL_MUTEX_UNLOCK(&client->mutex);     \
@@ -230,6 +895,18 @@ void mqtt_reinit(struct mqtt_client* client,
     msg = mqtt_mq_register(&client->mq, (size_t)tmp);                       \
 
 
+/**
+ * Calls the client's wakeup callback once an API call queued a message, see mqtt_init_wakeup.
+ * The mutex must be held: the callback and its state are only set under the mutex, so they
+ * can't be replaced (and the state freed) while the callback runs.
+ */
+static void __mqtt_wakeup(struct mqtt_client *client)
+{
+    if (client->wakeup_callback != NULL) {
+        client->wakeup_callback(&client->wakeup_state);
+    }
+}
+
 enum MQTTErrors mqtt_connect(struct mqtt_client *client,
                      const char* client_id,
                      const char* will_topic,
@@ -264,6 +941,11 @@ enum MQTTErrors mqtt_connect(struct mqtt_client *client,
     /* save the control type of the message */
     msg->control_type = MQTT_CONTROL_CONNECT;
 
+    /* the CONNECT goes before the messages that mqtt_reinit kept */
+    if (client->send_partial == NULL) {
+        __mqtt_mq_move_back_to_front(&client->mq);
+    }
+
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
 }
@@ -278,8 +960,16 @@ enum MQTTErrors mqtt_publish(struct mqtt_client *client,
     ssize_t rv;
     uint16_t packet_id;
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
-    packet_id = __mqtt_next_pid(client);
 
+    /* QoS 0 messages are never acknowledged, so they don't need a packet ID */
+    packet_id = 0;
+    if (publish_flags & MQTT_PUBLISH_QOS_MASK) {
+        packet_id = __mqtt_next_pid(client);
+        if (packet_id == 0) {
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return MQTT_ERROR_PACKET_ID_EXHAUSTED;
+        }
+    }
 
     /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(
@@ -297,30 +987,513 @@ enum MQTTErrors mqtt_publish(struct mqtt_client *client,
     /* save the control type and packet id of the message */
     msg->control_type = MQTT_CONTROL_PUBLISH;
     msg->packet_id = packet_id;
+    __mqtt_pid_acquire(client, packet_id);
+    rv = __mqtt_journal_append(client, msg);
 
+    __mqtt_wakeup(client);
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-    return MQTT_OK;
+    return (enum MQTTErrors) rv;
 }
 
-ssize_t __mqtt_puback(struct mqtt_client *client, uint16_t packet_id) {
-    ssize_t rv;
+enum MQTTErrors mqtt_publish_ref(struct mqtt_client *client,
+                                 const char* topic_name,
+                                 const void* application_message,
+                                 size_t application_message_size,
+                                 uint8_t publish_flags,
+                                 void (*release_callback)(void *release_state, const void *application_message),
+                                 void *release_state)
+{
     struct mqtt_queued_message *msg;
+    ssize_t rv;
+    uint16_t packet_id;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
 
-    /* try to pack the message */
+    /* QoS 0 messages are never acknowledged, so they don't need a packet ID */
+    packet_id = 0;
+    if (publish_flags & MQTT_PUBLISH_QOS_MASK) {
+        packet_id = __mqtt_next_pid(client);
+        if (packet_id == 0) {
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return MQTT_ERROR_PACKET_ID_EXHAUSTED;
+        }
+    }
+
+    /* try to pack the header, the application message is sent from the caller's memory */
     MQTT_CLIENT_TRY_PACK(
         rv, msg, client, 
-        mqtt_pack_pubxxx_request(
+        mqtt_pack_publish_header(
             client->mq.curr, client->mq.curr_sz,
-            MQTT_CONTROL_PUBACK,
-            packet_id
-        ),
-        0
+            topic_name,
+            packet_id,
+            application_message_size,
+            publish_flags
+        ), 
+        1
     );
-    /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_PUBACK;
+    /* save the control type, packet id and application message of the message */
+    msg->control_type = MQTT_CONTROL_PUBLISH;
     msg->packet_id = packet_id;
-
-    return MQTT_OK;
+    __mqtt_pid_acquire(client, packet_id);
+    msg->application_message = application_message;
+    msg->application_message_size = application_message_size;
+    msg->release_callback = release_callback;
+    msg->release_state = release_state;
+    rv = __mqtt_journal_append(client, msg);
+
+    __mqtt_wakeup(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return (enum MQTTErrors) rv;
+}
+
+enum MQTTErrors mqtt_publish_stream(struct mqtt_client *client,
+                                    const char* topic_name,
+                                    size_t application_message_size,
+                                    uint8_t publish_flags,
+                                    ssize_t (*producer)(void *state, size_t offset, const void **data),
+                                    void (*release_callback)(void *release_state, const void *application_message),
+                                    void *state)
+{
+    struct mqtt_queued_message *msg;
+    ssize_t rv;
+    uint16_t packet_id;
+    if (producer == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+
+    /* QoS 0 messages are never acknowledged, so they don't need a packet ID */
+    packet_id = 0;
+    if (publish_flags & MQTT_PUBLISH_QOS_MASK) {
+        packet_id = __mqtt_next_pid(client);
+        if (packet_id == 0) {
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return MQTT_ERROR_PACKET_ID_EXHAUSTED;
+        }
+    }
+
+    /* try to pack the header, the application message is produced while it is sent */
+    MQTT_CLIENT_TRY_PACK(
+        rv, msg, client,
+        mqtt_pack_publish_header(
+            client->mq.curr, client->mq.curr_sz,
+            topic_name,
+            packet_id,
+            application_message_size,
+            publish_flags
+        ),
+        1
+    );
+    /* save the control type, packet id and producer of the message */
+    msg->control_type = MQTT_CONTROL_PUBLISH;
+    msg->packet_id = packet_id;
+    __mqtt_pid_acquire(client, packet_id);
+    msg->application_message_size = application_message_size;
+    msg->producer = producer;
+    msg->release_callback = release_callback;
+    msg->release_state = state;
+    rv = __mqtt_journal_append(client, msg);
+
+    __mqtt_wakeup(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return (enum MQTTErrors) rv;
+}
+
+enum MQTTErrors mqtt_publish_stream_resume(struct mqtt_client *client)
+{
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    client->producer_starved = 0;
+    __mqtt_wakeup(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+/**
+ * Copies a packet into \p buf, returns the size of the packet or 0 if it doesn't fit.
+ */
+static ssize_t __mqtt_pack_copy(uint8_t *buf, size_t bufsz, const void *packet, size_t packet_size)
+{
+    if (bufsz < packet_size) {
+        return 0;
+    }
+    memcpy(buf, packet, packet_size);
+    return (ssize_t) packet_size;
+}
+
+enum MQTTErrors mqtt_restore_message(struct mqtt_client *client, const void *packet, size_t packet_size)
+{
+    struct mqtt_response response;
+    struct mqtt_queued_message *msg;
+    enum MQTTControlPacketType control_type;
+    uint16_t packet_id;
+    ssize_t rv;
+
+    rv = mqtt_unpack_response(&response, (const uint8_t*) packet, packet_size);
+    if (rv < 0) {
+        return (enum MQTTErrors) rv;
+    } else if ((size_t) rv != packet_size) {
+        return MQTT_ERROR_MALFORMED_REQUEST;
+    }
+    control_type = response.fixed_header.control_type;
+    if (control_type == MQTT_CONTROL_PUBLISH && response.decoded.publish.qos_level != 0) {
+        packet_id = response.decoded.publish.packet_id;
+    } else if (control_type == MQTT_CONTROL_PUBREC) {
+        packet_id = response.decoded.pubrec.packet_id;
+    } else if (control_type == MQTT_CONTROL_PUBREL) {
+        packet_id = response.decoded.pubrel.packet_id;
+    } else {
+        return MQTT_ERROR_MALFORMED_REQUEST;
+    }
+
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (mqtt_mq_find(&client->mq, control_type, &packet_id) != NULL) {
+        /* still queued from before */
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_OK;
+    }
+
+    /* try to copy the packet */
+    MQTT_CLIENT_TRY_PACK(
+        rv, msg, client,
+        __mqtt_pack_copy(client->mq.curr, client->mq.curr_sz, packet, packet_size),
+        1
+    );
+    /* save the control type and packet id of the message */
+    msg->control_type = control_type;
+    msg->packet_id = packet_id;
+    if (control_type == MQTT_CONTROL_PUBLISH) {
+        /* it may have been sent before [Spec MQTT-3.3.1-1] */
+        msg->start[0] |= MQTT_PUBLISH_DUP;
+    }
+    if (control_type != MQTT_CONTROL_PUBREC) {
+        __mqtt_pid_acquire(client, packet_id);
+    }
+
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+/**
+ * The header of a record in the publish staging ring, followed by the PUBLISH packet. A record
+ * with a packet_size of 0 is skipped (padding at the end of the ring, or a packing error).
+ */
+struct __mqtt_stage_record {
+    /** The size of the record in bytes (a multiple of 16), 0 until the record is ready. */
+    uint32_t size;
+    uint32_t packet_size;
+    /** The offset of the packet ID in the packet, 0 for QoS 0. */
+    uint32_t packet_id_offset;
+    uint32_t reserved;
+};
+
+/**
+ * Returns the size of a PUBLISH packet.
+ */
+static size_t __mqtt_publish_packet_size(const char* topic_name, size_t application_message_size, uint8_t publish_flags)
+{
+    size_t remaining_length = __mqtt_packed_cstrlen(topic_name) + application_message_size;
+    if (publish_flags & MQTT_PUBLISH_QOS_MASK) {
+        remaining_length += 2;
+    }
+    if (remaining_length < 128u) {
+        return 2u + remaining_length;
+    } else if (remaining_length < 16384u) {
+        return 3u + remaining_length;
+    } else if (remaining_length < 2097152u) {
+        return 4u + remaining_length;
+    }
+    return 5u + remaining_length;
+}
+
+/**
+ * Returns \c MQTT_OK if \p desc can be packed into a PUBLISH, the error mqtt_publish would
+ * report for it otherwise.
+ */
+static enum MQTTErrors __mqtt_publish_desc_check(const struct mqtt_publish_desc *desc)
+{
+    if (desc->topic_name == NULL || (desc->application_message == NULL && desc->application_message_size != 0)) {
+        return MQTT_ERROR_NULLPTR;
+    }
+    if ((desc->publish_flags & MQTT_PUBLISH_QOS_MASK) == MQTT_PUBLISH_QOS_MASK) {
+        return MQTT_ERROR_PUBLISH_FORBIDDEN_QOS;
+    }
+    if (__mqtt_packed_cstrlen(desc->topic_name) + desc->application_message_size + 2u >= 256u*1024u*1024u) {
+        return MQTT_ERROR_INVALID_REMAINING_LENGTH;
+    }
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_publish_many(struct mqtt_client *client,
+                                  const struct mqtt_publish_desc *msgs,
+                                  size_t n,
+                                  size_t *accepted)
+{
+    enum MQTTErrors rv = MQTT_OK;
+    enum MQTTErrors invalid = MQTT_OK;
+    size_t total = 0;
+    size_t i;
+    int fits;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+
+    if (client->error < 0) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        if (accepted != NULL) {
+            *accepted = 0;
+        }
+        return client->error;
+    }
+
+    /* only the messages in front of an invalid one are published */
+    for(i = 0; i < n; ++i) {
+        invalid = __mqtt_publish_desc_check(&msgs[i]);
+        if (invalid != MQTT_OK) {
+            n = i;
+            break;
+        }
+        total += __mqtt_publish_packet_size(msgs[i].topic_name, msgs[i].application_message_size, msgs[i].publish_flags);
+    }
+
+    /* make room once, if the whole burst doesn't fit as is */
+    if (i > 0) {
+        /* curr_sz already leaves room for the first mqtt_queued_message */
+        total += (i - 1) * sizeof(struct mqtt_queued_message);
+    }
+    fits = total <= client->mq.curr_sz;
+    if (!fits) {
+        __mqtt_mq_make_room(client, total);
+        fits = total <= client->mq.curr_sz;
+    }
+    while (!fits && __mqtt_mq_grow(client, total)) {
+        fits = total <= client->mq.curr_sz;
+    }
+
+    /* pack the messages back to back, until one doesn't fit (if they don't all fit) */
+    for(i = 0; i < n; ++i) {
+        const struct mqtt_publish_desc *desc = &msgs[i];
+        struct mqtt_queued_message *msg;
+        uint16_t packet_id = 0;
+        ssize_t tmp;
+
+        if (!fits
+            && __mqtt_publish_packet_size(desc->topic_name, desc->application_message_size, desc->publish_flags) > client->mq.curr_sz)
+        {
+            rv = MQTT_ERROR_SEND_BUFFER_IS_FULL;
+            break;
+        }
+        if (desc->publish_flags & MQTT_PUBLISH_QOS_MASK) {
+            packet_id = __mqtt_next_pid(client);
+            if (packet_id == 0) {
+                rv = MQTT_ERROR_PACKET_ID_EXHAUSTED;
+                break;
+            }
+        }
+
+        tmp = mqtt_pack_publish_request(client->mq.curr, client->mq.curr_sz,
+                                        desc->topic_name, packet_id,
+                                        desc->application_message, desc->application_message_size,
+                                        desc->publish_flags);
+        if (tmp < 0) {
+            rv = (enum MQTTErrors) tmp;
+            break;
+        } else if (tmp == 0) {
+            rv = MQTT_ERROR_SEND_BUFFER_IS_FULL;
+            break;
+        }
+        msg = mqtt_mq_register(&client->mq, (size_t) tmp);
+        msg->control_type = MQTT_CONTROL_PUBLISH;
+        msg->packet_id = packet_id;
+        __mqtt_pid_acquire(client, packet_id);
+        rv = __mqtt_journal_append(client, msg);
+        if (rv != MQTT_OK) {
+            break;
+        }
+    }
+
+    if (rv == MQTT_OK) {
+        rv = invalid;
+    }
+    if (accepted != NULL) {
+        *accepted = i;
+    }
+    if (i > 0) {
+        __mqtt_wakeup(client);
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return rv;
+}
+
+enum MQTTErrors mqtt_publish_staged(struct mqtt_client *client,
+                                    const char* topic_name,
+                                    const void* application_message,
+                                    size_t application_message_size,
+                                    uint8_t publish_flags)
+{
+#if defined(MQTT_PAL_HAVE_ATOMICS)
+    struct mqtt_publish_stage *stage = &client->publish_stage;
+    struct __mqtt_stage_record *record;
+    size_t packet_size, record_size, capacity, pos, offset, padding;
+    ssize_t rv;
+
+    if (stage->mem == NULL) {
+        return mqtt_publish(client, topic_name, application_message, application_message_size, publish_flags);
+    }
+    if (topic_name == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+
+    /* a record that takes at most half of the ring always fits once the ring is drained */
+    packet_size = __mqtt_publish_packet_size(topic_name, application_message_size, publish_flags);
+    capacity = stage->mask + 1;
+    if (packet_size > capacity / 2) {
+        return MQTT_ERROR_SEND_BUFFER_IS_FULL;
+    }
+    record_size = (sizeof(struct __mqtt_stage_record) + packet_size + 15u) & ~(size_t) 15u;
+    if (record_size > capacity / 2) {
+        return MQTT_ERROR_SEND_BUFFER_IS_FULL;
+    }
+
+    /* reserve the record (and the padding up to the end of the ring if it doesn't fit there) */
+    pos = MQTT_PAL_ATOMIC_LOAD(&stage->reserved);
+    do {
+        offset = pos & stage->mask;
+        padding = offset + record_size > capacity ? capacity - offset : 0;
+        if (pos + padding + record_size - MQTT_PAL_ATOMIC_LOAD(&stage->drained) > capacity) {
+            return MQTT_ERROR_SEND_BUFFER_IS_FULL;
+        }
+    } while (!MQTT_PAL_ATOMIC_CAS(&stage->reserved, &pos, pos + padding + record_size));
+
+    if (padding != 0) {
+        record = (struct __mqtt_stage_record*) (stage->mem + offset);
+        record->packet_size = 0;
+        MQTT_PAL_ATOMIC_STORE(&record->size, (uint32_t) padding);
+        offset = 0;
+    }
+
+    /* pack the packet with packet ID 0, the real one is written when it is queued */
+    record = (struct __mqtt_stage_record*) (stage->mem + offset);
+    rv = mqtt_pack_publish_request((uint8_t*) (record + 1), packet_size,
+                                   topic_name, 0,
+                                   application_message, application_message_size,
+                                   publish_flags);
+    record->packet_size = rv > 0 ? (uint32_t) rv : 0;
+    record->packet_id_offset = 0;
+    if (rv > 0 && (publish_flags & MQTT_PUBLISH_QOS_MASK)) {
+        record->packet_id_offset = (uint32_t) ((size_t) rv - application_message_size - 2u);
+    }
+    MQTT_PAL_ATOMIC_STORE(&record->size, (uint32_t) record_size);
+    if (rv <= 0) {
+        return rv < 0 ? (enum MQTTErrors) rv : MQTT_ERROR_SEND_BUFFER_IS_FULL;
+    }
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    __mqtt_wakeup(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+#else
+    return mqtt_publish(client, topic_name, application_message, application_message_size, publish_flags);
+#endif
+}
+
+/**
+ * Returns non-zero if there are staged messages that haven't been queued yet.
+ */
+static int __mqtt_publish_stage_pending(struct mqtt_client *client)
+{
+#if defined(MQTT_PAL_HAVE_ATOMICS)
+    struct mqtt_publish_stage *stage = &client->publish_stage;
+    return stage->mem != NULL && MQTT_PAL_ATOMIC_LOAD(&stage->reserved) != stage->drained;
+#else
+    (void) client;
+    return 0;
+#endif
+}
+
+/**
+ * Moves the ready records of the publish staging ring into the message queue, until the first
+ * record that isn't ready or doesn't fit. The client's mutex must be held.
+ */
+static void __mqtt_publish_stage_drain(struct mqtt_client *client)
+{
+#if defined(MQTT_PAL_HAVE_ATOMICS)
+    struct mqtt_publish_stage *stage = &client->publish_stage;
+    size_t pos = stage->drained;
+    enum MQTTErrors rv;
+    if (stage->mem == NULL) {
+        return;
+    }
+
+    while (pos != MQTT_PAL_ATOMIC_LOAD(&stage->reserved)) {
+        struct __mqtt_stage_record *record = (struct __mqtt_stage_record*) (stage->mem + (pos & stage->mask));
+        uint32_t record_size = MQTT_PAL_ATOMIC_LOAD(&record->size);
+        if (record_size == 0) {
+            /* still being packed, the records after it have to wait to keep the order */
+            break;
+        }
+
+        if (record->packet_size != 0) {
+            struct mqtt_queued_message *msg;
+            uint16_t packet_id = 0;
+            if (client->mq.curr_sz < record->packet_size) {
+                __mqtt_mq_make_room(client, record->packet_size);
+            }
+            while (client->mq.curr_sz < record->packet_size && __mqtt_mq_grow(client, record->packet_size));
+            if (client->mq.curr_sz < record->packet_size && mqtt_mq_length(&client->mq) == 0) {
+                /* it will never fit, drop it like mqtt_publish would */
+                client->error = MQTT_ERROR_SEND_BUFFER_IS_FULL;
+            } else if (client->mq.curr_sz < record->packet_size) {
+                break;
+            } else {
+                if (record->packet_id_offset != 0) {
+                    packet_id = __mqtt_next_pid(client);
+                    if (packet_id == 0) {
+                        break;
+                    }
+                }
+
+                memcpy(client->mq.curr, record + 1, record->packet_size);
+                if (packet_id != 0) {
+                    client->mq.curr[record->packet_id_offset] = (uint8_t) (packet_id >> 8);
+                    client->mq.curr[record->packet_id_offset + 1] = (uint8_t) (packet_id & 0xFF);
+                }
+                msg = mqtt_mq_register(&client->mq, record->packet_size);
+                msg->control_type = MQTT_CONTROL_PUBLISH;
+                msg->packet_id = packet_id;
+                __mqtt_pid_acquire(client, packet_id);
+                rv = __mqtt_journal_append(client, msg);
+                if (rv != MQTT_OK) {
+                    /* nobody is left to report the error to but the client */
+                    client->error = rv;
+                }
+            }
+        }
+
+        /* a record may start anywhere in here next time, it must not look ready */
+        memset(record, 0, record_size);
+        pos += record_size;
+        MQTT_PAL_ATOMIC_STORE(&stage->drained, pos);
+    }
+#else
+    (void) client;
+#endif
+}
+
+ssize_t __mqtt_puback(struct mqtt_client *client, uint16_t packet_id) {
+    ssize_t rv;
+    struct mqtt_queued_message *msg;
+
+    /* try to pack the message */
+    MQTT_CLIENT_TRY_PACK(
+        rv, msg, client, 
+        mqtt_pack_pubxxx_request(
+            client->mq.curr, client->mq.curr_sz,
+            MQTT_CONTROL_PUBACK,
+            packet_id
+        ),
+        0
+    );
+    /* save the control type and packet id of the message */
+    msg->control_type = MQTT_CONTROL_PUBACK;
+    msg->packet_id = packet_id;
+
+    return MQTT_OK;
 }
 
 ssize_t __mqtt_pubrec(struct mqtt_client *client, uint16_t packet_id) {
@@ -341,7 +1514,7 @@ ssize_t __mqtt_pubrec(struct mqtt_client *client, uint16_t packet_id) {
     msg->control_type = MQTT_CONTROL_PUBREC;
     msg->packet_id = packet_id;
 
-    return MQTT_OK;
+    return __mqtt_journal_append(client, msg);
 }
 
 ssize_t __mqtt_pubrel(struct mqtt_client *client, uint16_t packet_id) {
@@ -362,7 +1535,7 @@ ssize_t __mqtt_pubrel(struct mqtt_client *client, uint16_t packet_id) {
     msg->control_type = MQTT_CONTROL_PUBREL;
     msg->packet_id = packet_id;
 
-    return MQTT_OK;
+    return __mqtt_journal_append(client, msg);
 }
 
 ssize_t __mqtt_pubcomp(struct mqtt_client *client, uint16_t packet_id) {
@@ -395,6 +1568,10 @@ enum MQTTErrors mqtt_subscribe(struct mqtt_client *client,
     struct mqtt_queued_message *msg;
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
     packet_id = __mqtt_next_pid(client);
+    if (packet_id == 0) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_PACKET_ID_EXHAUSTED;
+    }
 
     /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(
@@ -411,7 +1588,9 @@ enum MQTTErrors mqtt_subscribe(struct mqtt_client *client,
     /* save the control type and packet id of the message */
     msg->control_type = MQTT_CONTROL_SUBSCRIBE;
     msg->packet_id = packet_id;
+    __mqtt_pid_acquire(client, packet_id);
 
+    __mqtt_wakeup(client);
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
 }
@@ -419,10 +1598,15 @@ enum MQTTErrors mqtt_subscribe(struct mqtt_client *client,
 enum MQTTErrors mqtt_unsubscribe(struct mqtt_client *client,
                          const char* topic_name)
 {
-    uint16_t packet_id = __mqtt_next_pid(client);
+    uint16_t packet_id;
     ssize_t rv;
     struct mqtt_queued_message *msg;
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    packet_id = __mqtt_next_pid(client);
+    if (packet_id == 0) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_PACKET_ID_EXHAUSTED;
+    }
 
     /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(
@@ -438,7 +1622,9 @@ enum MQTTErrors mqtt_unsubscribe(struct mqtt_client *client,
     /* save the control type and packet id of the message */
     msg->control_type = MQTT_CONTROL_UNSUBSCRIBE;
     msg->packet_id = packet_id;
+    __mqtt_pid_acquire(client, packet_id);
 
+    __mqtt_wakeup(client);
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
 }
@@ -447,6 +1633,9 @@ enum MQTTErrors mqtt_ping(struct mqtt_client *client) {
     enum MQTTErrors rv;
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
     rv = __mqtt_ping(client);
+    if (rv == MQTT_OK) {
+        __mqtt_wakeup(client);
+    }
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return rv;
 }
@@ -478,6 +1667,7 @@ enum MQTTErrors mqtt_reconnect(struct mqtt_client *client)
     if (err == MQTT_OK) {
         MQTT_PAL_MUTEX_LOCK(&client->mutex);
         client->error = MQTT_ERROR_RECONNECTING;
+        __mqtt_wakeup(client);
         MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     }
     return err;
@@ -500,52 +1690,192 @@ enum MQTTErrors mqtt_disconnect(struct mqtt_client *client)
     /* save the control type and packet id of the message */
     msg->control_type = MQTT_CONTROL_DISCONNECT;
 
+    __mqtt_wakeup(client);
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
 }
 
-ssize_t __mqtt_send(struct mqtt_client *client) 
+/**
+ * Returns the number of bytes that go on the wire for a queued message.
+ */
+static size_t __mqtt_queued_message_total_size(const struct mqtt_queued_message *msg)
+{
+    return msg->size + msg->application_message_size;
+}
+
+/**
+ * Appends a buffer to an iovec array, extending the last entry if the buffer
+ * directly follows it in memory. Returns the new number of entries.
+ */
+static int __mqtt_iov_append(mqtt_pal_iovec *iov, int num_iov, const uint8_t *base, size_t len)
+{
+    if (num_iov > 0 && (const uint8_t*) iov[num_iov - 1].iov_base + iov[num_iov - 1].iov_len == base) {
+        iov[num_iov - 1].iov_len += len;
+        return num_iov;
+    }
+    iov[num_iov].iov_base = (void*) base;
+    iov[num_iov].iov_len = len;
+    return num_iov + 1;
+}
+
+/**
+ * Puts a message that was just sent completely into its next state.
+ */
+static ssize_t __mqtt_update_sent_state(struct mqtt_queued_message *msg)
 {
     uint8_t inspected;
-    ssize_t len;
-    int inflight_qos2 = 0;
-    int i = 0;
-    
+
+    /* 
+    Determine the state to put the message in.
+    Control Types:
+    MQTT_CONTROL_CONNECT     -> awaiting
+    MQTT_CONTROL_CONNACK     -> n/a
+    MQTT_CONTROL_PUBLISH     -> qos == 0 ? complete : awaiting
+    MQTT_CONTROL_PUBACK      -> complete
+    MQTT_CONTROL_PUBREC      -> awaiting
+    MQTT_CONTROL_PUBREL      -> awaiting
+    MQTT_CONTROL_PUBCOMP     -> complete
+    MQTT_CONTROL_SUBSCRIBE   -> awaiting
+    MQTT_CONTROL_SUBACK      -> n/a
+    MQTT_CONTROL_UNSUBSCRIBE -> awaiting
+    MQTT_CONTROL_UNSUBACK    -> n/a
+    MQTT_CONTROL_PINGREQ     -> awaiting
+    MQTT_CONTROL_PINGRESP    -> n/a
+    MQTT_CONTROL_DISCONNECT  -> complete
+    */
+    switch (msg->control_type) {
+    case MQTT_CONTROL_PUBACK:
+    case MQTT_CONTROL_PUBCOMP:
+    case MQTT_CONTROL_DISCONNECT:
+        msg->state = MQTT_QUEUED_COMPLETE;
+        break;
+    case MQTT_CONTROL_PUBLISH:
+        inspected = ( MQTT_PUBLISH_QOS_MASK & (msg->start[0]) ) >> 1; /* qos */
+        if (inspected == 0) {
+            msg->state = MQTT_QUEUED_COMPLETE;
+            __mqtt_release_application_message(msg);
+        } else if (inspected == 1) {
+            msg->state = MQTT_QUEUED_AWAITING_ACK;
+            /*set DUP flag for subsequent sends [Spec MQTT-3.3.1-1] */ 
+            msg->start[0] |= MQTT_PUBLISH_DUP;
+        } else {
+            msg->state = MQTT_QUEUED_AWAITING_ACK;
+        }
+        break;
+    case MQTT_CONTROL_CONNECT:
+    case MQTT_CONTROL_PUBREC:
+    case MQTT_CONTROL_PUBREL:
+    case MQTT_CONTROL_SUBSCRIBE:
+    case MQTT_CONTROL_UNSUBSCRIBE:
+    case MQTT_CONTROL_PINGREQ:
+        msg->state = MQTT_QUEUED_AWAITING_ACK;
+        break;
+    default:
+        return MQTT_ERROR_MALFORMED_REQUEST;
+    }
+    return MQTT_OK;
+}
+
+ssize_t __mqtt_send(struct mqtt_client *client) 
+{
+    return __mqtt_send_at(client, MQTT_PAL_TIME_MS());
+}
+
+/**
+ * Handles egress client traffic (see __mqtt_send), with \p now being the current time.
+ */
+static ssize_t __mqtt_send_at(struct mqtt_client *client, mqtt_pal_time_ms_t now)
+{
+    struct mqtt_send_batch batch;
+    ssize_t rv = __mqtt_send_begin(client, &batch, now);
+
+    /* loop through all messages in the queue, flushing them in batches */
+    while(rv > 0 && (rv = __mqtt_send_gather(client, &batch)) > 0) {
+        /* we're sending the messages */
+        ssize_t tmp = mqtt_pal_sendv(client->socketfd, batch.iov, batch.num_iov, 0);
+        rv = __mqtt_send_sent(client, &batch, tmp);
+    }
+    return __mqtt_send_end(client, &batch, rv);
+}
+
+ssize_t __mqtt_send_begin(struct mqtt_client *client, struct mqtt_send_batch *batch, mqtt_pal_time_ms_t now)
+{
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
+
+    memset(batch->inflight, 0, sizeof(batch->inflight));
+    memset(batch->stalled, 0, sizeof(batch->stalled));
+    batch->now = now;
+    batch->next = 0;
+    batch->length = 0;
     
     if (client->error < 0 && client->error != MQTT_ERROR_SEND_BUFFER_IS_FULL) {
-        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
         return client->error;
     }
 
-    /* loop through all messages in the queue */
-    len = mqtt_mq_length(&client->mq);
-    for(; i < len; ++i) {
+    /* queue the messages that were staged by mqtt_publish_staged */
+    __mqtt_publish_stage_drain(client);
+
+    /* make the journaled messages durable before they go on the wire */
+    if (client->journal != NULL && client->journal->flush != NULL) {
+        enum MQTTErrors rv = client->journal->flush(client->journal->state);
+        if (rv != MQTT_OK) {
+            client->error = rv;
+            return rv;
+        }
+    }
+
+    batch->length = mqtt_mq_length(&client->mq);
+    if (client->send_partial != NULL) {
+        /* forget a partially sent message that was removed from the queue */
+        ssize_t k;
+        for(k = 0; k < batch->length && mqtt_mq_get(&client->mq, k) != client->send_partial; ++k);
+        if (k == batch->length) {
+            client->send_partial = NULL;
+            client->send_offset = 0;
+        }
+    }
+    return MQTT_OK;
+}
+
+ssize_t __mqtt_send_gather(struct mqtt_client *client, struct mqtt_send_batch *batch)
+{
+    mqtt_pal_time_ms_t now = batch->now;
+    mqtt_pal_iovec *iov = batch->iov;
+    int num_iov = 0;
+    int num_msgs = 0;
+    int partial_pending = client->send_partial != NULL;
+    ssize_t i;
+
+    batch->first_offset = 0;
+    batch->size = 0;
+    batch->produced = -1;
+
+    /* gather the messages that need to be sent (contiguous packets share an iovec, so both limits apply) */
+    for(i = batch->next; i < batch->length && num_iov + 2 <= MQTT_PAL_IOV_MAX && num_msgs < MQTT_PAL_IOV_MAX; ++i) {
         struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
+        size_t offset = 0;
+        size_t gathered = 0;
+        ssize_t produced = -1;
         int resend = 0;
-        if (msg->state == MQTT_QUEUED_UNSENT) {
+        if (partial_pending) {
+            /* the rest of a partially sent message goes on the wire before any other message */
+            resend = msg == client->send_partial;
+            partial_pending = !resend;
+        } else if (msg->state == MQTT_QUEUED_UNSENT) {
             /* message has not been sent to lets send it */
             resend = 1;
         } else if (msg->state == MQTT_QUEUED_AWAITING_ACK) {
             /* check for timeout */
-            if (MQTT_PAL_TIME() > msg->time_sent + client->response_timeout) {
+            if (now >= msg->time_sent + client->response_timeout_ms) {
                 resend = 1;
                 client->number_of_timeouts += 1;
-                client->send_offset = 0;
             }
         }
 
-        /* only send QoS 2 message if there are no inflight QoS 2 PUBLISH messages */
-        if (msg->control_type == MQTT_CONTROL_PUBLISH
-            && (msg->state == MQTT_QUEUED_UNSENT || msg->state == MQTT_QUEUED_AWAITING_ACK)) 
-        {
-            inspected = 0x03 & ((msg->start[0]) >> 1); /* qos */
-            if (inspected == 2) {
-                if (inflight_qos2) {
-                    resend = 0;
-                }
-                inflight_qos2 = 1;
-            }
+        /* only send QoS 1/2 PUBLISH messages while their in-flight window is open */
+        if (__mqtt_inflight_window_full(client, msg, batch->inflight) && msg != client->send_partial) {
+            batch->stalled[0x03 & ((msg->start[0]) >> 1)] = 1;
+            resend = 0;
         }
 
         /* goto next message if we don't need to send */
@@ -553,139 +1883,523 @@ ssize_t __mqtt_send(struct mqtt_client *client)
             continue;
         }
 
-        /* we're sending the message */
-        {
-          ssize_t tmp = mqtt_pal_sendall(client->socketfd, msg->start + client->send_offset, msg->size - client->send_offset, 0);
-          if (tmp < 0) {
-            client->error = (enum MQTTErrors)tmp;
-            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-            return tmp;
-          } else {
-            client->send_offset += (unsigned long)tmp;
-            if(client->send_offset < msg->size) {
-              /* partial sent. Await additional calls */
-              break;
-            } else {
-              /* whole message has been sent */
-              client->send_offset = 0;
+        /* only the first message of a batch can have been partially sent */
+        if (msg == client->send_partial) {
+            batch->first_offset = client->send_offset;
+            offset = batch->first_offset;
+        }
+
+        /* the queued bytes followed by the referenced application message (if any) */
+        if (offset < msg->size) {
+            num_iov = __mqtt_iov_append(iov, num_iov, msg->start + offset, msg->size - offset);
+            gathered = msg->size - offset;
+            offset = 0;
+        } else {
+            offset -= msg->size;
+        }
+        if (msg->producer != NULL && offset < msg->application_message_size) {
+            /* as much of the application message as the producer has ready */
+            const void *data = NULL;
+            produced = msg->producer(msg->release_state, offset, &data);
+            if (produced < 0) {
+                client->error = (enum MQTTErrors)produced;
+                return produced;
+            }
+            if ((size_t) produced > msg->application_message_size - offset) {
+                produced = (ssize_t) (msg->application_message_size - offset);
             }
+            if (produced > 0) {
+                num_iov = __mqtt_iov_append(iov, num_iov, (const uint8_t*) data, (size_t) produced);
+            }
+            gathered += (size_t) produced;
+        } else if (offset < msg->application_message_size) {
+            num_iov = __mqtt_iov_append(iov, num_iov, 
+                                        (const uint8_t*) msg->application_message + offset, 
+                                        msg->application_message_size - offset);
+            gathered += msg->application_message_size - offset;
+        }
+        batch->msgs[num_msgs++] = msg;
+        batch->size += gathered;
 
-          }
+        /* nothing can follow an application message that isn't produced completely */
+        if (msg->producer != NULL && offset + (size_t) (produced > 0 ? produced : 0) < msg->application_message_size) {
+            batch->produced = produced;
+            break;
+        }
+    }
 
+    batch->next = i;
+    batch->num_iov = num_iov;
+    batch->num_msgs = num_msgs;
+    return num_msgs;
+}
+
+ssize_t __mqtt_send_sent(struct mqtt_client *client, struct mqtt_send_batch *batch, ssize_t sent)
+{
+    size_t remaining;
+    int k;
+
+    if (sent < 0) {
+        client->error = (enum MQTTErrors)sent;
+        return sent;
+    }
+
+    /* update the messages that were sent completely */
+    remaining = (size_t) sent;
+    for(k = 0; k < batch->num_msgs; ++k) {
+        struct mqtt_queued_message *msg = batch->msgs[k];
+        size_t offset = (k == 0) ? batch->first_offset : 0;
+        size_t size = __mqtt_queued_message_total_size(msg);
+        ssize_t rv;
+        if (remaining < size - offset) {
+            /* partial sent. Await additional calls */
+            client->send_offset = offset + remaining;
+            client->send_partial = msg;
+            break;
         }
+        remaining -= size - offset;
+
+        /* whole message has been sent */
+        client->send_offset = 0;
+        client->send_partial = NULL;
 
         /* update timeout watcher */
-        client->time_of_last_send = MQTT_PAL_TIME();
-        msg->time_sent = client->time_of_last_send;
-
-        /* 
-        Determine the state to put the message in.
-        Control Types:
-        MQTT_CONTROL_CONNECT     -> awaiting
-        MQTT_CONTROL_CONNACK     -> n/a
-        MQTT_CONTROL_PUBLISH     -> qos == 0 ? complete : awaiting
-        MQTT_CONTROL_PUBACK      -> complete
-        MQTT_CONTROL_PUBREC      -> awaiting
-        MQTT_CONTROL_PUBREL      -> awaiting
-        MQTT_CONTROL_PUBCOMP     -> complete
-        MQTT_CONTROL_SUBSCRIBE   -> awaiting
-        MQTT_CONTROL_SUBACK      -> n/a
-        MQTT_CONTROL_UNSUBSCRIBE -> awaiting
-        MQTT_CONTROL_UNSUBACK    -> n/a
-        MQTT_CONTROL_PINGREQ     -> awaiting
-        MQTT_CONTROL_PINGRESP    -> n/a
-        MQTT_CONTROL_DISCONNECT  -> complete
-        */
-        switch (msg->control_type) {
-        case MQTT_CONTROL_PUBACK:
-        case MQTT_CONTROL_PUBCOMP:
-        case MQTT_CONTROL_DISCONNECT:
-            msg->state = MQTT_QUEUED_COMPLETE;
-            break;
-        case MQTT_CONTROL_PUBLISH:
-            inspected = ( MQTT_PUBLISH_QOS_MASK & (msg->start[0]) ) >> 1; /* qos */
-            if (inspected == 0) {
-                msg->state = MQTT_QUEUED_COMPLETE;
-            } else if (inspected == 1) {
-                msg->state = MQTT_QUEUED_AWAITING_ACK;
-                /*set DUP flag for subsequent sends [Spec MQTT-3.3.1-1] */ 
-                msg->start[0] |= MQTT_PUBLISH_DUP;
-            } else {
-                msg->state = MQTT_QUEUED_AWAITING_ACK;
-            }
-            break;
-        case MQTT_CONTROL_CONNECT:
-        case MQTT_CONTROL_PUBREC:
-        case MQTT_CONTROL_PUBREL:
-        case MQTT_CONTROL_SUBSCRIBE:
-        case MQTT_CONTROL_UNSUBSCRIBE:
-        case MQTT_CONTROL_PINGREQ:
-            msg->state = MQTT_QUEUED_AWAITING_ACK;
-            break;
-        default:
-            client->error = MQTT_ERROR_MALFORMED_REQUEST;
+        client->time_of_last_send = batch->now;
+        msg->time_sent = batch->now;
+
+        rv = __mqtt_update_sent_state(msg);
+        if (rv != MQTT_OK) {
+            client->error = (enum MQTTErrors)rv;
+            return rv;
+        }
+    }
+
+    client->producer_starved = 0;
+    if ((size_t) sent < batch->size) {
+        /* the socket is full */
+        return 0;
+    }
+    if (batch->produced == 0) {
+        /* the producer has nothing ready, continue once it resumes */
+        client->producer_starved = 1;
+        return 0;
+    }
+    return batch->next < batch->length;
+}
+
+ssize_t __mqtt_send_end(struct mqtt_client *client, struct mqtt_send_batch *batch, ssize_t rv)
+{
+    mqtt_pal_time_ms_t now = batch->now;
+
+    if (rv < 0) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return rv;
+    }
+
+    client->number_of_qos1_window_stalls += batch->stalled[1];
+    client->number_of_qos2_window_stalls += batch->stalled[2];
+
+    /* move back into the client's own send buffer once the grown one is idle */
+    __mqtt_mq_shrink(client);
+
+    /* check for keep-alive */
+    if (client->keep_alive != 0) {
+        mqtt_pal_time_ms_t keep_alive_timeout = client->time_of_last_send + 1000u * (mqtt_pal_time_ms_t) client->keep_alive;
+        if (now >= keep_alive_timeout) {
+          rv = __mqtt_ping(client);
+          if (rv != MQTT_OK) {
+            client->error = (enum MQTTErrors)rv;
             MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-            return MQTT_ERROR_MALFORMED_REQUEST;
+            return rv;
+          }
         }
     }
 
-    /* check for keep-alive */
-    {
-        mqtt_pal_time_t keep_alive_timeout = client->time_of_last_send + (mqtt_pal_time_t)((float)(client->keep_alive));
-        if (MQTT_PAL_TIME() > keep_alive_timeout) {
-          ssize_t rv = __mqtt_ping(client);
-          if (rv != MQTT_OK) {
-            client->error = (enum MQTTErrors)rv;
-            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-            return rv;
-          }
-        }
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+void mqtt_init_recv_stream(struct mqtt_client *client,
+                              void (*begin)(void** state, struct mqtt_response_publish *publish),
+                              void (*chunk)(void** state, const void *data, size_t size),
+                              void (*end)(void** state, enum MQTTErrors result),
+                              void *state)
+{
+    client->recv_stream.begin = begin;
+    client->recv_stream.chunk = chunk;
+    client->recv_stream.end = end;
+    client->recv_stream.state = state;
+    client->recv_stream.remaining = 0;
+    client->recv_stream.packet_id = 0;
+    client->recv_stream.qos_level = 0;
+    client->recv_stream.discard = 0;
+}
+
+/**
+ * Starts streaming the PUBLISH at the start of the (full) receive buffer, if its headers fit.
+ * Returns 1 if the stream was started, 0 if the packet can't be streamed or an error.
+ */
+static ssize_t __mqtt_recv_stream_begin(struct mqtt_client *client)
+{
+    struct mqtt_recv_stream *stream = &client->recv_stream;
+    struct mqtt_response response;
+    struct mqtt_response_publish *publish = &response.decoded.publish;
+    const uint8_t *buf = client->recv_buffer.parse_curr;
+    size_t size = (size_t) (client->recv_buffer.curr - buf);
+    size_t headers;
+    ssize_t rv;
+
+    rv = __mqtt_unpack_fixed_header(&response, buf, size);
+    if (rv <= 0 || response.fixed_header.control_type != MQTT_CONTROL_PUBLISH) {
+        return rv;
+    }
+
+    /* the variable header has to be in the buffer */
+    publish->qos_level = (response.fixed_header.control_flags & MQTT_PUBLISH_QOS_MASK) >> 1;
+    if ((size_t) rv + 2 > size) {
+        return 0;
+    }
+    publish->topic_name_size = __mqtt_unpack_uint16(buf + rv);
+    headers = 2u + publish->topic_name_size + (publish->qos_level > 0 ? 2u : 0u);
+    if ((size_t) rv + headers > size) {
+        return 0;
+    }
+    if (response.fixed_header.remaining_length < headers) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+
+    publish->dup_flag = (response.fixed_header.control_flags & MQTT_PUBLISH_DUP) >> 3;
+    publish->retain_flag = response.fixed_header.control_flags & MQTT_PUBLISH_RETAIN;
+    publish->topic_name = buf + rv + 2;
+    publish->packet_id = publish->qos_level > 0 ? __mqtt_unpack_uint16(buf + rv + 2 + publish->topic_name_size) : 0;
+    publish->application_message = NULL;
+    publish->application_message_size = response.fixed_header.remaining_length - headers;
+
+    stream->remaining = publish->application_message_size;
+    stream->packet_id = publish->packet_id;
+    stream->qos_level = publish->qos_level;
+    /* skip the payload of a duplicate */
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    stream->discard = publish->qos_level == 2
+        && mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREC, &publish->packet_id) != NULL;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    if (!stream->discard) {
+        stream->begin(&stream->state, publish);
+    }
+
+    /* the payload follows the headers */
+    client->recv_buffer.parse_curr += (size_t) rv + headers;
+    return 1;
+}
+
+/**
+ * Passes the received payload bytes of the streamed PUBLISH on, and acknowledges it once all
+ * of them were received.
+ */
+static ssize_t __mqtt_recv_stream_chunk(struct mqtt_client *client)
+{
+    struct mqtt_recv_stream *stream = &client->recv_stream;
+    ssize_t rv;
+    size_t n = (size_t) (client->recv_buffer.curr - client->recv_buffer.parse_curr);
+    if (n > stream->remaining) {
+        n = stream->remaining;
+    }
+    if (n > 0 && !stream->discard) {
+        stream->chunk(&stream->state, client->recv_buffer.parse_curr, n);
+    }
+    client->recv_buffer.parse_curr += n;
+    stream->remaining -= n;
+    if (stream->remaining > 0) {
+        return MQTT_OK;
+    }
+
+    if (stream->discard) {
+        return MQTT_OK;
+    }
+    stream->end(&stream->state, MQTT_OK);
+    if (stream->qos_level == 0) {
+        return MQTT_OK;
+    }
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (stream->qos_level == 1) {
+        rv = __mqtt_puback(client, stream->packet_id);
+    } else {
+        rv = __mqtt_pubrec(client, stream->packet_id);
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return rv;
+}
+
+/**
+ * Moves the bytes of the (full) receive buffer into an allocated buffer of at least twice its
+ * size that fits the packet at its start, but not beyond the client's limit. Returns 1 if the
+ * buffer was grown.
+ */
+static int __mqtt_recv_buffer_grow(struct mqtt_client *client)
+{
+    struct mqtt_elastic_buffers *buffers = &client->buffers;
+    struct mqtt_response response;
+    size_t size = client->recv_buffer.mem_size;
+    size_t used = (size_t) (client->recv_buffer.curr - client->recv_buffer.mem_start);
+    size_t new_size = 2 * size;
+    ssize_t rv;
+    uint8_t *mem;
+
+    if (buffers->allocator == NULL || size == 0 || size >= buffers->max_recvbuf_size) {
+        return 0;
+    }
+
+    /* make room for the whole packet at once, if it can fit at all */
+    rv = __mqtt_unpack_fixed_header(&response, client->recv_buffer.mem_start, used);
+    if (rv > 0) {
+        size_t packet_size = (size_t) rv + response.fixed_header.remaining_length;
+        if (packet_size > buffers->max_recvbuf_size) {
+            return 0;
+        }
+        if (new_size < packet_size) {
+            new_size = packet_size;
+        }
+    }
+    if (new_size > buffers->max_recvbuf_size) {
+        new_size = buffers->max_recvbuf_size;
+    }
+    /* the allocator hooks are called with the mutex held, like on the sending side */
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    mem = (uint8_t*) buffers->allocator->allocate(buffers->allocator->context, new_size);
+    if (mem == NULL) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return 0;
+    }
+
+    memcpy(mem, client->recv_buffer.mem_start, used);
+    if (buffers->grown_recvbuf != NULL) {
+        buffers->allocator->deallocate(buffers->allocator->context, buffers->grown_recvbuf, size);
+    }
+    buffers->grown_recvbuf = mem;
+    buffers->number_of_grows += 1;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    client->recv_buffer.mem_start = mem;
+    client->recv_buffer.mem_size = new_size;
+    client->recv_buffer.parse_curr = mem;
+    client->recv_buffer.curr = mem + used;
+    client->recv_buffer.curr_sz = new_size - used;
+    return 1;
+}
+
+/**
+ * Moves back into the client's own receive buffer once the grown one is empty.
+ */
+static void __mqtt_recv_buffer_shrink(struct mqtt_client *client)
+{
+    struct mqtt_elastic_buffers *buffers = &client->buffers;
+    if (buffers->grown_recvbuf == NULL || client->recv_buffer.parse_curr != client->recv_buffer.curr) {
+        return;
+    }
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    buffers->allocator->deallocate(buffers->allocator->context, buffers->grown_recvbuf, client->recv_buffer.mem_size);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    buffers->grown_recvbuf = NULL;
+    client->recv_buffer.mem_start = buffers->recvbuf;
+    client->recv_buffer.mem_size = buffers->recvbuf_size;
+    client->recv_buffer.parse_curr = client->recv_buffer.mem_start;
+    client->recv_buffer.curr = client->recv_buffer.mem_start;
+    client->recv_buffer.curr_sz = client->recv_buffer.mem_size;
+}
+
+/**
+ * Moves the unparsed bytes of the receive buffer back to its start.
+ */
+static void __mqtt_recv_buffer_compact(struct mqtt_client *client)
+{
+    size_t n = (size_t) (client->recv_buffer.curr - client->recv_buffer.parse_curr);
+    memmove(client->recv_buffer.mem_start, client->recv_buffer.parse_curr, n);
+    client->recv_buffer.parse_curr = client->recv_buffer.mem_start;
+    client->recv_buffer.curr = client->recv_buffer.mem_start + n;
+    client->recv_buffer.curr_sz = client->recv_buffer.mem_size - n;
+}
+
+/**
+ * Updates the response time statistics with the acknowledgement of \p msg received at \p now.
+ */
+static void __mqtt_record_response_time(struct mqtt_client *client, const struct mqtt_queued_message *msg, mqtt_pal_time_ms_t now)
+{
+    float sample = now > msg->time_sent ? (float) (now - msg->time_sent) : 0.0f;
+    if (client->typical_response_time_ms < 0.0f) {
+        client->typical_response_time_ms = sample;
+        client->response_time_deviation_ms = sample / 2.0f;
+    } else {
+        float error = sample - client->typical_response_time_ms;
+        client->response_time_deviation_ms = 0.75f * (client->response_time_deviation_ms) + 0.25f * (error < 0.0f ? -error : error);
+        client->typical_response_time_ms = 0.875f * (client->typical_response_time_ms) + 0.125f * sample;
     }
+}
 
+/**
+ * Sets the client's error from the receiving side, returns \p error.
+ */
+static ssize_t __mqtt_recv_error(struct mqtt_client *client, ssize_t error)
+{
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    client->error = (enum MQTTErrors) error;
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-    return MQTT_OK;
+    return error;
 }
 
 ssize_t __mqtt_recv(struct mqtt_client *client)
+{
+    return __mqtt_recv_at(client, MQTT_PAL_TIME_MS(), NULL, 0);
+}
+
+ssize_t __mqtt_recv_data(struct mqtt_client *client, const void *data, size_t size)
+{
+    return __mqtt_recv_at(client, MQTT_PAL_TIME_MS(), (const uint8_t*) data, size);
+}
+
+/**
+ * Passes the publishes that were staged by __mqtt_recv_at to the publish callback, with the
+ * client's receive lock released (see mqtt_init_deferred_delivery).
+ */
+static void __mqtt_deliver_staged(struct mqtt_client *client)
+{
+    struct mqtt_delivery_queue *delivery = &client->delivery;
+    size_t i, n = delivery->length;
+    if (n == 0) {
+        return;
+    }
+
+    delivery->delivering = 1;
+    MQTT_PAL_MUTEX_UNLOCK(&client->recv_mutex);
+    for(i = 0; i < n; ++i) {
+        client->publish_response_callback(&client->publish_response_callback_state, &delivery->publishes[i]);
+    }
+    MQTT_PAL_MUTEX_LOCK(&client->recv_mutex);
+    delivery->length = 0;
+    delivery->delivering = 0;
+    delivery->number_of_deliveries += 1;
+}
+
+/**
+ * Handles ingress client traffic (see __mqtt_recv), with \p now being the current time. The
+ * bytes are read from the socket, or taken from \p data if it isn't NULL.
+ */
+static ssize_t __mqtt_recv_at(struct mqtt_client *client, mqtt_pal_time_ms_t now, const uint8_t *data, size_t size)
 {
     struct mqtt_response response;
     ssize_t mqtt_recv_ret = MQTT_OK;
-    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    int parse_buffered = 0;
+    int deliver;
+    MQTT_PAL_MUTEX_LOCK(&client->recv_mutex);
+
+    if (client->delivery.delivering) {
+        /* the publishes that are being delivered point into the receive buffer */
+        MQTT_PAL_MUTEX_UNLOCK(&client->recv_mutex);
+        return MQTT_OK;
+    }
 
     /* read until there is nothing left to read, or there was an error */
     while(mqtt_recv_ret == MQTT_OK) {
-        /* read in as many bytes as possible */
         ssize_t rv, consumed;
         struct mqtt_queued_message *msg = NULL;
 
-        rv = mqtt_pal_recvall(client->socketfd, client->recv_buffer.curr, client->recv_buffer.curr_sz, 0);
-        if (rv < 0) {
-            /* an error occurred */
-            client->error = (enum MQTTErrors)rv;
-            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-            return rv;
-        } else {
-            client->recv_buffer.curr += rv;
-            client->recv_buffer.curr_sz -= (unsigned long)rv;
+        /* read in as many bytes as possible, unless there are buffered packets left to parse */
+        if (!parse_buffered) {
+            if (data == NULL) {
+                rv = mqtt_pal_recvall(client->socketfd, client->recv_buffer.curr, client->recv_buffer.curr_sz, 0);
+            } else {
+                /* as much of the bytes that were received by the caller as fits */
+                rv = (ssize_t) (size < client->recv_buffer.curr_sz ? size : client->recv_buffer.curr_sz);
+                memcpy(client->recv_buffer.curr, data, (size_t) rv);
+                data += rv;
+                size -= (size_t) rv;
+            }
+            if (rv < 0) {
+                /* an error occurred */
+                __mqtt_recv_error(client, rv);
+                MQTT_PAL_MUTEX_UNLOCK(&client->recv_mutex);
+                return rv;
+            } else {
+                client->recv_buffer.curr += rv;
+                client->recv_buffer.curr_sz -= (unsigned long)rv;
+            }
+        }
+
+        /* pass the payload of a streamed publish on */
+        if (client->recv_stream.remaining > 0) {
+            int received = client->recv_buffer.curr != client->recv_buffer.parse_curr;
+            rv = __mqtt_recv_stream_chunk(client);
+            if (rv < 0) {
+                __mqtt_recv_error(client, rv);
+                MQTT_PAL_MUTEX_UNLOCK(&client->recv_mutex);
+                return rv;
+            }
+            if (client->recv_buffer.parse_curr == client->recv_buffer.curr) {
+                client->recv_buffer.parse_curr = client->recv_buffer.mem_start;
+                client->recv_buffer.curr = client->recv_buffer.mem_start;
+                client->recv_buffer.curr_sz = client->recv_buffer.mem_size;
+            }
+            if (client->recv_stream.remaining > 0) {
+                if (!received && !parse_buffered) {
+                    /* just need to wait for the rest of the payload */
+                    MQTT_PAL_MUTEX_UNLOCK(&client->recv_mutex);
+                    return MQTT_OK;
+                }
+                parse_buffered = 0;
+                continue;
+            }
         }
 
         /* attempt to parse */
-        consumed = mqtt_unpack_response(&response, client->recv_buffer.mem_start, (size_t) (client->recv_buffer.curr - client->recv_buffer.mem_start));
+        consumed = mqtt_unpack_response(&response, client->recv_buffer.parse_curr, (size_t) (client->recv_buffer.curr - client->recv_buffer.parse_curr));
 
         if (consumed < 0) {
-            client->error = (enum MQTTErrors)consumed;
-            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            __mqtt_recv_error(client, consumed);
+            __mqtt_deliver_staged(client);
+            MQTT_PAL_MUTEX_UNLOCK(&client->recv_mutex);
             return consumed;
         } else if (consumed == 0) {
-            /* if curr_sz is 0 then the buffer is too small to ever fit the message */
             if (client->recv_buffer.curr_sz == 0) {
-                client->error = MQTT_ERROR_RECV_BUFFER_TOO_SMALL;
-                MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                return MQTT_ERROR_RECV_BUFFER_TOO_SMALL;
+                /* the buffer is about to change, deliver the publishes that point into it */
+                __mqtt_deliver_staged(client);
+
+                /* if the packet starts at mem_start then the buffer is too small to ever fit the message */
+                if (client->recv_buffer.parse_curr == client->recv_buffer.mem_start) {
+                    /* unless the buffer can grow to fit it */
+                    if (__mqtt_recv_buffer_grow(client)) {
+                        parse_buffered = 0;
+                        continue;
+                    }
+
+                    /* or it is a publish that can be streamed */
+                    rv = client->recv_stream.begin != NULL ? __mqtt_recv_stream_begin(client) : 0;
+                    if (rv < 0) {
+                        __mqtt_recv_error(client, rv);
+                        MQTT_PAL_MUTEX_UNLOCK(&client->recv_mutex);
+                        return rv;
+                    } else if (rv > 0) {
+                        parse_buffered = 1;
+                        continue;
+                    }
+                    __mqtt_recv_error(client, MQTT_ERROR_RECV_BUFFER_TOO_SMALL);
+                    MQTT_PAL_MUTEX_UNLOCK(&client->recv_mutex);
+                    return MQTT_ERROR_RECV_BUFFER_TOO_SMALL;
+                }
+
+                /* move the partial packet to the front of the buffer and read the rest */
+                __mqtt_recv_buffer_compact(client);
+                parse_buffered = 0;
+                continue;
+            }
+
+            if (parse_buffered) {
+                /* the buffered bytes are an incomplete packet, try to read the rest */
+                parse_buffered = 0;
+                continue;
             }
 
             /* just need to wait for the rest of the data */
-            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            __mqtt_deliver_staged(client);
+            __mqtt_recv_buffer_shrink(client);
+            MQTT_PAL_MUTEX_UNLOCK(&client->recv_mutex);
             return MQTT_OK;
         }
 
@@ -718,7 +2432,12 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
             -> release UNSUBSCRIBE
         MQTT_CONTROL_PINGRESP:
             -> release PINGREQ
+
+        The message queue and the client's error belong to the sending side, so they are only
+        touched with the client's mutex held.
         */
+        deliver = 0;
+        MQTT_PAL_MUTEX_LOCK(&client->mutex);
         switch (response.fixed_header.control_type) {
             case MQTT_CONTROL_CONNACK:
                 /* release associated CONNECT */
@@ -730,7 +2449,8 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
                 /* initialize typical response time */
-                client->typical_response_time = (float) (MQTT_PAL_TIME() - msg->time_sent);
+                client->typical_response_time_ms = -1.0f;
+                __mqtt_record_response_time(client, msg, now);
                 /* check that connection was successful */
                 if (response.decoded.connack.return_code != MQTT_CONNACK_ACCEPTED) {
                     if (response.decoded.connack.return_code == MQTT_CONNACK_REFUSED_IDENTIFIER_REJECTED) {
@@ -765,8 +2485,7 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                         break;
                     }
                 }
-                /* call publish callback */
-                client->publish_response_callback(&client->publish_response_callback_state, &response.decoded.publish);
+                deliver = 1;
                 break;
             case MQTT_CONTROL_PUBACK:
                 /* release associated PUBLISH */
@@ -777,8 +2496,11 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                     break;
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
+                __mqtt_pid_release(client, msg->packet_id);
+                __mqtt_release_application_message(msg);
+                __mqtt_journal_complete(client, msg);
                 /* update response time */
-                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (MQTT_PAL_TIME() - msg->time_sent);
+                __mqtt_record_response_time(client, msg, now);
                 break;
             case MQTT_CONTROL_PUBREC:
                 /* check if this is a duplicate */
@@ -793,8 +2515,9 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                     break;
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
+                __mqtt_release_application_message(msg);
                 /* update response time */
-                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (MQTT_PAL_TIME() - msg->time_sent);
+                __mqtt_record_response_time(client, msg, now);
                 /* stage PUBREL */
                 rv = __mqtt_pubrel(client, response.decoded.pubrec.packet_id);
                 if (rv != MQTT_OK) {
@@ -806,15 +2529,14 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
             case MQTT_CONTROL_PUBREL:
                 /* release associated PUBREC */
                 msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREC, &response.decoded.pubrel.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
-                    mqtt_recv_ret = MQTT_ERROR_ACK_OF_UNKNOWN;
-                    break;
+                if (msg != NULL) {
+                    msg->state = MQTT_QUEUED_COMPLETE;
+                    __mqtt_journal_complete(client, msg);
+                    /* update response time */
+                    __mqtt_record_response_time(client, msg, now);
                 }
-                msg->state = MQTT_QUEUED_COMPLETE;
-                /* update response time */
-                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (MQTT_PAL_TIME() - msg->time_sent);
-                /* stage PUBCOMP */
+                /* stage PUBCOMP, even if the PUBREC is gone (the broker resends the PUBREL
+                   after a reconnect if the PUBCOMP was lost) */
                 rv = __mqtt_pubcomp(client, response.decoded.pubrec.packet_id);
                 if (rv != MQTT_OK) {
                     client->error = (enum MQTTErrors)rv;
@@ -831,8 +2553,10 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                     break;
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
+                __mqtt_pid_release(client, msg->packet_id);
+                __mqtt_journal_complete(client, msg);
                 /* update response time */
-                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (MQTT_PAL_TIME() - msg->time_sent);
+                __mqtt_record_response_time(client, msg, now);
                 break;
             case MQTT_CONTROL_SUBACK:
                 /* release associated SUBSCRIBE */
@@ -843,8 +2567,9 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                     break;
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
+                __mqtt_pid_release(client, msg->packet_id);
                 /* update response time */
-                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (MQTT_PAL_TIME() - msg->time_sent);
+                __mqtt_record_response_time(client, msg, now);
                 /* check that subscription was successful (not currently only one subscribe at a time) */
                 if (response.decoded.suback.return_codes[0] == MQTT_SUBACK_FAILURE) {
                     client->error = MQTT_ERROR_SUBSCRIBE_FAILED;
@@ -861,8 +2586,9 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                     break;
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
+                __mqtt_pid_release(client, msg->packet_id);
                 /* update response time */
-                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (MQTT_PAL_TIME() - msg->time_sent);
+                __mqtt_record_response_time(client, msg, now);
                 break;
             case MQTT_CONTROL_PINGRESP:
                 /* release associated PINGREQ */
@@ -874,26 +2600,45 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
                 }
                 msg->state = MQTT_QUEUED_COMPLETE;
                 /* update response time */
-                client->typical_response_time = 0.875f * (client->typical_response_time) + 0.125f * (float) (MQTT_PAL_TIME() - msg->time_sent);
+                __mqtt_record_response_time(client, msg, now);
                 break;
             default:
                 client->error = MQTT_ERROR_MALFORMED_RESPONSE;
                 mqtt_recv_ret = MQTT_ERROR_MALFORMED_RESPONSE;
                 break;
         }
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+
+        /* call publish callback, or stage the publish until the receive lock is released */
+        if (deliver) {
+            if (client->delivery.publishes != NULL) {
+                client->delivery.publishes[client->delivery.length++] = response.decoded.publish;
+            } else {
+                client->publish_response_callback(&client->publish_response_callback_state, &response.decoded.publish);
+            }
+        }
+
+        /* we've handled the response, now consume it */
+        client->recv_buffer.parse_curr += consumed;
+        if (client->recv_buffer.parse_curr == client->recv_buffer.curr
+            || client->delivery.length == client->delivery.capacity)
         {
-          /* we've handled the response, now clean the buffer */
-          void* dest = (unsigned char*)client->recv_buffer.mem_start;
-          void* src  = (unsigned char*)client->recv_buffer.mem_start + consumed;
-          size_t n = (size_t) (client->recv_buffer.curr - client->recv_buffer.mem_start - consumed);
-          memmove(dest, src, n);
-          client->recv_buffer.curr -= consumed;
-          client->recv_buffer.curr_sz += (unsigned long)consumed;
+            __mqtt_deliver_staged(client);
+        }
+        if (client->recv_buffer.parse_curr == client->recv_buffer.curr) {
+            /* everything was consumed, start over at the front of the buffer */
+            client->recv_buffer.parse_curr = client->recv_buffer.mem_start;
+            client->recv_buffer.curr = client->recv_buffer.mem_start;
+            client->recv_buffer.curr_sz = client->recv_buffer.mem_size;
+            parse_buffered = 0;
+        } else {
+            parse_buffered = 1;
         }
     }
 
     /* In case there was some error handling the (well formed) message, we end up here */
-    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    __mqtt_deliver_staged(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->recv_mutex);
     return mqtt_recv_ret;
 }
 
@@ -989,7 +2734,11 @@ static ssize_t mqtt_fixed_header_rule_violation(const struct mqtt_fixed_header *
     return 0;
 }
 
-ssize_t mqtt_unpack_fixed_header(struct mqtt_response *response, const uint8_t *buf, size_t bufsz) {
+/**
+ * Unpacks the bytes of a fixed header, without checking that the rest of the packet is in
+ * \p buf. Returns 0 if the fixed header itself isn't complete.
+ */
+static ssize_t __mqtt_unpack_fixed_header(struct mqtt_response *response, const uint8_t *buf, size_t bufsz) {
     struct mqtt_fixed_header *fixed_header;
     const uint8_t *start = buf;
     int lshift;
@@ -1038,16 +2787,30 @@ ssize_t mqtt_unpack_fixed_header(struct mqtt_response *response, const uint8_t *
         return errcode;
     }
 
+    /* return how many bytes were consumed */
+    return buf - start;
+}
+
+ssize_t mqtt_unpack_fixed_header(struct mqtt_response *response, const uint8_t *buf, size_t bufsz) {
+    ssize_t rv = __mqtt_unpack_fixed_header(response, buf, bufsz);
+    if (rv <= 0) {
+        return rv;
+    }
+
     /* check that the buffer size if GT remaining length */
-    if (bufsz < fixed_header->remaining_length) {
+    if (bufsz - (size_t) rv < response->fixed_header.remaining_length) {
         return 0;
     }
 
     /* return how many bytes were consumed */
-    return buf - start;
+    return rv;
 }
 
-ssize_t mqtt_pack_fixed_header(uint8_t *buf, size_t bufsz, const struct mqtt_fixed_header *fixed_header) {
+/**
+ * Packs only the bytes of a fixed header, without checking that the rest of the
+ * packet fits into \p buf.
+ */
+static ssize_t __mqtt_pack_fixed_header(uint8_t *buf, size_t bufsz, const struct mqtt_fixed_header *fixed_header) {
     const uint8_t *start = buf;
     ssize_t errcode;
     uint32_t remaining_length;
@@ -1092,13 +2855,23 @@ ssize_t mqtt_pack_fixed_header(uint8_t *buf, size_t bufsz, const struct mqtt_fix
     --bufsz;
     ++buf;
 
+    /* return how many bytes were consumed */
+    return buf - start;
+}
+
+ssize_t mqtt_pack_fixed_header(uint8_t *buf, size_t bufsz, const struct mqtt_fixed_header *fixed_header) {
+    ssize_t rv = __mqtt_pack_fixed_header(buf, bufsz, fixed_header);
+    if (rv <= 0) {
+        return rv;
+    }
+
     /* check that there's still enough space in buffer for packet */
-    if (bufsz < fixed_header->remaining_length) {
+    if (bufsz - (size_t)rv < fixed_header->remaining_length) {
         return 0;
     }
 
     /* return how many bytes were consumed */
-    return buf - start;
+    return rv;
 }
 
 /* CONNECT */
@@ -1270,17 +3043,17 @@ ssize_t mqtt_pack_ping_request(uint8_t *buf, size_t bufsz) {
 }
 
 /* PUBLISH */
-ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
-                                  const char* topic_name,
-                                  uint16_t packet_id,
-                                  const void* application_message,
-                                  size_t application_message_size,
-                                  uint8_t publish_flags)
+ssize_t mqtt_pack_publish_header(uint8_t *buf, size_t bufsz,
+                                 const char* topic_name,
+                                 uint16_t packet_id,
+                                 size_t application_message_size,
+                                 uint8_t publish_flags)
 {
     const uint8_t *const start = buf;
     ssize_t rv;
     struct mqtt_fixed_header fixed_header;
     uint32_t remaining_length;
+    uint32_t variable_header_length;
     uint8_t inspected_qos;
 
     /* check for null pointers */
@@ -1295,11 +3068,11 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
     fixed_header.control_type = MQTT_CONTROL_PUBLISH;
 
     /* calculate remaining length */
-    remaining_length = (uint32_t)__mqtt_packed_cstrlen(topic_name);
+    variable_header_length = (uint32_t)__mqtt_packed_cstrlen(topic_name);
     if (inspected_qos > 0) {
-        remaining_length += 2;
+        variable_header_length += 2;
     }
-    remaining_length += (uint32_t)application_message_size;
+    remaining_length = variable_header_length + (uint32_t)application_message_size;
     fixed_header.remaining_length = remaining_length;
 
     /* force dup to 0 if qos is 0 [Spec MQTT-3.3.1-2] */
@@ -1313,8 +3086,8 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
     }
     fixed_header.control_flags = publish_flags & 0x7;
 
-    /* pack fixed header */
-    rv = mqtt_pack_fixed_header(buf, bufsz, &fixed_header);
+    /* pack fixed header (the application message doesn't go into buf) */
+    rv = __mqtt_pack_fixed_header(buf, bufsz, &fixed_header);
     if (rv <= 0) {
         /* something went wrong */
         return rv;
@@ -1323,7 +3096,7 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
     bufsz -= (size_t)rv;
 
     /* check that buffer is big enough */
-    if (bufsz < remaining_length) {
+    if (bufsz < variable_header_length) {
         return 0;
     }
 
@@ -1333,11 +3106,36 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
         buf += __mqtt_pack_uint16(buf, packet_id);
     }
 
+    /* return length of header */
+    return buf - start;
+}
+
+ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
+                                  const char* topic_name,
+                                  uint16_t packet_id,
+                                  const void* application_message,
+                                  size_t application_message_size,
+                                  uint8_t publish_flags)
+{
+    ssize_t rv;
+
+    /* pack the header */
+    rv = mqtt_pack_publish_header(buf, bufsz, topic_name, packet_id, application_message_size, publish_flags);
+    if (rv <= 0) {
+        /* something went wrong */
+        return rv;
+    }
+
+    /* check that buffer is big enough */
+    if (bufsz - (size_t)rv < application_message_size) {
+        return 0;
+    }
+
     /* pack payload */
-    memcpy(buf, application_message, application_message_size);
-    buf += application_message_size;
+    memcpy(buf + rv, application_message, application_message_size);
 
-    return buf - start;
+    /* return length of packet */
+    return rv + (ssize_t)application_message_size;
 }
 
 ssize_t mqtt_unpack_publish_response(struct mqtt_response *mqtt_response, const uint8_t *buf)
@@ -1613,13 +3411,185 @@ ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz, unsigned int p
 }
 
 /* MESSAGE QUEUE */
+/**
+ * Hashes the (control_type, packet_id) key of a message queue's packet ID index.
+ */
+static uint32_t __mqtt_mq_index_hash(enum MQTTControlPacketType control_type, uint16_t packet_id)
+{
+    uint32_t h = ((((uint32_t) control_type) << 16) | packet_id) * 0x9E3779B1u;
+    return h ^ (h >> 16);
+}
+
+/**
+ * Returns non-zero if messages with the key (\p control_type, \p packet_id) can be
+ * acknowledged, only those are looked up by packet ID and kept in the packet ID index.
+ */
+static int __mqtt_mq_index_key(enum MQTTControlPacketType control_type, uint16_t packet_id)
+{
+    switch (control_type) {
+    case MQTT_CONTROL_PUBLISH:
+    case MQTT_CONTROL_PUBREC:
+    case MQTT_CONTROL_PUBREL:
+    case MQTT_CONTROL_SUBSCRIBE:
+    case MQTT_CONTROL_UNSUBSCRIBE:
+        return packet_id != 0;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Returns non-zero if \p msg belongs in the packet ID index. QoS 0 PUBLISH's (packet ID 0),
+ * PINGREQ's and the acknowledgements that the client sends would all share a few keys and
+ * turn the probe sequences quadratic.
+ */
+static int __mqtt_mq_indexed(const struct mqtt_queued_message *msg)
+{
+    if (!__mqtt_mq_index_key(msg->control_type, msg->packet_id)) {
+        return 0;
+    }
+    return msg->control_type != MQTT_CONTROL_PUBLISH || (msg->start[0] & MQTT_PUBLISH_QOS_MASK) != 0;
+}
+
+/**
+ * Returns the home slot of the message that \p value (a sequence number plus one) refers to.
+ */
+static uint32_t __mqtt_mq_index_home(const struct mqtt_message_queue *mq, uint32_t value)
+{
+    const struct mqtt_queued_message *msg = mqtt_mq_get(mq, value - 1u - mq->index_head_seq);
+    return __mqtt_mq_index_hash(msg->control_type, msg->packet_id) & mq->index_mask;
+}
+
+/**
+ * Adds the messages that were registered since the last call to the packet ID index, as
+ * long as the index stays at most 3/4 full.
+ */
+static void __mqtt_mq_index_catch_up(struct mqtt_message_queue *mq)
+{
+    uint32_t len = (uint32_t) mqtt_mq_length(mq);
+    uint32_t max_used = mq->index_mask - (mq->index_mask >> 2);
+    for(; mq->index_count < len; ++mq->index_count) {
+        uint32_t value = mq->index_head_seq + mq->index_count + 1u;
+        uint32_t slot;
+        if (!__mqtt_mq_indexed(mqtt_mq_get(mq, mq->index_count))) {
+            continue;
+        }
+        if (mq->index_used >= max_used) {
+            break;
+        }
+        slot = __mqtt_mq_index_home(mq, value);
+        while(mq->index[slot] != 0) {
+            slot = (slot + 1u) & mq->index_mask;
+        }
+        mq->index[slot] = value;
+        ++mq->index_used;
+    }
+}
+
+/**
+ * Removes the message at position \p i of the queue from the packet ID index (using backward 
+ * shift deletion so that no tombstones are needed).
+ */
+static void __mqtt_mq_index_remove(struct mqtt_message_queue *mq, uint32_t i)
+{
+    uint32_t value = mq->index_head_seq + i + 1u;
+    uint32_t slot, next;
+    if (!__mqtt_mq_indexed(mqtt_mq_get(mq, i))) {
+        return;
+    }
+    slot = __mqtt_mq_index_home(mq, value);
+    while(mq->index[slot] != value) {
+        slot = (slot + 1u) & mq->index_mask;
+    }
+
+    /* shift back the following entries of the cluster that may live in the emptied slot */
+    for(next = (slot + 1u) & mq->index_mask; mq->index[next] != 0; next = (next + 1u) & mq->index_mask) {
+        uint32_t home = __mqtt_mq_index_home(mq, mq->index[next]);
+        if (((next - home) & mq->index_mask) >= ((next - slot) & mq->index_mask)) {
+            mq->index[slot] = mq->index[next];
+            slot = next;
+        }
+    }
+    mq->index[slot] = 0;
+    --mq->index_used;
+}
+
+/**
+ * Removes the first \p n messages of the queue from the packet ID index. Must be called 
+ * before the front of the queue is advanced.
+ */
+static void __mqtt_mq_index_advance(struct mqtt_message_queue *mq, uint32_t n)
+{
+    uint32_t i;
+    if (mq->index == NULL) {
+        return;
+    }
+    for(i = 0; i < n && i < mq->index_count; ++i) {
+        __mqtt_mq_index_remove(mq, i);
+    }
+    mq->index_count -= i;
+    mq->index_head_seq += n;
+
+    if ((uint32_t) mqtt_mq_length(mq) == n) {
+        /* the queue is empty, restart the sequence numbers */
+        mq->index_head_seq = 0;
+    } else if (mq->index_head_seq >= 0x80000000u) {
+        /* rebase the sequence numbers before they wrap around */
+        uint32_t slot;
+        for(slot = 0; slot <= mq->index_mask; ++slot) {
+            if (mq->index[slot] != 0) {
+                mq->index[slot] -= mq->index_head_seq;
+            }
+        }
+        mq->index_head_seq = 0;
+    }
+}
+
+/**
+ * Returns the number of bytes that can be packed at the queue's \c curr, leaving room for
+ * the mqtt_queued_message of the packet.
+ */
+static size_t __mqtt_mq_currsz(const struct mqtt_message_queue *mq)
+{
+    uint8_t *end;
+    if (mq->mem_start == NULL) {
+        return 0;
+    }
+    end = (uint8_t *) (mq->queue_tail - 1);
+    return mq->curr >= end ? 0 : (size_t) (end - mq->curr);
+}
+
 void mqtt_mq_init(struct mqtt_message_queue *mq, void *buf, size_t bufsz) 
 {  
+    mq->index = NULL;
+    mq->index_mask = 0;
+    mq->index_head_seq = 0;
+    mq->index_count = 0;
+    mq->index_used = 0;
+
+    if (buf != NULL) {
+        /* carve the packet ID index from the front of the buffer */
+        size_t max_messages = bufsz / sizeof(struct mqtt_queued_message);
+        size_t slots = MQTT_MQ_INDEX_MIN_SLOTS;
+        size_t padding = (size_t) (-(uintptr_t) buf & (sizeof(uint32_t) - 1));
+        while (slots < max_messages && slots <= 0x40000000uL) {
+            slots *= 2;
+        }
+        if (max_messages >= MQTT_MQ_INDEX_MIN_SLOTS && padding + slots * sizeof(uint32_t) < bufsz) {
+            mq->index = (uint32_t *) ((uint8_t *)buf + padding);
+            mq->index_mask = (uint32_t) (slots - 1);
+            memset(mq->index, 0, slots * sizeof(uint32_t));
+            bufsz -= padding + slots * sizeof(uint32_t);
+            buf = mq->index + slots;
+        }
+    }
+
     mq->mem_start = buf;
     mq->mem_end = (uint8_t *)buf + bufsz;
     mq->curr = (uint8_t *)buf;
     mq->queue_tail = (struct mqtt_queued_message *)mq->mem_end;
-    mq->curr_sz = buf == NULL ? 0 : mqtt_mq_currsz(mq);
+    mq->queue_head = 0;
+    mq->curr_sz = __mqtt_mq_currsz(mq);
 }
 
 struct mqtt_queued_message* mqtt_mq_register(struct mqtt_message_queue *mq, size_t nbytes)
@@ -1629,70 +3599,226 @@ struct mqtt_queued_message* mqtt_mq_register(struct mqtt_message_queue *mq, size
     mq->queue_tail->start = mq->curr;
     mq->queue_tail->size = nbytes;
     mq->queue_tail->state = MQTT_QUEUED_UNSENT;
+    mq->queue_tail->packet_id = 0;
+    mq->queue_tail->application_message = NULL;
+    mq->queue_tail->application_message_size = 0;
+    mq->queue_tail->producer = NULL;
+    mq->queue_tail->release_callback = NULL;
 
     /* move curr and recalculate curr_sz */
     mq->curr += nbytes;
-    mq->curr_sz = (size_t) (mqtt_mq_currsz(mq));
+    mq->curr_sz = __mqtt_mq_currsz(mq);
 
     return mq->queue_tail;
 }
 
+/**
+ * Moves the packets of the queue to \c mem_start and their mqtt_queued_message's to the top
+ * of the array, reclaiming the space of the removed messages. The order of the messages (and
+ * with it the packet ID index) is kept. Returns 1 if anything was moved.
+ */
+static int __mqtt_mq_compact(struct mqtt_message_queue *mq)
+{
+    ssize_t i, len = mqtt_mq_length(mq);
+    size_t removing;
+    if (len == 0 || (mq->queue_head == 0 && mqtt_mq_get(mq, 0)->start == (uint8_t *)mq->mem_start)) {
+        return 0;
+    }
+
+    /* move buffered data */
+    removing = (size_t) (mqtt_mq_get(mq, 0)->start - (uint8_t *)mq->mem_start);
+    memmove(mq->mem_start, mqtt_mq_get(mq, 0)->start, (size_t) (mq->curr - mqtt_mq_get(mq, 0)->start));
+    mq->curr -= removing;
+
+    /* move queue */
+    memmove(mq->queue_tail + mq->queue_head, mq->queue_tail, sizeof(struct mqtt_queued_message) * (size_t) len);
+    mq->queue_tail += mq->queue_head;
+    mq->queue_head = 0;
+
+    /* bump back start's */
+    for(i = 0; i < len; ++i) {
+        mqtt_mq_get(mq, i)->start -= removing;
+    }
+    mq->curr_sz = __mqtt_mq_currsz(mq);
+    return 1;
+}
+
 void mqtt_mq_clean(struct mqtt_message_queue *mq) {
-    struct mqtt_queued_message *new_head;
+    ssize_t n = 0, len = mqtt_mq_length(mq);
+    size_t removed, remaining;
 
-    for(new_head = mqtt_mq_get(mq, 0); new_head >= mq->queue_tail; --new_head) {
-        if (new_head->state != MQTT_QUEUED_COMPLETE) break;
+    while(n < len && mqtt_mq_get(mq, n)->state == MQTT_QUEUED_COMPLETE) {
+        ++n;
+    }
+    if (n == 0) {
+        /* do nothing */
+        return;
     }
     
+    /* drop the removed messages from the packet ID index */
+    __mqtt_mq_index_advance(mq, (uint32_t) n);
+
     /* check if everything can be removed */
-    if (new_head < mq->queue_tail) {
+    if (n == len) {
         mq->curr = (uint8_t *)mq->mem_start;
         mq->queue_tail = (struct mqtt_queued_message *)mq->mem_end;
-        mq->curr_sz = (size_t) (mqtt_mq_currsz(mq));
-        return;
-    } else if (new_head == mqtt_mq_get(mq, 0)) {
-        /* do nothing */
+        mq->queue_head = 0;
+        mq->curr_sz = __mqtt_mq_currsz(mq);
         return;
     }
 
-    /* move buffered data */
-    {
-        size_t n = (size_t) (mq->curr - new_head->start);
-        size_t removing = (size_t) (new_head->start - (uint8_t*) mq->mem_start);
-        memmove(mq->mem_start, new_head->start, n);
-        mq->curr = (unsigned char*)mq->mem_start + n;
-      
+    /* advance the front of the queue */
+    mq->queue_head += (size_t) n;
+    len -= n;
 
-        /* move queue */
-        {
-            ssize_t new_tail_idx = new_head - mq->queue_tail;
-            memmove(mqtt_mq_get(mq, new_tail_idx), mq->queue_tail, sizeof(struct mqtt_queued_message) * (size_t) ((new_tail_idx + 1)));
-            mq->queue_tail = mqtt_mq_get(mq, new_tail_idx);
-          
-            {
-                /* bump back start's */
-                ssize_t i = 0;
-                for(; i < new_tail_idx + 1; ++i) {
-                    mqtt_mq_get(mq, i)->start -= removing;
-                }
-            }
+    /* reclaim the removed messages once that costs no more than removing them did */
+    removed = (size_t) (mqtt_mq_get(mq, 0)->start - (uint8_t *)mq->mem_start) + mq->queue_head * sizeof(struct mqtt_queued_message);
+    remaining = (size_t) (mq->curr - mqtt_mq_get(mq, 0)->start) + (size_t) len * sizeof(struct mqtt_queued_message);
+    if (removed >= remaining) {
+        __mqtt_mq_compact(mq);
+    }
+}
+
+/**
+ * Reverses the bytes [\p first, \p last).
+ */
+static void __mqtt_reverse(uint8_t *first, uint8_t *last)
+{
+    while (first + 1 < last) {
+        uint8_t tmp = *first;
+        *first++ = *--last;
+        *last = tmp;
+    }
+}
+
+/**
+ * Rotates the bytes [\p first, \p last) in place so that \p middle becomes the first one.
+ */
+static void __mqtt_rotate(uint8_t *first, uint8_t *middle, uint8_t *last)
+{
+    __mqtt_reverse(first, middle);
+    __mqtt_reverse(middle, last);
+    __mqtt_reverse(first, last);
+}
+
+/**
+ * Removes the completed messages that are left behind the front of a compacted queue (by a
+ * message at the front that waits for its acknowledgement, e.g. a QoS 2 PUBLISH) and closes
+ * their gaps, keeping the order of the others. Pointers to queued messages are invalidated.
+ * Returns the number of removed messages.
+ */
+static ssize_t __mqtt_mq_close_gaps(struct mqtt_message_queue *mq)
+{
+    ssize_t i, n = 0, len = mqtt_mq_length(mq);
+
+    for(i = 0; i < len && mqtt_mq_get(mq, i)->state != MQTT_QUEUED_COMPLETE; ++i);
+    if (i == len) {
+        return 0;
+    }
+
+    /* close the gaps of the completed messages */
+    mq->curr = (uint8_t *)mq->mem_start;
+    for(i = 0; i < len; ++i) {
+        struct mqtt_queued_message msg = *mqtt_mq_get(mq, i);
+        if (msg.state == MQTT_QUEUED_COMPLETE) {
+            continue;
         }
+        memmove(mq->curr, msg.start, msg.size);
+        msg.start = mq->curr;
+        *mqtt_mq_get(mq, n++) = msg;
+        mq->curr += msg.size;
+    }
+    mq->queue_tail = mqtt_mq_get(mq, n - 1);
+    mq->curr_sz = __mqtt_mq_currsz(mq);
+
+    /* the sequence numbers changed, the index is rebuilt when it is used */
+    if (mq->index != NULL) {
+        memset(mq->index, 0, ((size_t) mq->index_mask + 1) * sizeof(uint32_t));
+    }
+    mq->index_head_seq = 0;
+    mq->index_count = 0;
+    mq->index_used = 0;
+    return len - n;
+}
+
+/**
+ * Drops the completed messages of the queue and moves the others in order to the ends of the
+ * queue's memory: their packets to \c mem_start and their mqtt_queued_message's to the top of
+ * the array. Pointers to queued messages are invalidated.
+ */
+static void __mqtt_mq_straighten(struct mqtt_message_queue *mq)
+{
+    mqtt_mq_clean(mq);
+    __mqtt_mq_compact(mq);
+    __mqtt_mq_close_gaps(mq);
+}
+
+/**
+ * Moves the message at the back of the queue (and its packet) to the front of the queue.
+ * Pointers to queued messages are invalidated.
+ */
+static void __mqtt_mq_move_back_to_front(struct mqtt_message_queue *mq)
+{
+    struct mqtt_queued_message last;
+    ssize_t i, len = mqtt_mq_length(mq);
+    if (len < 2) {
+        return;
+    }
+    __mqtt_mq_straighten(mq);
+    len = mqtt_mq_length(mq);
+    if (len < 2) {
+        return;
     }
 
-    /* get curr_sz */
-    mq->curr_sz = (size_t) (mqtt_mq_currsz(mq));
+    last = *mqtt_mq_get(mq, len - 1);
+    __mqtt_rotate((uint8_t *)mq->mem_start, last.start, last.start + last.size);
+    for(i = len - 1; i > 0; --i) {
+        *mqtt_mq_get(mq, i) = *mqtt_mq_get(mq, i - 1);
+        mqtt_mq_get(mq, i)->start += last.size;
+    }
+    last.start = (uint8_t *)mq->mem_start;
+    *mqtt_mq_get(mq, 0) = last;
 }
 
-struct mqtt_queued_message* mqtt_mq_find(const struct mqtt_message_queue *mq, enum MQTTControlPacketType control_type, const uint16_t *packet_id)
+struct mqtt_queued_message* mqtt_mq_find(struct mqtt_message_queue *mq, enum MQTTControlPacketType control_type, const uint16_t *packet_id)
 {
     struct mqtt_queued_message *curr;
-    for(curr = mqtt_mq_get(mq, 0); curr >= mq->queue_tail; --curr) {
-        if (curr->control_type == control_type) {
-            if ((packet_id == NULL && curr->state != MQTT_QUEUED_COMPLETE) ||
-                (packet_id != NULL && *packet_id == curr->packet_id)) {
+    struct mqtt_queued_message *last = mqtt_mq_get(mq, 0);
+    int indexed;
+    if (packet_id == NULL) {
+        for(curr = mqtt_mq_get(mq, 0); curr >= mq->queue_tail; --curr) {
+            if (curr->control_type == control_type && curr->state != MQTT_QUEUED_COMPLETE) {
                 return curr;
             }
         }
+        return NULL;
+    }
+
+    /* messages that can't be acknowledged aren't indexed, they are searched linearly */
+    indexed = mq->index != NULL && __mqtt_mq_index_key(control_type, *packet_id);
+    if (indexed) {
+        __mqtt_mq_index_catch_up(mq);
+        last = mqtt_mq_get(mq, mq->index_count);
+    }
+
+    /* search the messages that aren't indexed (the most recent ones) */
+    for(curr = mq->queue_tail; curr <= last; ++curr) {
+        if (curr->control_type == control_type && curr->packet_id == *packet_id) {
+            return curr;
+        }
+    }
+
+    if (indexed) {
+        /* matches are probed in the order they were queued, so the last one is the newest */
+        struct mqtt_queued_message *found = NULL;
+        uint32_t slot = __mqtt_mq_index_hash(control_type, *packet_id) & mq->index_mask;
+        for(; mq->index[slot] != 0; slot = (slot + 1u) & mq->index_mask) {
+            curr = mqtt_mq_get(mq, mq->index[slot] - 1u - mq->index_head_seq);
+            if (curr->control_type == control_type && curr->packet_id == *packet_id) {
+                found = curr;
+            }
+        }
+        return found;
     }
     return NULL;
 }
@@ -0,0 +1,336 @@
+/*
+MIT License
+
+Copyright(c) 2018 Liam Bindle
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <mqtt_dispatcher.h>
+
+/**
+ * @file
+ * @brief Implements the topic filter dispatcher (see @ref dispatcher).
+ *
+ * @cond Doxygen_Suppress
+ */
+
+/* A callback registered for a filter. */
+struct mqtt_dispatcher_subscription {
+    mqtt_dispatcher_callback callback;
+    void *state;
+    struct mqtt_dispatcher_subscription *next;
+};
+
+/*
+ * A topic level of the trie. The children of a node that match a level exactly are a binary
+ * search tree ordered by the hash of the level (random enough to keep it balanced), the
+ * child for '+' is kept apart. The level's bytes follow the node.
+ */
+struct mqtt_dispatcher_node {
+    uint32_t hash;
+    uint16_t level_size;
+    struct mqtt_dispatcher_node *left;
+    struct mqtt_dispatcher_node *right;
+    struct mqtt_dispatcher_node *children;
+    struct mqtt_dispatcher_node *plus;
+
+    /* the filters that end at this level */
+    struct mqtt_dispatcher_subscription *subscriptions;
+
+    /* the filters that end with a '#' after this level */
+    struct mqtt_dispatcher_subscription *multi_level;
+};
+
+/* ARENA */
+#define MQTT_DISPATCHER_ALIGNMENT (sizeof(void*))
+
+static void* __mqtt_dispatcher_alloc(struct mqtt_dispatcher *dispatcher, size_t size)
+{
+    /* align the address, the arena itself needn't be aligned */
+    uintptr_t base = (uintptr_t) dispatcher->arena;
+    size_t offset = (size_t) (((base + dispatcher->arena_used + MQTT_DISPATCHER_ALIGNMENT - 1)
+                               & ~(uintptr_t) (MQTT_DISPATCHER_ALIGNMENT - 1)) - base);
+    if (offset > dispatcher->arena_size || size > dispatcher->arena_size - offset) {
+        return NULL;
+    }
+    dispatcher->arena_used = offset + size;
+    return dispatcher->arena + offset;
+}
+
+static struct mqtt_dispatcher_node* __mqtt_dispatcher_new_node(struct mqtt_dispatcher *dispatcher, uint32_t hash, const char *level, size_t level_size)
+{
+    struct mqtt_dispatcher_node *node = (struct mqtt_dispatcher_node*) __mqtt_dispatcher_alloc(dispatcher, sizeof(struct mqtt_dispatcher_node) + level_size);
+    if (node == NULL) {
+        return NULL;
+    }
+    memset(node, 0, sizeof(*node));
+    node->hash = hash;
+    node->level_size = (uint16_t) level_size;
+    memcpy(node + 1, level, level_size);
+    return node;
+}
+
+/* TOPIC LEVELS */
+static uint32_t __mqtt_dispatcher_hash(const char *level, size_t level_size)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for(i = 0; i < level_size; ++i) {
+        hash = (hash ^ (uint8_t) level[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/* Returns the end of the topic level that starts at \p level (the next '/' or \p end). */
+static const char* __mqtt_dispatcher_level_end(const char *level, const char *end)
+{
+    const char *slash = (const char*) memchr(level, '/', (size_t) (end - level));
+    return slash != NULL ? slash : end;
+}
+
+/* Returns the address of the link to the child of \p node for \p level (which is NULL if there is none). */
+static struct mqtt_dispatcher_node** __mqtt_dispatcher_find(struct mqtt_dispatcher_node *node, uint32_t hash, const char *level, size_t level_size)
+{
+    struct mqtt_dispatcher_node **link = &node->children;
+    while (*link != NULL) {
+        struct mqtt_dispatcher_node *child = *link;
+        int cmp;
+        if (hash != child->hash) {
+            cmp = hash < child->hash ? -1 : 1;
+        } else if (level_size != child->level_size) {
+            cmp = level_size < child->level_size ? -1 : 1;
+        } else {
+            cmp = memcmp(level, child + 1, level_size);
+        }
+        if (cmp == 0) {
+            break;
+        }
+        link = cmp < 0 ? &child->left : &child->right;
+    }
+    return link;
+}
+
+/*
+ * Walks (and with \p create, builds) the path of \p topic_filter through the trie, and returns
+ * the address of the list of subscriptions that the filter ends in (or NULL).
+ */
+static struct mqtt_dispatcher_subscription** __mqtt_dispatcher_walk(struct mqtt_dispatcher *dispatcher, const char *topic_filter, int create, enum MQTTErrors *error)
+{
+    const char *level = topic_filter;
+    const char *end;
+    struct mqtt_dispatcher_node *node;
+
+    *error = MQTT_ERROR_INVALID_TOPIC_FILTER;
+    if (topic_filter == NULL || topic_filter[0] == '\0') {
+        return NULL;
+    }
+    end = topic_filter + strlen(topic_filter);
+    if (end - topic_filter > 65535) {
+        return NULL;
+    }
+
+    if (dispatcher->root == NULL) {
+        if (!create) {
+            return NULL;
+        }
+        dispatcher->root = __mqtt_dispatcher_new_node(dispatcher, 0, "", 0);
+        if (dispatcher->root == NULL) {
+            *error = MQTT_ERROR_DISPATCHER_FULL;
+            return NULL;
+        }
+    }
+    node = dispatcher->root;
+
+    for(;;) {
+        const char *level_end = __mqtt_dispatcher_level_end(level, end);
+        size_t level_size = (size_t) (level_end - level);
+        struct mqtt_dispatcher_node **link;
+        uint32_t hash = 0;
+
+        if (level_size == 1 && level[0] == '#') {
+            /* '#' has to be the last level */
+            return level_end == end ? &node->multi_level : NULL;
+        } else if (level_size == 1 && level[0] == '+') {
+            link = &node->plus;
+        } else if (memchr(level, '+', level_size) != NULL || memchr(level, '#', level_size) != NULL) {
+            /* wildcards have to take up a whole level */
+            return NULL;
+        } else {
+            hash = __mqtt_dispatcher_hash(level, level_size);
+            link = __mqtt_dispatcher_find(node, hash, level, level_size);
+        }
+
+        if (*link == NULL) {
+            if (!create) {
+                return NULL;
+            }
+            *link = __mqtt_dispatcher_new_node(dispatcher, hash, level, level_size);
+            if (*link == NULL) {
+                *error = MQTT_ERROR_DISPATCHER_FULL;
+                return NULL;
+            }
+        }
+        node = *link;
+
+        if (level_end == end) {
+            return &node->subscriptions;
+        }
+        level = level_end + 1;
+    }
+}
+
+/* MATCHING */
+static size_t __mqtt_dispatcher_call(struct mqtt_dispatcher_subscription *subscription, struct mqtt_response_publish *publish)
+{
+    size_t called = 0;
+    while (subscription != NULL) {
+        /* the callback may remove its own subscription */
+        struct mqtt_dispatcher_subscription *next = subscription->next;
+        subscription->callback(&subscription->state, publish);
+        subscription = next;
+        ++called;
+    }
+    return called;
+}
+
+/*
+ * Calls the callbacks of the filters below \p node that match the topic from \p level on
+ * (\p level is NULL once the whole topic has been matched). Wildcards don't match the first
+ * level of a topic that starts with '$'.
+ */
+static size_t __mqtt_dispatcher_match(struct mqtt_dispatcher_node *node, const char *level, const char *end, struct mqtt_response_publish *publish)
+{
+    const char *level_end;
+    size_t called = 0;
+    int wildcards = level != (const char*) publish->topic_name || level == end || level[0] != '$';
+    struct mqtt_dispatcher_node *child;
+
+    if (wildcards) {
+        called += __mqtt_dispatcher_call(node->multi_level, publish);
+    }
+    if (level == NULL) {
+        return called + __mqtt_dispatcher_call(node->subscriptions, publish);
+    }
+
+    level_end = __mqtt_dispatcher_level_end(level, end);
+    child = *__mqtt_dispatcher_find(node, __mqtt_dispatcher_hash(level, (size_t) (level_end - level)), level, (size_t) (level_end - level));
+    if (child != NULL) {
+        called += __mqtt_dispatcher_match(child, level_end == end ? NULL : level_end + 1, end, publish);
+    }
+    if (node->plus != NULL && wildcards) {
+        called += __mqtt_dispatcher_match(node->plus, level_end == end ? NULL : level_end + 1, end, publish);
+    }
+    return called;
+}
+
+static void __mqtt_dispatcher_publish_callback(void** state, struct mqtt_response_publish *publish)
+{
+    mqtt_dispatcher_dispatch((struct mqtt_dispatcher*) *state, publish);
+}
+
+/** @endcond */
+
+/* API */
+void mqtt_dispatcher_init(struct mqtt_dispatcher *dispatcher,
+                          void *arena, size_t arena_size,
+                          mqtt_dispatcher_callback unmatched_callback,
+                          void *unmatched_state)
+{
+    dispatcher->arena = (uint8_t*) arena;
+    dispatcher->arena_size = arena != NULL ? arena_size : 0;
+    dispatcher->arena_used = 0;
+    dispatcher->root = NULL;
+    dispatcher->number_of_filters = 0;
+    dispatcher->unmatched_callback = unmatched_callback;
+    dispatcher->unmatched_state = unmatched_state;
+}
+
+enum MQTTErrors mqtt_dispatcher_add(struct mqtt_dispatcher *dispatcher,
+                                    const char *topic_filter,
+                                    mqtt_dispatcher_callback callback,
+                                    void *state)
+{
+    struct mqtt_dispatcher_subscription **list;
+    struct mqtt_dispatcher_subscription *subscription;
+    enum MQTTErrors error;
+
+    if (callback == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+    list = __mqtt_dispatcher_walk(dispatcher, topic_filter, 1, &error);
+    if (list == NULL) {
+        return error;
+    }
+    subscription = (struct mqtt_dispatcher_subscription*) __mqtt_dispatcher_alloc(dispatcher, sizeof(struct mqtt_dispatcher_subscription));
+    if (subscription == NULL) {
+        return MQTT_ERROR_DISPATCHER_FULL;
+    }
+    subscription->callback = callback;
+    subscription->state = state;
+    subscription->next = NULL;
+
+    /* keep the callbacks of a filter in the order in which they were added */
+    while (*list != NULL) {
+        list = &(*list)->next;
+    }
+    *list = subscription;
+    ++dispatcher->number_of_filters;
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_dispatcher_remove(struct mqtt_dispatcher *dispatcher,
+                                       const char *topic_filter,
+                                       mqtt_dispatcher_callback callback,
+                                       void *state)
+{
+    enum MQTTErrors error;
+    struct mqtt_dispatcher_subscription **list = __mqtt_dispatcher_walk(dispatcher, topic_filter, 0, &error);
+    if (list == NULL) {
+        return MQTT_ERROR_INVALID_TOPIC_FILTER;
+    }
+    for(; *list != NULL; list = &(*list)->next) {
+        if ((*list)->callback == callback && (*list)->state == state) {
+            *list = (*list)->next;
+            --dispatcher->number_of_filters;
+            return MQTT_OK;
+        }
+    }
+    return MQTT_ERROR_INVALID_TOPIC_FILTER;
+}
+
+size_t mqtt_dispatcher_dispatch(struct mqtt_dispatcher *dispatcher, struct mqtt_response_publish *publish)
+{
+    const char *topic = (const char*) publish->topic_name;
+    size_t called = 0;
+    if (dispatcher->root != NULL) {
+        called = __mqtt_dispatcher_match(dispatcher->root, topic, topic + publish->topic_name_size, publish);
+    }
+    if (called == 0 && dispatcher->unmatched_callback != NULL) {
+        dispatcher->unmatched_callback(&dispatcher->unmatched_state, publish);
+    }
+    return called;
+}
+
+void mqtt_dispatcher_attach(struct mqtt_dispatcher *dispatcher, struct mqtt_client *client)
+{
+    client->publish_response_callback = __mqtt_dispatcher_publish_callback;
+    client->publish_response_callback_state = dispatcher;
+}
@@ -0,0 +1,232 @@
+/*
+MIT License
+
+Copyright(c) 2018 Liam Bindle
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* for pthread_setaffinity_np */
+#define _GNU_SOURCE
+#endif
+
+#include <mqtt_io_thread.h>
+
+/**
+ * @file
+ * @brief Implements the I/O thread (see @ref io_thread).
+ *
+ * @cond Doxygen_Suppress
+ */
+
+#if defined(MQTT_IO_THREAD_AVAILABLE)
+
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#else
+#include <fcntl.h>
+#endif
+
+/* WAKEUPS */
+static int __mqtt_io_thread_open(struct mqtt_io_thread *io)
+{
+#if defined(__linux__)
+    io->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    io->wakeup_write_fd = io->wakeup_fd;
+    return io->wakeup_fd >= 0;
+#else
+    int fds[2];
+    if (pipe(fds) != 0) {
+        io->wakeup_fd = io->wakeup_write_fd = -1;
+        return 0;
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    io->wakeup_fd = fds[0];
+    io->wakeup_write_fd = fds[1];
+    return 1;
+#endif
+}
+
+static void __mqtt_io_thread_close(struct mqtt_io_thread *io)
+{
+    if (io->wakeup_write_fd >= 0 && io->wakeup_write_fd != io->wakeup_fd) close(io->wakeup_write_fd);
+    if (io->wakeup_fd >= 0) close(io->wakeup_fd);
+    io->wakeup_fd = io->wakeup_write_fd = -1;
+}
+
+static void __mqtt_io_thread_signal(struct mqtt_io_thread *io)
+{
+#if defined(__linux__)
+    uint64_t one = 1;
+    ssize_t rv = write(io->wakeup_write_fd, &one, sizeof(one));
+#else
+    ssize_t rv = write(io->wakeup_write_fd, "", 1);
+#endif
+    (void) rv; /* a full pipe is already readable */
+}
+
+static void __mqtt_io_thread_drain(struct mqtt_io_thread *io)
+{
+    uint8_t buf[64];
+    while (read(io->wakeup_fd, buf, sizeof(buf)) > 0);
+}
+
+/* The client's wakeup callback: signals the thread once until it has read the signal. */
+static void __mqtt_io_thread_wakeup(void **state)
+{
+    struct mqtt_io_thread *io = (struct mqtt_io_thread*) *state;
+    uint32_t expected = 0;
+    if (MQTT_PAL_ATOMIC_CAS(&io->signaled, &expected, 1u)) {
+        __mqtt_io_thread_signal(io);
+    }
+}
+
+/* THREAD */
+static int __mqtt_io_thread_timeout(mqtt_pal_time_ms_t deadline)
+{
+    mqtt_pal_time_ms_t now;
+    if (deadline == MQTT_SYNC_NO_DEADLINE) {
+        return -1;
+    }
+    now = MQTT_PAL_TIME_MS();
+    if (deadline <= now) {
+        return 0;
+    }
+    return deadline - now > 60000u ? 60000 : (int) (deadline - now);
+}
+
+static void* __mqtt_io_thread_main(void *arg)
+{
+    struct mqtt_io_thread *io = (struct mqtt_io_thread*) arg;
+    struct mqtt_client *client = io->client;
+    enum MQTTErrors err = MQTT_OK;
+
+    while (!MQTT_PAL_ATOMIC_LOAD(&io->stopped)) {
+        struct pollfd pfd[2];
+        mqtt_pal_time_ms_t deadline;
+        int interest = mqtt_sync_interest(client, &deadline);
+        int timeout = __mqtt_io_thread_timeout(deadline);
+
+        /* a client that can't recover is retried now and then instead of right away */
+        if (err < 0 && timeout == 0) {
+            timeout = MQTT_IO_THREAD_ERROR_BACKOFF_MS;
+        }
+
+        pfd[0].fd = client->socketfd;
+        pfd[0].events = (short) (((interest & MQTT_SYNC_WANT_READ) ? POLLIN : 0) | ((interest & MQTT_SYNC_WANT_WRITE) ? POLLOUT : 0));
+        pfd[1].fd = io->wakeup_fd;
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, timeout) > 0 && (pfd[1].revents & POLLIN)) {
+            /*
+             * Read the signal before the flag is cleared: a message that is queued after the
+             * flag was cleared signals again, one that was queued before is sent right below.
+             */
+            __mqtt_io_thread_drain(io);
+            MQTT_PAL_ATOMIC_STORE(&io->signaled, 0u);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            io->number_of_wakeups += 1;
+        }
+
+        err = mqtt_sync(client);
+        io->number_of_syncs += 1;
+    }
+
+    /* send what was queued before the thread was stopped */
+    mqtt_sync(client);
+    io->number_of_syncs += 1;
+    return NULL;
+}
+
+/** @endcond */
+
+/* API */
+enum MQTTErrors mqtt_io_thread_start(struct mqtt_io_thread *io, struct mqtt_client *client,
+                                     int cpu, int policy, int priority)
+{
+    pthread_attr_t attr;
+    int rv;
+
+#if !defined(__linux__)
+    if (cpu >= 0) {
+        return MQTT_ERROR_NOT_IMPLEMENTED;
+    }
+#endif
+    io->client = client;
+    io->signaled = 0;
+    io->stopped = 0;
+    io->number_of_wakeups = 0;
+    io->number_of_syncs = 0;
+    if (!__mqtt_io_thread_open(io)) {
+        __mqtt_io_thread_close(io);
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+    mqtt_init_wakeup(client, __mqtt_io_thread_wakeup, io);
+
+    rv = pthread_attr_init(&attr);
+    if (rv == 0 && policy >= 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        rv = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        if (rv == 0) rv = pthread_attr_setschedpolicy(&attr, policy);
+        if (rv == 0) rv = pthread_attr_setschedparam(&attr, &param);
+    }
+    if (rv == 0) {
+        rv = pthread_create(&io->thread, &attr, __mqtt_io_thread_main, io);
+    }
+    pthread_attr_destroy(&attr);
+    if (rv != 0) {
+        mqtt_init_wakeup(client, NULL, NULL);
+        __mqtt_io_thread_close(io);
+        return MQTT_ERROR_IO_THREAD;
+    }
+
+#if defined(__linux__)
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(io->thread, sizeof(set), &set) != 0) {
+            mqtt_io_thread_stop(io);
+            return MQTT_ERROR_IO_THREAD;
+        }
+    }
+#endif
+    return MQTT_OK;
+}
+
+void mqtt_io_thread_stop(struct mqtt_io_thread *io)
+{
+    /* once the callback is removed (under the mutex) no publisher signals the eventfd anymore */
+    mqtt_init_wakeup(io->client, NULL, NULL);
+    MQTT_PAL_ATOMIC_STORE(&io->stopped, 1u);
+    __mqtt_io_thread_signal(io);
+    pthread_join(io->thread, NULL);
+    __mqtt_io_thread_close(io);
+}
+
+#endif
@@ -26,7 +26,7 @@ SOFTWARE.
 
 /** 
  * @file 
- * @brief Implements @ref mqtt_pal_sendall and @ref mqtt_pal_recvall and 
+ * @brief Implements @ref mqtt_pal_sendall, @ref mqtt_pal_sendv and @ref mqtt_pal_recvall and 
  *        any platform-specific helpers you'd like.
  * @cond Doxygen_Suppress
  */
@@ -359,6 +359,49 @@ ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle fd, const void* buf, size_t len,
     return (ssize_t)sent;
 }
 
+ssize_t mqtt_pal_sendv(mqtt_pal_socket_handle fd, mqtt_pal_iovec *iov, int iovcnt, int flags) {
+    enum MQTTErrors error = 0;
+    size_t sent = 0;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while(msg.msg_iovlen > 0) {
+        ssize_t rv = sendmsg(fd, &msg, flags);
+        if (rv < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* should call sendmsg later again */
+                break;
+            }
+            error = MQTT_ERROR_SOCKET_ERROR;
+            break;
+        }
+        if (rv == 0) {
+            /* is this possible? maybe OS bug. */
+            error = MQTT_ERROR_SOCKET_ERROR;
+            break;
+        }
+        sent += (size_t) rv;
+
+        /* skip the buffers that were sent completely and advance into the partial one */
+        while(msg.msg_iovlen > 0 && (size_t) rv >= msg.msg_iov->iov_len) {
+            rv -= (ssize_t) msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + rv;
+            msg.msg_iov->iov_len -= (size_t) rv;
+        }
+    }
+    if (sent == 0) {
+        return error;
+    }
+    return (ssize_t)sent;
+}
+
+#define MQTT_PAL_HAVE_NATIVE_SENDV
+
 ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int flags) {
     const void *const start = buf;
     enum MQTTErrors error = 0;
@@ -437,4 +480,123 @@ ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int
 
 #endif /* defined(MQTT_USE_CUSTOM_SOCKET_HANDLE) */
 
+#if !defined(MQTT_PAL_HAVE_NATIVE_SENDV) && \
+    !(defined(MQTT_USE_CUSTOM_SOCKET_HANDLE) && defined(MQTT_USE_CUSTOM_SENDV))
+
+/*
+ * Generic scatter-gather send for transports without vectored writes (TLS
+ * libraries, Windows and custom sockets). Small buffers are coalesced so that
+ * a batch of queued packets costs one write (and one TLS record) instead of
+ * one write per packet.
+ */
+
+#if !defined(MQTT_PAL_SENDV_STAGE_SIZE)
+#define MQTT_PAL_SENDV_STAGE_SIZE 512
+#endif
+
+ssize_t mqtt_pal_sendv(mqtt_pal_socket_handle fd, mqtt_pal_iovec *iov, int iovcnt, int flags) {
+    uint8_t stage[MQTT_PAL_SENDV_STAGE_SIZE];
+    size_t staged = 0;
+    size_t sent = 0;
+    ssize_t rv;
+    int i;
+    for(i = 0; i <= iovcnt; ++i) {
+        const uint8_t *base = NULL;
+        size_t len = 0;
+        if (i < iovcnt) {
+            base = (const uint8_t*) iov[i].iov_base;
+            len = iov[i].iov_len;
+        }
+
+        /* flush the staged bytes if this buffer doesn't fit behind them */
+        if (staged > 0 && (i == iovcnt || staged + len > sizeof(stage))) {
+            rv = mqtt_pal_sendall(fd, stage, staged, flags);
+            if (rv < 0) {
+                return sent > 0 ? (ssize_t) sent : rv;
+            }
+            sent += (size_t) rv;
+            if ((size_t) rv < staged) {
+                /* partial send */
+                return (ssize_t) sent;
+            }
+            staged = 0;
+        }
+        if (i == iovcnt) {
+            break;
+        }
+
+        if (staged + len <= sizeof(stage)) {
+            memcpy(stage + staged, base, len);
+            staged += len;
+        } else {
+            /* too big to stage, send it directly */
+            rv = mqtt_pal_sendall(fd, base, len, flags);
+            if (rv < 0) {
+                return sent > 0 ? (ssize_t) sent : rv;
+            }
+            sent += (size_t) rv;
+            if ((size_t) rv < len) {
+                /* partial send */
+                return (ssize_t) sent;
+            }
+        }
+    }
+    return (ssize_t) sent;
+}
+
+#endif
+
 /** @endcond */
+
+#if defined(__unix__) || defined(__APPLE__) || defined(__NuttX__)
+
+mqtt_pal_time_ms_t mqtt_pal_time_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (mqtt_pal_time_ms_t) ts.tv_sec * 1000u + (mqtt_pal_time_ms_t) (ts.tv_nsec / 1000000);
+}
+
+#elif defined(_MSC_VER) || defined(WIN32)
+
+mqtt_pal_time_ms_t mqtt_pal_time_ms(void) {
+    return (mqtt_pal_time_ms_t) GetTickCount64();
+}
+
+#endif
+
+#if MQTT_PAL_LOCK_POLICY == MQTT_PAL_LOCK_SPIN
+
+#if defined(__unix__) || defined(__APPLE__) || defined(__NuttX__)
+#include <sched.h>
+#define MQTT_PAL_YIELD() sched_yield()
+#elif defined(_MSC_VER) || defined(WIN32)
+#define MQTT_PAL_YIELD() SwitchToThread()
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MQTT_PAL_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__) || (defined(__arm__) && __ARM_ARCH >= 7)
+#define MQTT_PAL_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define MQTT_PAL_CPU_RELAX() ((void) 0)
+#endif
+
+void mqtt_pal_spin_lock(mqtt_pal_mutex_t *lock) {
+    unsigned spins = 0;
+    for(;;) {
+        /* wait for the lock to look free before trying to take it again */
+        while (MQTT_PAL_ATOMIC_LOAD(lock) != 0u) {
+            if (spins < MQTT_PAL_SPIN_COUNT) {
+                ++spins;
+                MQTT_PAL_CPU_RELAX();
+            } else {
+                MQTT_PAL_YIELD();
+            }
+        }
+        if (MQTT_PAL_ATOMIC_EXCHANGE(lock, 1u) == 0u) {
+            return;
+        }
+    }
+}
+
+#endif
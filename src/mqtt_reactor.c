@@ -0,0 +1,1215 @@
+/*
+MIT License
+
+Copyright(c) 2018 Liam Bindle
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <mqtt_reactor.h>
+
+/**
+ * @file
+ * @brief Implements the epoll (and io_uring) based reactor (see @ref reactor).
+ *
+ * @cond Doxygen_Suppress
+ */
+
+#if defined(MQTT_REACTOR_AVAILABLE)
+
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#if defined(MQTT_USE_IO_URING)
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#endif
+
+/* TIMER HEAP */
+static void __mqtt_reactor_heap_set(struct mqtt_reactor *reactor, size_t i, struct mqtt_reactor_entry *entry)
+{
+    reactor->heap[i] = entry;
+    entry->heap_index = i;
+}
+
+static void __mqtt_reactor_heap_update(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry)
+{
+    size_t i = entry->heap_index;
+
+    /* sift up */
+    while (i > 0 && reactor->heap[(i - 1) / 2]->deadline > entry->deadline) {
+        __mqtt_reactor_heap_set(reactor, i, reactor->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+
+    /* sift down */
+    for(;;) {
+        size_t child = 2 * i + 1;
+        if (child >= reactor->heap_size) {
+            break;
+        }
+        if (child + 1 < reactor->heap_size && reactor->heap[child + 1]->deadline < reactor->heap[child]->deadline) {
+            ++child;
+        }
+        if (reactor->heap[child]->deadline >= entry->deadline) {
+            break;
+        }
+        __mqtt_reactor_heap_set(reactor, i, reactor->heap[child]);
+        i = child;
+    }
+    __mqtt_reactor_heap_set(reactor, i, entry);
+}
+
+/* CLIENT STATE */
+/**
+ * Returns non-zero if the client's error has to be handled by mqtt_sync (a full send buffer
+ * doesn't stop the client).
+ */
+static int __mqtt_reactor_has_failed(const struct mqtt_client *client)
+{
+    return client->error != MQTT_OK && client->error != MQTT_ERROR_SEND_BUFFER_IS_FULL;
+}
+
+/**
+ * Returns the time at which the client's keep-alive ping is sent (early, by its jitter).
+ */
+static mqtt_pal_time_ms_t __mqtt_reactor_keep_alive_deadline(const struct mqtt_reactor_entry *entry)
+{
+    const struct mqtt_client *client = entry->client;
+    mqtt_pal_time_ms_t keep_alive_ms = 1000u * (mqtt_pal_time_ms_t) client->keep_alive;
+    mqtt_pal_time_ms_t jitter = entry->jitter_seed % (keep_alive_ms / MQTT_REACTOR_KEEP_ALIVE_JITTER + 1u);
+    return client->time_of_last_send + keep_alive_ms - jitter;
+}
+
+static void __mqtt_reactor_settle(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry, mqtt_pal_time_ms_t now);
+
+/* EPOLL BACKEND */
+
+/**
+ * Stops watching the client's socket.
+ */
+static void __mqtt_reactor_epoll_unregister(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry)
+{
+    if (entry->fd >= 0) {
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, entry->fd, NULL);
+    }
+    entry->fd = -1;
+    entry->events = 0;
+}
+
+/**
+ * Makes sure the client's current socket is registered for \p events.
+ */
+static enum MQTTErrors __mqtt_reactor_epoll_register(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry, uint32_t events)
+{
+    struct epoll_event ev;
+    if (entry->fd != entry->client->socketfd) {
+        __mqtt_reactor_epoll_unregister(reactor, entry);
+        entry->fd = entry->client->socketfd;
+    }
+    if (entry->fd < 0 || entry->events == events) {
+        return MQTT_OK;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = entry;
+    if (epoll_ctl(reactor->epoll_fd, entry->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, entry->fd, &ev) != 0) {
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+    entry->events = events;
+    return MQTT_OK;
+}
+
+/**
+ * Arms the timerfd for the earliest deadline of the registered clients.
+ */
+static void __mqtt_reactor_epoll_arm_timer(struct mqtt_reactor *reactor)
+{
+    mqtt_pal_time_ms_t deadline = reactor->heap_size > 0 ? reactor->heap[0]->deadline : MQTT_SYNC_NO_DEADLINE;
+    struct itimerspec spec;
+    if (deadline == reactor->timer_deadline) {
+        return;
+    }
+
+    memset(&spec, 0, sizeof(spec));
+    if (deadline != MQTT_SYNC_NO_DEADLINE) {
+        /* the clocks are the same, an all zero time would disarm the timer */
+        spec.it_value.tv_sec = (time_t) (deadline / 1000u);
+        spec.it_value.tv_nsec = (long) (deadline % 1000u) * 1000000L + 1;
+    }
+    timerfd_settime(reactor->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    reactor->timer_deadline = deadline;
+}
+
+static enum MQTTErrors __mqtt_reactor_epoll_init(struct mqtt_reactor *reactor)
+{
+    struct epoll_event ev;
+    reactor->timer_deadline = MQTT_SYNC_NO_DEADLINE;
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (reactor->epoll_fd < 0 || reactor->timer_fd < 0) {
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+
+    /* the timer and the wakeup are told apart from the clients by their data pointers */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &reactor->timer_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->timer_fd, &ev) != 0) {
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+    ev.data.ptr = &reactor->wakeup_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wakeup_fd, &ev) != 0) {
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+    return MQTT_OK;
+}
+
+static void __mqtt_reactor_epoll_destroy(struct mqtt_reactor *reactor)
+{
+    if (reactor->epoll_fd >= 0) close(reactor->epoll_fd);
+    if (reactor->timer_fd >= 0) close(reactor->timer_fd);
+    reactor->epoll_fd = -1;
+    reactor->timer_fd = -1;
+}
+
+#if defined(MQTT_USE_IO_URING)
+/* IO_URING BACKEND */
+
+/*
+ * The low bits of an operation's user_data tell what it is: the multishot receive of an entry,
+ * the poll of an entry for EPOLLOUT or a send that was submitted by the flush.
+ */
+#define MQTT_REACTOR_RING_RECV 0u
+#define MQTT_REACTOR_RING_POLL_OUT 1u
+#define MQTT_REACTOR_RING_SEND 2u
+#define MQTT_REACTOR_RING_TAGS 3u
+
+/**
+ * A client's messages that are sent by the flush, see __mqtt_reactor_ring_flush.
+ */
+struct __mqtt_reactor_send {
+    struct mqtt_reactor_entry *entry;
+    struct mqtt_send_batch batch;
+    struct msghdr msg;
+    ssize_t rv;
+    int res;
+    int submitted;
+};
+
+static uint64_t __mqtt_reactor_user_data(const void *ptr, unsigned kind)
+{
+    return (uint64_t) (uintptr_t) ptr | kind;
+}
+
+static int __mqtt_reactor_uses_ring(const struct mqtt_reactor *reactor)
+{
+    return reactor->ring_fd >= 0;
+}
+
+/**
+ * Submits the queued submission queue entries (and waits for \p min_complete completions if
+ * \p flags has IORING_ENTER_GETEVENTS).
+ */
+static int __mqtt_reactor_ring_enter(struct mqtt_reactor *reactor, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    struct mqtt_reactor_ring *ring = &reactor->ring;
+    unsigned to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return (int) syscall(__NR_io_uring_enter, reactor->ring_fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+/**
+ * Queues an operation and returns its (cleared) submission queue entry, or NULL if the
+ * submission queue is full. The submission queue is flushed first if it is full.
+ */
+static struct io_uring_sqe *__mqtt_reactor_ring_sqe(struct mqtt_reactor *reactor, uint8_t opcode, int fd, uint64_t user_data)
+{
+    struct mqtt_reactor_ring *ring = &reactor->ring;
+    unsigned tail = *ring->sq_tail;
+    struct io_uring_sqe *sqe;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == *ring->sq_entries) {
+        __mqtt_reactor_ring_enter(reactor, 0, 0, NULL, 0);
+        if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == *ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    /* the kernel only reads the queue in io_uring_enter, the entry can be filled in after this */
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/**
+ * Queues a poll of \p fd for \p events.
+ */
+static enum MQTTErrors __mqtt_reactor_ring_poll(struct mqtt_reactor *reactor, int fd, uint32_t events, uint32_t flags, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = __mqtt_reactor_ring_sqe(reactor, IORING_OP_POLL_ADD, fd, user_data);
+    if (sqe == NULL) {
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    events = (events << 16) | (events >> 16);
+#endif
+    sqe->poll32_events = events;
+    sqe->len = flags;
+    return MQTT_OK;
+}
+
+/**
+ * Queues the cancellation of the operation with \p user_data.
+ */
+static void __mqtt_reactor_ring_cancel(struct mqtt_reactor *reactor, uint8_t opcode, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = __mqtt_reactor_ring_sqe(reactor, opcode, -1, 0);
+    if (sqe != NULL) {
+        sqe->addr = user_data;
+    }
+}
+
+/**
+ * Hands the provided buffer \p bid back to the kernel.
+ */
+static void __mqtt_reactor_ring_recycle(struct mqtt_reactor_ring *ring, unsigned bid)
+{
+    uint16_t tail = ring->buf_ring->tail;
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[tail & (ring->num_buffers - 1)];
+    buf->addr = (uint64_t) (uintptr_t) (ring->buffers + (size_t) bid * MQTT_REACTOR_RING_BUFFER_SIZE);
+    buf->len = MQTT_REACTOR_RING_BUFFER_SIZE;
+    buf->bid = (uint16_t) bid;
+    __atomic_store_n(&ring->buf_ring->tail, (uint16_t) (tail + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * Clears the operations of \p entry whose last completion is in the completion queue, and
+ * hides all of its completions from mqtt_reactor_run_once.
+ */
+static void __mqtt_reactor_ring_scrub(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry)
+{
+    struct mqtt_reactor_ring *ring = &reactor->ring;
+    unsigned head;
+    for(head = *ring->cq_head; head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE); ++head) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        unsigned kind = (unsigned) (cqe->user_data & MQTT_REACTOR_RING_TAGS);
+        if (kind == MQTT_REACTOR_RING_SEND || (cqe->user_data & ~(uint64_t) MQTT_REACTOR_RING_TAGS) != __mqtt_reactor_user_data(entry, 0)) {
+            continue;
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            entry->events &= kind == MQTT_REACTOR_RING_POLL_OUT ? ~(uint32_t) EPOLLOUT : ~(uint32_t) EPOLLIN;
+        }
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            __mqtt_reactor_ring_recycle(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        cqe->user_data = 0;
+    }
+}
+
+/**
+ * Stops receiving from the client's socket.
+ */
+static void __mqtt_reactor_ring_unregister(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry)
+{
+    if (entry->events & EPOLLIN) {
+        __mqtt_reactor_ring_cancel(reactor, IORING_OP_ASYNC_CANCEL, __mqtt_reactor_user_data(entry, MQTT_REACTOR_RING_RECV));
+    }
+    if (entry->events & EPOLLOUT) {
+        __mqtt_reactor_ring_cancel(reactor, IORING_OP_POLL_REMOVE, __mqtt_reactor_user_data(entry, MQTT_REACTOR_RING_POLL_OUT));
+    }
+
+    /* the entry can be reused once the operations are done, wait for their last completions */
+    for(;;) {
+        __mqtt_reactor_ring_scrub(reactor, entry);
+        if (!(entry->events & (EPOLLIN | EPOLLOUT))) {
+            break;
+        }
+        if (__mqtt_reactor_ring_enter(reactor, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            break;
+        }
+    }
+    entry->fd = -1;
+    entry->events = 0;
+}
+
+/**
+ * Makes sure the client's current socket is received from, and watched for \p events.
+ *
+ * The socket is received from by a multishot receive into the reactor's provided buffers. A
+ * poll for EPOLLOUT completes once; one that is no longer needed isn't cancelled.
+ */
+static enum MQTTErrors __mqtt_reactor_ring_register(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry, uint32_t events)
+{
+    if (entry->fd != entry->client->socketfd) {
+        __mqtt_reactor_ring_unregister(reactor, entry);
+        entry->fd = entry->client->socketfd;
+    }
+    if (entry->fd < 0) {
+        return MQTT_OK;
+    }
+
+    if (!(entry->events & EPOLLIN)) {
+        struct io_uring_sqe *sqe = __mqtt_reactor_ring_sqe(reactor, IORING_OP_RECV, entry->fd, __mqtt_reactor_user_data(entry, MQTT_REACTOR_RING_RECV));
+        if (sqe == NULL) {
+            return MQTT_ERROR_SOCKET_ERROR;
+        }
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        entry->events |= EPOLLIN;
+    }
+    if ((events & EPOLLOUT) && !(entry->events & EPOLLOUT)) {
+        if (__mqtt_reactor_ring_poll(reactor, entry->fd, EPOLLOUT, 0, __mqtt_reactor_user_data(entry, MQTT_REACTOR_RING_POLL_OUT)) != MQTT_OK) {
+            return MQTT_ERROR_SOCKET_ERROR;
+        }
+        entry->events |= EPOLLOUT;
+    }
+    return MQTT_OK;
+}
+
+/**
+ * Queues \p entry for the next flush (see __mqtt_reactor_ring_flush).
+ */
+static void __mqtt_reactor_ring_ready(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry)
+{
+    struct mqtt_reactor_ring *ring = &reactor->ring;
+    if (entry->ready) {
+        return;
+    }
+    entry->ready = 1;
+    entry->next_ready = NULL;
+    if (ring->ready_tail != NULL) {
+        ring->ready_tail->next_ready = entry;
+    } else {
+        ring->ready = entry;
+    }
+    ring->ready_tail = entry;
+
+    /* the flush schedules the client again, keep it out of the way of the expired deadlines */
+    entry->deadline = MQTT_SYNC_NO_DEADLINE;
+    __mqtt_reactor_heap_update(reactor, entry);
+}
+
+/**
+ * Takes \p entry out of the entries for the next flush.
+ */
+static void __mqtt_reactor_ring_unready(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry)
+{
+    struct mqtt_reactor_ring *ring = &reactor->ring;
+    struct mqtt_reactor_entry *prev = NULL;
+    struct mqtt_reactor_entry *it;
+    if (!entry->ready) {
+        return;
+    }
+    for(it = ring->ready; it != entry; it = it->next_ready) {
+        prev = it;
+    }
+    if (prev != NULL) {
+        prev->next_ready = entry->next_ready;
+    } else {
+        ring->ready = entry->next_ready;
+    }
+    if (ring->ready_tail == entry) {
+        ring->ready_tail = prev;
+    }
+    entry->ready = 0;
+    entry->next_ready = NULL;
+}
+
+/**
+ * Feeds the bytes of a completed receive to the client, and returns the buffer to the kernel.
+ */
+static void __mqtt_reactor_ring_received(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry, const struct io_uring_cqe *cqe)
+{
+    struct mqtt_reactor_ring *ring = &reactor->ring;
+    struct mqtt_client *client = entry->client;
+    int failed = __mqtt_reactor_has_failed(client);
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!failed && cqe->res > 0) {
+            __mqtt_recv_data(client, ring->buffers + (size_t) bid * MQTT_REACTOR_RING_BUFFER_SIZE, (size_t) cqe->res);
+        }
+        __mqtt_reactor_ring_recycle(ring, bid);
+    }
+    if (!failed && cqe->res <= 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        /* the end of the stream or an error, let the socket report it */
+        __mqtt_recv(client);
+    }
+}
+
+/**
+ * Waits until the kernel completed the \p count sends that are queued, and hides their
+ * completions from mqtt_reactor_run_once.
+ *
+ * The sends don't wait for the sockets (MSG_DONTWAIT), they complete while they are submitted.
+ */
+static void __mqtt_reactor_ring_complete_sends(struct mqtt_reactor *reactor, unsigned count)
+{
+    struct mqtt_reactor_ring *ring = &reactor->ring;
+    unsigned flags = 0;
+    while(count > 0) {
+        unsigned head;
+        if (__mqtt_reactor_ring_enter(reactor, flags != 0 ? 1 : 0, flags, NULL, 0) < 0 && errno != EINTR) {
+            break;
+        }
+        for(head = *ring->cq_head; head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE); ++head) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            struct __mqtt_reactor_send *send;
+            if ((cqe->user_data & MQTT_REACTOR_RING_TAGS) != MQTT_REACTOR_RING_SEND) {
+                continue;
+            }
+            send = (struct __mqtt_reactor_send*) (uintptr_t) (cqe->user_data & ~(uint64_t) MQTT_REACTOR_RING_TAGS);
+            send->res = cqe->res;
+            cqe->user_data = 0;
+            --count;
+        }
+        flags = IORING_ENTER_GETEVENTS;
+    }
+}
+
+/**
+ * Sends the messages of the clients that are queued for the flush, and schedules the clients.
+ *
+ * The messages of up to \ref MQTT_REACTOR_RING_SENDS clients are gathered with the clients'
+ * mutexes locked and submitted together in one io_uring_enter call. Clients that have more to
+ * send than one batch are queued again.
+ */
+static void __mqtt_reactor_ring_flush(struct mqtt_reactor *reactor, mqtt_pal_time_ms_t now)
+{
+    struct mqtt_reactor_ring *ring = &reactor->ring;
+    struct __mqtt_reactor_send *sends = (struct __mqtt_reactor_send*) ring->sends;
+    while (ring->ready != NULL) {
+        unsigned submitted = 0;
+        int n = 0;
+        int i;
+
+        /* gather the messages */
+        while (ring->ready != NULL && n < MQTT_REACTOR_RING_SENDS) {
+            struct __mqtt_reactor_send *send = &sends[n++];
+            struct mqtt_reactor_entry *entry = ring->ready;
+            struct mqtt_client *client = entry->client;
+            struct io_uring_sqe *sqe;
+
+            ring->ready = entry->next_ready;
+            if (ring->ready == NULL) {
+                ring->ready_tail = NULL;
+            }
+            entry->ready = 0;
+            entry->next_ready = NULL;
+            send->entry = entry;
+            send->submitted = 0;
+            send->rv = MQTT_OK;
+            if (__mqtt_reactor_has_failed(client)) {
+                continue;
+            }
+
+            send->rv = __mqtt_send_begin(client, &send->batch, now);
+            if (send->rv > 0) {
+                send->rv = __mqtt_send_gather(client, &send->batch);
+            }
+
+            /* with nothing else to send, ping before __mqtt_send would (i.e. with this client's jitter) */
+            if (send->rv == 0 && client->keep_alive != 0 && now >= __mqtt_reactor_keep_alive_deadline(entry)) {
+                send->rv = __mqtt_ping(client);
+                if (send->rv == MQTT_OK) {
+                    /* packing it may have moved the queue, gather it from the front again */
+                    send->batch.next = 0;
+                    send->batch.length = mqtt_mq_length(&client->mq);
+                    send->rv = __mqtt_send_gather(client, &send->batch);
+                }
+            }
+            if (send->rv <= 0) {
+                send->rv = __mqtt_send_end(client, &send->batch, send->rv);
+                continue;
+            }
+
+            /* the mutex stays locked until the kernel is done with the buffers */
+            send->submitted = 1;
+            send->res = 0;
+            sqe = __mqtt_reactor_ring_sqe(reactor, IORING_OP_SENDMSG, client->socketfd, __mqtt_reactor_user_data(send, MQTT_REACTOR_RING_SEND));
+            if (sqe == NULL) {
+                /* try again once the socket is writable */
+                continue;
+            }
+            memset(&send->msg, 0, sizeof(send->msg));
+            send->msg.msg_iov = send->batch.iov;
+            send->msg.msg_iovlen = (size_t) send->batch.num_iov;
+            sqe->addr = (uint64_t) (uintptr_t) &send->msg;
+            sqe->msg_flags = MSG_DONTWAIT;
+            send->res = -EIO;
+            ++submitted;
+        }
+
+        /* send them with one system call */
+        if (submitted > 0) {
+            __mqtt_reactor_ring_complete_sends(reactor, submitted);
+        }
+
+        /* update the clients' messages, and unlock them */
+        for(i = 0; i < n; ++i) {
+            struct __mqtt_reactor_send *send = &sends[i];
+            struct mqtt_client *client = send->entry->client;
+            ssize_t sent;
+            if (!send->submitted) {
+                continue;
+            }
+            if (send->res > 0) {
+                sent = send->res;
+            } else {
+                sent = send->res == -EAGAIN ? 0 : MQTT_ERROR_SOCKET_ERROR;
+            }
+            send->rv = __mqtt_send_sent(client, &send->batch, sent);
+            __mqtt_send_end(client, &send->batch, send->rv > 0 ? MQTT_OK : send->rv);
+        }
+
+        /* schedule them (reconnecting the ones that failed), or queue them again */
+        for(i = 0; i < n; ++i) {
+            struct __mqtt_reactor_send *send = &sends[i];
+            if (send->submitted && send->rv > 0) {
+                __mqtt_reactor_ring_ready(reactor, send->entry);
+            } else {
+                __mqtt_reactor_settle(reactor, send->entry, now);
+            }
+        }
+    }
+}
+
+/**
+ * Submits the queued changes, waits for completions (or the earliest deadline), feeds the
+ * received bytes to the clients and queues them for the flush.
+ */
+static enum MQTTErrors __mqtt_reactor_ring_wait(struct mqtt_reactor *reactor, int timeout_ms, mqtt_pal_time_ms_t *now, int *woken)
+{
+    struct mqtt_reactor_ring *ring = &reactor->ring;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    mqtt_pal_time_ms_t wait_ms = timeout_ms < 0 ? MQTT_SYNC_NO_DEADLINE : (mqtt_pal_time_ms_t) timeout_ms;
+    int n;
+
+    /* the earliest deadline takes the place of the timerfd */
+    if (reactor->heap_size > 0 && reactor->heap[0]->deadline != MQTT_SYNC_NO_DEADLINE) {
+        mqtt_pal_time_ms_t t = MQTT_PAL_TIME_MS();
+        mqtt_pal_time_ms_t until_deadline = reactor->heap[0]->deadline > t ? reactor->heap[0]->deadline - t : 0;
+        if (until_deadline < wait_ms) {
+            wait_ms = until_deadline;
+        }
+    }
+    if (!ring->wakeup_armed) {
+        if (__mqtt_reactor_ring_poll(reactor, reactor->wakeup_fd, EPOLLIN, IORING_POLL_ADD_MULTI, __mqtt_reactor_user_data(&reactor->wakeup_fd, 0)) != MQTT_OK) {
+            return MQTT_ERROR_SOCKET_ERROR;
+        }
+        ring->wakeup_armed = 1;
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    if (wait_ms != MQTT_SYNC_NO_DEADLINE) {
+        ts.tv_sec = (long long) (wait_ms / 1000u);
+        ts.tv_nsec = (long long) (wait_ms % 1000u) * 1000000LL;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+    if (__mqtt_reactor_ring_enter(reactor, wait_ms == 0 ? 0 : 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0
+        && errno != EINTR && errno != ETIME && errno != EBUSY)
+    {
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+    *now = MQTT_PAL_TIME_MS();
+
+    for(n = 0; n < MQTT_REACTOR_MAX_EVENTS; ++n) {
+        unsigned head = *ring->cq_head;
+        struct io_uring_cqe cqe;
+        struct mqtt_reactor_entry *entry;
+        unsigned kind;
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        /* consume it first, the client may wait for more completions */
+        cqe = ring->cqes[head & *ring->cq_mask];
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (cqe.user_data == 0) {
+            /* a cancellation, or a hidden completion of a send or a removed client */
+            continue;
+        }
+        if (cqe.user_data == __mqtt_reactor_user_data(&reactor->wakeup_fd, 0)) {
+            *woken = 1;
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                ring->wakeup_armed = 0;
+            }
+            continue;
+        }
+
+        entry = (struct mqtt_reactor_entry*) (uintptr_t) (cqe.user_data & ~(uint64_t) MQTT_REACTOR_RING_TAGS);
+        kind = (unsigned) (cqe.user_data & MQTT_REACTOR_RING_TAGS);
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            /* the operation is done (re-armed when the client is scheduled) */
+            entry->events &= kind == MQTT_REACTOR_RING_POLL_OUT ? ~(uint32_t) EPOLLOUT : ~(uint32_t) EPOLLIN;
+        }
+        if (kind == MQTT_REACTOR_RING_RECV) {
+            __mqtt_reactor_ring_received(reactor, entry, &cqe);
+        }
+        __mqtt_reactor_ring_ready(reactor, entry);
+    }
+    return MQTT_OK;
+}
+
+/**
+ * Returns non-zero if the kernel has all the io_uring features that the backend uses
+ * (Linux >= 6.0, which brought multishot receives along with IORING_OP_SEND_ZC).
+ */
+static int __mqtt_reactor_ring_probe(struct mqtt_reactor *reactor, const struct io_uring_params *params)
+{
+    union {
+        struct io_uring_probe probe;
+        uint8_t storage[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)];
+    } probe;
+    if (!(params->features & IORING_FEAT_EXT_ARG) || !(params->features & IORING_FEAT_NODROP)) {
+        return 0;
+    }
+    memset(&probe, 0, sizeof(probe));
+    if (syscall(__NR_io_uring_register, reactor->ring_fd, IORING_REGISTER_PROBE, &probe.probe, 256) < 0) {
+        return 0;
+    }
+    return probe.probe.last_op >= IORING_OP_SEND_ZC && (probe.probe.ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+}
+
+static enum MQTTErrors __mqtt_reactor_ring_init(struct mqtt_reactor *reactor, size_t capacity)
+{
+    struct mqtt_reactor_ring *ring = &reactor->ring;
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    size_t cq_entries;
+    unsigned i;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    /* a buffer for every client (so a burst of receives doesn't run out of them) */
+    ring->num_buffers = MQTT_REACTOR_RING_BUFFERS;
+    while (ring->num_buffers < capacity && ring->num_buffers < 32768u) {
+        ring->num_buffers *= 2u;
+    }
+
+    /* room for the completions of everything that can be in flight at the same time */
+    cq_entries = 2u * capacity + ring->num_buffers + MQTT_REACTOR_RING_SENDS + 2u * MQTT_REACTOR_RING_ENTRIES;
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = (uint32_t) (cq_entries < 65536u ? cq_entries : 65536u);
+    reactor->ring_fd = (int) syscall(__NR_io_uring_setup, MQTT_REACTOR_RING_ENTRIES, &params);
+    if (reactor->ring_fd < 0) {
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+    if (params.cq_entries < cq_entries || !__mqtt_reactor_ring_probe(reactor, &params)) {
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = 0;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reactor->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+    ring->cq_ptr = ring->sq_ptr;
+    if (ring->cq_size != 0) {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reactor->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            return MQTT_ERROR_SOCKET_ERROR;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reactor->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+
+    ring->sq_head = (unsigned*) ((uint8_t*) ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned*) ((uint8_t*) ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) ((uint8_t*) ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_entries = (unsigned*) ((uint8_t*) ring->sq_ptr + params.sq_off.ring_entries);
+    ring->cq_head = (unsigned*) ((uint8_t*) ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned*) ((uint8_t*) ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) ((uint8_t*) ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) ((uint8_t*) ring->cq_ptr + params.cq_off.cqes);
+
+    /* submission queue entry i is always in slot i */
+    for(i = 0; i < params.sq_entries; ++i) {
+        ((unsigned*) ((uint8_t*) ring->sq_ptr + params.sq_off.array))[i] = i;
+    }
+
+    /* the provided buffers that the sockets are received into */
+    ring->buf_ring_size = ring->num_buffers * sizeof(struct io_uring_buf);
+    ring->buf_ring = (struct io_uring_buf_ring*) mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+    ring->buffers_size = (size_t) ring->num_buffers * MQTT_REACTOR_RING_BUFFER_SIZE;
+    ring->buffers = (uint8_t*) mmap(NULL, ring->buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) {
+        ring->buffers = NULL;
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ring->buf_ring;
+    reg.ring_entries = ring->num_buffers;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, reactor->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+    for(i = 0; i < ring->num_buffers; ++i) {
+        __mqtt_reactor_ring_recycle(ring, i);
+    }
+
+    /* the state of the sends that are submitted together */
+    ring->sends_size = MQTT_REACTOR_RING_SENDS * sizeof(struct __mqtt_reactor_send);
+    ring->sends = mmap(NULL, ring->sends_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->sends == MAP_FAILED) {
+        ring->sends = NULL;
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+    return MQTT_OK;
+}
+
+static void __mqtt_reactor_ring_destroy(struct mqtt_reactor *reactor)
+{
+    struct mqtt_reactor_ring *ring = &reactor->ring;
+    if (ring->sends != NULL) munmap(ring->sends, ring->sends_size);
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != NULL && ring->cq_size != 0) munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr != NULL) munmap(ring->sq_ptr, ring->sq_size);
+    if (reactor->ring_fd >= 0) close(reactor->ring_fd);
+    /* the kernel lets go of the provided buffers with the ring */
+    if (ring->buffers != NULL) munmap(ring->buffers, ring->buffers_size);
+    if (ring->buf_ring != NULL) munmap(ring->buf_ring, ring->buf_ring_size);
+    memset(ring, 0, sizeof(*ring));
+    reactor->ring_fd = -1;
+}
+#else
+static int __mqtt_reactor_uses_ring(const struct mqtt_reactor *reactor)
+{
+    (void) reactor;
+    return 0;
+}
+#endif
+
+/* BACKEND SELECTION */
+/**
+ * Stops watching the client's socket.
+ */
+static void __mqtt_reactor_unregister(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry)
+{
+#if defined(MQTT_USE_IO_URING)
+    if (__mqtt_reactor_uses_ring(reactor)) {
+        __mqtt_reactor_ring_unregister(reactor, entry);
+        return;
+    }
+#endif
+    __mqtt_reactor_epoll_unregister(reactor, entry);
+}
+
+/**
+ * Makes sure the client's current socket is watched for \p events.
+ */
+static enum MQTTErrors __mqtt_reactor_register(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry, uint32_t events)
+{
+#if defined(MQTT_USE_IO_URING)
+    if (__mqtt_reactor_uses_ring(reactor)) {
+        return __mqtt_reactor_ring_register(reactor, entry, events);
+    }
+#endif
+    return __mqtt_reactor_epoll_register(reactor, entry, events);
+}
+
+/**
+ * Arms the timerfd (with io_uring the timeout of the wait is derived from the timer heap instead).
+ */
+static void __mqtt_reactor_arm_timer(struct mqtt_reactor *reactor)
+{
+    if (!__mqtt_reactor_uses_ring(reactor)) {
+        __mqtt_reactor_epoll_arm_timer(reactor);
+    }
+}
+
+/* SCHEDULING */
+/**
+ * Updates the socket events and the deadline the client is waiting for.
+ */
+static enum MQTTErrors __mqtt_reactor_schedule(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry)
+{
+    mqtt_pal_time_ms_t deadline;
+    int interest = mqtt_sync_interest(entry->client, &deadline);
+    uint32_t events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    if (interest & MQTT_SYNC_WANT_WRITE) {
+        events |= EPOLLOUT;
+    }
+    if (!__mqtt_reactor_has_failed(entry->client) && entry->client->keep_alive != 0) {
+        mqtt_pal_time_ms_t keep_alive_deadline = __mqtt_reactor_keep_alive_deadline(entry);
+        if (keep_alive_deadline < deadline) {
+            deadline = keep_alive_deadline;
+        }
+    }
+
+    entry->deadline = deadline;
+    __mqtt_reactor_heap_update(reactor, entry);
+    return __mqtt_reactor_register(reactor, entry, events);
+}
+
+/* DISPATCH */
+/**
+ * Removes a client that can't recover from an error and reports the error.
+ */
+static void __mqtt_reactor_fail(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry, enum MQTTErrors error)
+{
+    struct mqtt_client *client = entry->client;
+    mqtt_reactor_remove(reactor, entry);
+    if (reactor->error_callback != NULL) {
+        reactor->error_callback(reactor, client, error);
+    }
+}
+
+/**
+ * Reconnects the client if it failed and schedules it again, after its traffic was handled.
+ */
+static void __mqtt_reactor_settle(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry, mqtt_pal_time_ms_t now)
+{
+    struct mqtt_client *client = entry->client;
+
+    if (__mqtt_reactor_has_failed(client)) {
+        if (client->reconnect_callback == NULL && client->error != MQTT_ERROR_RECONNECTING) {
+            __mqtt_reactor_fail(reactor, entry, client->error);
+            return;
+        }
+
+        /* let mqtt_sync call the reconnect callback (which replaces the socket), the other
+           clients wait while it runs (see mqtt_reactor_add) */
+        mqtt_sync(client);
+        __mqtt_reactor_unregister(reactor, entry);
+        if (__mqtt_reactor_has_failed(client) && client->reconnect_callback == NULL) {
+            __mqtt_reactor_fail(reactor, entry, client->error);
+            return;
+        }
+    }
+
+    if (__mqtt_reactor_schedule(reactor, entry) != MQTT_OK) {
+        __mqtt_reactor_fail(reactor, entry, MQTT_ERROR_SOCKET_ERROR);
+        return;
+    }
+
+    /* don't retry failed reconnects immediately */
+    if (__mqtt_reactor_has_failed(client) && entry->deadline < now + MQTT_REACTOR_RECONNECT_INTERVAL_MS) {
+        entry->deadline = now + MQTT_REACTOR_RECONNECT_INTERVAL_MS;
+        __mqtt_reactor_heap_update(reactor, entry);
+    }
+}
+
+/**
+ * Handles the client's traffic after its socket reported \p events (or its deadline passed
+ * when \p events is 0).
+ *
+ * With io_uring the client is only queued: its bytes were already received, and its messages
+ * are sent together with the other clients' by __mqtt_reactor_ring_flush.
+ */
+static void __mqtt_reactor_dispatch(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry, uint32_t events, mqtt_pal_time_ms_t now)
+{
+    struct mqtt_client *client = entry->client;
+    ssize_t rv = MQTT_OK;
+
+#if defined(MQTT_USE_IO_URING)
+    if (__mqtt_reactor_uses_ring(reactor)) {
+        __mqtt_reactor_ring_ready(reactor, entry);
+        return;
+    }
+#endif
+
+    if (!__mqtt_reactor_has_failed(client)) {
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            rv = __mqtt_recv(client);
+        }
+        if (rv == MQTT_OK) {
+            rv = __mqtt_send(client);
+        }
+
+        /* ping before __mqtt_send would (i.e. with this client's jitter) */
+        if (rv == MQTT_OK && client->keep_alive != 0 && now >= __mqtt_reactor_keep_alive_deadline(entry)) {
+            rv = mqtt_ping(client);
+            if (rv == MQTT_OK) {
+                rv = __mqtt_send(client);
+            }
+        }
+    }
+
+    __mqtt_reactor_settle(reactor, entry, now);
+}
+
+/* WAITING */
+/**
+ * Waits for socket events (or the timerfd) and dispatches the clients whose sockets are ready.
+ */
+static enum MQTTErrors __mqtt_reactor_epoll_wait(struct mqtt_reactor *reactor, int timeout_ms, mqtt_pal_time_ms_t *now, int *woken)
+{
+    struct epoll_event events[MQTT_REACTOR_MAX_EVENTS];
+    uint64_t counter;
+    int n, i;
+
+    n = epoll_wait(reactor->epoll_fd, events, MQTT_REACTOR_MAX_EVENTS, timeout_ms);
+    if (n < 0 && errno != EINTR) {
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+    *now = MQTT_PAL_TIME_MS();
+
+    for(i = 0; i < n; ++i) {
+        if (events[i].data.ptr == &reactor->timer_fd) {
+            if (read(reactor->timer_fd, &counter, sizeof(counter)) < 0) {
+                /* EAGAIN: the timer was re-armed after it fired */
+            }
+        } else if (events[i].data.ptr == &reactor->wakeup_fd) {
+            *woken = 1;
+        } else {
+            __mqtt_reactor_dispatch(reactor, (struct mqtt_reactor_entry*) events[i].data.ptr, events[i].events, *now);
+        }
+    }
+    return MQTT_OK;
+}
+
+static enum MQTTErrors __mqtt_reactor_wait(struct mqtt_reactor *reactor, int timeout_ms, mqtt_pal_time_ms_t *now, int *woken)
+{
+#if defined(MQTT_USE_IO_URING)
+    if (__mqtt_reactor_uses_ring(reactor)) {
+        return __mqtt_reactor_ring_wait(reactor, timeout_ms, now, woken);
+    }
+#endif
+    return __mqtt_reactor_epoll_wait(reactor, timeout_ms, now, woken);
+}
+
+/* API */
+enum MQTTErrors mqtt_reactor_init(struct mqtt_reactor *reactor, struct mqtt_reactor_entry **heap, size_t capacity)
+{
+    reactor->heap = heap;
+    reactor->heap_size = 0;
+    reactor->heap_capacity = capacity;
+    reactor->pending = NULL;
+    reactor->flushing = NULL;
+    reactor->jitter_state = 2463534242u;
+    reactor->error_callback = NULL;
+    reactor->error_callback_state = NULL;
+
+    reactor->epoll_fd = -1;
+    reactor->timer_fd = -1;
+#if defined(MQTT_USE_IO_URING)
+    reactor->ring_fd = -1;
+#endif
+
+    reactor->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->wakeup_fd < 0) {
+        mqtt_reactor_destroy(reactor);
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+#if defined(MQTT_USE_IO_URING)
+    if (__mqtt_reactor_ring_init(reactor, capacity) == MQTT_OK) {
+        return MQTT_OK;
+    }
+    /* io_uring isn't available (or the completion queue can't take this many clients) */
+    __mqtt_reactor_ring_destroy(reactor);
+#else
+    (void) capacity;
+#endif
+    if (__mqtt_reactor_epoll_init(reactor) != MQTT_OK) {
+        mqtt_reactor_destroy(reactor);
+        return MQTT_ERROR_SOCKET_ERROR;
+    }
+    return MQTT_OK;
+}
+
+void mqtt_reactor_destroy(struct mqtt_reactor *reactor)
+{
+#if defined(MQTT_USE_IO_URING)
+    __mqtt_reactor_ring_destroy(reactor);
+#endif
+    __mqtt_reactor_epoll_destroy(reactor);
+    if (reactor->wakeup_fd >= 0) close(reactor->wakeup_fd);
+    reactor->wakeup_fd = -1;
+}
+
+enum MQTTErrors mqtt_reactor_add(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry, struct mqtt_client *client)
+{
+    enum MQTTErrors rv;
+    if (reactor->heap_size == reactor->heap_capacity) {
+        return MQTT_ERROR_REACTOR_FULL;
+    }
+
+    /* xorshift32 */
+    reactor->jitter_state ^= reactor->jitter_state << 13;
+    reactor->jitter_state ^= reactor->jitter_state >> 17;
+    reactor->jitter_state ^= reactor->jitter_state << 5;
+
+    entry->client = client;
+    entry->fd = -1;
+    entry->events = 0;
+    entry->deadline = MQTT_SYNC_NO_DEADLINE;
+    entry->jitter_seed = reactor->jitter_state;
+    entry->pending = 0;
+    entry->next_pending = NULL;
+#if defined(MQTT_USE_IO_URING)
+    entry->ready = 0;
+    entry->next_ready = NULL;
+#endif
+    __mqtt_reactor_heap_set(reactor, reactor->heap_size++, entry);
+
+    rv = __mqtt_reactor_schedule(reactor, entry);
+    if (rv != MQTT_OK) {
+        mqtt_reactor_remove(reactor, entry);
+        return rv;
+    }
+    __mqtt_reactor_arm_timer(reactor);
+    return MQTT_OK;
+}
+
+void mqtt_reactor_remove(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry)
+{
+    struct mqtt_reactor_entry *last;
+    struct mqtt_reactor_entry **link;
+    int found = 0;
+
+    /* the entry may be waiting to be synced by mqtt_reactor_run_once */
+    for(link = &reactor->flushing; *link != NULL; link = &(*link)->next_pending) {
+        if (*link == entry) {
+            *link = entry->next_pending;
+            found = 1;
+            break;
+        }
+    }
+
+    /* take the entry out of the list of entries to flush and leave pending set, so that 
+       mqtt_reactor_wakeup ignores it from now on. A wakeup that already set pending is still
+       pushing the entry, wait for it to arrive */
+    while (!found) {
+        struct mqtt_reactor_entry *list;
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&entry->pending, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        list = __atomic_exchange_n(&reactor->pending, NULL, __ATOMIC_ACQ_REL);
+        while (list != NULL) {
+            struct mqtt_reactor_entry *next = list->next_pending;
+            if (list != entry) {
+                list->next_pending = __atomic_load_n(&reactor->pending, __ATOMIC_RELAXED);
+                while (!__atomic_compare_exchange_n(&reactor->pending, &list->next_pending, list, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+            } else {
+                found = 1;
+            }
+            list = next;
+        }
+        if (!found) {
+            sched_yield();
+        }
+    }
+
+#if defined(MQTT_USE_IO_URING)
+    if (__mqtt_reactor_uses_ring(reactor)) {
+        __mqtt_reactor_ring_unready(reactor, entry);
+    }
+#endif
+    __mqtt_reactor_unregister(reactor, entry);
+
+    /* move the last entry of the heap into the hole */
+    last = reactor->heap[--reactor->heap_size];
+    if (last != entry) {
+        __mqtt_reactor_heap_set(reactor, entry->heap_index, last);
+        __mqtt_reactor_heap_update(reactor, last);
+    }
+    __mqtt_reactor_arm_timer(reactor);
+}
+
+void mqtt_reactor_wakeup(struct mqtt_reactor *reactor, struct mqtt_reactor_entry *entry)
+{
+    uint64_t one = 1;
+    if (__atomic_exchange_n(&entry->pending, 1, __ATOMIC_ACQ_REL)) {
+        /* already waiting to be flushed */
+        return;
+    }
+    entry->next_pending = __atomic_load_n(&reactor->pending, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&reactor->pending, &entry->next_pending, entry, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (write(reactor->wakeup_fd, &one, sizeof(one)) < 0) {
+        /* the counter is already non-zero (EAGAIN), the reactor will wake up anyway */
+    }
+}
+
+enum MQTTErrors mqtt_reactor_run_once(struct mqtt_reactor *reactor, int timeout_ms)
+{
+    mqtt_pal_time_ms_t now;
+    size_t budget;
+    int woken = 0;
+    enum MQTTErrors rv;
+
+    /* socket events */
+    rv = __mqtt_reactor_wait(reactor, timeout_ms, &now, &woken);
+    if (rv != MQTT_OK) {
+        return rv;
+    }
+
+    /* clients that have messages queued by other threads */
+    if (woken) {
+        struct mqtt_reactor_entry *entry;
+        uint64_t counter;
+        if (read(reactor->wakeup_fd, &counter, sizeof(counter)) < 0) {
+            /* EAGAIN: somebody else already reset the counter */
+        }
+
+        /* kept in the reactor, so that mqtt_reactor_remove can take entries out of it */
+        reactor->flushing = __atomic_exchange_n(&reactor->pending, NULL, __ATOMIC_ACQ_REL);
+        while ((entry = reactor->flushing) != NULL) {
+            reactor->flushing = entry->next_pending;
+            __atomic_store_n(&entry->pending, 0, __ATOMIC_RELEASE);
+            __mqtt_reactor_dispatch(reactor, entry, 0, now);
+        }
+    }
+
+    /* clients whose deadline has passed (each at most once per call) */
+    for(budget = reactor->heap_size; budget > 0 && reactor->heap_size > 0 && reactor->heap[0]->deadline <= now; --budget) {
+        __mqtt_reactor_dispatch(reactor, reactor->heap[0], 0, now);
+    }
+
+#if defined(MQTT_USE_IO_URING)
+    /* send for all the clients that are ready */
+    if (__mqtt_reactor_uses_ring(reactor)) {
+        __mqtt_reactor_ring_flush(reactor, now);
+    }
+#endif
+
+    __mqtt_reactor_arm_timer(reactor);
+    return MQTT_OK;
+}
+
+#endif /* defined(MQTT_REACTOR_AVAILABLE) */
+
+/** @endcond */
@@ -0,0 +1,482 @@
+/*
+MIT License
+
+Copyright(c) 2018 Liam Bindle
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <mqtt_store.h>
+
+/**
+ * @file
+ * @brief Implements the memory-mapped session store (see @ref store).
+ *
+ * @cond Doxygen_Suppress
+ */
+
+#if defined(MQTT_STORE_AVAILABLE)
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if !defined(PATH_MAX)
+#define PATH_MAX 4096
+#endif
+
+/* FILE FORMAT */
+
+#define MQTT_STORE_VERSION 1u
+
+/* outgoing PUBLISH/PUBREL records by packet ID, then incoming PUBREC records by packet ID */
+#define MQTT_STORE_INDEX_BYTES (2u * 65536u * sizeof(uint32_t))
+
+static const char __mqtt_store_magic[8] = {'M', 'Q', 'T', 'T', '-', 'C', 'S', 'S'};
+
+struct __mqtt_store_header {
+    char magic[8];
+    uint32_t version;
+    /** The epoch of the last time the file was opened. */
+    uint32_t epoch;
+};
+
+enum {
+    MQTT_STORE_RECORD_APPEND = 1,
+    MQTT_STORE_RECORD_COMPLETE = 2
+};
+
+/**
+ * The header of a record, followed by \c size bytes of the packet and padding up to the next
+ * multiple of 8. Records are only valid after the header, and while their epochs don't
+ * decrease: an older record that follows a newer one was left over from before a crash.
+ */
+struct __mqtt_store_record {
+    /** FNV-1a of the rest of the header and the packet. */
+    uint32_t checksum;
+    uint32_t epoch;
+    uint32_t size;
+    uint16_t packet_id;
+    uint8_t control_type;
+    uint8_t kind;
+};
+
+#define MQTT_STORE_RECORD_SIZE(size) ((sizeof(struct __mqtt_store_record) + (size_t) (size) + 7u) & ~(size_t) 7u)
+
+static uint32_t __mqtt_store_checksum(const struct __mqtt_store_record *record)
+{
+    const uint8_t *p = (const uint8_t*) record + sizeof(record->checksum);
+    const uint8_t *end = (const uint8_t*) (record + 1) + record->size;
+    uint32_t hash = 2166136261u;
+    for(; p < end; ++p) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+static size_t __mqtt_store_slot(enum MQTTControlPacketType control_type, uint16_t packet_id)
+{
+    return control_type == MQTT_CONTROL_PUBREC ? 65536u + packet_id : packet_id;
+}
+
+static struct __mqtt_store_record* __mqtt_store_record_at(const struct mqtt_store *store, size_t pos)
+{
+    return (struct __mqtt_store_record*) (store->map + pos);
+}
+
+/* Writes a record at store->end (there must be room for it). */
+static void __mqtt_store_put(struct mqtt_store *store, uint8_t kind,
+                             enum MQTTControlPacketType control_type, uint16_t packet_id,
+                             const void *packet, size_t packet_size,
+                             const void *payload, size_t payload_size)
+{
+    struct __mqtt_store_record *record = __mqtt_store_record_at(store, store->end);
+    record->epoch = store->epoch;
+    record->size = (uint32_t) (packet_size + payload_size);
+    record->packet_id = packet_id;
+    record->control_type = (uint8_t) control_type;
+    record->kind = kind;
+    if (packet_size > 0) {
+        memcpy(record + 1, packet, packet_size);
+    }
+    if (payload_size > 0) {
+        memcpy((uint8_t*) (record + 1) + packet_size, payload, payload_size);
+    }
+    record->checksum = __mqtt_store_checksum(record);
+    store->end += MQTT_STORE_RECORD_SIZE(record->size);
+}
+
+/* Forgets the live record in a slot of the index (if any). */
+static void __mqtt_store_forget(struct mqtt_store *store, size_t slot)
+{
+    if (store->index[slot] != 0) {
+        store->live_size -= MQTT_STORE_RECORD_SIZE(__mqtt_store_record_at(store, store->index[slot])->size);
+        store->number_of_messages -= 1;
+        store->index[slot] = 0;
+    }
+}
+
+/* SYNCING */
+static enum MQTTErrors __mqtt_store_sync(struct mqtt_store *store)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t from = store->synced & ~(page - 1);
+    if (store->synced == store->end) {
+        return MQTT_OK;
+    }
+    if (msync(store->map + from, store->end - from, MS_SYNC) != 0) {
+        return MQTT_ERROR_STORE_IO;
+    }
+    store->synced = store->end;
+    store->number_of_syncs += 1;
+    return MQTT_OK;
+}
+
+/* Makes a rename in the directory of path durable. */
+static void __mqtt_store_sync_directory(const char *path)
+{
+    char directory[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    size_t length = slash == NULL ? 0 : (slash == path ? 1 : (size_t) (slash - path));
+    int fd;
+    if (length >= sizeof(directory)) {
+        return;
+    }
+    if (slash == NULL) {
+        directory[length++] = '.';
+    } else {
+        memcpy(directory, path, length);
+    }
+    directory[length] = '\0';
+
+    fd = open(directory, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/* COMPACTION */
+
+/*
+ * Copies the live records into a new file that replaces the old one, so \p needed more bytes
+ * can be appended.
+ */
+static enum MQTTErrors __mqtt_store_compact(struct mqtt_store *store, size_t needed)
+{
+    char tmp_path[PATH_MAX];
+    struct __mqtt_store_header *header;
+    uint8_t *map;
+    size_t pos, end;
+    int fd;
+
+    if (sizeof(struct __mqtt_store_header) + store->live_size + needed > store->capacity) {
+        return MQTT_ERROR_STORE_FULL;
+    }
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", store->path) >= (int) sizeof(tmp_path)) {
+        return MQTT_ERROR_STORE_IO;
+    }
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return MQTT_ERROR_STORE_IO;
+    }
+    map = ftruncate(fd, (off_t) store->capacity) == 0
+        ? (uint8_t*) mmap(NULL, store->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+        : (uint8_t*) MAP_FAILED;
+    if (map == (uint8_t*) MAP_FAILED) {
+        close(fd);
+        unlink(tmp_path);
+        return MQTT_ERROR_STORE_IO;
+    }
+
+    header = (struct __mqtt_store_header*) map;
+    memcpy(header->magic, __mqtt_store_magic, sizeof(header->magic));
+    header->version = MQTT_STORE_VERSION;
+    header->epoch = store->epoch;
+
+    /* the live records keep their order (and their epochs, which don't decrease) */
+    end = sizeof(struct __mqtt_store_header);
+    for(pos = end; pos < store->end; pos += MQTT_STORE_RECORD_SIZE(__mqtt_store_record_at(store, pos)->size)) {
+        const struct __mqtt_store_record *record = __mqtt_store_record_at(store, pos);
+        size_t slot = __mqtt_store_slot((enum MQTTControlPacketType) record->control_type, record->packet_id);
+        if (record->kind == MQTT_STORE_RECORD_APPEND && store->index[slot] == pos) {
+            memcpy(map + end, record, MQTT_STORE_RECORD_SIZE(record->size));
+            store->index[slot] = (uint32_t) end;
+            end += MQTT_STORE_RECORD_SIZE(record->size);
+        }
+    }
+
+    if (store->durability != MQTT_STORE_NO_SYNC && (msync(map, end, MS_SYNC) != 0 || fsync(fd) != 0)) {
+        munmap(map, store->capacity);
+        close(fd);
+        unlink(tmp_path);
+        return MQTT_ERROR_STORE_IO;
+    }
+    if (rename(tmp_path, store->path) != 0) {
+        munmap(map, store->capacity);
+        close(fd);
+        unlink(tmp_path);
+        return MQTT_ERROR_STORE_IO;
+    }
+    if (store->durability != MQTT_STORE_NO_SYNC) {
+        __mqtt_store_sync_directory(store->path);
+    }
+
+    munmap(store->map, store->capacity);
+    close(store->fd);
+    store->map = map;
+    store->fd = fd;
+    store->end = end;
+    store->synced = end;
+    store->number_of_compactions += 1;
+    return MQTT_OK;
+}
+
+/* JOURNAL HOOKS */
+static enum MQTTErrors __mqtt_store_append(void *state, const struct mqtt_queued_message *msg)
+{
+    struct mqtt_store *store = (struct mqtt_store*) state;
+    size_t size, slot;
+    const void *payload;
+
+    if (msg->producer != NULL) {
+        /* a streamed payload isn't known yet */
+        return MQTT_OK;
+    }
+    payload = msg->application_message;
+    size = MQTT_STORE_RECORD_SIZE(msg->size + msg->application_message_size);
+    if (store->end + size > store->capacity) {
+        enum MQTTErrors rv = __mqtt_store_compact(store, size);
+        if (rv != MQTT_OK) {
+            return rv;
+        }
+    }
+
+    /* a PUBREL replaces its PUBLISH */
+    slot = __mqtt_store_slot(msg->control_type, msg->packet_id);
+    __mqtt_store_forget(store, slot);
+    store->index[slot] = (uint32_t) store->end;
+    store->number_of_messages += 1;
+    store->live_size += size;
+    __mqtt_store_put(store, MQTT_STORE_RECORD_APPEND, msg->control_type, msg->packet_id,
+                     msg->start, msg->size, payload, msg->application_message_size);
+
+    if (store->durability == MQTT_STORE_SYNC_EACH) {
+        return __mqtt_store_sync(store);
+    }
+    return MQTT_OK;
+}
+
+static void __mqtt_store_complete(void *state, enum MQTTControlPacketType control_type, uint16_t packet_id)
+{
+    struct mqtt_store *store = (struct mqtt_store*) state;
+    size_t slot = __mqtt_store_slot(control_type, packet_id);
+    if (store->index[slot] == 0 || __mqtt_store_record_at(store, store->index[slot])->control_type != control_type) {
+        return;
+    }
+    __mqtt_store_forget(store, slot);
+
+    /*
+     * The completion is synced with the next append (at worst the message is sent once more
+     * after a crash). If there is no room for it, compacting drops the record altogether.
+     */
+    if (store->end + MQTT_STORE_RECORD_SIZE(0) > store->capacity) {
+        __mqtt_store_compact(store, 0);
+        return;
+    }
+    __mqtt_store_put(store, MQTT_STORE_RECORD_COMPLETE, control_type, packet_id, NULL, 0, NULL, 0);
+}
+
+static enum MQTTErrors __mqtt_store_flush_batch(void *state)
+{
+    struct mqtt_store *store = (struct mqtt_store*) state;
+    if (store->durability != MQTT_STORE_SYNC_BATCH) {
+        return MQTT_OK;
+    }
+    return __mqtt_store_sync(store);
+}
+
+/* Finds the live records of the file and returns the epoch of the last valid record. */
+static uint32_t __mqtt_store_recover(struct mqtt_store *store)
+{
+    uint32_t epoch = 1;
+    size_t pos = sizeof(struct __mqtt_store_header);
+    while (pos + sizeof(struct __mqtt_store_record) <= store->capacity) {
+        const struct __mqtt_store_record *record = __mqtt_store_record_at(store, pos);
+        size_t slot = __mqtt_store_slot((enum MQTTControlPacketType) record->control_type, record->packet_id);
+        if (record->epoch < epoch
+            || (record->kind != MQTT_STORE_RECORD_APPEND && record->kind != MQTT_STORE_RECORD_COMPLETE)
+            || record->size > store->capacity - pos - sizeof(struct __mqtt_store_record)
+            || record->checksum != __mqtt_store_checksum(record))
+        {
+            /* the end of the records, or one that was torn by a crash */
+            break;
+        }
+        epoch = record->epoch;
+
+        if (record->kind == MQTT_STORE_RECORD_APPEND) {
+            __mqtt_store_forget(store, slot);
+            store->index[slot] = (uint32_t) pos;
+            store->number_of_messages += 1;
+            store->live_size += MQTT_STORE_RECORD_SIZE(record->size);
+        } else if (store->index[slot] != 0
+                   && __mqtt_store_record_at(store, store->index[slot])->control_type == record->control_type)
+        {
+            __mqtt_store_forget(store, slot);
+        }
+        pos += MQTT_STORE_RECORD_SIZE(record->size);
+    }
+    store->end = pos;
+    store->synced = pos;
+    return epoch;
+}
+
+/** @endcond */
+
+/* API */
+enum MQTTErrors mqtt_store_open(struct mqtt_store *store, const char *path, size_t capacity,
+                                enum MQTTStoreDurability durability)
+{
+    struct __mqtt_store_header *header;
+    struct stat st;
+    uint32_t epoch;
+
+    store->journal.append = __mqtt_store_append;
+    store->journal.complete = __mqtt_store_complete;
+    store->journal.flush = __mqtt_store_flush_batch;
+    store->journal.state = store;
+    store->path = path;
+    store->fd = -1;
+    store->map = NULL;
+    store->capacity = (capacity + 7u) & ~(size_t) 7u;
+    store->end = sizeof(struct __mqtt_store_header);
+    store->synced = store->end;
+    store->index = NULL;
+    store->epoch = 1;
+    store->durability = durability;
+    store->number_of_messages = 0;
+    store->live_size = 0;
+    store->number_of_syncs = 0;
+    store->number_of_compactions = 0;
+
+    store->index = (uint32_t*) mmap(NULL, MQTT_STORE_INDEX_BYTES, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (store->index == (uint32_t*) MAP_FAILED) {
+        store->index = NULL;
+        return MQTT_ERROR_STORE_IO;
+    }
+
+    store->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (store->fd < 0 || fstat(store->fd, &st) != 0) {
+        mqtt_store_close(store);
+        return MQTT_ERROR_STORE_IO;
+    }
+    if ((size_t) st.st_size > store->capacity) {
+        store->capacity = (size_t) st.st_size & ~(size_t) 7u;
+    }
+    if (store->capacity < sizeof(struct __mqtt_store_header) + MQTT_STORE_RECORD_SIZE(0)
+        || store->capacity > UINT32_MAX
+        || ((size_t) st.st_size < store->capacity && ftruncate(store->fd, (off_t) store->capacity) != 0))
+    {
+        mqtt_store_close(store);
+        return MQTT_ERROR_STORE_IO;
+    }
+    store->map = (uint8_t*) mmap(NULL, store->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+    if (store->map == (uint8_t*) MAP_FAILED) {
+        store->map = NULL;
+        mqtt_store_close(store);
+        return MQTT_ERROR_STORE_IO;
+    }
+
+    header = (struct __mqtt_store_header*) store->map;
+    if (st.st_size == 0) {
+        memcpy(header->magic, __mqtt_store_magic, sizeof(header->magic));
+        header->version = MQTT_STORE_VERSION;
+        header->epoch = 0;
+    } else if (memcmp(header->magic, __mqtt_store_magic, sizeof(header->magic)) != 0
+               || header->version != MQTT_STORE_VERSION)
+    {
+        mqtt_store_close(store);
+        return MQTT_ERROR_STORE_IO;
+    }
+
+    /* new records must never look older than the ones left over behind them */
+    epoch = __mqtt_store_recover(store);
+    store->epoch = (header->epoch > epoch ? header->epoch : epoch) + 1;
+    header->epoch = store->epoch;
+    if (durability != MQTT_STORE_NO_SYNC
+        && (msync(store->map, sizeof(struct __mqtt_store_header), MS_SYNC) != 0 || fsync(store->fd) != 0))
+    {
+        mqtt_store_close(store);
+        return MQTT_ERROR_STORE_IO;
+    }
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_store_attach(struct mqtt_store *store, struct mqtt_client *client)
+{
+    size_t pos;
+
+    /* nothing may be appended (and compact the file) while the records are read */
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    mqtt_init_session_journal(client, NULL);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+
+    for(pos = sizeof(struct __mqtt_store_header); pos < store->end; pos += MQTT_STORE_RECORD_SIZE(__mqtt_store_record_at(store, pos)->size)) {
+        const struct __mqtt_store_record *record = __mqtt_store_record_at(store, pos);
+        size_t slot = __mqtt_store_slot((enum MQTTControlPacketType) record->control_type, record->packet_id);
+        if (record->kind == MQTT_STORE_RECORD_APPEND && store->index[slot] == pos) {
+            enum MQTTErrors rv = mqtt_restore_message(client, record + 1, record->size);
+            if (rv != MQTT_OK) {
+                return rv;
+            }
+        }
+    }
+
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    mqtt_init_session_journal(client, &store->journal);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_store_flush(struct mqtt_store *store)
+{
+    return __mqtt_store_sync(store);
+}
+
+void mqtt_store_close(struct mqtt_store *store)
+{
+    if (store->map != NULL) {
+        munmap(store->map, store->capacity);
+        store->map = NULL;
+    }
+    if (store->fd >= 0) {
+        close(store->fd);
+        store->fd = -1;
+    }
+    if (store->index != NULL) {
+        munmap(store->index, MQTT_STORE_INDEX_BYTES);
+        store->index = NULL;
+    }
+}
+
+#endif
@@ -0,0 +1,251 @@
+/*
+MIT License
+
+Copyright(c) 2018 Liam Bindle
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <mqtt_topic.h>
+
+/**
+ * @file
+ * @brief Implements the topic matching helpers (see @ref topic).
+ *
+ * @cond Doxygen_Suppress
+ */
+
+#if defined(__GNUC__) && !defined(MQTT_TOPIC_NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MQTT_TOPIC_USE_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define MQTT_TOPIC_USE_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MQTT_TOPIC_USE_NEON
+#endif
+#endif
+
+/* LEVEL SEPARATORS */
+
+/*
+ * Appends the offset after every '/' of s[from, size) to out, and returns the new number of
+ * offsets in out (max + 1 if there are more than max).
+ */
+static size_t __mqtt_topic_scan_scalar(const char *s, size_t from, size_t size, uint32_t *out, size_t n, size_t max)
+{
+    size_t i;
+    for(i = from; i < size; ++i) {
+        if (s[i] == '/') {
+            if (n == max) {
+                return max + 1;
+            }
+            out[n++] = (uint32_t) (i + 1);
+        }
+    }
+    return n;
+}
+
+#if defined(MQTT_TOPIC_USE_AVX2) || defined(MQTT_TOPIC_USE_SSE2)
+/* Appends the offsets after the '/' that are flagged in mask (one bit per byte from base). */
+static size_t __mqtt_topic_append_mask(uint32_t mask, size_t base, uint32_t *out, size_t n, size_t max)
+{
+    while (mask != 0) {
+        if (n == max) {
+            return max + 1;
+        }
+        out[n++] = (uint32_t) (base + (size_t) __builtin_ctz(mask) + 1);
+        mask &= mask - 1;
+    }
+    return n;
+}
+#endif
+
+static size_t __mqtt_topic_scan(const char *s, size_t size, uint32_t *out, size_t max)
+{
+    size_t i = 0, n = 0;
+#if defined(MQTT_TOPIC_USE_AVX2)
+    const __m256i slash = _mm256_set1_epi8('/');
+    for(; i + 32 <= size && n <= max; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*) (s + i));
+        n = __mqtt_topic_append_mask((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, slash)), i, out, n, max);
+    }
+#elif defined(MQTT_TOPIC_USE_SSE2)
+    const __m128i slash = _mm_set1_epi8('/');
+    for(; i + 16 <= size && n <= max; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (s + i));
+        n = __mqtt_topic_append_mask((uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, slash)), i, out, n, max);
+    }
+#elif defined(MQTT_TOPIC_USE_NEON)
+    const uint8x16_t slash = vdupq_n_u8('/');
+    for(; i + 16 <= size && n <= max; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t*) (s + i)), slash);
+        /* narrow the comparison to 4 bits per byte */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        while (mask != 0 && n <= max) {
+            unsigned bit = (unsigned) __builtin_ctzll(mask);
+            if (n == max) {
+                n = max + 1;
+                break;
+            }
+            out[n++] = (uint32_t) (i + bit / 4 + 1);
+            mask &= ~((uint64_t) 0xF << (bit & ~3u));
+        }
+    }
+#endif
+    if (n > max) {
+        return max + 1;
+    }
+    return __mqtt_topic_scan_scalar(s, i, size, out, n, max);
+}
+
+/* MATCHING */
+static int __mqtt_topic_match_levels(const struct mqtt_topic_filter *filter, const struct mqtt_topic_levels *topic)
+{
+    const struct mqtt_topic_levels *levels = &filter->levels;
+    size_t i;
+
+    if (levels->count > MQTT_TOPIC_MAX_LEVELS || topic->count > MQTT_TOPIC_MAX_LEVELS) {
+        return mqtt_topic_matches(levels->name, topic->name, topic->size);
+    }
+    if (filter->multi_level ? topic->count < levels->count : topic->count != levels->count) {
+        return 0;
+    }
+    if (filter->leading_wildcard && topic->size > 0 && topic->name[0] == '$') {
+        return 0;
+    }
+
+    for(i = 0; i < levels->count; ++i) {
+        uint32_t size = levels->start[i + 1] - levels->start[i];
+        if (size == 2 && levels->name[levels->start[i]] == '+') {
+            continue;
+        }
+        if (size != topic->start[i + 1] - topic->start[i]
+            || memcmp(levels->name + levels->start[i], topic->name + topic->start[i], size - 1) != 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/** @endcond */
+
+/* API */
+size_t mqtt_topic_split(struct mqtt_topic_levels *levels, const char *topic, size_t size)
+{
+    size_t separators = __mqtt_topic_scan(topic, size, levels->start + 1, MQTT_TOPIC_MAX_LEVELS - 1);
+    levels->name = topic;
+    levels->size = size;
+    levels->start[0] = 0;
+    if (separators > MQTT_TOPIC_MAX_LEVELS - 1) {
+        levels->count = MQTT_TOPIC_MAX_LEVELS + 1;
+        return 0;
+    }
+    levels->count = separators + 1;
+    levels->start[levels->count] = (uint32_t) (size + 1);
+    return levels->count;
+}
+
+enum MQTTErrors mqtt_topic_filter_compile(struct mqtt_topic_filter *filter, const char *topic_filter)
+{
+    size_t size, i;
+    if (topic_filter == NULL || topic_filter[0] == '\0') {
+        return MQTT_ERROR_INVALID_TOPIC_FILTER;
+    }
+
+    /* wildcards have to take up a whole level, '#' has to be the last one */
+    size = strlen(topic_filter);
+    for(i = 0; i < size; ++i) {
+        if (topic_filter[i] != '+' && topic_filter[i] != '#') {
+            continue;
+        }
+        if ((i > 0 && topic_filter[i - 1] != '/')
+            || (i + 1 < size && (topic_filter[i] == '#' || topic_filter[i + 1] != '/')))
+        {
+            return MQTT_ERROR_INVALID_TOPIC_FILTER;
+        }
+    }
+
+    mqtt_topic_split(&filter->levels, topic_filter, size);
+    filter->multi_level = topic_filter[size - 1] == '#';
+    filter->leading_wildcard = topic_filter[0] == '+' || topic_filter[0] == '#';
+    if (filter->multi_level && filter->levels.count <= MQTT_TOPIC_MAX_LEVELS) {
+        /* the levels before the '#' have to match */
+        filter->levels.count -= 1;
+    }
+    return MQTT_OK;
+}
+
+int mqtt_topic_matches(const char *topic_filter, const char *topic, size_t size)
+{
+    const char *end = topic + size;
+    if (size > 0 && topic[0] == '$' && (topic_filter[0] == '+' || topic_filter[0] == '#')) {
+        return 0;
+    }
+
+    for(;;) {
+        /* at the start of a level of both */
+        if (topic_filter[0] == '#') {
+            return 1;
+        } else if (topic_filter[0] == '+') {
+            const char *slash = (const char*) memchr(topic, '/', (size_t) (end - topic));
+            topic = slash != NULL ? slash : end;
+            ++topic_filter;
+        } else {
+            while (*topic_filter != '\0' && *topic_filter != '/') {
+                if (topic == end || *topic != *topic_filter) {
+                    return 0;
+                }
+                ++topic;
+                ++topic_filter;
+            }
+            if (topic != end && *topic != '/') {
+                return 0;
+            }
+        }
+
+        /* at the end of a level of both */
+        if (*topic_filter == '\0') {
+            return topic == end;
+        } else if (topic == end) {
+            /* "a/#" matches "a" */
+            return topic_filter[1] == '#';
+        }
+        ++topic_filter;
+        ++topic;
+    }
+}
+
+size_t mqtt_topic_match_batch(const struct mqtt_topic_filter *filters, size_t n,
+                              const struct mqtt_topic_levels *topic, uint8_t *matches)
+{
+    size_t matched = 0;
+    size_t i;
+    for(i = 0; i < n; ++i) {
+        int match = __mqtt_topic_match_levels(&filters[i], topic);
+        if (matches != NULL) {
+            matches[i] = (uint8_t) match;
+        }
+        matched += (size_t) match;
+    }
+    return matched;
+}
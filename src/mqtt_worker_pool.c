@@ -0,0 +1,327 @@
+/*
+MIT License
+
+Copyright(c) 2018 Liam Bindle
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files(the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions :
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <mqtt_worker_pool.h>
+
+/**
+ * @file
+ * @brief Implements the worker pool (see @ref workers).
+ *
+ * @cond Doxygen_Suppress
+ */
+
+#if defined(MQTT_WORKER_POOL_AVAILABLE)
+
+/* RINGS */
+
+/*
+ * A publish in a worker's ring, followed by its topic name and payload if they are copied.
+ * Records are 8 byte aligned and never wrap around the end of the ring, the rest of the ring
+ * is skipped with a padding record instead.
+ */
+struct __mqtt_worker_record {
+    /* the size of the record in bytes, including what follows it */
+    uint32_t size;
+    uint8_t padding;
+    uint8_t copied;
+    uint8_t dup_flag;
+    uint8_t qos_level;
+    uint8_t retain_flag;
+    uint16_t topic_name_size;
+    uint16_t packet_id;
+    size_t application_message_size;
+    const void *topic_name;
+    const void *application_message;
+};
+
+#define MQTT_WORKER_RING_MIN_SIZE 64u
+
+static size_t __mqtt_worker_record_size(size_t size)
+{
+    return (size + 7u) & ~(size_t) 7u;
+}
+
+/* Picks the worker of a topic (FNV-1a, reduced to the number of workers by multiplication). */
+static size_t __mqtt_worker_index(const struct mqtt_worker_pool *pool, const struct mqtt_response_publish *publish)
+{
+    const uint8_t *topic = (const uint8_t*) publish->topic_name;
+    uint32_t hash = 2166136261u;
+    uint16_t i;
+    for(i = 0; i < publish->topic_name_size; ++i) {
+        hash = (hash ^ topic[i]) * 16777619u;
+    }
+    return (size_t) (((uint64_t) hash * pool->number_of_workers) >> 32);
+}
+
+/* Wakes the worker if it sleeps, after records were written to its ring. */
+static void __mqtt_worker_notify(struct mqtt_worker *worker)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (MQTT_PAL_ATOMIC_LOAD(&worker->sleeping)) {
+        pthread_mutex_lock(&worker->mutex);
+        pthread_cond_signal(&worker->records);
+        pthread_mutex_unlock(&worker->mutex);
+    }
+}
+
+/* Waits until the worker's ring has room for size more bytes (all of it: until it is empty). */
+static void __mqtt_worker_wait(struct mqtt_worker *worker, size_t size)
+{
+    size_t capacity = worker->mask + 1;
+    size_t head = MQTT_PAL_ATOMIC_LOAD(&worker->head);
+    if (head - MQTT_PAL_ATOMIC_LOAD(&worker->tail) + size <= capacity) {
+        return;
+    }
+
+    worker->number_of_waits += 1;
+    pthread_mutex_lock(&worker->mutex);
+    MQTT_PAL_ATOMIC_STORE(&worker->waiting, 1u);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (head - MQTT_PAL_ATOMIC_LOAD(&worker->tail) + size > capacity) {
+        pthread_cond_wait(&worker->space, &worker->mutex);
+    }
+    MQTT_PAL_ATOMIC_STORE(&worker->waiting, 0u);
+    pthread_mutex_unlock(&worker->mutex);
+}
+
+/* Sleeps until records are written to the worker's empty ring, or the pool is stopped. */
+static void __mqtt_worker_sleep(struct mqtt_worker_pool *pool, struct mqtt_worker *worker, size_t tail)
+{
+    pthread_mutex_lock(&worker->mutex);
+    MQTT_PAL_ATOMIC_STORE(&worker->sleeping, 1u);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (MQTT_PAL_ATOMIC_LOAD(&worker->head) == tail && !MQTT_PAL_ATOMIC_LOAD(&pool->stopped)) {
+        pthread_cond_wait(&worker->records, &worker->mutex);
+    }
+    MQTT_PAL_ATOMIC_STORE(&worker->sleeping, 0u);
+    pthread_mutex_unlock(&worker->mutex);
+}
+
+/* Marks the records up to tail as processed and wakes the receiving thread if it waits. */
+static void __mqtt_worker_consume(struct mqtt_worker *worker, size_t tail)
+{
+    MQTT_PAL_ATOMIC_STORE(&worker->tail, tail);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (MQTT_PAL_ATOMIC_LOAD(&worker->waiting)) {
+        pthread_mutex_lock(&worker->mutex);
+        pthread_cond_signal(&worker->space);
+        pthread_mutex_unlock(&worker->mutex);
+    }
+}
+
+/** @endcond */
+
+/* API */
+enum MQTTErrors mqtt_worker_pool_init(struct mqtt_worker_pool *pool,
+                                      struct mqtt_worker *workers, size_t number_of_workers,
+                                      void *mem, size_t memsz,
+                                      void (*callback)(void** state, struct mqtt_response_publish *publish),
+                                      void *state)
+{
+    size_t padding, share, size = MQTT_WORKER_RING_MIN_SIZE;
+    size_t i;
+    if (pool == NULL || workers == NULL || number_of_workers == 0 || mem == NULL || callback == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+
+    /* every worker gets the same power of two sized ring, 8 byte aligned */
+    padding = (size_t) (-(uintptr_t) mem & 7u);
+    share = memsz > padding ? (memsz - padding) / number_of_workers : 0;
+    if (share < MQTT_WORKER_RING_MIN_SIZE) {
+        return MQTT_ERROR_NULLPTR;
+    }
+    while (size <= share / 2) {
+        size *= 2;
+    }
+
+    for(i = 0; i < number_of_workers; ++i) {
+        struct mqtt_worker *worker = &workers[i];
+        worker->mem = (uint8_t*) mem + padding + i * size;
+        worker->mask = size - 1;
+        worker->head = 0;
+        worker->tail = 0;
+        pthread_mutex_init(&worker->mutex, NULL);
+        pthread_cond_init(&worker->records, NULL);
+        pthread_cond_init(&worker->space, NULL);
+        worker->sleeping = 0;
+        worker->waiting = 0;
+        worker->number_of_publishes = 0;
+        worker->number_of_waits = 0;
+    }
+
+    pool->workers = workers;
+    pool->number_of_workers = number_of_workers;
+    pool->callback = callback;
+    pool->state = state;
+    pool->client = NULL;
+    pool->stopped = 0;
+    pool->number_of_inline_publishes = 0;
+    return MQTT_OK;
+}
+
+void mqtt_worker_pool_destroy(struct mqtt_worker_pool *pool)
+{
+    size_t i;
+    for(i = 0; i < pool->number_of_workers; ++i) {
+        pthread_cond_destroy(&pool->workers[i].space);
+        pthread_cond_destroy(&pool->workers[i].records);
+        pthread_mutex_destroy(&pool->workers[i].mutex);
+    }
+}
+
+void mqtt_worker_pool_attach(struct mqtt_worker_pool *pool, struct mqtt_client *client)
+{
+    pool->client = client->delivery.publishes != NULL ? client : NULL;
+    client->publish_response_callback = mqtt_worker_pool_dispatch;
+    client->publish_response_callback_state = pool;
+}
+
+void mqtt_worker_pool_dispatch(void** state, struct mqtt_response_publish *publish)
+{
+    struct mqtt_worker_pool *pool = (struct mqtt_worker_pool*) *state;
+    struct mqtt_worker *worker = &pool->workers[__mqtt_worker_index(pool, publish)];
+    struct __mqtt_worker_record *record;
+    size_t capacity = worker->mask + 1;
+    size_t size = sizeof(struct __mqtt_worker_record);
+    size_t gap;
+    int copied = pool->client == NULL;
+
+    if (copied) {
+        size += publish->topic_name_size + publish->application_message_size;
+    }
+    size = __mqtt_worker_record_size(size);
+    if (size > capacity) {
+        /* too large for the ring, process it here once the worker is done with its topics */
+        __mqtt_worker_wait(worker, capacity);
+        pool->callback(&pool->state, publish);
+        pool->number_of_inline_publishes += 1;
+        return;
+    }
+
+    /* skip the rest of the ring if the record doesn't fit before its end */
+    gap = capacity - (worker->head & worker->mask);
+    if (gap < size) {
+        __mqtt_worker_wait(worker, gap);
+        record = (struct __mqtt_worker_record*) (worker->mem + (worker->head & worker->mask));
+        record->size = (uint32_t) gap;
+        record->padding = 1;
+        MQTT_PAL_ATOMIC_STORE(&worker->head, worker->head + gap);
+    }
+
+    __mqtt_worker_wait(worker, size);
+    record = (struct __mqtt_worker_record*) (worker->mem + (worker->head & worker->mask));
+    record->size = (uint32_t) size;
+    record->padding = 0;
+    record->copied = (uint8_t) copied;
+    record->dup_flag = publish->dup_flag;
+    record->qos_level = publish->qos_level;
+    record->retain_flag = publish->retain_flag;
+    record->topic_name_size = publish->topic_name_size;
+    record->packet_id = publish->packet_id;
+    record->application_message_size = publish->application_message_size;
+    if (copied) {
+        uint8_t *data = (uint8_t*) (record + 1);
+        memcpy(data, publish->topic_name, publish->topic_name_size);
+        memcpy(data + publish->topic_name_size, publish->application_message, publish->application_message_size);
+        record->topic_name = NULL;
+        record->application_message = NULL;
+    } else {
+        record->topic_name = publish->topic_name;
+        record->application_message = publish->application_message;
+    }
+    MQTT_PAL_ATOMIC_STORE(&worker->head, worker->head + size);
+    __mqtt_worker_notify(worker);
+
+    /* the referenced publishes point into the receive buffer, which is reused after the batch */
+    if (!copied && publish == &pool->client->delivery.publishes[pool->client->delivery.length - 1]) {
+        mqtt_worker_pool_drain(pool);
+    }
+}
+
+void mqtt_worker_pool_run(struct mqtt_worker_pool *pool, size_t index)
+{
+    struct mqtt_worker *worker = &pool->workers[index];
+    struct mqtt_response_publish publish;
+    size_t tail = worker->tail;
+    unsigned idle = 0;
+
+    for(;;) {
+        size_t head = MQTT_PAL_ATOMIC_LOAD(&worker->head);
+        if (head == tail) {
+            if (MQTT_PAL_ATOMIC_LOAD(&pool->stopped)) {
+                return;
+            }
+            if (++idle >= MQTT_WORKER_POOL_SPIN) {
+                __mqtt_worker_sleep(pool, worker, tail);
+                idle = 0;
+            }
+            continue;
+        }
+
+        idle = 0;
+        while (tail != head) {
+            struct __mqtt_worker_record *record = (struct __mqtt_worker_record*) (worker->mem + (tail & worker->mask));
+            if (!record->padding) {
+                publish.dup_flag = record->dup_flag;
+                publish.qos_level = record->qos_level;
+                publish.retain_flag = record->retain_flag;
+                publish.topic_name_size = record->topic_name_size;
+                publish.packet_id = record->packet_id;
+                publish.application_message_size = record->application_message_size;
+                if (record->copied) {
+                    publish.topic_name = record + 1;
+                    publish.application_message = (const uint8_t*) (record + 1) + record->topic_name_size;
+                } else {
+                    publish.topic_name = record->topic_name;
+                    publish.application_message = record->application_message;
+                }
+                pool->callback(&pool->state, &publish);
+                worker->number_of_publishes += 1;
+            }
+            tail += record->size;
+            __mqtt_worker_consume(worker, tail);
+        }
+    }
+}
+
+void mqtt_worker_pool_drain(struct mqtt_worker_pool *pool)
+{
+    size_t i;
+    for(i = 0; i < pool->number_of_workers; ++i) {
+        __mqtt_worker_wait(&pool->workers[i], pool->workers[i].mask + 1);
+    }
+}
+
+void mqtt_worker_pool_stop(struct mqtt_worker_pool *pool)
+{
+    size_t i;
+    MQTT_PAL_ATOMIC_STORE(&pool->stopped, 1u);
+    for(i = 0; i < pool->number_of_workers; ++i) {
+        pthread_mutex_lock(&pool->workers[i].mutex);
+        pthread_cond_broadcast(&pool->workers[i].records);
+        pthread_mutex_unlock(&pool->workers[i].mutex);
+    }
+}
+
+#endif
@@ -28,6 +28,12 @@
 
 
 #include <mqtt.h>
+#include <mqtt_reactor.h>
+#include <mqtt_dispatcher.h>
+#include <mqtt_topic.h>
+#include <mqtt_store.h>
+#include <mqtt_worker_pool.h>
+#include <mqtt_io_thread.h>
 #include "examples/templates/posix_sockets.h"
 
 void make_socket_blocking(int socket)
@@ -599,6 +605,183 @@ static void TEST__utility__message_queue(void **unused) {
     assert_true((void*) mq.queue_tail == mq.mem_end);
 }
 
+static struct mqtt_queued_message* linear_mq_find(struct mqtt_message_queue *mq, enum MQTTControlPacketType control_type, uint16_t packet_id) {
+    /* the most recently queued match */
+    for(ssize_t i = mqtt_mq_length(mq) - 1; i >= 0; --i) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(mq, i);
+        if (msg->control_type == control_type && msg->packet_id == packet_id) {
+            return msg;
+        }
+    }
+    return NULL;
+}
+
+static void TEST__utility__message_queue_index(void **unused) {
+    static uint8_t mem[1024 * sizeof(struct mqtt_queued_message)];
+    const enum MQTTControlPacketType types[] = {MQTT_CONTROL_PUBLISH, MQTT_CONTROL_PUBREL, MQTT_CONTROL_SUBSCRIBE};
+    struct mqtt_message_queue mq;
+    uint16_t packet_id;
+    mqtt_mq_init(&mq, mem, sizeof(mem));
+    assert_true(mq.index != NULL);
+
+    for(int round = 0; round < 4; ++round) {
+        /* fill the queue with messages, including packet ids that are reused (also across types) */
+        for(int i = 0; mq.curr_sz >= 4; ++i) {
+            struct mqtt_queued_message *msg;
+            memset(mq.curr, 0, 4);
+            mq.curr[0] = (uint8_t) ((MQTT_CONTROL_PUBLISH << 4) | MQTT_PUBLISH_QOS_1);
+            msg = mqtt_mq_register(&mq, 4);
+            msg->control_type = types[i % 3];
+            msg->packet_id = (uint16_t) ((i * 7 + round) % 1024);
+        }
+        /* tiny messages overflow the index, so the linear fallback is exercised too */
+        assert_true(mqtt_mq_length(&mq) > (ssize_t) (mq.index_mask + 1) * 3 / 4);
+
+        /* every lookup has to agree with a linear search */
+        for(int i = 0; i < 5000; ++i) {
+            packet_id = (uint16_t) i;
+            for(int t = 0; t < 3; ++t) {
+                assert_true(mqtt_mq_find(&mq, types[t], &packet_id) == linear_mq_find(&mq, types[t], packet_id));
+            }
+        }
+
+        /* complete a prefix of the queue and clean it */
+        for(ssize_t i = 0; i < mqtt_mq_length(&mq) / 2 + round; ++i) {
+            mqtt_mq_get(&mq, i)->state = MQTT_QUEUED_COMPLETE;
+        }
+        mqtt_mq_clean(&mq);
+        for(int i = 0; i < 5000; ++i) {
+            packet_id = (uint16_t) i;
+            for(int t = 0; t < 3; ++t) {
+                assert_true(mqtt_mq_find(&mq, types[t], &packet_id) == linear_mq_find(&mq, types[t], packet_id));
+            }
+        }
+    }
+
+    /* emptying the queue empties the index */
+    for(ssize_t i = 0; i < mqtt_mq_length(&mq); ++i) {
+        mqtt_mq_get(&mq, i)->state = MQTT_QUEUED_COMPLETE;
+    }
+    mqtt_mq_clean(&mq);
+    assert_true(mqtt_mq_length(&mq) == 0);
+    assert_true(mq.index_count == 0 && mq.index_head_seq == 0 && mq.index_used == 0);
+    for(uint32_t slot = 0; slot <= mq.index_mask; ++slot) {
+        assert_true(mq.index[slot] == 0);
+    }
+}
+
+static void TEST__utility__message_queue_index_qos0(void **unused) {
+    static uint8_t mem[4096 * sizeof(struct mqtt_queued_message)];
+    struct mqtt_message_queue mq;
+    uint16_t packet_id, qos1 = 0;
+    uint32_t run = 0, longest_run = 0;
+    mqtt_mq_init(&mq, mem, sizeof(mem));
+    assert_true(mq.index != NULL);
+
+    /* telemetry: QoS 0 publishes (packet ID 0) and pings, with a QoS 1 publish now and then */
+    for(int i = 0; mq.curr_sz >= 4; ++i) {
+        struct mqtt_queued_message *msg;
+        memset(mq.curr, 0, 4);
+        if (i % 16 == 0) {
+            mq.curr[0] = (uint8_t) ((MQTT_CONTROL_PUBLISH << 4) | MQTT_PUBLISH_QOS_1);
+        }
+        msg = mqtt_mq_register(&mq, 4);
+        msg->control_type = i % 64 == 63 ? MQTT_CONTROL_PINGREQ : MQTT_CONTROL_PUBLISH;
+        if (i % 16 == 0) {
+            msg->packet_id = ++qos1;
+        }
+    }
+    for(packet_id = 0; packet_id <= qos1 + 1; ++packet_id) {
+        assert_true(mqtt_mq_find(&mq, MQTT_CONTROL_PUBLISH, &packet_id) == linear_mq_find(&mq, MQTT_CONTROL_PUBLISH, packet_id));
+    }
+
+    /* only the QoS 1 publishes are indexed, so the probe sequences stay short */
+    assert_true(mq.index_count == (uint32_t) mqtt_mq_length(&mq));
+    assert_true(mq.index_used == qos1);
+    for(uint32_t slot = 0; slot <= 2 * mq.index_mask + 1; ++slot) {
+        run = mq.index[slot & mq.index_mask] != 0 ? run + 1 : 0;
+        longest_run = run > longest_run ? run : longest_run;
+    }
+    assert_true(longest_run < 16);
+
+    /* removing the QoS 0 publishes leaves the index alone */
+    for(ssize_t i = 0; i < mqtt_mq_length(&mq) - 1; ++i) {
+        mqtt_mq_get(&mq, i)->state = MQTT_QUEUED_COMPLETE;
+    }
+    mqtt_mq_clean(&mq);
+    assert_true(mq.index_used == (mqtt_mq_get(&mq, 0)->packet_id != 0 ? 1u : 0u));
+    packet_id = 1;
+    assert_true(mqtt_mq_find(&mq, MQTT_CONTROL_PUBLISH, &packet_id) == NULL);
+}
+
+static void TEST__utility__message_queue_make_room(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendbuf[512], recvbuf[256];
+    char payload[180];
+    size_t free_space;
+    mqtt_init(&client, (mqtt_pal_socket_handle) -1, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(mqtt_connect(&client, "make-room", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    memset(payload, 'p', sizeof(payload));
+    assert_true(mqtt_publish(&client, "t", payload, 100, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+
+    /* removing the CONNECT frees less than the PUBLISH behind it takes, so nothing moves */
+    mqtt_mq_get(&client.mq, 0)->state = MQTT_QUEUED_COMPLETE;
+    mqtt_mq_clean(&client.mq);
+    assert_true(mqtt_mq_length(&client.mq) == 1);
+    assert_true(client.mq.queue_head == 1);
+    free_space = client.mq.curr_sz + (size_t) (mqtt_mq_get(&client.mq, 0)->start - (uint8_t*) client.mq.mem_start) + QM_SZ;
+    assert_true(client.mq.curr_sz < 186 && free_space >= 186);
+
+    /* a packet that only fits into all of the free space is packed after moving the queue */
+    assert_true(mqtt_publish(&client, "t", payload, 180, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(client.error == MQTT_OK);
+    assert_true(mqtt_mq_length(&client.mq) == 2);
+    assert_true(client.mq.queue_head == 0);
+    assert_true(mqtt_mq_get(&client.mq, 0)->start == (uint8_t*) client.mq.mem_start);
+    assert_true(mqtt_mq_get(&client.mq, 0)->start[mqtt_mq_get(&client.mq, 0)->size - 1] == 'p');
+    assert_true(mqtt_mq_get(&client.mq, 1)->size == 186);
+}
+
+static void TEST__utility__message_queue_stalled_head(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendbuf[1024], recvbuf[256];
+    char payload[100];
+    uint16_t packet_id;
+    mqtt_init(&client, (mqtt_pal_socket_handle) -1, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(mqtt_connect(&client, "stalled-head", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    mqtt_mq_get(&client.mq, 0)->state = MQTT_QUEUED_COMPLETE;
+
+    /* a QoS 2 PUBLISH at the front waits for its PUBREC */
+    assert_true(mqtt_publish(&client, "stalled", "q2", 2, MQTT_PUBLISH_QOS_2) == MQTT_OK);
+    mqtt_mq_clean(&client.mq);
+    mqtt_mq_get(&client.mq, 0)->state = MQTT_QUEUED_AWAITING_ACK;
+    packet_id = mqtt_mq_get(&client.mq, 0)->packet_id;
+
+    /* the publishes sent behind it keep being reclaimed, far more than the queue holds */
+    memset(payload, 'p', sizeof(payload));
+    for(int i = 0; i < 100; ++i) {
+        assert_true(mqtt_publish(&client, "t", payload, sizeof(payload), MQTT_PUBLISH_QOS_0) == MQTT_OK);
+        mqtt_mq_get(&client.mq, mqtt_mq_length(&client.mq) - 1)->state = MQTT_QUEUED_COMPLETE;
+    }
+    assert_true(client.error == MQTT_OK);
+    assert_true(mqtt_mq_get(&client.mq, 0)->state == MQTT_QUEUED_AWAITING_ACK);
+    assert_true(mqtt_mq_find(&client.mq, MQTT_CONTROL_PUBLISH, &packet_id) == mqtt_mq_get(&client.mq, 0));
+
+    /* a partially sent message keeps its place while the ones before it are reclaimed */
+    assert_true(mqtt_publish(&client, "t", payload, sizeof(payload), MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    client.send_partial = mqtt_mq_get(&client.mq, mqtt_mq_length(&client.mq) - 1);
+    client.send_offset = 10;
+    for(int i = 0; i < 20; ++i) {
+        assert_true(mqtt_publish(&client, "t", payload, sizeof(payload), MQTT_PUBLISH_QOS_0) == MQTT_OK);
+        mqtt_mq_get(&client.mq, mqtt_mq_length(&client.mq) - 1)->state = MQTT_QUEUED_COMPLETE;
+    }
+    assert_true(client.error == MQTT_OK);
+    assert_true(client.send_partial == mqtt_mq_get(&client.mq, 1));
+    assert_true(client.send_partial->state == MQTT_QUEUED_UNSENT);
+    assert_true(client.send_partial->size == 105);
+    assert_true(client.send_offset == 10);
+}
+
 static void TEST__utility__pid_lfsr(void **unused) {
     struct mqtt_client client;
     uint8_t send[256], recv[256];
@@ -612,6 +795,2034 @@ static void TEST__utility__pid_lfsr(void **unused) {
     assert_true(period == 65535u);
 }
 
+#if !defined(WIN32)
+static void TEST__utility__batched_send(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendbuf[512], recvbuf[256], rxbuf[512];
+    int sv[2];
+    ssize_t rv, total = 0;
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    rv = mqtt_connect(&client, "batched-sender", NULL, NULL, 0, NULL, NULL, 0, 30);
+    assert_true(rv == MQTT_OK);
+
+    /* queue three messages, they should leave with the CONNECT in a single flush */
+    for(int i = 0; i < 3; ++i) {
+        rv = mqtt_publish(&client, "batched", "abc", 3, MQTT_PUBLISH_QOS_0);
+        assert_true(rv == MQTT_OK);
+    }
+    rv = __mqtt_send(&client);
+    assert_true(rv == MQTT_OK);
+    assert_true(mqtt_mq_get(&client.mq, 0)->state == MQTT_QUEUED_AWAITING_ACK);
+    for(int i = 0; i < 4; ++i) {
+        if (i > 0) {
+            assert_true(mqtt_mq_get(&client.mq, i)->state == MQTT_QUEUED_COMPLETE);
+        }
+        total += mqtt_mq_get(&client.mq, i)->size;
+    }
+
+    /* the peer must see the packets back to back */
+    rv = recv(sv[1], rxbuf, sizeof(rxbuf), 0);
+    assert_true(rv == total);
+    assert_true(memcmp(rxbuf, client.mq.mem_start, total) == 0);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__batched_send_gather(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendbuf[16384], recvbuf[256], rxbuf[2048];
+    int sv[2];
+    ssize_t rv, total = 0;
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    rv = mqtt_connect(&client, "batched-sender", NULL, NULL, 0, NULL, NULL, 0, 30);
+    assert_true(rv == MQTT_OK);
+
+    /* contiguous packets share an iovec, so a flush can gather more messages than iovecs */
+    for(int i = 0; i < 2 * MQTT_PAL_IOV_MAX; ++i) {
+        rv = mqtt_publish(&client, "batched", "abc", 3, MQTT_PUBLISH_QOS_0);
+        assert_true(rv == MQTT_OK);
+    }
+    rv = __mqtt_send(&client);
+    assert_true(rv == MQTT_OK);
+    for(int i = 0; i < 1 + 2 * MQTT_PAL_IOV_MAX; ++i) {
+        if (i > 0) {
+            assert_true(mqtt_mq_get(&client.mq, i)->state == MQTT_QUEUED_COMPLETE);
+        }
+        total += mqtt_mq_get(&client.mq, i)->size;
+    }
+    rv = recv(sv[1], rxbuf, sizeof(rxbuf), 0);
+    assert_true(rv == total);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__batched_send_partial(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_send_batch batch;
+    uint8_t sendbuf[512], recvbuf[256], rxbuf[512];
+    int sv[2];
+    ssize_t rv, total = 0;
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    rv = mqtt_connect(&client, "batched-sender", NULL, NULL, 0, NULL, NULL, 0, 30);
+    assert_true(rv == MQTT_OK);
+    for(int i = 0; i < 3; ++i) {
+        rv = mqtt_publish(&client, "batched", "abc", 3, MQTT_PUBLISH_QOS_0);
+        assert_true(rv == MQTT_OK);
+    }
+
+    /* the messages behind the rest of a partially sent CONNECT are gathered with it */
+    client.send_partial = mqtt_mq_get(&client.mq, 0);
+    client.send_offset = 5;
+    assert_true(__mqtt_send_begin(&client, &batch, MQTT_PAL_TIME_MS()) == MQTT_OK);
+    assert_true(__mqtt_send_gather(&client, &batch) == 4);
+    assert_true(batch.first_offset == 5);
+    for(int i = 0; i < 4; ++i) {
+        total += mqtt_mq_get(&client.mq, i)->size;
+    }
+    assert_true(batch.size == (size_t) total - 5);
+    rv = mqtt_pal_sendv(client.socketfd, batch.iov, batch.num_iov, 0);
+    assert_true(__mqtt_send_sent(&client, &batch, rv) == 0);
+    assert_true(__mqtt_send_end(&client, &batch, MQTT_OK) == MQTT_OK);
+    assert_true(client.send_partial == NULL);
+    assert_true(mqtt_mq_get(&client.mq, 3)->state == MQTT_QUEUED_COMPLETE);
+
+    rv = recv(sv[1], rxbuf, sizeof(rxbuf), 0);
+    assert_true(rv == total - 5);
+    assert_true(memcmp(rxbuf, (uint8_t*) client.mq.mem_start + 5, (size_t) rv) == 0);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void count_release(void *state, const void *application_message) {
+    *(int*)state += 1;
+}
+
+static void TEST__utility__publish_ref(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendbuf[512], recvbuf[256], rxbuf[2048], header[64];
+    char payload[1024];
+    int sv[2];
+    int released = 0;
+    ssize_t rv, hdrsz;
+    uint16_t packet_id;
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    rv = mqtt_connect(&client, "ref-sender", NULL, NULL, 0, NULL, NULL, 0, 30);
+    assert_true(rv == MQTT_OK);
+    rv = __mqtt_send(&client);
+    assert_true(rv == MQTT_OK);
+    rv = recv(sv[1], rxbuf, sizeof(rxbuf), 0);
+    assert_true(rv == (ssize_t) mqtt_mq_get(&client.mq, 0)->size);
+
+    /* the payload is larger than sendbuf, only the header is queued */
+    memset(payload, 'x', sizeof(payload));
+    rv = mqtt_publish_ref(&client, "ref", payload, sizeof(payload), MQTT_PUBLISH_QOS_1, count_release, &released);
+    assert_true(rv == MQTT_OK);
+    packet_id = mqtt_mq_get(&client.mq, 1)->packet_id;
+    hdrsz = mqtt_pack_publish_header(header, sizeof(header), "ref", packet_id, sizeof(payload), MQTT_PUBLISH_QOS_1);
+    assert_true(hdrsz > 0);
+    assert_true(mqtt_mq_get(&client.mq, 1)->size == (size_t) hdrsz);
+
+    /* the peer gets the whole packet, the payload is held until the PUBACK */
+    rv = __mqtt_send(&client);
+    assert_true(rv == MQTT_OK);
+    rv = recv(sv[1], rxbuf, (size_t) hdrsz + sizeof(payload), MSG_WAITALL);
+    assert_true(rv == hdrsz + (ssize_t) sizeof(payload));
+    assert_true(memcmp(rxbuf, header, (size_t) hdrsz) == 0);
+    assert_true(memcmp(rxbuf + hdrsz, payload, sizeof(payload)) == 0);
+    assert_true(released == 0);
+
+    rv = mqtt_pack_pubxxx_request(rxbuf, sizeof(rxbuf), MQTT_CONTROL_PUBACK, packet_id);
+    assert_true(send(sv[1], rxbuf, (size_t) rv, 0) == rv);
+    rv = __mqtt_recv(&client);
+    assert_true(rv == MQTT_OK);
+    assert_true(mqtt_mq_get(&client.mq, 1)->state == MQTT_QUEUED_COMPLETE);
+    assert_true(released == 1);
+
+    /* a message that never completes is released when the queue is reset */
+    rv = mqtt_publish_ref(&client, "ref", payload, sizeof(payload), MQTT_PUBLISH_QOS_2, count_release, &released);
+    assert_true(rv == MQTT_OK);
+    mqtt_reinit(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf));
+    assert_true(released == 2);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__publish_many(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendbuf[2048], recvbuf[64];
+    struct mqtt_publish_desc msgs[32];
+    size_t accepted, queued;
+    ssize_t i;
+    enum MQTTErrors rv;
+    mqtt_init(&client, (mqtt_pal_socket_handle) -1, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(mqtt_connect(&client, "publish-many", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    for(i = 0; i < 32; ++i) {
+        msgs[i].topic_name = "many";
+        msgs[i].application_message = "payload";
+        msgs[i].application_message_size = 7;
+        msgs[i].publish_flags = (i % 2) ? MQTT_PUBLISH_QOS_1 : MQTT_PUBLISH_QOS_0;
+    }
+
+    /* a burst is packed back to back */
+    rv = mqtt_publish_many(&client, msgs, 4, &accepted);
+    assert_true(rv == MQTT_OK);
+    assert_true(accepted == 4);
+    assert_true(mqtt_mq_length(&client.mq) == 5);
+    for(i = 1; i < 5; ++i) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&client.mq, i);
+        assert_true(msg->start == mqtt_mq_get(&client.mq, i - 1)->start + mqtt_mq_get(&client.mq, i - 1)->size);
+        assert_true(msg->control_type == MQTT_CONTROL_PUBLISH);
+        assert_true(msg->start[0] == (0x30 | msgs[i - 1].publish_flags));
+        assert_true((msg->packet_id != 0) == (i % 2 == 0));
+    }
+    assert_true(mqtt_mq_get(&client.mq, 2)->packet_id != mqtt_mq_get(&client.mq, 4)->packet_id);
+
+    /* when the buffer fills up the rest is rejected, without an error state */
+    rv = mqtt_publish_many(&client, msgs, 32, &accepted);
+    assert_true(rv == MQTT_ERROR_SEND_BUFFER_IS_FULL);
+    assert_true(accepted > 0 && accepted < 32);
+    assert_true(client.error == MQTT_OK);
+    assert_true((size_t) mqtt_mq_length(&client.mq) == 5 + accepted);
+
+    /* the rejected messages fit once the sent ones are cleaned */
+    queued = accepted;
+    for(i = 0; i < mqtt_mq_length(&client.mq); ++i) {
+        mqtt_mq_get(&client.mq, i)->state = MQTT_QUEUED_COMPLETE;
+    }
+    rv = mqtt_publish_many(&client, msgs + queued, 32 - queued, &accepted);
+    assert_true(rv == MQTT_OK || rv == MQTT_ERROR_SEND_BUFFER_IS_FULL);
+    assert_true(accepted > 0);
+    assert_true((size_t) mqtt_mq_length(&client.mq) == accepted);
+
+    /* an invalid message is rejected with the ones behind it, without an error state */
+    for(i = 0; i < mqtt_mq_length(&client.mq); ++i) {
+        mqtt_mq_get(&client.mq, i)->state = MQTT_QUEUED_COMPLETE;
+    }
+    mqtt_mq_clean(&client.mq);
+    msgs[2].topic_name = NULL;
+    rv = mqtt_publish_many(&client, msgs, 4, &accepted);
+    assert_true(rv == MQTT_ERROR_NULLPTR);
+    assert_true(accepted == 2);
+    assert_true(mqtt_mq_length(&client.mq) == 2);
+    assert_true(client.error == MQTT_OK);
+    msgs[2].topic_name = "many";
+    msgs[0].publish_flags = MQTT_PUBLISH_QOS_MASK;
+    rv = mqtt_publish_many(&client, msgs, 2, &accepted);
+    assert_true(rv == MQTT_ERROR_PUBLISH_FORBIDDEN_QOS);
+    assert_true(accepted == 0);
+    assert_true(mqtt_mq_length(&client.mq) == 2);
+    assert_true(client.error == MQTT_OK);
+    assert_true(mqtt_publish_many(&client, msgs + 1, 3, &accepted) == MQTT_OK && accepted == 3);
+}
+
+static void check_recv_in_place(void** state, struct mqtt_response_publish *publish) {
+    int *received = *(int**)state;
+    char expected[16];
+    snprintf(expected, sizeof(expected), "message-%03d", *received);
+    assert_true(publish->application_message_size == strlen(expected));
+    assert_true(memcmp(publish->application_message, expected, strlen(expected)) == 0);
+    *received += 1;
+}
+
+static void TEST__utility__recv_in_place(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendbuf[256], recvbuf[64], packet[64];
+    char message[16];
+    int sv[2];
+    int received = 0;
+    ssize_t rv;
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), check_recv_in_place);
+    client.publish_response_callback_state = &received;
+    rv = mqtt_connect(&client, "recv-in-place", NULL, NULL, 0, NULL, NULL, 0, 30);
+    assert_true(rv == MQTT_OK);
+
+    /* many packets that don't line up with the end of recvbuf */
+    for(int i = 0; i < 100; ++i) {
+        snprintf(message, sizeof(message), "message-%03d", i);
+        rv = mqtt_pack_publish_request(packet, sizeof(packet), "t", 0, message, strlen(message), MQTT_PUBLISH_QOS_0);
+        assert_true(rv > 0);
+        assert_true(send(sv[1], packet, (size_t) rv, 0) == rv);
+    }
+    rv = __mqtt_recv(&client);
+    assert_true(rv == MQTT_OK);
+    assert_true(received == 100);
+    assert_true(client.recv_buffer.parse_curr == client.recv_buffer.mem_start);
+    assert_true(client.recv_buffer.curr == client.recv_buffer.mem_start);
+
+    /* a partial packet stays buffered until the rest arrives */
+    snprintf(message, sizeof(message), "message-%03d", 100);
+    rv = mqtt_pack_publish_request(packet, sizeof(packet), "t", 0, message, strlen(message), MQTT_PUBLISH_QOS_0);
+    assert_true(send(sv[1], packet, 5, 0) == 5);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(received == 100);
+    assert_true(send(sv[1], packet + 5, (size_t) rv - 5, 0) == rv - 5);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(received == 101);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+#endif
+
+#if !defined(WIN32)
+static void TEST__utility__response_timeout_ms(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendbuf[1024], recvbuf[64], rxbuf[256], packet[16];
+    const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    int sv[2];
+    uint16_t packet_id;
+    ssize_t rv;
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    assert_true(fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(client.response_timeout_ms == 30000);
+    assert_true(client.typical_response_time_ms < 0);
+    rv = mqtt_connect(&client, "response-timeout", NULL, NULL, 0, NULL, NULL, 0, 30);
+    assert_true(rv == MQTT_OK);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(recv(sv[1], rxbuf, sizeof(rxbuf), 0) > 0);
+
+    /* the CONNACK starts the response time statistics */
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(client.typical_response_time_ms >= 0 && client.typical_response_time_ms < 1000);
+
+    /* a QoS 1 message is retransmitted once response_timeout_ms has passed */
+    client.response_timeout_ms = 50;
+    rv = mqtt_publish(&client, "t", "m", 1, MQTT_PUBLISH_QOS_1);
+    assert_true(rv == MQTT_OK);
+    packet_id = mqtt_mq_get(&client.mq, 1)->packet_id;
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(client.number_of_timeouts == 0);
+    usleep(100000);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(client.number_of_timeouts == 1);
+
+    /* the PUBACK is a second sample */
+    rv = mqtt_pack_pubxxx_request(packet, sizeof(packet), MQTT_CONTROL_PUBACK, packet_id);
+    assert_true(send(sv[1], packet, (size_t) rv, 0) == rv);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(mqtt_mq_get(&client.mq, 1)->state == MQTT_QUEUED_COMPLETE);
+    assert_true(client.typical_response_time_ms >= 0 && client.typical_response_time_ms < 1000);
+    assert_true(client.response_time_deviation_ms >= 0);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+#endif
+
+#if !defined(WIN32)
+static void TEST__utility__sync_interest(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendbuf[2048], recvbuf[64], rxbuf[256];
+    const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    mqtt_pal_time_ms_t deadline;
+    int sv[2];
+    ssize_t rv;
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    rv = mqtt_connect(&client, "sync-interest", NULL, NULL, 0, NULL, NULL, 0, 30);
+    assert_true(rv == MQTT_OK);
+
+    /* the CONNECT is waiting to be sent */
+    assert_true(mqtt_sync_interest(&client, &deadline) == (MQTT_SYNC_WANT_READ | MQTT_SYNC_WANT_WRITE));
+
+    /* then for its CONNACK (or the retransmit) */
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(recv(sv[1], rxbuf, sizeof(rxbuf), 0) > 0);
+    client.response_timeout_ms = 50;
+    assert_true(mqtt_sync_interest(&client, &deadline) == MQTT_SYNC_WANT_READ);
+    assert_true(deadline == mqtt_mq_get(&client.mq, 0)->time_sent + 50);
+
+    /* then only for the keep-alive */
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(mqtt_sync_interest(&client, &deadline) == MQTT_SYNC_WANT_READ);
+    assert_true(deadline == client.time_of_last_send + 30000);
+
+    /* a QoS 2 message that has to wait for another one doesn't need the socket to be writable */
+    assert_true(mqtt_publish(&client, "t", "1", 1, MQTT_PUBLISH_QOS_2) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "t", "2", 1, MQTT_PUBLISH_QOS_2) == MQTT_OK);
+    assert_true(mqtt_sync_interest(&client, &deadline) == (MQTT_SYNC_WANT_READ | MQTT_SYNC_WANT_WRITE));
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(mqtt_mq_get(&client.mq, 2)->state == MQTT_QUEUED_UNSENT);
+    assert_true(mqtt_sync_interest(&client, &deadline) == MQTT_SYNC_WANT_READ);
+    assert_true(deadline == mqtt_mq_get(&client.mq, 1)->time_sent + 50);
+
+    /* errors have to be handled by mqtt_sync right away */
+    client.error = MQTT_ERROR_SOCKET_ERROR;
+    mqtt_sync_interest(&client, &deadline);
+    assert_true(deadline <= MQTT_PAL_TIME_MS());
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__inflight_window(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendbuf[4096], recvbuf[64], rxbuf[512];
+    mqtt_pal_time_ms_t deadline;
+    uint16_t packet_id;
+    int sv[2], i;
+    ssize_t rv;
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(client.max_inflight_qos1 == 0 && client.max_inflight_qos2 == 1);
+    assert_true(mqtt_connect(&client, "inflight-window", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    client.max_inflight_qos1 = 2;
+    client.max_inflight_qos2 = 3;
+
+    /* queue 1: the CONNECT, 1-4: QoS 1, 5-8: QoS 2 */
+    for(i = 0; i < 4; ++i) {
+        assert_true(mqtt_publish(&client, "t", "1", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    }
+    for(i = 0; i < 4; ++i) {
+        assert_true(mqtt_publish(&client, "t", "2", 1, MQTT_PUBLISH_QOS_2) == MQTT_OK);
+    }
+
+    /* only the windows are sent, concurrent QoS 2 exchanges have their own packet IDs */
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(recv(sv[1], rxbuf, sizeof(rxbuf), 0) > 0);
+    for(i = 1; i <= 8; ++i) {
+        int sent = (i <= 2) || (i >= 5 && i <= 7);
+        assert_true(mqtt_mq_get(&client.mq, i)->state == (sent ? MQTT_QUEUED_AWAITING_ACK : MQTT_QUEUED_UNSENT));
+    }
+    assert_true(mqtt_mq_get(&client.mq, 5)->packet_id != mqtt_mq_get(&client.mq, 6)->packet_id);
+    assert_true(client.number_of_qos1_window_stalls == 1);
+    assert_true(client.number_of_qos2_window_stalls == 1);
+    assert_true(mqtt_sync_interest(&client, &deadline) == MQTT_SYNC_WANT_READ);
+
+    /* a PUBACK opens the QoS 1 window */
+    packet_id = mqtt_mq_get(&client.mq, 1)->packet_id;
+    rv = mqtt_pack_pubxxx_request(rxbuf, sizeof(rxbuf), MQTT_CONTROL_PUBACK, packet_id);
+    assert_true(send(sv[1], rxbuf, (size_t) rv, 0) == rv);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(mqtt_sync_interest(&client, &deadline) == (MQTT_SYNC_WANT_READ | MQTT_SYNC_WANT_WRITE));
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(mqtt_mq_get(&client.mq, 3)->state == MQTT_QUEUED_AWAITING_ACK);
+    assert_true(mqtt_mq_get(&client.mq, 4)->state == MQTT_QUEUED_UNSENT);
+    assert_true(client.number_of_qos1_window_stalls == 2);
+
+    /* 0 means no limit */
+    client.max_inflight_qos1 = 0;
+    client.max_inflight_qos2 = 0;
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(mqtt_mq_get(&client.mq, 4)->state == MQTT_QUEUED_AWAITING_ACK);
+    assert_true(mqtt_mq_get(&client.mq, 8)->state == MQTT_QUEUED_AWAITING_ACK);
+    assert_true(client.number_of_qos1_window_stalls == 2);
+    assert_true(client.number_of_qos2_window_stalls == 2);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+#endif
+
+#if !defined(WIN32)
+#define STAGE_THREADS 4
+#define STAGE_MESSAGES 100
+
+struct stage_publisher {
+    struct mqtt_client *client;
+    int id;
+};
+
+static void* stage_publisher_thread(void *arg) {
+    struct stage_publisher *publisher = (struct stage_publisher*) arg;
+    uint8_t qos = publisher->id % 2 ? MQTT_PUBLISH_QOS_1 : MQTT_PUBLISH_QOS_0;
+    char message[16];
+    int i;
+    for(i = 0; i < STAGE_MESSAGES; ++i) {
+        enum MQTTErrors rv;
+        snprintf(message, sizeof(message), "%d:%d", publisher->id, i);
+        while ((rv = mqtt_publish_staged(publisher->client, "stage", message, strlen(message), qos)) == MQTT_ERROR_SEND_BUFFER_IS_FULL) {
+            sched_yield();
+        }
+        if (rv != MQTT_OK) {
+            return NULL;
+        }
+    }
+    return publisher;
+}
+
+static void TEST__utility__publish_stage(void **unused) {
+    static uint8_t sendbuf[131072], rxbuf[32768];
+    uint8_t recvbuf[64], stagebuf[1024 + 16];
+    struct mqtt_client client;
+    struct stage_publisher publishers[STAGE_THREADS];
+    pthread_t threads[STAGE_THREADS];
+    int next[STAGE_THREADS] = {0};
+    static uint8_t seen_pid[65536];
+    size_t received = 0, parsed = 0;
+    int sv[2], i, count = 0;
+    memset(seen_pid, 0, sizeof(seen_pid));
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    assert_true(fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    mqtt_init_publish_stage(&client, stagebuf + 1, sizeof(stagebuf) - 1);
+    assert_true(client.publish_stage.mask + 1 == 512 || client.publish_stage.mask + 1 == 1024);
+    assert_true(((uintptr_t) client.publish_stage.mem & 15u) == 0);
+    assert_true(mqtt_connect(&client, "publish-stage", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(recv(sv[1], rxbuf, sizeof(rxbuf), 0) > 0);
+
+    /* too big for the ring */
+    assert_true(mqtt_publish_staged(&client, "stage", rxbuf, 512, MQTT_PUBLISH_QOS_0) == MQTT_ERROR_SEND_BUFFER_IS_FULL);
+    assert_true(client.error == MQTT_OK);
+
+    /* publishers fill the ring while it is drained into the queue */
+    for(i = 0; i < STAGE_THREADS; ++i) {
+        publishers[i].client = &client;
+        publishers[i].id = i;
+        assert_true(pthread_create(&threads[i], NULL, stage_publisher_thread, &publishers[i]) == 0);
+    }
+    while (received < sizeof(rxbuf) && count < STAGE_THREADS * STAGE_MESSAGES) {
+        ssize_t rv;
+        assert_true(__mqtt_send(&client) == MQTT_OK);
+        rv = recv(sv[1], rxbuf + received, sizeof(rxbuf) - received, 0);
+        if (rv > 0) {
+            received += (size_t) rv;
+        }
+
+        /* every thread's messages arrive in order, QoS 1 messages have unique packet ID's */
+        for(;;) {
+            struct mqtt_response response;
+            const struct mqtt_response_publish *publish = &response.decoded.publish;
+            int thread, seq;
+            char message[16];
+            ssize_t len = mqtt_unpack_fixed_header(&response, rxbuf + parsed, received - parsed);
+            if (len <= 0 || received - parsed < (size_t) len + response.fixed_header.remaining_length) {
+                break;
+            }
+            if (response.fixed_header.control_type == MQTT_CONTROL_PUBLISH) {
+                assert_true(mqtt_unpack_publish_response(&response, rxbuf + parsed + len) > 0);
+                assert_true(publish->application_message_size < sizeof(message));
+                memcpy(message, publish->application_message, publish->application_message_size);
+                message[publish->application_message_size] = '\0';
+                assert_true(sscanf(message, "%d:%d", &thread, &seq) == 2);
+                assert_true(thread >= 0 && thread < STAGE_THREADS);
+                assert_true(seq == next[thread]++);
+                assert_true(publish->qos_level == (thread % 2));
+                if (publish->qos_level == 1) {
+                    assert_true(publish->packet_id != 0 && !seen_pid[publish->packet_id]);
+                    seen_pid[publish->packet_id] = 1;
+                }
+                ++count;
+            }
+            parsed += (size_t) len + response.fixed_header.remaining_length;
+        }
+    }
+    for(i = 0; i < STAGE_THREADS; ++i) {
+        void *rv;
+        assert_true(pthread_join(threads[i], &rv) == 0);
+        assert_true(rv == &publishers[i]);
+        assert_true(next[i] == STAGE_MESSAGES);
+    }
+    assert_true(count == STAGE_THREADS * STAGE_MESSAGES);
+    assert_true(client.publish_stage.reserved == client.publish_stage.drained);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+#endif
+
+#if defined(MQTT_REACTOR_AVAILABLE)
+static void reactor_error_callback(struct mqtt_reactor *reactor, struct mqtt_client *client, enum MQTTErrors error) {
+    *(struct mqtt_client**) reactor->error_callback_state = client;
+}
+
+static void TEST__utility__reactor(void **unused) {
+    struct mqtt_client clients[2];
+    struct mqtt_reactor reactor;
+    struct mqtt_reactor_entry entries[2];
+    struct mqtt_reactor_entry *heap[2];
+    struct mqtt_client *failed = NULL;
+    uint8_t sendbufs[2][1024], recvbufs[2][64], rxbuf[256];
+    const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    int sv[2][2];
+    int i, j;
+    assert_true(mqtt_reactor_init(&reactor, heap, 2) == MQTT_OK);
+    reactor.error_callback = reactor_error_callback;
+    reactor.error_callback_state = &failed;
+    for(i = 0; i < 2; ++i) {
+        assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]) == 0);
+        assert_true(fcntl(sv[i][0], F_SETFL, fcntl(sv[i][0], F_GETFL) | O_NONBLOCK) == 0);
+        assert_true(fcntl(sv[i][1], F_SETFL, fcntl(sv[i][1], F_GETFL) | O_NONBLOCK) == 0);
+        mqtt_init(&clients[i], sv[i][0], sendbufs[i], sizeof(sendbufs[i]), recvbufs[i], sizeof(recvbufs[i]), NULL);
+        assert_true(mqtt_connect(&clients[i], "reactor", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+        assert_true(mqtt_reactor_add(&reactor, &entries[i], &clients[i]) == MQTT_OK);
+    }
+    assert_true(mqtt_reactor_add(&reactor, &entries[0], &clients[0]) == MQTT_ERROR_REACTOR_FULL);
+
+    /* the CONNECTs are sent as soon as the sockets are writable */
+    assert_true(mqtt_reactor_run_once(&reactor, 1000) == MQTT_OK);
+    for(i = 0; i < 2; ++i) {
+        assert_true(recv(sv[i][1], rxbuf, sizeof(rxbuf), 0) > 0);
+        assert_true(send(sv[i][1], connack, sizeof(connack), 0) == sizeof(connack));
+    }
+    for(j = 0; j < 10 && (mqtt_mq_get(&clients[0].mq, 0)->state != MQTT_QUEUED_COMPLETE
+                          || mqtt_mq_get(&clients[1].mq, 0)->state != MQTT_QUEUED_COMPLETE); ++j) {
+        assert_true(mqtt_reactor_run_once(&reactor, 100) == MQTT_OK);
+    }
+    assert_true(mqtt_mq_get(&clients[0].mq, 0)->state == MQTT_QUEUED_COMPLETE);
+    assert_true(mqtt_mq_get(&clients[1].mq, 0)->state == MQTT_QUEUED_COMPLETE);
+
+    /* messages queued from outside are sent after a wakeup */
+    clients[0].response_timeout_ms = 50;
+    assert_true(mqtt_publish(&clients[0], "t", "m", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    mqtt_reactor_wakeup(&reactor, &entries[0]);
+    assert_true(mqtt_reactor_run_once(&reactor, 1000) == MQTT_OK);
+    assert_true(recv(sv[0][1], rxbuf, sizeof(rxbuf), 0) > 0);
+
+    /* the timer retransmits it once response_timeout_ms has passed */
+    for(j = 0; j < 10 && clients[0].number_of_timeouts == 0; ++j) {
+        assert_true(mqtt_reactor_run_once(&reactor, 1000) == MQTT_OK);
+    }
+    assert_true(clients[0].number_of_timeouts == 1);
+    assert_true(recv(sv[0][1], rxbuf, sizeof(rxbuf), 0) > 0);
+
+    /* a client whose connection is closed is removed and reported */
+    close(sv[1][1]);
+    for(j = 0; j < 10 && failed == NULL; ++j) {
+        assert_true(mqtt_reactor_run_once(&reactor, 1000) == MQTT_OK);
+    }
+    assert_true(failed == &clients[1]);
+    assert_true(reactor.heap_size == 1 && reactor.heap[0] == &entries[0]);
+
+    /* a removed entry is taken out of the wakeups and ignored by later ones */
+    mqtt_reactor_wakeup(&reactor, &entries[0]);
+    assert_true(reactor.pending == &entries[0]);
+    mqtt_reactor_remove(&reactor, &entries[0]);
+    assert_true(reactor.heap_size == 0);
+    assert_true(reactor.pending == NULL);
+    mqtt_reactor_wakeup(&reactor, &entries[0]);
+    assert_true(reactor.pending == NULL);
+    assert_true(mqtt_reactor_run_once(&reactor, 0) == MQTT_OK);
+    mqtt_reactor_destroy(&reactor);
+    close(sv[0][0]);
+    close(sv[0][1]);
+    close(sv[1][0]);
+}
+
+static void reactor_count_publish(void **state, struct mqtt_response_publish *publish) {
+    ++*(int*) *state;
+}
+
+static void TEST__utility__reactor_traffic(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_reactor reactor;
+    struct mqtt_reactor_entry entry;
+    struct mqtt_reactor_entry *heap[1];
+    uint8_t sendbuf[16384], recvbuf[256], packet[64], rxbuf[4096];
+    static uint8_t incoming[2000 * 64];
+    const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    int received = 0;
+    int sv[2];
+    ssize_t packet_size, rv;
+    size_t incoming_size = 0, incoming_sent = 0;
+    size_t sent = 0, expected = 0;
+    int i, j;
+
+    assert_true(mqtt_reactor_init(&reactor, heap, 1) == MQTT_OK);
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    assert_true(fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), reactor_count_publish);
+    client.publish_response_callback_state = &received;
+    assert_true(mqtt_connect(&client, "reactor", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(mqtt_reactor_add(&reactor, &entry, &client) == MQTT_OK);
+    assert_true(mqtt_reactor_run_once(&reactor, 1000) == MQTT_OK);
+    assert_true(recv(sv[1], rxbuf, sizeof(rxbuf), 0) > 0);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+
+    /* many more bytes than fit in the receive buffer (or in one of the reactor's buffers) arrive at once */
+    packet_size = mqtt_pack_publish_request(packet, sizeof(packet), "reactor/traffic", 0, "0123456789abcdef", 16, MQTT_PUBLISH_QOS_0);
+    assert_true(packet_size > 0);
+    for(i = 0; i < 2000; ++i) {
+        memcpy(incoming + incoming_size, packet, (size_t) packet_size);
+        incoming_size += (size_t) packet_size;
+    }
+
+    /* while publishes are queued in the other direction */
+    for(i = 0; i < 100; ++i) {
+        assert_true(mqtt_publish(&client, "reactor/out", "m", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+        expected += (size_t) mqtt_pack_publish_request(packet, sizeof(packet), "reactor/out", 0, "m", 1, MQTT_PUBLISH_QOS_0);
+    }
+    mqtt_reactor_wakeup(&reactor, &entry);
+
+    for(j = 0; j < 100 && (received < 2000 || sent < expected); ++j) {
+        while (incoming_sent < incoming_size
+               && (rv = send(sv[1], incoming + incoming_sent, incoming_size - incoming_sent, 0)) > 0) {
+            incoming_sent += (size_t) rv;
+        }
+        assert_true(mqtt_reactor_run_once(&reactor, 100) == MQTT_OK);
+        while ((rv = recv(sv[1], rxbuf, sizeof(rxbuf), 0)) > 0) {
+            sent += (size_t) rv;
+        }
+    }
+    assert_true(received == 2000);
+    assert_true(sent == expected);
+    assert_true(client.error == MQTT_OK);
+
+    mqtt_reactor_remove(&reactor, &entry);
+    mqtt_reactor_destroy(&reactor);
+    close(sv[0]);
+    close(sv[1]);
+}
+#endif
+
+static void count_dispatch(void **state, struct mqtt_response_publish *publish) {
+    ++*(int*) *state;
+}
+
+static int dispatch_topic(struct mqtt_dispatcher *dispatcher, const char *topic) {
+    struct mqtt_response_publish publish;
+    memset(&publish, 0, sizeof(publish));
+    publish.topic_name = topic;
+    publish.topic_name_size = (uint16_t) strlen(topic);
+    return (int) mqtt_dispatcher_dispatch(dispatcher, &publish);
+}
+
+static void TEST__utility__dispatcher(void **unused) {
+    static const char *filters[] = {"a/b", "a/+", "a/#", "#", "+/b", "a/b/#", "$SYS/#", "+/+"};
+    struct mqtt_dispatcher dispatcher;
+    uint8_t arena[4096];
+    int hits[8] = {0}, unmatched = 0, i;
+
+    mqtt_dispatcher_init(&dispatcher, arena + 1, sizeof(arena) - 1, count_dispatch, &unmatched);
+    for(i = 0; i < 8; ++i) {
+        assert_true(mqtt_dispatcher_add(&dispatcher, filters[i], count_dispatch, &hits[i]) == MQTT_OK);
+    }
+    assert_true(dispatcher.number_of_filters == 8);
+    assert_true(((uintptr_t) dispatcher.root & (sizeof(void*) - 1)) == 0);
+
+    /* wildcards have to take up a whole level, '#' has to be the last one */
+    assert_true(mqtt_dispatcher_add(&dispatcher, "", count_dispatch, NULL) == MQTT_ERROR_INVALID_TOPIC_FILTER);
+    assert_true(mqtt_dispatcher_add(&dispatcher, "a/#/b", count_dispatch, NULL) == MQTT_ERROR_INVALID_TOPIC_FILTER);
+    assert_true(mqtt_dispatcher_add(&dispatcher, "a+/b", count_dispatch, NULL) == MQTT_ERROR_INVALID_TOPIC_FILTER);
+    assert_true(mqtt_dispatcher_add(&dispatcher, "a/b#", count_dispatch, NULL) == MQTT_ERROR_INVALID_TOPIC_FILTER);
+
+    /* "a/b/#" also matches "a/b" */
+    assert_true(dispatch_topic(&dispatcher, "a/b") == 7);
+    assert_true(hits[0] == 1 && hits[5] == 1 && hits[6] == 0);
+
+    /* wildcards don't match the first level of "$" topics */
+    assert_true(dispatch_topic(&dispatcher, "$SYS/x") == 1);
+    assert_true(hits[6] == 1 && hits[3] == 1 && hits[7] == 1);
+
+    /* "+" matches an empty level */
+    assert_true(dispatch_topic(&dispatcher, "a/") == 4);
+    assert_true(hits[1] == 2 && hits[7] == 2);
+    assert_true(dispatch_topic(&dispatcher, "a") == 2);
+    assert_true(dispatch_topic(&dispatcher, "c/d/e") == 1);
+
+    /* unmatched publishes */
+    assert_true(mqtt_dispatcher_remove(&dispatcher, "#", count_dispatch, &hits[3]) == MQTT_OK);
+    assert_true(mqtt_dispatcher_remove(&dispatcher, "#", count_dispatch, &hits[3]) == MQTT_ERROR_INVALID_TOPIC_FILTER);
+    assert_true(dispatcher.number_of_filters == 7);
+    assert_true(dispatch_topic(&dispatcher, "c/d/e") == 0);
+    assert_true(unmatched == 1);
+
+    /* the arena runs out */
+    mqtt_dispatcher_init(&dispatcher, arena, 256, NULL, NULL);
+    for(i = 0; i < 64; ++i) {
+        char filter[16];
+        snprintf(filter, sizeof(filter), "f/%d", i);
+        if (mqtt_dispatcher_add(&dispatcher, filter, count_dispatch, &hits[0]) != MQTT_OK) {
+            break;
+        }
+    }
+    assert_true(i > 0 && i < 64);
+    assert_true(mqtt_dispatcher_add(&dispatcher, "f/x", count_dispatch, &hits[0]) == MQTT_ERROR_DISPATCHER_FULL);
+    assert_true(dispatcher.arena_used <= 256);
+}
+
+/* A straightforward matcher (of the MQTT 3.1.1 rules) to check mqtt_topic_matches against. */
+static int reference_topic_matches(const char *filter, const char *topic) {
+    const char *flevels[64], *tlevels[64];
+    size_t fsizes[64], tsizes[64], fcount = 0, tcount = 0, i;
+    const char *p;
+    for(p = filter; ; ++fcount) {
+        const char *slash = strchr(p, '/');
+        flevels[fcount] = p;
+        fsizes[fcount] = slash != NULL ? (size_t) (slash - p) : strlen(p);
+        if (slash == NULL) { ++fcount; break; }
+        p = slash + 1;
+    }
+    for(p = topic; ; ++tcount) {
+        const char *slash = strchr(p, '/');
+        tlevels[tcount] = p;
+        tsizes[tcount] = slash != NULL ? (size_t) (slash - p) : strlen(p);
+        if (slash == NULL) { ++tcount; break; }
+        p = slash + 1;
+    }
+    if (topic[0] == '$' && (filter[0] == '+' || filter[0] == '#')) {
+        return 0;
+    }
+    for(i = 0; i < fcount; ++i) {
+        if (fsizes[i] == 1 && flevels[i][0] == '#') {
+            return 1;
+        }
+        if (i >= tcount) {
+            return 0;
+        }
+        if (fsizes[i] == 1 && flevels[i][0] == '+') {
+            continue;
+        }
+        if (fsizes[i] != tsizes[i] || memcmp(flevels[i], tlevels[i], fsizes[i]) != 0) {
+            return 0;
+        }
+    }
+    return fcount == tcount;
+}
+
+static void TEST__utility__topic_matching(void **unused) {
+    /* long levels exercise the vectorized scan, many levels the fallback for MQTT_TOPIC_MAX_LEVELS */
+    static const char *topic_levels[] = {"a", "b", "", "ab", "$SYS", "abcdefghijklmnopqrstuvwxyz0123456789"};
+    static const char *filter_levels[] = {"a", "b", "", "ab", "$SYS", "abcdefghijklmnopqrstuvwxyz0123456789", "+", "+"};
+    static char topics[64][512], filters[64][512];
+    static struct mqtt_topic_filter compiled[64];
+    struct mqtt_topic_levels levels;
+    uint8_t matches[64];
+    uint32_t rng = 1;
+    int round, i, j;
+
+    /* invalid filters */
+    assert_true(mqtt_topic_filter_compile(&compiled[0], "") == MQTT_ERROR_INVALID_TOPIC_FILTER);
+    assert_true(mqtt_topic_filter_compile(&compiled[0], "a/#/b") == MQTT_ERROR_INVALID_TOPIC_FILTER);
+    assert_true(mqtt_topic_filter_compile(&compiled[0], "a+") == MQTT_ERROR_INVALID_TOPIC_FILTER);
+    assert_true(mqtt_topic_filter_compile(&compiled[0], "a/b#") == MQTT_ERROR_INVALID_TOPIC_FILTER);
+    assert_true(mqtt_topic_filter_compile(&compiled[0], "+/+/#") == MQTT_OK);
+
+    /* the split levels */
+    assert_true(mqtt_topic_split(&levels, "a//bc/", 6) == 4);
+    assert_true(levels.start[0] == 0 && levels.start[1] == 2 && levels.start[2] == 3 && levels.start[3] == 6 && levels.start[4] == 7);
+
+    /* random topics and filters against the reference matcher */
+    for(round = 0; round < 50; ++round) {
+        for(i = 0; i < 64; ++i) {
+            int tcount = 1 + (int) ((rng = rng * 1103515245u + 12345u) >> 16) % (round % 10 == 9 ? 40 : 6);
+            int fcount = 1 + (int) ((rng = rng * 1103515245u + 12345u) >> 16) % (round % 10 == 9 ? 40 : 6);
+            topics[i][0] = filters[i][0] = '\0';
+            for(j = 0; j < tcount; ++j) {
+                const char *level = topic_levels[((rng = rng * 1103515245u + 12345u) >> 16) % 6];
+                if (j > 0 && strcmp(level, "$SYS") == 0) {
+                    level = "a";
+                }
+                if (j > 0) strcat(topics[i], "/");
+                strcat(topics[i], level);
+            }
+            for(j = 0; j < fcount; ++j) {
+                const char *level = filter_levels[((rng = rng * 1103515245u + 12345u) >> 16) % 8];
+                if (j > 0) strcat(filters[i], "/");
+                strcat(filters[i], level);
+            }
+            if (filters[i][0] == '\0' || ((rng = rng * 1103515245u + 12345u) >> 16) % 4 == 0) {
+                strcat(filters[i], "/#");
+            } else if (((rng = rng * 1103515245u + 12345u) >> 16) % 16 == 0) {
+                strcpy(filters[i], "#");
+            }
+            assert_true(mqtt_topic_filter_compile(&compiled[i], filters[i]) == MQTT_OK);
+        }
+
+        /* each topic against the filters of the round */
+        for(i = 0; i < 64; ++i) {
+            size_t expected = 0;
+            mqtt_topic_split(&levels, topics[i], strlen(topics[i]));
+            mqtt_topic_match_batch(compiled, 64, &levels, matches);
+            for(j = 0; j < 64; ++j) {
+                int match = reference_topic_matches(filters[j], topics[i]);
+                assert_true(mqtt_topic_matches(filters[j], topics[i], strlen(topics[i])) == match);
+                assert_true(matches[j] == match);
+                expected += (size_t) match;
+            }
+            assert_true(mqtt_topic_match_batch(compiled, 64, &levels, NULL) == expected);
+        }
+
+        /* a topic always matches itself and "#" (unless it starts with '$') */
+        assert_true(mqtt_topic_matches(topics[round], topics[round], strlen(topics[round])));
+        assert_true(mqtt_topic_matches("#", topics[round], strlen(topics[round])) == (topics[round][0] != '$'));
+    }
+}
+
+#if !defined(WIN32)
+static void TEST__utility__dispatcher_recv(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_dispatcher dispatcher;
+    uint8_t sendbuf[1024], recvbuf[256], rxbuf[256], arena[1024];
+    int hits = 0, sv[2];
+    ssize_t rv;
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    mqtt_dispatcher_init(&dispatcher, arena, sizeof(arena), NULL, NULL);
+    mqtt_dispatcher_attach(&dispatcher, &client);
+    assert_true(mqtt_dispatcher_add(&dispatcher, "sensors/+/temperature", count_dispatch, &hits) == MQTT_OK);
+    assert_true(mqtt_connect(&client, "dispatcher", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+
+    /* the publishes are routed by __mqtt_recv */
+    rv = mqtt_pack_publish_request(rxbuf, sizeof(rxbuf), "sensors/1/temperature", 0, "20", 2, MQTT_PUBLISH_QOS_0);
+    assert_true(rv > 0 && send(sv[1], rxbuf, (size_t) rv, 0) == rv);
+    rv = mqtt_pack_publish_request(rxbuf, sizeof(rxbuf), "sensors/1/humidity", 0, "50", 2, MQTT_PUBLISH_QOS_0);
+    assert_true(rv > 0 && send(sv[1], rxbuf, (size_t) rv, 0) == rv);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(hits == 1);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+struct stream_state {
+    int begins, ends, publishes;
+    size_t size, received;
+    uint32_t checksum;
+    enum MQTTErrors result;
+};
+
+static void stream_begin(void **state, struct mqtt_response_publish *publish) {
+    struct stream_state *stream = (struct stream_state*) *state;
+    assert_true(publish->topic_name_size == 5 && memcmp(publish->topic_name, "large", 5) == 0);
+    assert_true(publish->application_message == NULL);
+    ++stream->begins;
+    stream->size = publish->application_message_size;
+    stream->received = 0;
+    stream->checksum = 0;
+}
+
+static void stream_chunk(void **state, const void *data, size_t size) {
+    struct stream_state *stream = (struct stream_state*) *state;
+    size_t i;
+    for(i = 0; i < size; ++i) {
+        stream->checksum = stream->checksum * 31u + ((const uint8_t*) data)[i];
+    }
+    stream->received += size;
+}
+
+static void stream_end(void **state, enum MQTTErrors result) {
+    struct stream_state *stream = (struct stream_state*) *state;
+    ++stream->ends;
+    stream->result = result;
+}
+
+static void stream_publish(void **state, struct mqtt_response_publish *publish) {
+    ++((struct stream_state*) *state)->publishes;
+}
+
+static void TEST__utility__recv_stream(void **unused) {
+    struct mqtt_client client;
+    struct stream_state stream;
+    static uint8_t payload[20000], rxbuf[21000];
+    uint8_t sendbuf[1024], recvbuf[64], smallbuf[64];
+    uint32_t checksum = 0;
+    uint16_t packet_id = 7;
+    ssize_t rv, small;
+    int sv[2];
+    size_t i;
+
+    for(i = 0; i < sizeof(payload); ++i) {
+        payload[i] = (uint8_t) (i * 7u);
+        checksum = checksum * 31u + payload[i];
+    }
+    memset(&stream, 0, sizeof(stream));
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), stream_publish);
+    client.publish_response_callback_state = &stream;
+    mqtt_init_recv_stream(&client, stream_begin, stream_chunk, stream_end, &stream);
+    assert_true(mqtt_connect(&client, "stream", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    small = mqtt_pack_publish_request(smallbuf, sizeof(smallbuf), "small", 0, "x", 1, MQTT_PUBLISH_QOS_0);
+    assert_true(small > 0);
+
+    /* a QoS 1 publish 300 times the size of the receive buffer, arriving in two parts */
+    rv = mqtt_pack_publish_request(rxbuf, sizeof(rxbuf), "large", packet_id, payload, sizeof(payload), MQTT_PUBLISH_QOS_1);
+    assert_true(rv > 0);
+    assert_true(send(sv[1], rxbuf, 5000, 0) == 5000);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(stream.begins == 1 && stream.ends == 0 && stream.size == sizeof(payload));
+    assert_true(stream.received > 0 && stream.received < sizeof(payload));
+    assert_true(mqtt_mq_find(&client.mq, MQTT_CONTROL_PUBACK, &packet_id) == NULL);
+
+    /* the packets after it are parsed as usual */
+    assert_true(send(sv[1], rxbuf + 5000, (size_t) rv - 5000, 0) == rv - 5000);
+    assert_true(send(sv[1], smallbuf, (size_t) small, 0) == small);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(stream.ends == 1 && stream.result == MQTT_OK);
+    assert_true(stream.received == sizeof(payload) && stream.checksum == checksum);
+    assert_true(stream.publishes == 1);
+    assert_true(mqtt_mq_find(&client.mq, MQTT_CONTROL_PUBACK, &packet_id) != NULL);
+
+    /* the payload of a duplicate QoS 2 publish is skipped */
+    rv = mqtt_pack_publish_request(rxbuf, sizeof(rxbuf), "large", packet_id, payload, sizeof(payload), MQTT_PUBLISH_QOS_2);
+    assert_true(rv > 0);
+    assert_true(send(sv[1], rxbuf, (size_t) rv, 0) == rv);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(send(sv[1], rxbuf, (size_t) rv, 0) == rv);
+    assert_true(send(sv[1], smallbuf, (size_t) small, 0) == small);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(stream.begins == 2 && stream.ends == 2 && stream.publishes == 2);
+    assert_true(mqtt_mq_find(&client.mq, MQTT_CONTROL_PUBREC, &packet_id) != NULL);
+
+    /* a publish that is cut off by a reconnect is ended with the error */
+    rv = mqtt_pack_publish_request(rxbuf, sizeof(rxbuf), "large", 0, payload, sizeof(payload), MQTT_PUBLISH_QOS_0);
+    assert_true(rv > 0);
+    assert_true(send(sv[1], rxbuf, 5000, 0) == 5000);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(stream.begins == 3 && stream.ends == 2);
+    client.error = MQTT_ERROR_SOCKET_ERROR;
+    mqtt_reinit(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf));
+    assert_true(stream.ends == 3 && stream.result == MQTT_ERROR_SOCKET_ERROR);
+    assert_true(client.recv_stream.remaining == 0);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+struct producer_state {
+    const uint8_t *payload;
+    size_t size;
+    uint8_t scratch[1000];
+    int stall_at;
+    int calls;
+    int restarts;
+    int released;
+};
+
+static ssize_t produce_payload(void *state, size_t offset, const void **data) {
+    struct producer_state *producer = (struct producer_state*) state;
+    size_t n = producer->size - offset < sizeof(producer->scratch) ? producer->size - offset : sizeof(producer->scratch);
+    if (producer->calls++ == producer->stall_at) {
+        /* nothing ready this time */
+        return 0;
+    }
+    if (offset == 0) {
+        ++producer->restarts;
+    }
+    memcpy(producer->scratch, producer->payload + offset, n);
+    *data = producer->scratch;
+    return (ssize_t) n;
+}
+
+static void release_producer(void *state, const void *application_message) {
+    assert_true(application_message == NULL);
+    ++((struct producer_state*) state)->released;
+}
+
+/* Sends everything the client has queued, reading it from \p fd into \p buf. */
+static size_t drain_client(struct mqtt_client *client, int fd, uint8_t *buf, size_t bufsz) {
+    size_t len = 0;
+    int idle = 0;
+    while (idle < 3) {
+        ssize_t rv;
+        assert_true(__mqtt_send(client) == MQTT_OK);
+        rv = recv(fd, buf + len, bufsz - len, MSG_DONTWAIT);
+        if (rv > 0) {
+            len += (size_t) rv;
+            idle = 0;
+        } else {
+            ++idle;
+        }
+    }
+    return len;
+}
+
+static void TEST__utility__publish_stream(void **unused) {
+    const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    struct mqtt_client client;
+    struct producer_state producer;
+    struct mqtt_response response;
+    static uint8_t payload[100000], wire[250000];
+    uint8_t sendbuf[1024], recvbuf[64], puback[4];
+    uint16_t packet_id;
+    ssize_t rv;
+    size_t len, connect_size, publish_size, i;
+    int sv[2];
+
+    for(i = 0; i < sizeof(payload); ++i) {
+        payload[i] = (uint8_t) (i * 13u);
+    }
+    memset(&producer, 0, sizeof(producer));
+    producer.payload = payload;
+    producer.size = sizeof(payload);
+    producer.stall_at = 10;
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(mqtt_connect(&client, "stream", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+
+    /* a message 100 times the size of the send buffer, followed by a regular one */
+    assert_true(mqtt_publish_stream(&client, "firmware", sizeof(payload), MQTT_PUBLISH_QOS_1,
+                                    produce_payload, release_producer, &producer) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "after", "x", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    packet_id = mqtt_mq_get(&client.mq, 1)->packet_id;
+    len = drain_client(&client, sv[1], wire, sizeof(wire));
+
+    /* the CONNECT, the PUBLISH with the produced message and then the next PUBLISH */
+    connect_size = 2u + wire[1];
+    rv = mqtt_unpack_fixed_header(&response, wire + connect_size, len - connect_size);
+    assert_true(rv > 0 && response.fixed_header.control_type == MQTT_CONTROL_PUBLISH);
+    publish_size = (size_t) rv + response.fixed_header.remaining_length;
+    assert_true(memcmp(wire + connect_size + publish_size - sizeof(payload), payload, sizeof(payload)) == 0);
+    assert_true(len == connect_size + publish_size + 10);
+    assert_true(wire[connect_size + publish_size] == 0x30 && memcmp(wire + len - 6, "after", 5) == 0);
+    assert_true(producer.calls > 100 && producer.restarts == 1 && producer.released == 0);
+
+    /* a retransmission produces the message again */
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    client.response_timeout_ms = 0;
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    client.response_timeout_ms = 30000;
+    len = drain_client(&client, sv[1], wire, sizeof(wire));
+    assert_true(len == publish_size && (wire[0] & MQTT_PUBLISH_DUP));
+    assert_true(memcmp(wire + publish_size - sizeof(payload), payload, sizeof(payload)) == 0);
+    assert_true(producer.restarts == 2);
+
+    /* the producer is released with the PUBACK */
+    rv = mqtt_pack_pubxxx_request(puback, sizeof(puback), MQTT_CONTROL_PUBACK, packet_id);
+    assert_true(rv == 4 && send(sv[1], puback, 4, 0) == 4);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(producer.released == 1);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void count_wakeup(void **state) {
+    ++*(int*) *state;
+}
+
+static void TEST__utility__publish_stream_starved(void **unused) {
+    struct mqtt_client client;
+    struct producer_state producer;
+    static uint8_t payload[5000], wire[10000];
+    uint8_t sendbuf[1024], recvbuf[64];
+    mqtt_pal_time_ms_t deadline;
+    size_t len;
+    int sv[2], wakeups = 0;
+
+    memset(payload, 's', sizeof(payload));
+    memset(&producer, 0, sizeof(producer));
+    producer.payload = payload;
+    producer.size = sizeof(payload);
+    producer.stall_at = 1;
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(mqtt_connect(&client, "starved", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(mqtt_publish_stream(&client, "firmware", sizeof(payload), MQTT_PUBLISH_QOS_0,
+                                    produce_payload, NULL, &producer) == MQTT_OK);
+    mqtt_init_wakeup(&client, count_wakeup, &wakeups);
+
+    /* the producer runs dry after its first piece, the socket isn't worth waiting for */
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(client.send_partial != NULL && client.producer_starved);
+    assert_true(mqtt_sync_interest(&client, &deadline) == MQTT_SYNC_WANT_READ);
+    assert_true(deadline == MQTT_SYNC_NO_DEADLINE);
+
+    /* resuming wakes the event loop up and the rest is sent */
+    assert_true(mqtt_publish_stream_resume(&client) == MQTT_OK);
+    assert_true(wakeups == 1);
+    assert_true(mqtt_sync_interest(&client, &deadline) == (MQTT_SYNC_WANT_READ | MQTT_SYNC_WANT_WRITE));
+    len = drain_client(&client, sv[1], wire, sizeof(wire));
+    assert_true(memcmp(wire + len - sizeof(payload), payload, sizeof(payload)) == 0);
+    assert_true(client.send_partial == NULL && !client.producer_starved);
+    assert_true(mqtt_sync_interest(&client, &deadline) == MQTT_SYNC_WANT_READ);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+struct counting_allocator {
+    size_t allocated;
+    int allocations;
+};
+
+static void* counting_allocate(void *context, size_t size) {
+    struct counting_allocator *allocator = (struct counting_allocator*) context;
+    allocator->allocated += size;
+    allocator->allocations += 1;
+    return malloc(size);
+}
+
+static void counting_deallocate(void *context, void *ptr, size_t size) {
+    ((struct counting_allocator*) context)->allocated -= size;
+    free(ptr);
+}
+
+static void count_received(void **state, struct mqtt_response_publish *publish) {
+    *(size_t*) *state += publish->application_message_size;
+}
+
+static void TEST__utility__elastic_buffers(void **unused) {
+    const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    struct counting_allocator counter = {0, 0};
+    const struct mqtt_allocator allocator = {counting_allocate, counting_deallocate, &counter};
+    struct mqtt_client client;
+    struct mqtt_response response;
+    static uint8_t wire[65536], large[20000];
+    uint8_t sendbuf[512], recvbuf[64], message[100], puback[4];
+    size_t len, pos, received = 0;
+    int i, publishes = 0, sv[2];
+    ssize_t rv;
+
+    memset(message, 'm', sizeof(message));
+    memset(large, 'l', sizeof(large));
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), count_received);
+    client.publish_response_callback_state = &received;
+    mqtt_init_allocator(&client, &allocator, 16384, 4096);
+    assert_true(mqtt_connect(&client, "elastic", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+
+    /* a burst 10 times the size of the send buffer grows it */
+    for(i = 0; i < 50; ++i) {
+        assert_true(mqtt_publish(&client, "burst", message, sizeof(message), MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    }
+    assert_true(client.buffers.grown_sendbuf != NULL && client.buffers.number_of_grows > 0);
+    assert_true(client.buffers.grown_sendbuf_size <= 16384);
+
+    /* the messages are sent in order, and acknowledged */
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    len = drain_client(&client, sv[1], wire, sizeof(wire));
+    for(pos = 2u + wire[1]; pos < len; pos += (size_t) rv) {
+        rv = mqtt_unpack_response(&response, wire + pos, len - pos);
+        assert_true(rv > 0 && response.fixed_header.control_type == MQTT_CONTROL_PUBLISH);
+        assert_true(response.decoded.publish.application_message_size == sizeof(message));
+        assert_true(mqtt_pack_pubxxx_request(puback, sizeof(puback), MQTT_CONTROL_PUBACK, response.decoded.publish.packet_id) == 4);
+        assert_true(send(sv[1], puback, sizeof(puback), 0) == sizeof(puback));
+        ++publishes;
+    }
+    assert_true(publishes == 50);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+
+    /* once they are complete the client moves back into its own send buffer */
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(client.buffers.grown_sendbuf == NULL);
+    assert_true((uint8_t*) client.mq.mem_start >= sendbuf && (uint8_t*) client.mq.mem_end <= sendbuf + sizeof(sendbuf));
+
+    /* a publish 30 times the size of the receive buffer grows it, until it is received */
+    rv = mqtt_pack_publish_request(wire, sizeof(wire), "large", 0, large, 2000, MQTT_PUBLISH_QOS_0);
+    assert_true(rv > 0 && send(sv[1], wire, (size_t) rv, 0) == rv);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(received == 2000);
+    assert_true(client.buffers.grown_recvbuf == NULL && client.recv_buffer.mem_start == recvbuf);
+    assert_true(counter.allocated == 0 && counter.allocations >= 2);
+
+    /* but not beyond their limits */
+    assert_true(mqtt_publish(&client, "large", large, sizeof(large), MQTT_PUBLISH_QOS_0) == MQTT_ERROR_SEND_BUFFER_IS_FULL);
+    client.error = MQTT_OK;
+    rv = mqtt_pack_publish_request(wire, sizeof(wire), "large", 0, large, 8000, MQTT_PUBLISH_QOS_0);
+    assert_true(rv > 0 && send(sv[1], wire, (size_t) rv, 0) == rv);
+    assert_true(__mqtt_recv(&client) == MQTT_ERROR_RECV_BUFFER_TOO_SMALL);
+
+    mqtt_free_buffers(&client);
+    assert_true(counter.allocated == 0);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void send_pubxxx(int fd, enum MQTTControlPacketType control_type, uint16_t packet_id) {
+    uint8_t packet[4];
+    assert_true(mqtt_pack_pubxxx_request(packet, sizeof(packet), control_type, packet_id) == 4);
+    assert_true(send(fd, packet, sizeof(packet), 0) == 4);
+}
+
+/* Sends the client's queued packets and unpacks them into responses (only the fixed header of a CONNECT or SUBSCRIBE). */
+static int drain_packets(struct mqtt_client *client, int fd, struct mqtt_response *responses, int max) {
+    static uint8_t wire[65536];
+    size_t len = drain_client(client, fd, wire, sizeof(wire));
+    size_t pos = 0;
+    int n = 0;
+    while (pos < len) {
+        ssize_t rv;
+        assert_true(n < max);
+        rv = mqtt_unpack_fixed_header(&responses[n], wire + pos, len - pos);
+        assert_true(rv > 0);
+        if (responses[n].fixed_header.control_type == MQTT_CONTROL_CONNECT
+            || responses[n].fixed_header.control_type == MQTT_CONTROL_SUBSCRIBE)
+        {
+            rv += (ssize_t) responses[n].fixed_header.remaining_length;
+        } else {
+            rv = mqtt_unpack_response(&responses[n], wire + pos, len - pos);
+            assert_true(rv > 0);
+        }
+        pos += (size_t) rv;
+        ++n;
+    }
+    return n;
+}
+
+/* The broker's end of a client that reconnects through session_reconnect, and the buffers it reconnects with. */
+struct session_peer {
+    int sv[2];
+    uint8_t *sendbuf;
+    size_t sendbufsz;
+    uint8_t *recvbuf;
+    size_t recvbufsz;
+    enum MQTTErrors reinit_error;
+};
+
+/* The reconnect callback: moves the client to a new socket pair (mqtt_sync holds the client's locks). */
+static void session_reconnect(struct mqtt_client *client, void **state) {
+    struct session_peer *peer = *((struct session_peer**) state);
+    if (peer->sv[0] >= 0) {
+        close(peer->sv[0]);
+        close(peer->sv[1]);
+    }
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, peer->sv) == 0);
+    assert_true(fcntl(peer->sv[0], F_SETFL, fcntl(peer->sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    peer->reinit_error = mqtt_reinit(client, peer->sv[0], peer->sendbuf, peer->sendbufsz, peer->recvbuf, peer->recvbufsz);
+    assert_true(mqtt_connect(client, "session", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+}
+
+static void session_init(struct mqtt_client *client, struct session_peer *peer, uint8_t *sendbuf, size_t sendbufsz,
+                         uint8_t *recvbuf, size_t recvbufsz,
+                         void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish)) {
+    peer->sv[0] = -1;
+    peer->sv[1] = -1;
+    peer->sendbuf = sendbuf;
+    peer->sendbufsz = sendbufsz;
+    peer->recvbuf = recvbuf;
+    peer->recvbufsz = recvbufsz;
+    peer->reinit_error = MQTT_OK;
+    mqtt_init_reconnect(client, session_reconnect, peer, publish_response_callback);
+}
+
+/* Drops the client's connection (if it has one), lets mqtt_sync reconnect it and acknowledges the CONNECT. */
+static void session_connect(struct mqtt_client *client, struct session_peer *peer, struct mqtt_store *store) {
+    const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    if (client->error == MQTT_OK) {
+        client->error = MQTT_ERROR_SOCKET_ERROR;
+    }
+    assert_true(mqtt_sync(client) == MQTT_OK);
+#if defined(MQTT_STORE_AVAILABLE)
+    if (store != NULL) {
+        assert_true(mqtt_store_attach(store, client) == MQTT_OK);
+    }
+#endif
+    assert_true(send(peer->sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+}
+
+#if defined(MQTT_STORE_AVAILABLE)
+static void TEST__utility__session_store(void **unused) {
+    char path[] = "/tmp/mqtt-c-store-XXXXXX";
+    struct mqtt_store store;
+    struct mqtt_client client;
+    struct mqtt_response sent[300];
+    static uint8_t sendbuf[16384], large[2500];
+    uint8_t recvbuf[1024], incoming[32], message[100];
+    struct session_peer peer;
+    uint16_t packet_ids[4];
+    size_t received = 0, end;
+    int i, n, fd;
+    ssize_t rv;
+
+    fd = mkstemp(path);
+    assert_true(fd >= 0);
+    close(fd);
+
+    /* the first run publishes at QoS 1 and 2, and receives a QoS 2 publish */
+    assert_true(mqtt_store_open(&store, path, 4096, MQTT_STORE_SYNC_BATCH) == MQTT_OK);
+    session_init(&client, &peer, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), count_received);
+    client.publish_response_callback_state = &received;
+    client.max_inflight_qos2 = 0;
+    session_connect(&client, &peer, &store);
+    assert_true(mqtt_publish(&client, "a", "one", 3, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "b", "two", 3, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "c", "three", 5, MQTT_PUBLISH_QOS_2) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "d", "four", 4, MQTT_PUBLISH_QOS_2) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "e", "five", 4, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 6) == 6);
+    for(i = 0; i < 4; ++i) {
+        packet_ids[i] = sent[i + 1].decoded.publish.packet_id;
+    }
+    assert_true(store.number_of_messages == 4 && store.number_of_syncs == 1);
+
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBACK, packet_ids[0]);
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBREC, packet_ids[2]);
+    rv = mqtt_pack_publish_request(incoming, sizeof(incoming), "in", 77, "six", 3, MQTT_PUBLISH_QOS_2);
+    assert_true(rv > 0 && send(peer.sv[1], incoming, (size_t) rv, 0) == rv);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 2) == 2);
+    assert_true(store.number_of_messages == 4);
+
+    /* the process dies */
+    mqtt_store_close(&store);
+    close(peer.sv[0]);
+    close(peer.sv[1]);
+
+    /* the second run resends the rest of the session */
+    assert_true(mqtt_store_open(&store, path, 4096, MQTT_STORE_SYNC_EACH) == MQTT_OK);
+    assert_true(store.number_of_messages == 4);
+    session_init(&client, &peer, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), count_received);
+    client.max_inflight_qos2 = 0;
+    session_connect(&client, &peer, &store);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 5) == 5);
+    assert_true(sent[0].fixed_header.control_type == MQTT_CONTROL_CONNECT);
+    assert_true(sent[1].fixed_header.control_type == MQTT_CONTROL_PUBLISH && sent[1].decoded.publish.dup_flag);
+    assert_true(sent[1].decoded.publish.packet_id == packet_ids[1]);
+    assert_true(memcmp(sent[1].decoded.publish.application_message, "two", 3) == 0);
+    assert_true(sent[2].fixed_header.control_type == MQTT_CONTROL_PUBLISH && sent[2].decoded.publish.dup_flag);
+    assert_true(sent[2].decoded.publish.packet_id == packet_ids[3]);
+    assert_true(sent[3].fixed_header.control_type == MQTT_CONTROL_PUBREL && sent[3].decoded.pubrel.packet_id == packet_ids[2]);
+    assert_true(sent[4].fixed_header.control_type == MQTT_CONTROL_PUBREC && sent[4].decoded.pubrec.packet_id == 77);
+
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBACK, packet_ids[1]);
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBCOMP, packet_ids[2]);
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBREL, 77);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(store.number_of_messages == 1);
+
+    /* a record that was torn by a crash is dropped */
+    assert_true(mqtt_publish(&client, "f", "seven", 5, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    end = store.end;
+    mqtt_store_close(&store);
+    close(peer.sv[0]);
+    close(peer.sv[1]);
+    fd = open(path, O_RDWR);
+    assert_true(fd >= 0 && pwrite(fd, "X", 1, (off_t) (end - 8)) == 1);
+    close(fd);
+
+    /* the file is compacted when it is full */
+    assert_true(mqtt_store_open(&store, path, 4096, MQTT_STORE_NO_SYNC) == MQTT_OK);
+    assert_true(store.number_of_messages == 1);
+    session_init(&client, &peer, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), count_received);
+    client.max_inflight_qos2 = 0;
+    session_connect(&client, &peer, &store);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 2) == 2);
+    assert_true(sent[1].decoded.publish.packet_id == packet_ids[3]);
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBREC, packet_ids[3]);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 1) == 1);
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBCOMP, packet_ids[3]);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    memset(message, 'm', sizeof(message));
+    for(i = 0; i < 200; ++i) {
+        assert_true(mqtt_publish(&client, "g", message, sizeof(message), MQTT_PUBLISH_QOS_1) == MQTT_OK);
+        n = drain_packets(&client, peer.sv[1], sent, 1);
+        assert_true(n == 1);
+        send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBACK, sent[0].decoded.publish.packet_id);
+        assert_true(__mqtt_recv(&client) == MQTT_OK);
+    }
+    assert_true(store.number_of_compactions > 0 && store.number_of_messages == 0);
+
+    /* but not beyond its size */
+    assert_true(mqtt_publish(&client, "g", large, 2500, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "g", large, 1600, MQTT_PUBLISH_QOS_1) == MQTT_ERROR_STORE_FULL);
+    assert_true(client.error == MQTT_OK && store.number_of_messages == 1);
+    mqtt_store_close(&store);
+
+    assert_true(mqtt_store_open(&store, path, 4096, MQTT_STORE_NO_SYNC) == MQTT_OK);
+    assert_true(store.number_of_messages == 1);
+    mqtt_store_close(&store);
+    close(peer.sv[0]);
+    close(peer.sv[1]);
+    unlink(path);
+}
+#endif
+
+static void TEST__utility__reinit_keep_queue(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_response sent[16];
+    struct session_peer peer;
+    uint8_t sendbuf[4096], other_sendbuf[4096], small_sendbuf[1024], tiny_sendbuf[512], recvbuf[256], incoming[32], message[300];
+    uint16_t packet_ids[5];
+    size_t received = 0;
+    int i;
+    ssize_t rv;
+
+    session_init(&client, &peer, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), count_received);
+    client.publish_response_callback_state = &received;
+    client.max_inflight_qos2 = 0;
+    mqtt_init_reinit_policy(&client, MQTT_REINIT_KEEP_SESSION);
+    session_connect(&client, &peer, NULL);
+
+    /* a session with messages in every state when the connection drops */
+    assert_true(mqtt_publish(&client, "a", "one", 3, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "b", "two", 3, MQTT_PUBLISH_QOS_2) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "c", "three", 5, MQTT_PUBLISH_QOS_2) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "d", "four", 4, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_subscribe(&client, "s", 1) == MQTT_OK);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 6);
+    for(i = 0; i < 3; ++i) {
+        packet_ids[i] = sent[i + 1].decoded.publish.packet_id;
+    }
+    assert_true(sent[5].fixed_header.control_type == MQTT_CONTROL_SUBSCRIBE);
+    packet_ids[3] = mqtt_mq_find(&client.mq, MQTT_CONTROL_SUBSCRIBE, NULL)->packet_id;
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBREC, packet_ids[2]);
+    rv = mqtt_pack_publish_request(incoming, sizeof(incoming), "in", 77, "six", 3, MQTT_PUBLISH_QOS_2);
+    assert_true(rv > 0 && send(peer.sv[1], incoming, (size_t) rv, 0) == rv);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(received == 3);
+    assert_true(mqtt_publish(&client, "e", "five", 4, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "f", "seven", 5, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+
+    /* the CONNECT goes first, then what wasn't acknowledged (sent PUBLISH's with DUP) */
+    session_connect(&client, &peer, NULL);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 7);
+    assert_true(sent[0].fixed_header.control_type == MQTT_CONTROL_CONNECT);
+    assert_true(sent[1].fixed_header.control_type == MQTT_CONTROL_PUBLISH && sent[1].decoded.publish.dup_flag);
+    assert_true(sent[1].decoded.publish.packet_id == packet_ids[0]);
+    assert_true(sent[2].fixed_header.control_type == MQTT_CONTROL_PUBLISH && sent[2].decoded.publish.dup_flag);
+    assert_true(sent[2].decoded.publish.packet_id == packet_ids[1]);
+    assert_true(sent[3].fixed_header.control_type == MQTT_CONTROL_SUBSCRIBE);
+    assert_true(sent[4].fixed_header.control_type == MQTT_CONTROL_PUBREL && sent[4].decoded.pubrel.packet_id == packet_ids[2]);
+    assert_true(sent[5].fixed_header.control_type == MQTT_CONTROL_PUBREC && sent[5].decoded.pubrec.packet_id == 77);
+    assert_true(sent[6].fixed_header.control_type == MQTT_CONTROL_PUBLISH && !sent[6].decoded.publish.dup_flag);
+    assert_true(memcmp(sent[6].decoded.publish.topic_name, "f", 1) == 0);
+    packet_ids[4] = sent[6].decoded.publish.packet_id;
+
+    /* kept QoS 0 messages, moved into another buffer */
+    mqtt_init_reinit_policy(&client, MQTT_REINIT_KEEP_ALL);
+    assert_true(mqtt_publish(&client, "g", "eight", 5, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    peer.sendbuf = other_sendbuf;
+    peer.sendbufsz = sizeof(other_sendbuf);
+    session_connect(&client, &peer, NULL);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 8);
+    assert_true(sent[0].fixed_header.control_type == MQTT_CONTROL_CONNECT);
+    assert_true(sent[6].fixed_header.control_type == MQTT_CONTROL_PUBLISH && sent[6].decoded.publish.dup_flag);
+    assert_true(sent[7].fixed_header.control_type == MQTT_CONTROL_PUBLISH);
+    assert_true(memcmp(sent[7].decoded.publish.topic_name, "g", 1) == 0);
+
+    /* the session completes, a PUBREL whose PUBREC is gone is answered anyway */
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBACK, packet_ids[0]);
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBREC, packet_ids[1]);
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBCOMP, packet_ids[2]);
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBREL, 77);
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBACK, packet_ids[4]);
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBREL, 99);
+    incoming[0] = 0x90;
+    incoming[1] = 0x03;
+    incoming[2] = (uint8_t) (packet_ids[3] >> 8);
+    incoming[3] = (uint8_t) packet_ids[3];
+    incoming[4] = 0x01;
+    assert_true(send(peer.sv[1], incoming, 5, 0) == 5);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(client.error == MQTT_OK);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 3);
+    assert_true(sent[0].fixed_header.control_type == MQTT_CONTROL_PUBREL && sent[0].decoded.pubrel.packet_id == packet_ids[1]);
+    assert_true(sent[1].fixed_header.control_type == MQTT_CONTROL_PUBCOMP && sent[1].decoded.pubcomp.packet_id == 77);
+    assert_true(sent[2].fixed_header.control_type == MQTT_CONTROL_PUBCOMP && sent[2].decoded.pubcomp.packet_id == 99);
+    assert_true(received == 3);
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBCOMP, packet_ids[1]);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+
+    /* packets that were moved to make room are kept in order */
+    peer.sendbuf = small_sendbuf;
+    peer.sendbufsz = sizeof(small_sendbuf);
+    session_connect(&client, &peer, NULL);
+    memset(message, 'm', sizeof(message));
+    assert_true(mqtt_publish(&client, "h", message, 250, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "i", message, 250, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 3);
+    send_pubxxx(peer.sv[1], MQTT_CONTROL_PUBACK, sent[1].decoded.publish.packet_id);
+    packet_ids[0] = sent[2].decoded.publish.packet_id;
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 0);
+    assert_true(mqtt_publish(&client, "j", message, 200, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_mq_get(&client.mq, 0)->start == (uint8_t*) client.mq.mem_start);
+    session_connect(&client, &peer, NULL);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 3);
+    assert_true(sent[0].fixed_header.control_type == MQTT_CONTROL_CONNECT);
+    assert_true(sent[1].decoded.publish.packet_id == packet_ids[0] && sent[1].decoded.publish.dup_flag);
+    assert_true(memcmp(sent[1].decoded.publish.topic_name, "i", 1) == 0);
+    assert_true(memcmp(sent[2].decoded.publish.topic_name, "j", 1) == 0 && !sent[2].decoded.publish.dup_flag);
+    assert_true(sent[2].decoded.publish.application_message_size == 200);
+    assert_true(peer.reinit_error == MQTT_OK);
+
+    /* kept messages that don't fit into the new buffer are reported */
+    assert_true(mqtt_publish(&client, "k", message, 100, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    peer.sendbuf = tiny_sendbuf;
+    peer.sendbufsz = sizeof(tiny_sendbuf);
+    session_connect(&client, &peer, NULL);
+    assert_true(peer.reinit_error == MQTT_ERROR_SEND_BUFFER_IS_FULL);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 2);
+    assert_true(sent[0].fixed_header.control_type == MQTT_CONTROL_CONNECT);
+    assert_true(sent[1].decoded.publish.packet_id == packet_ids[0]);
+
+    close(peer.sv[0]);
+    close(peer.sv[1]);
+}
+
+struct deferred_state {
+    struct mqtt_client *client;
+    char topics[8];
+    int n;
+};
+
+/* Records the topic and publishes it back, which needs the client's mutex. */
+static void publish_back(void **state, struct mqtt_response_publish *publish) {
+    struct deferred_state *deferred = (struct deferred_state*) *state;
+    assert_true(deferred->client->delivery.delivering);
+    assert_true(__mqtt_recv(deferred->client) == MQTT_OK);
+    deferred->topics[deferred->n++] = ((const char*) publish->topic_name)[0];
+    assert_true(mqtt_publish(deferred->client, "echo", publish->topic_name, publish->topic_name_size, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+}
+
+static void TEST__utility__deferred_delivery(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_response sent[16];
+    struct mqtt_response_publish publishes[2];
+    struct deferred_state deferred;
+    struct session_peer peer;
+    uint8_t sendbuf[4096], recvbuf[256], incoming[128];
+    size_t len = 0;
+    int i;
+    ssize_t rv;
+
+    session_init(&client, &peer, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), publish_back);
+    mqtt_init_deferred_delivery(&client, publishes, 2);
+    memset(&deferred, 0, sizeof(deferred));
+    deferred.client = &client;
+    client.publish_response_callback_state = &deferred;
+    session_connect(&client, &peer, NULL);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 1);
+
+    /* five publishes in one read are delivered in order, two at a time */
+    for(i = 0; i < 5; ++i) {
+        const char topic[2] = {(char) ('a' + i), '\0'};
+        rv = mqtt_pack_publish_request(incoming + len, sizeof(incoming) - len, topic, (uint16_t) (10 + i), "x", 1,
+                                       i % 2 == 0 ? MQTT_PUBLISH_QOS_1 : MQTT_PUBLISH_QOS_2);
+        assert_true(rv > 0);
+        len += (size_t) rv;
+    }
+    assert_true(send(peer.sv[1], incoming, len, 0) == (ssize_t) len);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(deferred.n == 5 && memcmp(deferred.topics, "abcde", 5) == 0);
+    assert_true(client.delivery.number_of_deliveries == 3);
+    assert_true(!client.delivery.delivering && client.delivery.length == 0);
+
+    /* each batch's acknowledgements were queued before its callbacks ran */
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 10);
+    for(i = 0; i < 5; ++i) {
+        struct mqtt_response *ack = &sent[(i / 2) * 4 + i % 2];
+        assert_true(ack->fixed_header.control_type == (i % 2 == 0 ? MQTT_CONTROL_PUBACK : MQTT_CONTROL_PUBREC));
+        assert_true(ack->decoded.puback.packet_id == 10 + i);
+    }
+    assert_true(sent[2].fixed_header.control_type == MQTT_CONTROL_PUBLISH);
+    assert_true(((const char*) sent[2].decoded.publish.application_message)[0] == 'a');
+
+    /* a duplicate QoS 2 publish is still acknowledged but not delivered again */
+    rv = mqtt_pack_publish_request(incoming, sizeof(incoming), "b", 11, "x", 1, MQTT_PUBLISH_QOS_2 | MQTT_PUBLISH_DUP);
+    assert_true(rv > 0 && send(peer.sv[1], incoming, (size_t) rv, 0) == rv);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(deferred.n == 5);
+
+    close(peer.sv[0]);
+    close(peer.sv[1]);
+}
+
+#if MQTT_PAL_LOCK_POLICY != MQTT_PAL_LOCK_NONE
+/* Takes a client lock if it is free. */
+static int try_lock(mqtt_pal_mutex_t *lock) {
+#if MQTT_PAL_LOCK_POLICY == MQTT_PAL_LOCK_SPIN
+    uint32_t unlocked = 0;
+    return __atomic_compare_exchange_n(lock, &unlocked, 1u, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+#else
+    return pthread_mutex_trylock(lock) == 0;
+#endif
+}
+
+/* Checks that only the receive lock is held, and publishes the topic back. */
+static void publish_back_locked(void **state, struct mqtt_response_publish *publish) {
+    struct mqtt_client *client = (struct mqtt_client*) *state;
+    assert_false(try_lock(&client->recv_mutex));
+    assert_true(try_lock(&client->mutex));
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    assert_true(mqtt_publish(client, "echo", publish->topic_name, publish->topic_name_size, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+}
+
+struct recv_lock_holder {
+    struct mqtt_client *client;
+    int locked;
+    int release;
+};
+
+static void* hold_recv_lock(void *arg) {
+    struct recv_lock_holder *holder = (struct recv_lock_holder*) arg;
+    MQTT_PAL_MUTEX_LOCK(&holder->client->recv_mutex);
+    __atomic_store_n(&holder->locked, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&holder->release, __ATOMIC_SEQ_CST)) {
+        usleep(1000);
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&holder->client->recv_mutex);
+    return NULL;
+}
+
+static void TEST__utility__split_locks(void **unused) {
+    struct mqtt_client client;
+    struct mqtt_response sent[16];
+    struct recv_lock_holder holder;
+    struct session_peer peer;
+    pthread_t thread;
+    uint8_t sendbuf[4096], recvbuf[256], incoming[64];
+    ssize_t rv;
+
+    session_init(&client, &peer, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), publish_back_locked);
+    client.publish_response_callback_state = &client;
+    session_connect(&client, &peer, NULL);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 1);
+
+    /* the publish callback runs without the client's mutex, so it may publish */
+    rv = mqtt_pack_publish_request(incoming, sizeof(incoming), "a", 10, "x", 1, MQTT_PUBLISH_QOS_1);
+    assert_true(rv > 0 && send(peer.sv[1], incoming, (size_t) rv, 0) == rv);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 2);
+    assert_true(sent[0].fixed_header.control_type == MQTT_CONTROL_PUBACK);
+    assert_true(sent[1].fixed_header.control_type == MQTT_CONTROL_PUBLISH);
+
+    /* publishing and sending go on while another thread receives */
+    holder.client = &client;
+    holder.locked = 0;
+    holder.release = 0;
+    assert_true(pthread_create(&thread, NULL, hold_recv_lock, &holder) == 0);
+    while (!__atomic_load_n(&holder.locked, __ATOMIC_SEQ_CST)) {
+        usleep(1000);
+    }
+    assert_true(mqtt_publish(&client, "b", "y", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    __atomic_store_n(&holder.release, 1, __ATOMIC_SEQ_CST);
+    assert_true(pthread_join(thread, NULL) == 0);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 1);
+    assert_true(sent[0].fixed_header.control_type == MQTT_CONTROL_PUBLISH);
+
+    close(peer.sv[0]);
+    close(peer.sv[1]);
+}
+#endif
+
+#define LOCK_THREADS 4
+#define LOCK_ROUNDS 20000
+
+struct lock_counter {
+    mqtt_pal_mutex_t lock;
+    long count;
+};
+
+static void* lock_counter_thread(void *arg) {
+    struct lock_counter *counter = (struct lock_counter*) arg;
+    int i;
+    for(i = 0; i < LOCK_ROUNDS; ++i) {
+        MQTT_PAL_MUTEX_LOCK(&counter->lock);
+        ++counter->count;
+        if (i % 1000 == 0) {
+            /* hold the lock long enough for the others to wait */
+            sched_yield();
+        }
+        MQTT_PAL_MUTEX_UNLOCK(&counter->lock);
+    }
+    return NULL;
+}
+
+static void TEST__utility__lock_policy(void **unused) {
+    struct lock_counter counter;
+    int i;
+    MQTT_PAL_MUTEX_INIT(&counter.lock);
+    counter.count = 0;
+#if MQTT_PAL_LOCK_POLICY == MQTT_PAL_LOCK_NONE
+    /* the locks do nothing, so the client (and this counter) is used from one thread */
+    (void) i;
+    lock_counter_thread(&counter);
+    assert_true(counter.count == LOCK_ROUNDS);
+#else
+    {
+        pthread_t threads[LOCK_THREADS];
+        for(i = 0; i < LOCK_THREADS; ++i) {
+            assert_true(pthread_create(&threads[i], NULL, lock_counter_thread, &counter) == 0);
+        }
+        for(i = 0; i < LOCK_THREADS; ++i) {
+            assert_true(pthread_join(threads[i], NULL) == 0);
+        }
+    }
+    assert_true(counter.count == (long) LOCK_THREADS * LOCK_ROUNDS);
+    assert_true(try_lock(&counter.lock));
+    assert_false(try_lock(&counter.lock));
+    MQTT_PAL_MUTEX_UNLOCK(&counter.lock);
+#endif
+}
+#endif
+
+#if defined(MQTT_WORKER_POOL_AVAILABLE)
+struct pool_state {
+    pthread_mutex_t mutex;
+    pthread_t threads[9];
+    int last[9];
+    int processed;
+};
+
+/* Checks that the publishes of every topic ("t0" to "t8") are processed in order on one thread. */
+static void pool_callback(void **state, struct mqtt_response_publish *publish) {
+    struct pool_state *pool_state = (struct pool_state*) *state;
+    int topic = ((const char*) publish->topic_name)[1] - '0';
+    int seq;
+    assert_true(publish->application_message_size >= sizeof(seq));
+    memcpy(&seq, publish->application_message, sizeof(seq));
+    pthread_mutex_lock(&pool_state->mutex);
+    assert_true(seq > pool_state->last[topic]);
+    if (pool_state->last[topic] >= 0) {
+        assert_true(pthread_equal(pool_state->threads[topic], pthread_self()));
+    }
+    pool_state->threads[topic] = pthread_self();
+    pool_state->last[topic] = seq;
+    pool_state->processed += 1;
+    pthread_mutex_unlock(&pool_state->mutex);
+}
+
+struct pool_thread {
+    struct mqtt_worker_pool *pool;
+    size_t index;
+};
+
+static void* pool_thread(void *arg) {
+    struct pool_thread *thread = (struct pool_thread*) arg;
+    mqtt_worker_pool_run(thread->pool, thread->index);
+    return NULL;
+}
+
+static void TEST__utility__worker_pool(void **unused) {
+    struct pool_state pool_state;
+    struct mqtt_worker_pool pool;
+    struct mqtt_worker workers[3];
+    struct pool_thread threads[3];
+    pthread_t tids[3];
+    struct mqtt_response_publish publish, publishes[4];
+    struct mqtt_client client;
+    struct mqtt_response sent[16];
+    struct session_peer peer;
+    uint8_t mem[3 * 256 + 8], payload[300], sendbuf[4096], recvbuf[512], incoming[256];
+    char topic[3] = {'t', '0', '\0'};
+    void *state = &pool;
+    size_t i, len = 0, processed = 0;
+    ssize_t rv;
+
+    memset(&pool_state, 0, sizeof(pool_state));
+    pthread_mutex_init(&pool_state.mutex, NULL);
+    for(i = 0; i < 9; ++i) {
+        pool_state.last[i] = -1;
+    }
+    assert_true(mqtt_worker_pool_init(&pool, workers, 3, mem, 3 * 63, pool_callback, &pool_state) == MQTT_ERROR_NULLPTR);
+    assert_true(mqtt_worker_pool_init(&pool, workers, 3, mem, sizeof(mem), pool_callback, &pool_state) == MQTT_OK);
+    assert_true(workers[0].mask == 255);
+    for(i = 0; i < 3; ++i) {
+        threads[i].pool = &pool;
+        threads[i].index = i;
+        assert_true(pthread_create(&tids[i], NULL, pool_thread, &threads[i]) == 0);
+    }
+
+    /* copied publishes on 8 topics, the rings wrap and fill up many times */
+    memset(&publish, 0, sizeof(publish));
+    memset(payload, 0, sizeof(payload));
+    publish.topic_name = topic;
+    publish.topic_name_size = 2;
+    publish.application_message = payload;
+    for(i = 0; i < 2000; ++i) {
+        int seq = (int) i;
+        topic[1] = (char) ('0' + i % 8);
+        memcpy(payload, &seq, sizeof(seq));
+        publish.application_message_size = sizeof(seq) + i % 13;
+        mqtt_worker_pool_dispatch(&state, &publish);
+    }
+
+    /* a publish that doesn't fit in a ring is processed here */
+    topic[1] = '8';
+    publish.application_message_size = sizeof(payload);
+    mqtt_worker_pool_dispatch(&state, &publish);
+    assert_true(pool.number_of_inline_publishes == 1);
+    assert_true(pthread_equal(pool_state.threads[8], pthread_self()));
+    mqtt_worker_pool_drain(&pool);
+    assert_true(pool_state.processed == 2001);
+    for(i = 0; i < 3; ++i) {
+        processed += workers[i].number_of_publishes;
+    }
+    assert_true(processed == 2000);
+
+    /* with deferred delivery the publishes are referenced in the receive buffer */
+    session_init(&client, &peer, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    mqtt_init_deferred_delivery(&client, publishes, 4);
+    mqtt_worker_pool_attach(&pool, &client);
+    assert_true(pool.client == &client);
+    session_connect(&client, &peer, NULL);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 1);
+    for(i = 0; i < 8; ++i) {
+        int seq = 3000 + (int) i;
+        topic[1] = (char) ('0' + i % 8);
+        rv = mqtt_pack_publish_request(incoming + len, sizeof(incoming) - len, topic, (uint16_t) (1 + i), &seq, sizeof(seq), MQTT_PUBLISH_QOS_1);
+        assert_true(rv > 0);
+        len += (size_t) rv;
+    }
+    assert_true(send(peer.sv[1], incoming, len, 0) == (ssize_t) len);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(pool_state.processed == 2009);
+    assert_true(client.delivery.number_of_deliveries == 2);
+    assert_true(drain_packets(&client, peer.sv[1], sent, 16) == 8);
+
+    mqtt_worker_pool_stop(&pool);
+    for(i = 0; i < 3; ++i) {
+        assert_true(pthread_join(tids[i], NULL) == 0);
+    }
+    mqtt_worker_pool_destroy(&pool);
+    pthread_mutex_destroy(&pool_state.mutex);
+    close(peer.sv[0]);
+    close(peer.sv[1]);
+}
+#endif
+
+#if defined(MQTT_IO_THREAD_AVAILABLE)
+#include <poll.h>
+
+/* Reads a packet of less than 128 bytes that fd receives within timeout_ms, returns its control type (0 if none). */
+static int read_packet_within(int fd, uint8_t *packet, int timeout_ms) {
+    size_t len = 0;
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (len < 2 || len < 2u + packet[1]) {
+        ssize_t rv;
+        if (poll(&pfd, 1, timeout_ms) != 1) {
+            return 0;
+        }
+        rv = recv(fd, packet + len, len < 2 ? 2 - len : 2u + packet[1] - len, 0);
+        assert_true(rv > 0);
+        len += (size_t) rv;
+        assert_true(packet[1] < 128);
+    }
+    return packet[0] >> 4;
+}
+
+static void io_thread_received(void **state, struct mqtt_response_publish *publish) {
+    __atomic_fetch_add((size_t*) *state, publish->application_message_size, __ATOMIC_SEQ_CST);
+}
+
+static void TEST__utility__io_thread(void **unused) {
+    const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    struct mqtt_io_thread io;
+    struct mqtt_client client;
+    uint8_t sendbuf[2048], recvbuf[256], packet[256];
+    size_t received = 0;
+    int i, sv[2];
+    ssize_t rv;
+#if defined(__linux__)
+    const int cpu = 0;
+#else
+    const int cpu = -1;
+#endif
+
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), io_thread_received);
+    client.publish_response_callback_state = &received;
+    assert_true(mqtt_connect(&client, "io-thread", NULL, NULL, 0, NULL, NULL, 0, 400) == MQTT_OK);
+    assert_true(mqtt_io_thread_start(&io, &client, cpu, -1, 0) == MQTT_OK);
+    assert_true(client.wakeup_callback != NULL);
+    assert_true(read_packet_within(sv[1], packet, 1000) == MQTT_CONTROL_CONNECT);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+
+    /* a publish wakes the thread up, the next keep-alive is minutes away */
+    for(i = 0; i < 3; ++i) {
+        mqtt_pal_time_ms_t start = MQTT_PAL_TIME_MS();
+        assert_true(mqtt_publish(&client, "io", "now", 3, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+        assert_true(read_packet_within(sv[1], packet, 1000) == MQTT_CONTROL_PUBLISH);
+        assert_true(MQTT_PAL_TIME_MS() - start < 1000);
+    }
+
+    /* received publishes are acknowledged and delivered by the thread */
+    rv = mqtt_pack_publish_request(packet, sizeof(packet), "in", 7, "inbound", 7, MQTT_PUBLISH_QOS_1);
+    assert_true(rv > 0 && send(sv[1], packet, (size_t) rv, 0) == rv);
+    assert_true(read_packet_within(sv[1], packet, 1000) == MQTT_CONTROL_PUBACK);
+    for(i = 0; i < 100 && __atomic_load_n(&received, __ATOMIC_SEQ_CST) != 7; ++i) {
+        usleep(10000);
+    }
+    assert_true(__atomic_load_n(&received, __ATOMIC_SEQ_CST) == 7);
+
+    /* what was queued before the thread is stopped is still sent */
+    assert_true(mqtt_disconnect(&client) == MQTT_OK);
+    mqtt_io_thread_stop(&io);
+    assert_true(client.wakeup_callback == NULL);
+    assert_true(io.number_of_wakeups >= 3);
+    assert_true(read_packet_within(sv[1], packet, 1000) == MQTT_CONTROL_DISCONNECT);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+#endif
+
+#if !defined(WIN32)
+static int pid_in_use(const uint32_t *bitmap, uint16_t packet_id) {
+    return (bitmap[packet_id / 32] >> (packet_id % 32)) & 1u;
+}
+
+static void TEST__utility__pid_bitmap(void **unused) {
+    struct mqtt_client client;
+    uint8_t sendbuf[1024], recvbuf[256], packet[16];
+    static uint32_t bitmap[MQTT_PID_BITMAP_WORDS];
+    uint16_t pids[3];
+    int sv[2];
+    ssize_t rv;
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) == 0);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    mqtt_init_pid_bitmap(&client, bitmap);
+    assert_true(pid_in_use(bitmap, 0));
+    rv = mqtt_connect(&client, "pid-bitmap", NULL, NULL, 0, NULL, NULL, 0, 30);
+    assert_true(rv == MQTT_OK);
+
+    /* QoS 0 doesn't use a packet id */
+    assert_true(mqtt_publish(&client, "t", "m", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_mq_get(&client.mq, 1)->packet_id == 0);
+
+    /* QoS 1 takes free ids */
+    for(int i = 0; i < 3; ++i) {
+        assert_true(mqtt_publish(&client, "t", "m", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+        pids[i] = mqtt_mq_get(&client.mq, 2 + i)->packet_id;
+        assert_true(pids[i] != 0 && pid_in_use(bitmap, pids[i]));
+    }
+    assert_true(pids[0] != pids[1] && pids[1] != pids[2] && pids[0] != pids[2]);
+
+    /* the PUBACK returns the id, and it's handed out again */
+    rv = mqtt_pack_pubxxx_request(packet, sizeof(packet), MQTT_CONTROL_PUBACK, pids[1]);
+    assert_true(send(sv[1], packet, (size_t) rv, 0) == rv);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(!pid_in_use(bitmap, pids[1]));
+    assert_true(mqtt_publish(&client, "t", "m", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_mq_get(&client.mq, 5)->packet_id == pids[1]);
+
+    /* an ack of a reused id completes the newest message */
+    assert_true(send(sv[1], packet, (size_t) rv, 0) == rv);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    assert_true(mqtt_mq_get(&client.mq, 5)->state == MQTT_QUEUED_COMPLETE);
+
+    /* running out of ids isn't fatal */
+    memset(bitmap, 0xFF, sizeof(bitmap));
+    assert_true(mqtt_publish(&client, "t", "m", 1, MQTT_PUBLISH_QOS_1) == MQTT_ERROR_PACKET_ID_EXHAUSTED);
+    assert_true(client.error == MQTT_OK);
+
+    /* reinit frees every id */
+    mqtt_reinit(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf));
+    assert_true(pid_in_use(bitmap, 0));
+    for(int i = 1; i < 65536; ++i) {
+        assert_true(!pid_in_use(bitmap, (uint16_t) i));
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+}
+#endif
+
 void publish_callback(void** state, struct mqtt_response_publish *publish) {
     /*char *name = (char*) malloc(publish->topic_name_size + 1);
     memcpy(name, publish->topic_name, publish->topic_name_size);
@@ -1007,7 +3218,54 @@ int main(int argc, const char *argv[]) {
     printf("\n[MQTT-C Utilities Tests]\n");
     const struct CMUnitTest util_tests[] = {
         cmocka_unit_test(TEST__utility__message_queue),
+        cmocka_unit_test(TEST__utility__message_queue_index),
+        cmocka_unit_test(TEST__utility__message_queue_index_qos0),
+        cmocka_unit_test(TEST__utility__message_queue_make_room),
+        cmocka_unit_test(TEST__utility__message_queue_stalled_head),
         cmocka_unit_test(TEST__utility__pid_lfsr),
+#if !defined(WIN32)
+        cmocka_unit_test(TEST__utility__pid_bitmap),
+#endif
+#if !defined(WIN32)
+        cmocka_unit_test(TEST__utility__batched_send),
+        cmocka_unit_test(TEST__utility__batched_send_gather),
+        cmocka_unit_test(TEST__utility__batched_send_partial),
+        cmocka_unit_test(TEST__utility__publish_ref),
+        cmocka_unit_test(TEST__utility__publish_many),
+        cmocka_unit_test(TEST__utility__recv_in_place),
+        cmocka_unit_test(TEST__utility__response_timeout_ms),
+        cmocka_unit_test(TEST__utility__sync_interest),
+        cmocka_unit_test(TEST__utility__inflight_window),
+        cmocka_unit_test(TEST__utility__publish_stage),
+#endif
+#if defined(MQTT_REACTOR_AVAILABLE)
+        cmocka_unit_test(TEST__utility__reactor),
+        cmocka_unit_test(TEST__utility__reactor_traffic),
+#endif
+        cmocka_unit_test(TEST__utility__dispatcher),
+        cmocka_unit_test(TEST__utility__topic_matching),
+#if !defined(WIN32)
+        cmocka_unit_test(TEST__utility__dispatcher_recv),
+        cmocka_unit_test(TEST__utility__recv_stream),
+        cmocka_unit_test(TEST__utility__publish_stream),
+        cmocka_unit_test(TEST__utility__publish_stream_starved),
+        cmocka_unit_test(TEST__utility__elastic_buffers),
+#if defined(MQTT_STORE_AVAILABLE)
+        cmocka_unit_test(TEST__utility__session_store),
+#endif
+        cmocka_unit_test(TEST__utility__reinit_keep_queue),
+        cmocka_unit_test(TEST__utility__deferred_delivery),
+#if MQTT_PAL_LOCK_POLICY != MQTT_PAL_LOCK_NONE
+        cmocka_unit_test(TEST__utility__split_locks),
+#endif
+        cmocka_unit_test(TEST__utility__lock_policy),
+#endif
+#if defined(MQTT_WORKER_POOL_AVAILABLE)
+        cmocka_unit_test(TEST__utility__worker_pool),
+#endif
+#if defined(MQTT_IO_THREAD_AVAILABLE)
+        cmocka_unit_test(TEST__utility__io_thread),
+#endif
         cmocka_unit_test(TEST__utility__connect_disconnect),
         cmocka_unit_test(TEST__utility__ping),
     };